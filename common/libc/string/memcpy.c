@@ -34,10 +34,23 @@
 
 #ifdef _KERNEL
 #include <types.h>
+#include <endian.h>
 #include <lib.h>
 #else
 #include <stdint.h>
 #include <string.h>
+#include <sys/endian.h>
+#endif
+
+/*
+ * Join the tail of aligned word W0 with the head of the next aligned
+ * word W1 into the word that starts LSH/8 bytes into W0. Shifts are
+ * in bits, and RSH is the word size less LSH. memmove.c uses this too.
+ */
+#if _BYTE_ORDER == _BIG_ENDIAN
+#define MERGEWORDS(w0, w1, lsh, rsh)  (((w0) << (lsh)) | ((w1) >> (rsh)))
+#else
+#define MERGEWORDS(w0, w1, lsh, rsh)  (((w0) >> (lsh)) | ((w1) << (rsh)))
 #endif
 
 /*
@@ -47,39 +60,79 @@
 void *
 memcpy(void *dst, const void *src, size_t len)
 {
-	size_t i;
+	unsigned char *d = dst;
+	const unsigned char *s = src;
+	unsigned long *wd;
+	const unsigned long *ws;
+	unsigned long w0, w1;
+	unsigned off, lsh, rsh;
 
 	/*
 	 * memcpy does not support overlapping buffers, so always do it
 	 * forwards. (Don't change this without adjusting memmove.)
 	 *
-	 * For speedy copying, optimize the common case where both pointers
-	 * and the length are word-aligned, and copy word-at-a-time instead
-	 * of byte-at-a-time. Otherwise, copy by bytes.
+	 * Anything but a tiny copy goes a word at a time: copy bytes
+	 * until the destination is word-aligned, then whole words, then
+	 * whatever bytes are left over. If the source is aligned too
+	 * (the common case) the word loop is unrolled eight times.
+	 * Otherwise each destination word is pieced together from the
+	 * two aligned source words it straddles, so every load and
+	 * store is still a whole word. Only source words that hold at
+	 * least one byte being copied are ever read.
 	 *
 	 * The alignment logic below should be portable. We rely on
 	 * the compiler to be reasonably intelligent about optimizing
 	 * the divides and modulos out. Fortunately, it is.
 	 */
 
-	if ((uintptr_t)dst % sizeof(long) == 0 &&
-	    (uintptr_t)src % sizeof(long) == 0 &&
-	    len % sizeof(long) == 0) {
-
-		long *d = dst;
-		const long *s = src;
+	if (len >= 2 * sizeof(long)) {
+		while ((uintptr_t)d % sizeof(long) != 0) {
+			*d++ = *s++;
+			len--;
+		}
 
-		for (i=0; i<len/sizeof(long); i++) {
-			d[i] = s[i];
+		wd = (unsigned long *)d;
+		off = (uintptr_t)s % sizeof(long);
+		if (off == 0) {
+			ws = (const unsigned long *)s;
+			while (len >= 8 * sizeof(long)) {
+				wd[0] = ws[0];
+				wd[1] = ws[1];
+				wd[2] = ws[2];
+				wd[3] = ws[3];
+				wd[4] = ws[4];
+				wd[5] = ws[5];
+				wd[6] = ws[6];
+				wd[7] = ws[7];
+				wd += 8;
+				ws += 8;
+				len -= 8 * sizeof(long);
+			}
+			while (len >= sizeof(long)) {
+				*wd++ = *ws++;
+				len -= sizeof(long);
+			}
+		}
+		else {
+			lsh = off * 8;
+			rsh = (sizeof(long) - off) * 8;
+			ws = (const unsigned long *)(s - off);
+			w0 = *ws++;
+			while (len >= sizeof(long)) {
+				w1 = *ws++;
+				*wd++ = MERGEWORDS(w0, w1, lsh, rsh);
+				w0 = w1;
+				len -= sizeof(long);
+			}
 		}
+
+		s += (unsigned char *)wd - d;
+		d = (unsigned char *)wd;
 	}
-	else {
-		char *d = dst;
-		const char *s = src;
 
-		for (i=0; i<len; i++) {
-			d[i] = s[i];
-		}
+	while (len > 0) {
+		*d++ = *s++;
+		len--;
 	}
 
 	return dst;
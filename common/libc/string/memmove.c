@@ -34,10 +34,19 @@
 
 #ifdef _KERNEL
 #include <types.h>
+#include <endian.h>
 #include <lib.h>
 #else
 #include <stdint.h>
 #include <string.h>
+#include <sys/endian.h>
+#endif
+
+/* See memcpy.c. */
+#if _BYTE_ORDER == _BIG_ENDIAN
+#define MERGEWORDS(w0, w1, lsh, rsh)  (((w0) << (lsh)) | ((w1) >> (rsh)))
+#else
+#define MERGEWORDS(w0, w1, lsh, rsh)  (((w0) >> (lsh)) | ((w1) << (rsh)))
 #endif
 
 /*
@@ -48,7 +57,12 @@
 void *
 memmove(void *dst, const void *src, size_t len)
 {
-	size_t i;
+	unsigned char *d;
+	const unsigned char *s;
+	unsigned long *wd;
+	const unsigned long *ws;
+	unsigned long w0, w1;
+	unsigned off, lsh, rsh;
 
 	/*
 	 * If the buffers don't overlap, it doesn't matter what direction
@@ -84,33 +98,64 @@ memmove(void *dst, const void *src, size_t len)
 	}
 
 	/*
-	 * Copy by words in the common case. Look in memcpy.c for more
-	 * information.
+	 * Otherwise copy back to front, the mirror image of memcpy:
+	 * bytes until the end of the destination is word-aligned, then
+	 * words (unrolled if the source end is aligned too, pieced
+	 * together from two source words if not), then the bytes left
+	 * at the front. Look in memcpy.c for more information.
 	 */
 
-	if ((uintptr_t)dst % sizeof(long) == 0 &&
-	    (uintptr_t)src % sizeof(long) == 0 &&
-	    len % sizeof(long) == 0) {
+	d = (unsigned char *)dst + len;
+	s = (const unsigned char *)src + len;
 
-		long *d = dst;
-		const long *s = src;
-
-		/*
-		 * The reason we copy index i-1 and test i>0 is that
-		 * i is unsigned -- so testing i>=0 doesn't work.
-		 */
+	if (len >= 2 * sizeof(long)) {
+		while ((uintptr_t)d % sizeof(long) != 0) {
+			*--d = *--s;
+			len--;
+		}
 
-		for (i=len/sizeof(long); i>0; i--) {
-			d[i-1] = s[i-1];
+		wd = (unsigned long *)d;
+		off = (uintptr_t)s % sizeof(long);
+		if (off == 0) {
+			ws = (const unsigned long *)s;
+			while (len >= 8 * sizeof(long)) {
+				wd -= 8;
+				ws -= 8;
+				wd[7] = ws[7];
+				wd[6] = ws[6];
+				wd[5] = ws[5];
+				wd[4] = ws[4];
+				wd[3] = ws[3];
+				wd[2] = ws[2];
+				wd[1] = ws[1];
+				wd[0] = ws[0];
+				len -= 8 * sizeof(long);
+			}
+			while (len >= sizeof(long)) {
+				*--wd = *--ws;
+				len -= sizeof(long);
+			}
+		}
+		else {
+			lsh = off * 8;
+			rsh = (sizeof(long) - off) * 8;
+			ws = (const unsigned long *)(s - off);
+			w1 = *ws;
+			while (len >= sizeof(long)) {
+				w0 = *--ws;
+				*--wd = MERGEWORDS(w0, w1, lsh, rsh);
+				w1 = w0;
+				len -= sizeof(long);
+			}
 		}
+
+		s -= d - (unsigned char *)wd;
+		d = (unsigned char *)wd;
 	}
-	else {
-		char *d = dst;
-		const char *s = src;
 
-		for (i=len; i>0; i--) {
-			d[i-1] = s[i-1];
-		}
+	while (len > 0) {
+		*--d = *--s;
+		len--;
 	}
 
 	return dst;
@@ -103,6 +103,15 @@
 #define PTE_IN_SWAP(pte) (pte & 0xFFFFFFBF) //Returns the pte with bit 5 set and 6 cleared (swap)
 #define PDE_AND_PTE_TO_VA(pde,pte) (pde & pte)
 
+/* Set once a page of a file mapping has been written since it was read
+   in. Pages without it can be dropped and read back from the file. */
+#define PTE_MODIFIED	0x80
+
+/* Set when a fault loads the page into the TLB. Load control clears it
+   (and flushes the TLBs) now and then, so it tells which pages have been
+   touched since; see vm_loadctl in smartvm.c. */
+#define PTE_REFERENCED	0x100
+
 /*
  * The top of user space. (Actually, the address immediately above the
  * last valid user address.)
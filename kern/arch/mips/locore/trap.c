@@ -149,11 +149,16 @@ mips_trap(struct trapframe *tf)
 	/* Interrupt? Call the interrupt handler and return. */
 	if (code == EX_IRQ) {
 		int old_in;
+		bool old_inuser;
 		bool doadjust;
 
 		old_in = curthread->t_in_interrupt;
 		curthread->t_in_interrupt = 1;
 
+		/* Tell the accounting in hardclock whose time this was. */
+		old_inuser = curthread->t_inuser;
+		curthread->t_inuser = !iskern;
+
 		/*
 		 * The processor has turned interrupts off; if the
 		 * currently recorded interrupt state is interrupts on
@@ -191,6 +196,7 @@ mips_trap(struct trapframe *tf)
 			curthread->t_curspl = 0;
 		}
 
+		curthread->t_inuser = old_inuser;
 		curthread->t_in_interrupt = old_in;
 		goto done2;
 	}
@@ -312,6 +318,14 @@ mips_trap(struct trapframe *tf)
 	panic("I can't handle this... I think I'll just die now...\n");
 
  done:
+	/*
+	 * If load control has swapped this process out, wait here until
+	 * it's let back in rather than going back to user mode.
+	 */
+	if (!iskern) {
+		vm_loadctl_wait();
+	}
+
 	/*
 	 * Turn interrupts off on the processor, without affecting the
 	 * stored interrupt state.
@@ -51,6 +51,13 @@
 #include <kern/stat.h>
 #include <test.h>
 #include <kern/wait.h>
+#include <kern/time.h>
+#include <kern/resource.h>
+#include <clock.h>
+#include <limits.h>
+#include <kern/mman.h>
+#include <elf.h>
+#include <pipe.h>
 
 /*
  * System call dispatcher.
@@ -101,6 +108,7 @@ syscall(struct trapframe *tf)
 	int err;
 	off_t arg64_1 = 0;			
 	int whence = 0;
+	int arg_fd = 0;				// mmap's fd, from the user stack
 
 	//kprintf("Inside syscall.\n");
 	KASSERT(curthread != NULL);
@@ -147,11 +155,35 @@ syscall(struct trapframe *tf)
 				 (userptr_t)tf->tf_a1);
 		break;
 
+	    case SYS_getrusage:
+		err = sys_getrusage((int)tf->tf_a0, (userptr_t)tf->tf_a1);
+		break;
+
+	    case SYS_nanosleep:
+		err = sys_nanosleep((const_userptr_t)tf->tf_a0,
+				    (userptr_t)tf->tf_a1);
+		break;
+
 		/*S Brake*/
 		case SYS_sbrk:
 			err = sys_sbrk((intptr_t) tf->tf_a0, &retval_sbrk);
 		break;
 
+		/* Memory mapping; fd and the 64-bit offset are on the user stack. */
+		case SYS_mmap:
+			err = copyin((const_userptr_t)(tf->tf_sp+16), &arg_fd, sizeof(arg_fd));
+			if (!err) {
+				err = copyin((const_userptr_t)(tf->tf_sp+24), &arg64_1, sizeof(arg64_1));
+			}
+			if (!err) {
+				err = sys_mmap((vaddr_t) tf->tf_a0, (size_t) tf->tf_a1, (int) tf->tf_a2, (int) tf->tf_a3, arg_fd, arg64_1, &retval);
+			}
+			break;
+
+		case SYS_munmap:
+			err = sys_munmap((vaddr_t) tf->tf_a0, (size_t) tf->tf_a1);
+			break;
+
 		/*Open*/
 		case SYS_open:
 			err = sys_open((char*) tf->tf_a0, (int) tf->tf_a1, &retval);
@@ -167,6 +199,30 @@ syscall(struct trapframe *tf)
 			err = sys_read((int) tf->tf_a0, (const void*) tf->tf_a1, (size_t) tf->tf_a2, &retval);
 			break;
 		
+		/* Scatter/gather I/O */
+		case SYS_readv:
+			err = sys_readv((int) tf->tf_a0, (const_userptr_t) tf->tf_a1, (int) tf->tf_a2, &retval);
+			break;
+
+		case SYS_writev:
+			err = sys_writev((int) tf->tf_a0, (const_userptr_t) tf->tf_a1, (int) tf->tf_a2, &retval);
+			break;
+
+		/* Positional I/O; the 64-bit offset is on the user stack. */
+		case SYS_pread:
+			err = copyin((const_userptr_t)(tf->tf_sp+16), &arg64_1, sizeof(arg64_1));
+			if (!err) {
+				err = sys_pread((int) tf->tf_a0, (userptr_t) tf->tf_a1, (size_t) tf->tf_a2, arg64_1, &retval);
+			}
+			break;
+
+		case SYS_pwrite:
+			err = copyin((const_userptr_t)(tf->tf_sp+16), &arg64_1, sizeof(arg64_1));
+			if (!err) {
+				err = sys_pwrite((int) tf->tf_a0, (userptr_t) tf->tf_a1, (size_t) tf->tf_a2, arg64_1, &retval);
+			}
+			break;
+
 		/*Close*/
 		case SYS_close:
 			err = sys_close((int) tf->tf_a0);
@@ -183,6 +239,11 @@ syscall(struct trapframe *tf)
 			err = sys_dup2((int) tf->tf_a0, (int) tf->tf_a1, &retval);
 			break;
 
+		/* Pipe */
+		case SYS_pipe:
+			err = sys_pipe((userptr_t) tf->tf_a0, &retval);
+			break;
+
 		/* Change Directory */
 		case SYS_chdir:
 			err = sys_chdir((const char*) tf->tf_a0, &retval);
@@ -213,10 +274,42 @@ syscall(struct trapframe *tf)
  			err = sys_fork(tf, &retval);
  			break;
 
+ 		case SYS_vfork:
+ 			err = sys_vfork(tf, &retval);
+ 			break;
+
  		case SYS_execv:
  			err = sys_execv((const char*) tf->tf_a0, (char**) tf->tf_a1, &retval);
  			break;
 
+ 		case SYS_threadfork:
+ 			err = sys_threadfork(tf, (vaddr_t) tf->tf_a0, (vaddr_t) tf->tf_a1, &retval);
+ 			break;
+
+ 		case SYS_threadexit:
+ 			sys_threadexit();
+ 			break;
+
+ 		case SYS_futex:
+ 			err = sys_futex((userptr_t) tf->tf_a0, (int) tf->tf_a1, (int) tf->tf_a2, (const_userptr_t) tf->tf_a3, &retval);
+ 			break;
+
+ 		case SYS_shmget:
+ 			err = sys_shmget((int) tf->tf_a0, (size_t) tf->tf_a1, (int) tf->tf_a2, &retval);
+ 			break;
+
+ 		case SYS_shmat:
+ 			err = sys_shmat((int) tf->tf_a0, (vaddr_t) tf->tf_a1, (int) tf->tf_a2, &retval);
+ 			break;
+
+ 		case SYS_shmdt:
+ 			err = sys_shmdt((vaddr_t) tf->tf_a0);
+ 			break;
+
+ 		case SYS_shmctl:
+ 			err = sys_shmctl((int) tf->tf_a0, (int) tf->tf_a1, (userptr_t) tf->tf_a2);
+ 			break;
+
 	    default:
 		kprintf("Unknown syscall %d\n", callno);
 		err = ENOSYS;
@@ -448,34 +541,184 @@ sys_sbrk(intptr_t amount, uint32_t *retval_sbrk)
 		amount += 4 - (amount%4);
 	}
 
+	// Other threads may be faulting, or moving the break too.
+	struct addrspace *as = curthread->t_addrspace;
+	lock_acquire(as->as_lock);
+
 	// Get the current location of the heap end.
-	vaddr_t current_heap = curthread->t_addrspace->heap_end;
+	vaddr_t current_heap = as->heap_end;
 	DEBUG(DB_VM, "Current heap end: 0x%x\n", current_heap);
 	// Combine heap location with amount.
 	vaddr_t new_heap = current_heap + amount;
 
 	// Check that new heap value does not go less than heap start.
-	if(new_heap < curthread->t_addrspace->heap_start) {
+	if(new_heap < as->heap_start) {
+		lock_release(as->as_lock);
 		return EINVAL;
 	}
 
 	// Check that new heap value does not go past the stack.
-	vaddr_t current_stack = curthread->t_addrspace->stack;
+	vaddr_t current_stack = as->stack;
 	if(new_heap >= current_stack) {
+		lock_release(as->as_lock);
+		return ENOMEM;
+	}
+
+	// ...or into an mmap'd region (leaving a guard page below it).
+	if(amount > 0 && as_find_overlap(as, current_heap, new_heap + PAGE_SIZE) != NULL) {
+		lock_release(as->as_lock);
 		return ENOMEM;
 	}
 
 	// Set new heap value.
-	curthread->t_addrspace->heap_end = new_heap;
+	as->heap_end = new_heap;
 	DEBUG(DB_VM, "New heap end: 0x%x\n", new_heap);
 
+	// If the heap shrank, free the pages now wholly above the break.
+	if(amount < 0) {
+		as_free_pages(as,
+			      ROUNDUP(new_heap, PAGE_SIZE),
+			      ROUNDUP(current_heap, PAGE_SIZE));
+	}
+	lock_release(as->as_lock);
+
 	// Return pointer to old heap break point
 	*retval_sbrk = (uint32_t)current_heap;
 	DEBUG(DB_VM, "Old heap end: 0x%x\n", (unsigned int)retval_sbrk);
-	as_activate(curthread->t_addrspace);
 	return 0;
 }
 
+int
+sys_mmap(vaddr_t addr, size_t len, int prot, int flags, int fd, off_t offset, int *retval)
+{
+	struct addrspace *as = curthread->t_addrspace;
+	struct vnode *vn = NULL;
+	struct file_handle *fh = NULL;
+	size_t npages;
+	int perms, result;
+
+	// Exactly one of MAP_SHARED and MAP_PRIVATE.
+	if(((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0)) {
+		return EINVAL;
+	}
+	if(len == 0 || len > USER_STACK_LIMIT) {
+		return EINVAL;
+	}
+	npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	// Convert PROT_* to the PF_* bits the page tables use.
+	perms = 0;
+	if(prot & PROT_READ) {
+		perms |= PF_R;
+	}
+	if(prot & PROT_WRITE) {
+		perms |= PF_W;
+	}
+	if(prot & PROT_EXEC) {
+		perms |= PF_X;
+	}
+
+	if(flags & MAP_FIXED) {
+		// Must be page aligned and between the heap and the stack.
+		if((addr & SUB_FRAME) || addr <= as->heap_end ||
+		   npages > (USER_STACK_LIMIT - addr) / PAGE_SIZE) {
+			return EINVAL;
+		}
+	}
+	else {
+		// Otherwise the address is only a hint, which we ignore.
+		addr = 0;
+	}
+
+	if(flags & MAP_ANON) {
+		offset = 0;
+	}
+	else {
+		if(offset < 0 || (offset & SUB_FRAME)) {
+			return EINVAL;
+		}
+		result = check_valid_fd(fd);
+		if(result) {
+			return result;
+		}
+		struct process *proc = get_process(curthread->t_pid);
+		// Hold the handle until the mapping has its own vnode reference.
+		fh = get_file_handle_ref(proc->p_id, fd);
+		if(fh == NULL) {
+			return EBADF;
+		}
+
+		// Need to be able to read the file, and to write it if writes
+		// to the mapping will end up there.
+		if((fh->fh_flags & O_ACCMODE) == O_WRONLY) {
+			put_file_handle(fh);
+			return EACCES;
+		}
+		if((flags & MAP_SHARED) && (prot & PROT_WRITE) &&
+		   (fh->fh_flags & O_ACCMODE) == O_RDONLY) {
+			put_file_handle(fh);
+			return EACCES;
+		}
+
+		// Not everything can be mapped (the console, for one).
+		result = VOP_MMAP(fh->vnode);
+		if(result) {
+			put_file_handle(fh);
+			return result;
+		}
+		vn = fh->vnode;
+	}
+
+	lock_acquire(as->as_lock);
+
+	// MAP_FIXED replaces whatever was there.
+	if(flags & MAP_FIXED) {
+		result = as_unmap_range(as, addr, addr + npages * PAGE_SIZE);
+		if(result) {
+			lock_release(as->as_lock);
+			if(fh != NULL) {
+				put_file_handle(fh);
+			}
+			return result;
+		}
+	}
+
+	result = as_map_region(as, &addr, npages, perms,
+			       flags & (MAP_SHARED | MAP_PRIVATE), vn, offset);
+	lock_release(as->as_lock);
+	if(fh != NULL) {
+		put_file_handle(fh);
+	}
+	if(result) {
+		return result;
+	}
+
+	*retval = (int)addr;
+	return 0;
+}
+
+int
+sys_munmap(vaddr_t addr, size_t len)
+{
+	size_t npages;
+
+	if((addr & SUB_FRAME) || len == 0) {
+		return EINVAL;
+	}
+	npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+	if(addr >= USERSPACETOP || npages > (USERSPACETOP - addr) / PAGE_SIZE) {
+		return EINVAL;
+	}
+
+	struct addrspace *as = curthread->t_addrspace;
+	int result;
+
+	lock_acquire(as->as_lock);
+	result = as_unmap_range(as, addr, addr + npages * PAGE_SIZE);
+	lock_release(as->as_lock);
+	return result;
+}
+
 int
 sys_open(char* filename, int flags, int *retval)
 {
@@ -519,10 +762,13 @@ sys_open(char* filename, int flags, int *retval)
 		return EINVAL;
 	}
 
-	// Find avaiable file descritpor.
+	// Find avaiable file descritpor. Other threads in the process share the
+	// table, so keep it locked until the handle is in the slot.
+	lock_acquire(proc->p_fd_lock);
 	fd = get_free_file_descriptor(proc->p_id);
 	if(fd < 0) {
 		// fd table is full; no fd's available to allocate.		
+		lock_release(proc->p_fd_lock);
 		return EMFILE;
 	}
 
@@ -533,16 +779,18 @@ sys_open(char* filename, int flags, int *retval)
 	fh = fh_create(path, flags);
 	if(fh == NULL) {
 		// Failed to create file handle for some reason, like a bad kmalloc
+		lock_release(proc->p_fd_lock);
 		return EMFILE;
 	}
 
-	proc->p_fd_table[fd] = fh;
-
 	// Need checks for create and exist
 
 	result = vfs_open(path, flags,/* Ignore MODE*/ 0, &(fh->vnode));
 	if(result)
 	{
+		fh->fh_open_count = 0;
+		fh_destroy(fh);
+		lock_release(proc->p_fd_lock);
 		return EIO;
 	}
 
@@ -552,7 +800,10 @@ sys_open(char* filename, int flags, int *retval)
 		struct stat file_stat;
 		result = VOP_STAT(fh->vnode, &file_stat);
 		if(result){
-			
+			vfs_close(fh->vnode);
+			fh->fh_open_count = 0;
+			fh_destroy(fh);
+			lock_release(proc->p_fd_lock);
 			return result;
 		}
 		
@@ -571,6 +822,9 @@ sys_open(char* filename, int flags, int *retval)
 
 	}
 
+	proc->p_fd_table[fd] = fh;
+	lock_release(proc->p_fd_lock);
+
 	// Successful sys_open, return file descriptor.
 	*retval = fd;
 
@@ -602,21 +856,26 @@ sys_write(int fd, const void* buf, size_t nbytes, int* retval)
 		return result;
 	}
 
-	// Check if the fd has a file handle attached to it.
-	result = check_open_fd(fd,proc);
-	if(result)
+	// Check if the fd has a file handle attached to it, and hold onto it
+	// in case another thread closes it.
+	struct file_handle *fh = get_file_handle_ref(proc->p_id, fd);
+	if(fh == NULL)
 	{
-		return result;
+		return EBADF;
 	}
-	// fd seems legit, now start checking the file handle
-	struct file_handle *fh = get_file_handle(proc->p_id, fd);
 	
 	// Check that file flags allow for writing.
 	if((fh->fh_flags & O_ACCMODE) == 0) {
+		put_file_handle(fh);
 		return EBADF;
 	}
 	
-	lock_acquire(fh->fh_open_lk);		// Lock in case multiple processes see this handle
+	// Lock in case multiple processes see this handle. Pipes have no offset
+	// to protect, and may block for as long as the other end likes.
+	bool seekable = !pipe_isvnode(fh->vnode);
+	if(seekable) {
+		lock_acquire(fh->fh_open_lk);
+	}
 	//Create an iovec struct.
 	iov.iov_ubase = (userptr_t) buf; 	//User pointer is the buffer
 	iov.iov_len = nbytes; 				//The lengeth is the number of bytes passed in
@@ -633,13 +892,19 @@ sys_write(int fd, const void* buf, size_t nbytes, int* retval)
 	result = VOP_WRITE(fh->vnode, &u);
 	if(result)
 	{
-		lock_release(fh->fh_open_lk);
+		if(seekable) {
+			lock_release(fh->fh_open_lk);
+		}
+		put_file_handle(fh);
 		return result;
 	}
 
 	// Update file handle offset
-	fh->fh_offset = u.uio_offset;
-	lock_release(fh->fh_open_lk);
+	if(seekable) {
+		fh->fh_offset = u.uio_offset;
+		lock_release(fh->fh_open_lk);
+	}
+	put_file_handle(fh);
 
 	//Our write succeeded. Per the man pages, return the # of bytes written (might not be everything)
 	*retval = nbytes - u.uio_resid;
@@ -674,20 +939,20 @@ sys_read(int fd, const void* buf, size_t buflen, int* retval)
 	struct thread *cur = curthread;
 	struct process *proc = get_process(cur->t_pid);
 
-	//Make sure fd refers to an open file (i.e. it's valid to read)
-	result = check_open_fd(fd,proc);
-	if(result)
+	//Make sure fd refers to an open file (i.e. it's valid to read), and
+	//keep it open while we read.
+	struct file_handle *fh = get_file_handle_ref(proc->p_id, fd);
+	if(fh == NULL)
 	{
-		return result;
+		return EBADF;
 	}
 
-	struct file_handle *fh = get_file_handle(proc->p_id, fd);
-
 	//First check that the specified file is open for reading.
 	if(!(fh->fh_flags & (O_RDWR|O_RDONLY)))
 	{
 		if(fh->fh_flags != O_RDONLY)
 		{
+			put_file_handle(fh);
 			return EBADF;
 		}
 	}
@@ -696,13 +961,19 @@ sys_read(int fd, const void* buf, size_t buflen, int* retval)
 	if(buf == NULL)
 	{
 		//kprintf("Buffer pointer is bad.\n");
+		put_file_handle(fh);
 		return EBADF;
 	}
 
 	
 	
 	// Initialize iov and uio
-	lock_acquire(fh->fh_open_lk);			// Lock it in case another process has access to this handle
+	// Lock it in case another process has access to this handle (but not
+	// for pipes, as in sys_write)
+	bool seekable = !pipe_isvnode(fh->vnode);
+	if(seekable) {
+		lock_acquire(fh->fh_open_lk);
+	}
 	iov.iov_ubase = (userptr_t) buf;		//User Data(copied into kernel) pointer is the buffer
 	iov.iov_len = buflen; 					//The lengeth is the number of bytes passed in
 	u.uio_iov = &iov; 
@@ -715,13 +986,19 @@ sys_read(int fd, const void* buf, size_t buflen, int* retval)
 
 	result = VOP_READ(fh->vnode, &u);
 	if (result) {
-		lock_release(fh->fh_open_lk);
+		if(seekable) {
+			lock_release(fh->fh_open_lk);
+		}
+		put_file_handle(fh);
 		return result;
 	}
 	
 	// Update file offset in file handle.
-	fh->fh_offset = u.uio_offset;
-	lock_release(fh->fh_open_lk);
+	if(seekable) {
+		fh->fh_offset = u.uio_offset;
+		lock_release(fh->fh_open_lk);
+	}
+	put_file_handle(fh);
 
 	// Return bytes read
 	*retval = buflen - u.uio_resid;
@@ -732,6 +1009,190 @@ sys_read(int fd, const void* buf, size_t buflen, int* retval)
 	return 0;
 }
 
+/*
+ * Number of iovecs readv/writev copy in onto the stack; longer arrays
+ * are kmalloc'd.
+ */
+#define UIO_FASTIOV 8
+
+/*
+ * Common code for readv, writev, pread, and pwrite: transfer to or
+ * from the user buffers described by the (kernel copy of the) iovec
+ * array IOV.
+ *
+ * If POSITIONAL is set, the transfer happens at OFFSET and the
+ * handle's seek position is neither used nor updated, so there is no
+ * need to hold fh_open_lk; concurrent positional I/O on a shared
+ * handle is serialized only by the file system. Otherwise this
+ * behaves like read/write.
+ */
+static
+int
+fd_rw(int fd, struct iovec *iov, int iovcnt, off_t offset, bool positional,
+      enum uio_rw rw, int *retval)
+{
+	struct uio u;
+	size_t total;
+	int i, result;
+
+	result = check_valid_fd(fd);
+	if(result)
+	{
+		return result;
+	}
+
+	struct thread *cur = curthread;
+	struct process *proc = get_process(cur->t_pid);
+
+	struct file_handle *fh = get_file_handle_ref(proc->p_id, fd);
+	if(fh == NULL)
+	{
+		return EBADF;
+	}
+
+	// Check the handle was opened for this direction.
+	if(rw == UIO_READ && (fh->fh_flags & O_ACCMODE) == O_WRONLY) {
+		put_file_handle(fh);
+		return EBADF;
+	}
+	if(rw == UIO_WRITE && (fh->fh_flags & O_ACCMODE) == O_RDONLY) {
+		put_file_handle(fh);
+		return EBADF;
+	}
+
+	if(positional) {
+		// Devices (the console) have no position to do I/O at.
+		if(fh->vnode->vn_fs == NULL) {
+			put_file_handle(fh);
+			return ESPIPE;
+		}
+		if(offset < 0) {
+			put_file_handle(fh);
+			return EINVAL;
+		}
+	}
+
+	// Total up the transfer; it has to fit in the int we return.
+	total = 0;
+	for(i = 0; i < iovcnt; i++) {
+		if(iov[i].iov_len > (size_t)0x7fffffff - total) {
+			put_file_handle(fh);
+			return EINVAL;
+		}
+		total += iov[i].iov_len;
+	}
+
+	u.uio_iov = iov;
+	u.uio_iovcnt = iovcnt;
+	u.uio_resid = total;
+	u.uio_segflg = UIO_USERSPACE;
+	u.uio_rw = rw;
+	u.uio_space = curthread->t_addrspace;
+
+	// Pipes have no position either, so skip the lock as sys_read does.
+	bool locked = !positional && !pipe_isvnode(fh->vnode);
+	if(locked) {
+		lock_acquire(fh->fh_open_lk);
+		u.uio_offset = fh->fh_offset;
+	}
+	else {
+		u.uio_offset = offset;
+	}
+
+	if(rw == UIO_READ) {
+		result = VOP_READ(fh->vnode, &u);
+	}
+	else {
+		result = VOP_WRITE(fh->vnode, &u);
+	}
+
+	if(locked) {
+		if(!result) {
+			fh->fh_offset = u.uio_offset;
+		}
+		lock_release(fh->fh_open_lk);
+	}
+	put_file_handle(fh);
+	if(result)
+	{
+		return result;
+	}
+
+	*retval = total - u.uio_resid;
+	return 0;
+}
+
+/*
+ * Common code for readv and writev: copy in the iovec array and hand
+ * off to fd_rw.
+ */
+static
+int
+fd_rwv(int fd, const_userptr_t user_iov, int iovcnt, enum uio_rw rw,
+       int *retval)
+{
+	struct iovec fastiov[UIO_FASTIOV];
+	struct iovec *iov;
+	int result;
+
+	if(iovcnt <= 0 || iovcnt > IOV_MAX) {
+		return EINVAL;
+	}
+
+	if(iovcnt <= UIO_FASTIOV) {
+		iov = fastiov;
+	}
+	else {
+		iov = kmalloc(iovcnt * sizeof(struct iovec));
+		if(iov == NULL) {
+			return ENOMEM;
+		}
+	}
+
+	// The kernel iovec has the same layout as the user one.
+	result = copyin(user_iov, iov, iovcnt * sizeof(struct iovec));
+	if(!result) {
+		result = fd_rw(fd, iov, iovcnt, 0, false, rw, retval);
+	}
+
+	if(iov != fastiov) {
+		kfree(iov);
+	}
+	return result;
+}
+
+int
+sys_readv(int fd, const_userptr_t iov, int iovcnt, int *retval)
+{
+	return fd_rwv(fd, iov, iovcnt, UIO_READ, retval);
+}
+
+int
+sys_writev(int fd, const_userptr_t iov, int iovcnt, int *retval)
+{
+	return fd_rwv(fd, iov, iovcnt, UIO_WRITE, retval);
+}
+
+int
+sys_pread(int fd, userptr_t buf, size_t buflen, off_t offset, int *retval)
+{
+	struct iovec iov;
+
+	iov.iov_ubase = buf;
+	iov.iov_len = buflen;
+	return fd_rw(fd, &iov, 1, offset, true, UIO_READ, retval);
+}
+
+int
+sys_pwrite(int fd, userptr_t buf, size_t nbytes, off_t offset, int *retval)
+{
+	struct iovec iov;
+
+	iov.iov_ubase = buf;
+	iov.iov_len = nbytes;
+	return fd_rw(fd, &iov, 1, offset, true, UIO_WRITE, retval);
+}
+
 int
 sys_close(int fd)
 {
@@ -745,35 +1206,26 @@ sys_close(int fd)
 
 	struct thread *cur = curthread;
 	struct process *proc = get_process(cur->t_pid);
-	struct file_handle *fh = get_file_handle(proc->p_id, fd);
 
 	// Make sure fd refers to an open file (i.e. it's valid to close)
+	lock_acquire(proc->p_fd_lock);
 	result = check_open_fd(fd,proc);
 	if(result)
 	{
+		lock_release(proc->p_fd_lock);
 		return result;
 	}
+	struct file_handle *fh = get_file_handle(proc->p_id, fd);
+	release_file_descriptor(proc->p_id, fd);	// Free the fd for use by teh process
+	lock_release(proc->p_fd_lock);
 
 	// Decrement file handle reference count; if zero, destroy file handle.
-	lock_acquire(fh->fh_open_lk);
-	fh->fh_open_count = (fh->fh_open_count) - 1;
-
-
 	// Only call vfs_close if the file handle count is zero. This is because vfs_open
 	// creates a unique fh on each open() call. Only on a fh destroy do we call vfs_close.
 	// This is very important for situations where dup2 are used, since it will have close()
 	// called shortly after dup2(), but the original fh remains for the newfd, and vfs_close()
 	// would cause an additional close without a matching open.
-	if(fh->fh_open_count == 0) {
-		vfs_close(fh->vnode);			// Does not return error, so nothing to check.
-		lock_release(fh->fh_open_lk);
-		fh_destroy(fh);
-	}
-	else {
-		lock_release(fh->fh_open_lk);
-	}
-
-	release_file_descriptor(proc->p_id, fd);	// Free the fd for use by teh process
+	put_file_handle(fh);
 
 	return 0;
 }
@@ -791,21 +1243,19 @@ sys_lseek(int fd, off_t pos, int whence, int64_t* retval64)
 
 	struct thread *cur = curthread;
 	struct process *proc = get_process(cur->t_pid);
-	if(proc->p_fd_table[fd] == NULL) {
-		//kprintf("File descriptor is not valid for seeking.\n");
-		return EBADF;
-	}
-	struct file_handle *fh = get_file_handle(proc->p_id, fd);
+	struct file_handle *fh = get_file_handle_ref(proc->p_id, fd);
 	
 	//fd might be positive, but it could still be bad. Check here:
 	if(fh == NULL)
 	{
+		//kprintf("File descriptor is not valid for seeking.\n");
 		return EBADF;
 	}
 
 	/* If vnode fs is null, most likely vnode refers to device*, per vnode.h*/
 	if(fh->vnode->vn_fs == NULL)
 	{
+		put_file_handle(fh);
 		return ESPIPE;
 	}
 
@@ -830,6 +1280,7 @@ sys_lseek(int fd, off_t pos, int whence, int64_t* retval64)
 			break;
 		default:
 			lock_release(fh->fh_open_lk);
+			put_file_handle(fh);
 			return EINVAL;
 			break;
 	}
@@ -837,14 +1288,16 @@ sys_lseek(int fd, off_t pos, int whence, int64_t* retval64)
 	if(newpos < 0) {
 		// Offset cannot be negative
 		lock_release(fh->fh_open_lk);
+		put_file_handle(fh);
 		return EINVAL;
 	}
 	else {
 		fh->fh_offset = newpos;
 		lock_release(fh->fh_open_lk);
 	}
+	put_file_handle(fh);
 	
-	*retval64 = (int)fh->fh_offset;
+	*retval64 = (int)newpos;
 
 	return 0;
 }
@@ -874,28 +1327,20 @@ sys_dup2(int oldfd, int newfd, int* retval)
 	}
 
 	struct process *proc = get_process(curthread->t_pid);
+	struct file_handle *fh_new = NULL;
 
+	lock_acquire(proc->p_fd_lock);
 	result = check_open_fd(oldfd, proc);
 	if(result)
 	{
+		lock_release(proc->p_fd_lock);
 		return result;
 	}
 
-	// Check if the new fd is already in use
+	// Check if the new fd is already in use; we close it once the table
+	// is unlocked.
 	if(proc->p_fd_table[newfd] != NULL) {
-		struct file_handle *fh_new = proc->p_fd_table[newfd];
-		lock_acquire(fh_new->fh_open_lk);
-			fh_new->fh_open_count = fh_new->fh_open_count - 1;
-
-		if(fh_new->fh_open_count == 0) {
-			vfs_close(fh_new->vnode);			// Does not return error, so nothing to check.
-			lock_release(fh_new->fh_open_lk);
-			fh_destroy(fh_new);
-		}
-		else {
-			lock_release(fh_new->fh_open_lk);
-		}
-
+		fh_new = proc->p_fd_table[newfd];
 		release_file_descriptor(proc->p_id, newfd);	// Free the fd for use by teh process
 	}
 	
@@ -906,11 +1351,91 @@ sys_dup2(int oldfd, int newfd, int* retval)
 	lock_acquire(proc->p_fd_table[newfd]->fh_open_lk);
 		proc->p_fd_table[newfd]->fh_open_count = (proc->p_fd_table[newfd]->fh_open_count) + 1;
 	lock_release(proc->p_fd_table[newfd]->fh_open_lk);
+	lock_release(proc->p_fd_lock);
+
+	if(fh_new != NULL) {
+		put_file_handle(fh_new);
+	}
 
 	*retval = newfd;
 	return 0;
 }
 
+static char pipename[] = "pipe";
+
+/* Throw away a file handle that never made it into the fd table. */
+static
+void
+pipe_fh_discard(struct file_handle *fh)
+{
+	if(fh != NULL) {
+		fh->fh_open_count = 0;
+		fh_destroy(fh);
+	}
+}
+
+int
+sys_pipe(userptr_t fds, int* retval)
+{
+	struct process *proc = get_process(curthread->t_pid);
+	struct file_handle *fh_read, *fh_write;
+	struct vnode *readend, *writeend;
+	int kfds[2];
+	int result;
+
+	if(fds == NULL) {
+		return EFAULT;
+	}
+
+	result = pipe_create(&readend, &writeend);
+	if(result) {
+		return result;
+	}
+
+	fh_read = fh_create(pipename, O_RDONLY);
+	fh_write = fh_create(pipename, O_WRONLY);
+	if(fh_read == NULL || fh_write == NULL) {
+		pipe_fh_discard(fh_read);
+		pipe_fh_discard(fh_write);
+		vfs_close(readend);
+		vfs_close(writeend);
+		return ENOMEM;
+	}
+	fh_read->vnode = readend;
+	fh_write->vnode = writeend;
+
+	// Claim the read end's descriptor first, so the second search skips it.
+	lock_acquire(proc->p_fd_lock);
+	kfds[0] = get_free_file_descriptor(proc->p_id);
+	if(kfds[0] >= 0) {
+		proc->p_fd_table[kfds[0]] = fh_read;
+		kfds[1] = get_free_file_descriptor(proc->p_id);
+	}
+	if(kfds[0] < 0 || kfds[1] < 0) {
+		if(kfds[0] >= 0) {
+			release_file_descriptor(proc->p_id, kfds[0]);
+		}
+		lock_release(proc->p_fd_lock);
+		pipe_fh_discard(fh_read);
+		pipe_fh_discard(fh_write);
+		vfs_close(readend);
+		vfs_close(writeend);
+		return EMFILE;
+	}
+	proc->p_fd_table[kfds[1]] = fh_write;
+	lock_release(proc->p_fd_lock);
+
+	result = copyout(kfds, fds, sizeof(kfds));
+	if(result) {
+		sys_close(kfds[0]);
+		sys_close(kfds[1]);
+		return result;
+	}
+
+	*retval = 0;
+	return 0;
+}
+
 int
 sys_chdir(const char* pathname, int* retval)
 {
@@ -1009,6 +1534,50 @@ sys_getpid(int* retval)
 	return 0;
 }
 
+/*
+ * Report resource usage. Times are kept in hardclocks and converted
+ * here.
+ */
+int
+sys_getrusage(int who, userptr_t usage)
+{
+	struct process *proc;
+	struct tusage tu;
+	struct rusage ru;
+
+	bzero(&tu, sizeof(tu));
+	switch (who) {
+	    case RUSAGE_THREAD:
+		tusage_add(&tu, &curthread->t_usage);
+		break;
+	    case RUSAGE_SELF:
+		proc = get_process(curthread->t_pid);
+		tusage_add(&tu, &proc->p_usage);
+		tusage_add(&tu, &curthread->t_usage);
+		break;
+	    case RUSAGE_CHILDREN:
+		processtable_biglock_acquire();
+		proc = get_process(curthread->t_pid);
+		tusage_add(&tu, &proc->p_childusage);
+		processtable_biglock_release();
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	bzero(&ru, sizeof(ru));
+	ru.ru_utime.tv_sec = tu.tu_uticks / HZ;
+	ru.ru_utime.tv_usec = (tu.tu_uticks % HZ) * (1000000 / HZ);
+	ru.ru_stime.tv_sec = tu.tu_sticks / HZ;
+	ru.ru_stime.tv_usec = (tu.tu_sticks % HZ) * (1000000 / HZ);
+	ru.ru_minflt = tu.tu_minflt;
+	ru.ru_majflt = tu.tu_majflt;
+	ru.ru_nvcsw = tu.tu_nvcsw;
+	ru.ru_nivcsw = tu.tu_nivcsw;
+
+	return copyout(&ru, usage, sizeof(ru));
+}
+
 void
 sys_exit(int exitcode)
 {
@@ -1076,7 +1645,7 @@ sys_fork(struct trapframe *tf, int* retval)
 	unsigned long curpid = (unsigned long) curthread->t_pid;
 	struct process *newprocess = NULL;
 	// splhigh();
-	int result = thread_forkf(cur->p_name, enter_forked_process,(void*) frame,curpid,NULL,&newprocess);
+	int result = thread_forkf(cur->p_name, enter_forked_process,(void*) frame,curpid,NULL,NULL,&newprocess);
 	if(result)
 	{
 		kfree(frame);
@@ -1093,6 +1662,133 @@ sys_fork(struct trapframe *tf, int* retval)
 	return 0;
 }
 
+/*
+ * vfork: like fork, but the child runs in our address space instead of
+ * a copy of it, and we sleep until it execs or exits. For fork-then-exec
+ * this skips copying (and swapping back in) the whole address space
+ * only for exec to throw it away. The child must not return from the
+ * function that called vfork; it borrows our stack too.
+ */
+int
+sys_vfork(struct trapframe *tf, int* retval)
+{
+	struct process *cur = get_process(curthread->t_pid);
+	struct process *newprocess = NULL;
+	struct trapframe *frame;
+	struct semaphore *sem;
+	int result;
+
+	frame = kmalloc(sizeof(struct trapframe));
+	if(frame == NULL)
+	{
+		return ENOMEM;
+	}
+	memcpy(frame,tf,sizeof(struct trapframe));
+
+	sem = sem_create("vfork", 0);
+	if(sem == NULL)
+	{
+		kfree(frame);
+		return ENOMEM;
+	}
+
+	result = thread_forkf(cur->p_name, enter_forked_process, (void*) frame,
+			      (unsigned long) curthread->t_pid, sem, NULL, &newprocess);
+	if(result)
+	{
+		sem_destroy(sem);
+		kfree(frame);
+		return result;
+	}
+
+	*retval = newprocess->p_id;
+
+	/* Wait for the child to give our address space back. */
+	P(sem);
+	sem_destroy(sem);
+	return 0;
+}
+
+/*
+ * Enter user mode for a thread made by threadfork. TF is a kmalloc'd
+ * trapframe set up to start it; copy it onto our stack, as
+ * mips_usermode wants, and go. USTACK is the user stack that was
+ * mapped for us, to be freed when we exit.
+ */
+void
+enter_new_thread(void *tf, unsigned long ustack)
+{
+	struct trapframe newtf;
+
+	curthread->t_ustack = (vaddr_t) ustack;
+	memcpy(&newtf, tf, sizeof(newtf));
+	kfree(tf);
+	as_activate(curthread->t_addrspace);
+	mips_usermode(&newtf);
+}
+
+/*
+ * threadfork: start another thread in this process, sharing its address
+ * space and file handles, running START(ARG) on a new stack. The stack
+ * is mapped like an mmap region and freed when the thread exits. (libc's
+ * threadfork() passes its own START, which calls threadexit if the
+ * user's function returns.)
+ */
+int
+sys_threadfork(struct trapframe *tf, vaddr_t start, vaddr_t arg, int* retval)
+{
+	struct addrspace *as = curthread->t_addrspace;
+	struct trapframe *frame;
+	vaddr_t stack;
+	int result;
+
+	if(start == 0 || start >= USERSPACETOP) {
+		return EFAULT;
+	}
+
+	frame = kmalloc(sizeof(struct trapframe));
+	if(frame == NULL) {
+		return ENOMEM;
+	}
+
+	result = as_map_thread_stack(as, &stack);
+	if(result) {
+		kfree(frame);
+		return result;
+	}
+
+	/*
+	 * Start from our own registers, for the status word and $gp,
+	 * and point it at START with ARG as its argument. Leave the 16
+	 * bytes at the top of the stack that a MIPS callee may store its
+	 * argument registers in.
+	 */
+	memcpy(frame, tf, sizeof(struct trapframe));
+	frame->tf_epc = start;
+	frame->tf_a0 = arg;
+	frame->tf_ra = 0;
+	frame->tf_sp = stack + VM_THREADSTACKPAGES * PAGE_SIZE - 16;
+	frame->tf_s8 = 0;
+
+	result = thread_forkt(curthread->t_name, enter_new_thread,
+			      (void*) frame, stack, NULL);
+	if(result) {
+		as_free_thread_stack(as, stack);
+		kfree(frame);
+		return result;
+	}
+
+	*retval = 0;
+	return 0;
+}
+
+/* threadexit: end the calling thread (and the process, if it's the last). */
+void
+sys_threadexit(void)
+{
+	process_threadexit(curthread->t_pid);
+}
+
 /*
  * waitpid() system call, for use by the kernel ONLY.
  * This should be called !!!ONLY!!! from the kernel menu, as it does not check to see
@@ -1128,167 +1824,199 @@ kern_sys_waitpid(pid_t pid, int* status, int options, int* retval)
 	return 0;
 }
 
-/* The exec() system call */
-/* Passes badcall_a (bad execv) */
-/* AKA don't touch me :) */
+/*
+ * Grow the execv argument buffer *BUF (currently *BUFSIZE bytes, of
+ * which the first USED are live) by doubling until it holds at least
+ * NEED bytes. The argument block may not exceed ARG_MAX.
+ */
+static
+int
+execv_growbuf(char **buf, size_t *bufsize, size_t used, size_t need)
+{
+	size_t newsize = *bufsize;
+	char *newbuf;
+
+	if (need > ARG_MAX) {
+		return E2BIG;
+	}
+	while (newsize < need) {
+		newsize *= 2;
+	}
+	if (newsize > ARG_MAX) {
+		newsize = ARG_MAX;
+	}
+	newbuf = kmalloc(newsize);
+	if (newbuf == NULL) {
+		return ENOMEM;
+	}
+	memcpy(newbuf, *buf, used);
+	kfree(*buf);
+	*buf = newbuf;
+	*bufsize = newsize;
+	return 0;
+}
+
+/*
+ * Copy in the argument vector UARGV, building the block runprogram2
+ * puts at the top of the new user stack: nargs+1 pointers (the last
+ * one NULL) followed by the strings, each padded out to 4 bytes. Until
+ * runprogram2 knows where the block will land, each pointer holds the
+ * offset of its string from the start of the block.
+ *
+ * The pointer vector is copied in up to a user page at a time and each
+ * string goes straight into place with copyinstr, so nothing is copied
+ * twice. The buffer starts at one page and doubles as needed.
+ */
+static
+int
+execv_copyin_args(userptr_t uargv, char **retbuf, size_t *retsize,
+		  unsigned long *retnargs)
+{
+	char *buf;
+	userptr_t *argv;
+	size_t bufsize, used, chunk, got, i;
+	unsigned long nargs;
+	vaddr_t uva;
+	bool found;
+	int result;
+
+	uva = (vaddr_t) uargv;
+	if (uva % sizeof(userptr_t) != 0) {
+		return EFAULT;
+	}
+
+	bufsize = PAGE_SIZE;
+	buf = kmalloc(bufsize);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	/* The pointer vector, through the terminating NULL. */
+	nargs = 0;
+	found = false;
+	while (!found) {
+		used = nargs * sizeof(userptr_t);
+		chunk = PAGE_SIZE - (uva % PAGE_SIZE);
+		if (used + chunk > ARG_MAX) {
+			chunk = ARG_MAX - used;
+			if (chunk == 0) {
+				result = E2BIG;
+				goto fail;
+			}
+		}
+		if (used + chunk > bufsize) {
+			result = execv_growbuf(&buf, &bufsize, used,
+					       used + chunk);
+			if (result) {
+				goto fail;
+			}
+		}
+		result = copyin((const_userptr_t) uva, buf + used, chunk);
+		if (result) {
+			goto fail;
+		}
+		argv = (userptr_t *) buf;
+		for (i = 0; i < chunk / sizeof(userptr_t); i++) {
+			if (argv[nargs] == NULL) {
+				found = true;
+				break;
+			}
+			nargs++;
+		}
+		uva += chunk;
+	}
+
+	/* The strings, right behind it. */
+	used = (nargs + 1) * sizeof(userptr_t);
+	for (i = 0; i < nargs; i++) {
+		/* If it doesn't fit, grow the buffer and try it again. */
+		for (;;) {
+			argv = (userptr_t *) buf;
+			result = copyinstr((const_userptr_t) argv[i],
+					   buf + used, bufsize - used, &got);
+			if (result != ENAMETOOLONG) {
+				break;
+			}
+			if (bufsize == ARG_MAX) {
+				result = E2BIG;
+				goto fail;
+			}
+			result = execv_growbuf(&buf, &bufsize, used,
+					       bufsize * 2);
+			if (result) {
+				goto fail;
+			}
+		}
+		if (result) {
+			goto fail;
+		}
+		argv = (userptr_t *) buf;
+		argv[i] = (userptr_t) used;
+		used += got;
+		/* bufsize is a multiple of 4, so the padding always fits. */
+		while (used % 4 != 0) {
+			buf[used++] = '\0';
+		}
+	}
+
+	*retbuf = buf;
+	*retsize = used;
+	*retnargs = nargs;
+	return 0;
+
+ fail:
+	kfree(buf);
+	return result;
+}
+
+/*
+ * The exec() system call. The program name and the arguments are
+ * copied in here; runprogram2 builds the new address space and only
+ * discards the old one once nothing else can fail, so a failed exec
+ * returns to the caller intact.
+ */
 int
 sys_execv(const char* program, char** args, int* retval)
 {
-	char kprogram[128]; (void) kprogram;
-	size_t bytesCopied = 0;
-	int result = 0;
-	size_t actual = 0;
+	char *kprogram;
+	char *argbuf;
+	size_t argsize, actual;
+	unsigned long nargs;
+	int result;
+
+	(void)retval;
 
-	if(args ==  NULL)
+	if(args == NULL)
 	{
-		//Args was NULL, return EFAULT
-		return EFAULT;	
+		return EFAULT;
 	}
 
-	result = copyinstr((const_userptr_t) program, (void*) kprogram,128,&actual);
+	kprogram = kmalloc(PATH_MAX);
+	if(kprogram == NULL)
+	{
+		return ENOMEM;
+	}
+	result = copyinstr((const_userptr_t) program, kprogram, PATH_MAX, &actual);
 	if(result)
 	{
-		//program pointer was invalid, return error
+		kfree(kprogram);
 		return result;
 	}
 	if(actual <= 1)
 	{
 		//An empty program string was passed into execv, return EINVAL
+		kfree(kprogram);
 		return EINVAL;
 	}
-	result = check_userptr( (const_userptr_t) args);
+
+	result = execv_copyin_args((userptr_t) args, &argbuf, &argsize, &nargs);
 	if(result)
 	{
+		kfree(kprogram);
 		return result;
 	}
-	// char kargs;
-	// // const_userptr_t uargs = (void*) args;
-	// result = copyin( (const_userptr_t) args, &kargs, 1);
-	// if(result)
-	// {
-	// 	//args pointer was invalid, return error
-	// 	return result;
-	// }
-
-	// do {
-	// 	result = copyin((userptr_t) program,&curchar,sizeof(char));
-	// 	if(result)
-	// 	{
-	// 		return result;
-	// 	}
-	// 	kprogram[bytesCopied] = curchar;
-	// 	bytesCopied++;
-	// 	program = program+1; 
-
-	// } while(curchar != '\0');
-
-	// kprintf("Copied in program\n");
-	size_t count = 0;
-	bytesCopied = 0;
-
-	size_t max = 1024 * 4;
-	(void)max;
-	// userptr_t curusrarg;
-	char* curarg;
-	// int* x;
-	(void)curarg;
-
-	char* buf = (char*) kmalloc(max);
-	char** argptrs = kmalloc(max);
-	actual = 0;
-	void* curcharptr;
-	// size_t curptrpos = max-4;
-	while(args[count] != NULL)
-	{
-		curcharptr = &buf[bytesCopied];
-		// kprintf("Actual: %d Pos: %d\n",actual,bytesCopied);
-		result = copyinstr((const_userptr_t) args[count], (void*) &buf[bytesCopied], max-actual,&actual);
-		if(result)
-		{	
-			// kprintf("copy failed!");
-			return result;
-		}
-		else { /*kprintf("%d bytes copied\n", actual);*/ bytesCopied += actual;}
-		while((max - bytesCopied) % 4 != 0)
-		{
-			// kprintf("padding args[%d]",actual);
-			buf[bytesCopied] = '\0';
-			bytesCopied++;
-		}
-		//Add arg ptr to arg array:
-		argptrs[count] = curcharptr;
-		count++;
-	}
-	// argptrs[count+1] = NULL;
-	// while(args[count] != NULL)
-	// {
-	// 	//Copy in pointer to current arg..
-	// 	curusrarg = (userptr_t) args[count];
-	// 	// result = copyin((const_userptr_t) args[count], (void*) curarg, 1);
-	// 	result = copyinstr((const_userptr_t) arg[count], curarg, 4)
-	// 	if(result)
-	// 	{
-	// 		kprintf("copy failed!\n");
-	// 		return result;
-	// 	}
-	// 	kprintf("copy worked!");
-	// 	//Copy in the arg, char by char.
-	// 	do
-	// 	{	
-	// 		if(bytesCopied == max)
-	// 		{
-	// 			return E2BIG;
-	// 		}
-	// 		result = copyin(curusrarg, &curchar, sizeof(char));
-	// 		if(result)
-	// 		{
-	// 			return result;
-	// 		}
-	// 		buf[bytesCopied] = curchar;
-	// 		bytesCopied++;
-	// 		curusrarg++;
-	// 	} while(curchar != '\0');
-	// 	//pad the arg, if needed
-	// 	while(bytesCopied % 4 != 0)
-	// 	{
-	// 		buf[bytesCopied] = '\0';
-	// 		bytesCopied++;
-	// 	}
-	// 	count++;
-
-	// }
-
-	// for(int i=0;i<bytesCopied;i++)
-	// {	
-	// 	kprintf("%s\n", (char *) &buf[i]);
-	// }
-
-	// char* kargs[count+1];
-	// int pos = 0;
-	// kargs[count] = NULL;
-	// for(size_t j=0;j<count;j++)
-	// {
-	// 	kargs[j] = (char*) &buf[pos];
-	// 	while(buf[pos] != '\0')
-	// 	{
-	// 		pos++;
-	// 	}
-	// }
-	// kprintf("kargs[0]:%s\n", (char*) kargs[0]);
-	// kprintf("kargs[1]:%s\n", (char*) kargs[1]);
-	// kfree(buf);
-	// for(size_t i = 0;i<bytesCopied;i++)
-	// {
-	// 	kprintf("buf[%d]: %c\n",i, (char) buf[i]);
-	// }
-	// for(size_t i = 0;i<count;i++)
-	// {
-	// 	kprintf("ptrs[%d]: %s\n",i, argptrs[i]);
-	// }
-	runprogram2(&kprogram[0], argptrs,count);
-	(void)program;
-	(void)args;
-	(void)retval;
-	return 0;
+
+	/* runprogram2 frees kprogram and argbuf, and only returns on error. */
+	return runprogram2(kprogram, argbuf, argsize, nargs);
 }
 
@@ -100,12 +100,30 @@ vm_tlbshootdown_all(void)
 }
 
 void
-vm_tlbshootdown(const struct tlbshootdown *ts)
+vm_tlbshootdown(const struct tlbshootdown *ts, int n)
 {
 	(void)ts;
+	(void)n;
 	panic("dumbvm tried to do tlb shootdown?!\n");
 }
 
+vaddr_t
+alloc_kvpages(int npages)
+{
+	return alloc_kpages(npages);
+}
+
+void
+vm_loadctl_bootstrap(void)
+{
+	/* no load control - nothing swaps */
+}
+
+void
+vm_loadctl_wait(void)
+{
+}
+
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
@@ -73,6 +73,30 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Smallest interval we program, so a deadline that is already past
+ * still gets an interrupt rather than waiting for the counter to
+ * wrap.
+ */
+#define TIMER_MIN_CYCLES 100
+
+/*
+ * Set the on-chip timer to go off NSECS nanoseconds from now. The
+ * clock code uses this to run the cpu tickless when idle and to
+ * deliver timeouts between ticks.
+ */
+void
+mainbus_timer_set(uint32_t nsecs)
+{
+	uint32_t count;
+
+	count = nsecs / (1000000000 / CPU_FREQUENCY);
+	if (count < TIMER_MIN_CYCLES) {
+		count = TIMER_MIN_CYCLES;
+	}
+	mips_timer_set(count);
+}
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -268,9 +292,11 @@ mainbus_interrupt(struct trapframe *tf)
 		lamebus_clear_ipi(lamebus, curcpu);
 	}
 	else if (cause & MIPS_TIMER_BIT) {
-		/* Reset the timer (this clears the interrupt) */
+		/*
+		 * Reset the timer (this clears the interrupt) and
+		 * call hardclock, which sets it for the next event.
+		 */
 		mips_timer_set(CPU_FREQUENCY / HZ);
-		/* and call hardclock */
 		hardclock();
 	}
 	else {
@@ -843,7 +843,8 @@ int
 emufs_mmap(struct vnode *v)
 {
 	(void)v;
-	return EUNIMP;
+	/* Mappable; the VM system uses emufs_read/emufs_write. */
+	return 0;
 }
 
 //////////////////////////////
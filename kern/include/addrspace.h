@@ -41,6 +41,13 @@
 // CJO: arbitrarily defined, to be changed when we layout our address space
 #define   HEAP_MAX  0x10000000 // 268435456 bytes (256MB)
 
+/* Maximum of 1MB of user stack */
+#define VM_STACKPAGES	256
+#define USER_STACK_LIMIT (0x80000000 - (VM_STACKPAGES * PAGE_SIZE))
+
+/* Stack of 256K for each thread threadfork makes, mapped like mmap */
+#define VM_THREADSTACKPAGES 64
+
 #define PAGE_DIR_ENTRIES 1024
 #define PAGE_TABLE_ENTRIES 1024
 /* Essentially we could do...
@@ -49,6 +56,34 @@ each of which ^ would point to a 1024-element int array.
 We use the struct for clarity. */
 
 struct vnode;
+struct lock;
+struct shm_segment;
+
+/*
+ * A region of the address space created by mmap or by load_elf for a
+ * program segment: anonymous memory, or a window onto a file. Pages are
+ * filled in by vm_fault as they are touched, from the file or with zeros.
+ * Only the VR_FILESZ bytes starting at VR_FILEVA come from the file; the
+ * rest of the region (an ELF segment's bss, say) reads as zeros. Regions
+ * are kept sorted by address, and mmap places them downward from the
+ * bottom of the stack.
+ */
+struct vm_region {
+	vaddr_t vr_start;		/* first address (page aligned) */
+	vaddr_t vr_end;			/* address past the end (page aligned) */
+	int vr_perms;			/* PF_R | PF_W | PF_X */
+	int vr_flags;			/* MAP_SHARED or MAP_PRIVATE */
+	struct vnode *vr_vnode;		/* backing file, or NULL if anonymous */
+	off_t vr_offset;		/* file offset of vr_fileva */
+	vaddr_t vr_fileva;		/* address of the first file byte */
+	size_t vr_filesz;		/* bytes of file data from vr_fileva */
+	bool vr_text;			/* read-only program segment, whose pages
+					   are shared with other processes */
+	struct shm_segment *vr_shm;	/* attached shared memory segment, or
+					   NULL; vr_offset and vr_fileva say
+					   where in it, as for a file */
+	struct vm_region *vr_next;
+};
 
 
 /* 
@@ -123,6 +158,36 @@ struct addrspace {
          * but before the stack. 
          */
         bool loadelf_done;
+
+        /* mmap'd regions, sorted by address */
+        struct vm_region *regions;
+
+        /* Threads using this address space (see as_incref/as_destroy) */
+        unsigned as_refcount;
+        /* Held while faulting or changing the layout (heap, stack,
+         * regions), since threads sharing the address space may be
+         * doing either at once on different cpus. */
+        struct lock *as_lock;
+
+        /* Fault-around (see vm_fault): where the last fault was, and how
+         * many resident pages beyond the next one to load as well, and in
+         * which direction (1 up, -1 down, 0 no pattern yet). */
+        vaddr_t as_lastfault;
+        unsigned as_faultwindow;
+        int as_faultdir;
+
+        /* Load control (see smartvm.c): pages resident and pages touched
+         * as of the last look, faults that read from swap (in all, and at
+         * the last look), and whether the process is swapped out and kept
+         * off the cpu, since which look. All address spaces are on a list
+         * through as_next. */
+        unsigned as_rss;
+        unsigned as_wss;
+        unsigned as_pageins;
+        unsigned as_lastpageins;
+        bool as_deactivated;
+        unsigned as_outsince;
+        struct addrspace *as_next;
 #endif
 };
 
@@ -143,8 +208,17 @@ struct addrspace {
  *                "seen" by the processor. Argument might be NULL, 
  *                meaning "no particular address space".
  *
- *    as_destroy - dispose of an address space. You may need to change
- *                the way this works if implementing user-level threads.
+ *    as_incref - take another reference to an address space, for a
+ *                thread that is going to share it.
+ *
+ *    as_destroy - drop a reference to an address space, and dispose of
+ *                it once the last thread using it lets go.
+ *
+ *    as_shootdown - invalidate the TLB entries for an address space on
+ *                this cpu and on every other cpu running it. Call with
+ *                as_lock held, before taking away pages or permissions,
+ *                so nobody can reload an entry until we're done. With a
+ *                NULL address space, flushes every cpu.
  *
  *    as_define_region - set up a region of memory within the address
  *                space.
@@ -163,7 +237,9 @@ struct addrspace {
 struct addrspace *as_create(void);
 int               as_copy(struct addrspace *src, struct addrspace **ret);
 void              as_activate(struct addrspace *);
+void              as_incref(struct addrspace *);
 void              as_destroy(struct addrspace *);
+void              as_shootdown(struct addrspace *);
 
 int               as_define_region(struct addrspace *as, 
                                    vaddr_t vaddr, size_t sz,
@@ -174,6 +250,79 @@ int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
+/*
+ * Functions for mmap'd regions and program segments.
+ *
+ *    as_find_region - return the region containing VA, or NULL.
+ *
+ *    as_find_overlap - return the first region overlapping [START, END),
+ *                 or NULL.
+ *
+ *    as_map_region - add a region of NPAGES pages at *VA, or anywhere
+ *                 free if *VA is 0, and hand back its address. Takes a
+ *                 reference to VN if it is not NULL.
+ *
+ *    as_map_segment - add a private region for the program segment of
+ *                 MEMSZ bytes at VADDR, whose first FILESZ bytes come
+ *                 from VN at OFFSET. Takes a reference to VN.
+ *
+ *    as_unmap_range - remove [START, END) from any regions it overlaps,
+ *                 writing back modified pages of shared file mappings
+ *                 and freeing pages and swap slots.
+ *
+ *    as_free_pages - free the pages of [START, END) that aren't part of
+ *                 any region, such as heap pages above a lowered break.
+ *
+ *    as_map_shm - attach NPAGES pages of shared memory segment SEG at *VA
+ *                 (or anywhere free, if *VA is 0) and hand back the
+ *                 address. The region takes over a reference to SEG
+ *                 the caller got with shm_incref.
+ *
+ *    as_map_thread_stack - map a fresh user stack for a new thread in
+ *                 AS, and hand back its lowest address.
+ *
+ *    as_free_thread_stack - unmap a stack from as_map_thread_stack.
+ *
+ *    as_page_refetchable - true if the page at VA (whose PTE is given)
+ *                 can be evicted by dropping it and reading it back
+ *                 from its file later, rather than swapping it.
+ *
+ *    vm_region_unmap_page - throw away the page at VA of region VR (or
+ *                 of no region, if VR is NULL).
+ *
+ *    vm_region_fill - read the file contents for page VA into the
+ *                 physical page PA, which must be zero filled.
+ *
+ *    vm_region_writeback - write physical page PA back to the file
+ *                 page VA came from, if the mapping is shared.
+ */
+struct vm_region *as_find_region(struct addrspace *as, vaddr_t va);
+struct vm_region *as_find_overlap(struct addrspace *as,
+                                  vaddr_t start, vaddr_t end);
+int               as_map_region(struct addrspace *as, vaddr_t *va,
+                                size_t npages, int perms, int flags,
+                                struct vnode *vn, off_t offset);
+int               as_map_segment(struct addrspace *as, vaddr_t vaddr,
+                                 size_t memsz, int perms, struct vnode *vn,
+                                 off_t offset, size_t filesz);
+int               as_unmap_range(struct addrspace *as,
+                                 vaddr_t start, vaddr_t end);
+void              as_free_pages(struct addrspace *as,
+                                vaddr_t start, vaddr_t end);
+int               as_map_shm(struct addrspace *as, vaddr_t *va,
+                             size_t npages, int perms,
+                             struct shm_segment *seg);
+int               as_map_thread_stack(struct addrspace *as, vaddr_t *va);
+void              as_free_thread_stack(struct addrspace *as, vaddr_t va);
+bool              as_page_refetchable(struct addrspace *as, vaddr_t va,
+                                      int pte);
+void              vm_region_unmap_page(struct addrspace *as,
+                                       struct vm_region *vr, vaddr_t va);
+int               vm_region_fill(struct vm_region *vr, vaddr_t va,
+                                 paddr_t pa);
+int               vm_region_writeback(struct vm_region *vr, vaddr_t va,
+                                      paddr_t pa);
+
 
 /*
  * Functions in loadelf.c
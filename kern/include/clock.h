@@ -35,8 +35,10 @@
 /*
  * Time-related definitions.
  *
- * hardclock() is called on every CPU HZ times a second, possibly only
- * when the CPU is not idle, for scheduling.
+ * hardclock() is called on every CPU HZ times a second, for
+ * scheduling, and also when a timeout is due. A CPU that is idle with
+ * nothing to run stops ticking until its next timeout or until it
+ * gets work.
  *
  * timerclock() is called on one CPU once a second to allow simple
  * timed operations. (This is a fairly simpleminded interface.)
@@ -56,6 +58,9 @@
 #define HZ  100
 #endif
 
+/* nanoseconds per hardclock */
+#define HARDCLOCK_NSECS  (1000000000 / HZ)
+
 void hardclock_bootstrap(void);
 
 void hardclock(void);
@@ -70,8 +75,53 @@ void getinterval(time_t secs1, uint32_t nsecs,
 /*
  * clocksleep() suspends execution for the requested number of seconds,
  * like userlevel sleep(3). (Don't confuse it with wchan_sleep.)
+ *
+ * clocksleep_nsecs() and clocksleep_until() do the same with
+ * nanosecond resolution; the deadline for clocksleep_until is in
+ * clock_nsecs() units.
  */
 void clocksleep(int seconds);
+void clocksleep_nsecs(uint64_t nsecs);
+void clocksleep_until(uint64_t deadline);
+
+/*
+ * clock_nsecs() returns the current time as a single nanosecond
+ * count, for computing deadlines.
+ */
+uint64_t clock_nsecs(void);
+
+/*
+ * Timeouts.
+ *
+ * A timeout calls to_func(to_data) once its deadline has passed. It
+ * runs from the timer interrupt of the cpu that armed it, so the
+ * function must not sleep.
+ *
+ * timeout_init sets up a timeout; it need not be cleaned up.
+ * timeout_add arms it to go off NSECS nanoseconds from now on the
+ * current cpu. It must not already be armed.
+ * timeout_del disarms it. It returns true if the timeout was still
+ * pending; otherwise the function either ran or is being run on
+ * another cpu, in which case timeout_del waits for it to finish.
+ * Either way the timeout may be freed or rearmed afterwards.
+ */
+struct timeout {
+	struct timeout *to_next;	/* next on the cpu's list */
+	struct cpu *to_cpu;		/* cpu it is armed on, or NULL */
+	uint64_t to_deadline;		/* when it goes off */
+	void (*to_func)(void *);	/* what to call */
+	void *to_data;			/* argument for to_func */
+};
+
+void timeout_init(struct timeout *to, void (*func)(void *), void *data);
+void timeout_add(struct timeout *to, uint64_t nsecs);
+bool timeout_del(struct timeout *to);
+
+/*
+ * Called from the idle loop when a cpu that turned off its periodic
+ * tick has something to run again.
+ */
+void hardclock_resume(void);
 
 
 #endif /* _CLOCK_H_ */
@@ -35,6 +35,9 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+struct timeout; /* from <clock.h> */
+struct addrspace; /* from <addrspace.h> */
+
 
 /*
  * Per-cpu structure
@@ -59,7 +62,21 @@ struct cpu {
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
+	struct threadlist c_leaving;	/* Threads bound for other cpus */
+	struct thread *c_idlethread;	/* Runs while c_leaving drains */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	uint64_t c_nexttick;		/* clock_nsecs() of next hardclock */
+	uint64_t c_timerdeadline;	/* When the timer is set to go off */
+	bool c_tickless;		/* Idle with the periodic tick off */
+	unsigned c_skippedticks;	/* Ticks not taken while tickless */
+
+	/*
+	 * Set by this cpu (in as_activate, with interrupts off) and
+	 * read without locking by others deciding whom to send a TLB
+	 * shootdown. A stale value only costs an extra shootdown: a
+	 * cpu switching to an address space flushes its TLB anyway.
+	 */
+	struct addrspace *c_curas;	/* Address space the TLB may map */
 
 	/*
 	 * Accessed by other cpus.
@@ -69,6 +86,21 @@ struct cpu {
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
 	struct spinlock c_runqueue_lock;
 
+	/*
+	 * Timeouts armed on this cpu, soonest first.
+	 * Protected by the timeout lock.
+	 */
+	struct timeout *c_timeouts;	/* Pending timeouts */
+	struct timeout *c_timeout_running; /* Timeout whose handler is running */
+	struct spinlock c_timeout_lock;
+
+	/*
+	 * Load balancing statistics.
+	 * Protected by the runqueue lock.
+	 */
+	unsigned c_steals;		/* Threads this cpu pulled from others */
+	unsigned c_migrations;		/* Threads other cpus pulled from us */
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the IPI lock.
@@ -152,7 +184,15 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
- * ipi_tlbshootdown_broadcast is like ipi_broadcast but carries TLB shootdown data.
+ * ipi_tlbshootdown_batch queues a batch of TLB shootdowns on every other
+ * CPU running one of their address spaces (any CPU, for a NULL one) and
+ * sends each of those one IPI; if it can take interrupts, it waits
+ * until they're done.
+ * ipi_tlbshootdown_addrspace flushes the whole TLB of every other CPU
+ * that is running the given address space (or every other CPU, if it
+ * is NULL), and waits until they have.
+ * ipi_tlbshootdown_needed says whether any other CPU is running the
+ * given address space (or any other CPU at all, if it is NULL).
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -167,7 +207,9 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
-void ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_batch(const struct tlbshootdown *mappings, unsigned n);
+void ipi_tlbshootdown_addrspace(struct addrspace *as);
+bool ipi_tlbshootdown_needed(struct addrspace *as);
 
 void interprocessor_interrupt(void);
 
@@ -0,0 +1,11 @@
+#ifndef _FUTEX_H_
+#define _FUTEX_H_
+
+/*
+ * Futexes: sleeping and waking on a word of user memory.
+ *
+ * futex_bootstrap - set up the wait queues. Called once at boot.
+ */
+void futex_bootstrap(void);
+
+#endif /* _FUTEX_H_ */
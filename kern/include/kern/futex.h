@@ -0,0 +1,10 @@
+#ifndef _KERN_FUTEX_H_
+#define _KERN_FUTEX_H_
+
+/*
+ * Operations for futex().
+ */
+#define FUTEX_WAIT	0	/* sleep if *addr == val */
+#define FUTEX_WAKE	1	/* wake up to val sleepers on addr */
+
+#endif /* _KERN_FUTEX_H_ */
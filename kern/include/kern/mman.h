@@ -0,0 +1,24 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Definitions for mmap and munmap.
+ */
+
+/* Page protections (prot argument) */
+#define PROT_NONE	0x0	/* no access */
+#define PROT_READ	0x1	/* pages may be read */
+#define PROT_WRITE	0x2	/* pages may be written */
+#define PROT_EXEC	0x4	/* pages may be executed */
+
+/* Mapping flags (flags argument); exactly one of SHARED and PRIVATE */
+#define MAP_SHARED	0x0001	/* writes go to the file */
+#define MAP_PRIVATE	0x0002	/* writes stay in this process */
+#define MAP_FIXED	0x0010	/* map exactly at the address given */
+#define MAP_ANON	0x1000	/* not backed by a file; zero filled */
+#define MAP_ANONYMOUS	MAP_ANON
+
+/* Error return from mmap */
+#define MAP_FAILED	((void *)-1)
+
+#endif /* _KERN_MMAN_H_ */
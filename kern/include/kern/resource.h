@@ -49,6 +49,7 @@
 /* flags for getrusage() */
 #define RUSAGE_SELF	0
 #define RUSAGE_CHILDREN	(-1)
+#define RUSAGE_THREAD	1	/* calling thread only */
 
 struct rusage {
 	struct timeval ru_utime;
@@ -0,0 +1,27 @@
+#ifndef _KERN_SHM_H_
+#define _KERN_SHM_H_
+
+/*
+ * Definitions for System V style shared memory (shmget and friends).
+ */
+
+/* Key for a segment that can only be found by the id shmget returns */
+#define IPC_PRIVATE	0
+
+/* shmget flags (the low nine bits are permissions, which we ignore) */
+#define IPC_CREAT	0001000	/* create the segment if there isn't one */
+#define IPC_EXCL	0002000	/* with IPC_CREAT: fail if there is one */
+
+/* shmat flags */
+#define SHM_RDONLY	0010000	/* attach for reading only */
+
+/* shmctl commands */
+#define IPC_RMID	0	/* remove once nobody has it attached */
+#define IPC_STAT	2	/* get a struct shmid_ds */
+
+struct shmid_ds {
+	size_t shm_segsz;	/* size in bytes */
+	unsigned shm_nattch;	/* number of current attachments */
+};
+
+#endif /* _KERN_SHM_H_ */
@@ -48,6 +48,9 @@ void mainbus_start_cpus(void);
 /* Bus-level interrupt handler, called from cpu-level trap/interrupt code */
 void mainbus_interrupt(struct trapframe *);
 
+/* Set the current cpu's timer to interrupt NSECS nanoseconds from now. */
+void mainbus_timer_set(uint32_t nsecs);
+
 /* Find the size of main memory. */
 /* XXX this interface is not adequately MI */
 size_t mainbus_ramsize(void);
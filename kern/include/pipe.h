@@ -0,0 +1,20 @@
+/* Pipes */
+
+#ifndef _PIPE_H_
+#define _PIPE_H_
+
+struct vnode;
+
+/*
+ * pipe_create - make a pipe, handing back a vnode for each end. Both
+ *               come back open (as if from vfs_open), so each is
+ *               released with vfs_close.
+ *
+ * pipe_isvnode - true if VN is one end of a pipe. Pipes have no seek
+ *               position, so file handles on them don't need to hold
+ *               fh_open_lk across a read or write (which may block).
+ */
+int pipe_create(struct vnode **readend, struct vnode **writeend);
+bool pipe_isvnode(struct vnode *vn);
+
+#endif /* _PIPE_H_ */
@@ -17,7 +17,7 @@ struct process {
 	pid_t p_id;
 
 	/* Internal Stuff */
-	struct processlistnode p_listnode; /* Link for run/sleep/zombie lists */
+	struct processlistnode p_listnode; /* Link on parent's p_children */
 
 	/*For waitpid()*/
 	struct semaphore *p_waitsem;
@@ -26,14 +26,24 @@ struct process {
 	//struct processlist p_waiters;
 
 	pid_t p_parentpid;
-	//struct processlist p_children;
+	struct processlist p_children;	/* Live and zombie children */
+	bool p_orphaned;		/* Reparented to init; reap on exit */
 	struct thread *p_thread;
+	unsigned p_nthreads;		/* Live threads; we exit with the last */
 
 	/* For fork() */
 	// struct semaphore *p_forksem;
 
+	/* vfork parent sleeps here while we run in its address space */
+	struct semaphore *p_vforksem;
+
 	// Array of file handle pointers; initialize to NULL pointers on process creation.
 	struct file_handle* p_fd_table[FD_MAX];
+	struct lock *p_fd_lock;		/* Protects p_fd_table; threads share it */
+
+	/* Resource usage of our exited threads, and of reaped children */
+	struct tusage p_usage;
+	struct tusage p_childusage;
 };
 
 /* States a process can be in. */
@@ -48,6 +58,9 @@ struct process *init_process_create(const char*);
 int process_create(const char*, pid_t parent, struct process**);
 
 void process_exit(pid_t pid, int exitcode);
+void process_threadexit(pid_t pid);
+void process_addthread(pid_t pid);
+void process_vfork_done(struct process *);
 void process_destroy(pid_t pid);
 int process_wait(pid_t pidToWait, pid_t pidToWaitFor);
 /* Call once during system startup to allocate data structures */
@@ -67,11 +80,12 @@ pid_t get_process_parent(pid_t);
 int get_free_file_descriptor(pid_t);				// Given a process id, returns a file descriptor that is free.
 void release_file_descriptor(pid_t, int fd);		// Closing file, so release fd
 struct file_handle* get_file_handle(pid_t, int fd);	// Given a file descriptor, returns the pointer to the associated file handle.
+struct file_handle* get_file_handle_ref(pid_t, int fd);	// Same, but holds the handle open until put_file_handle().
+void put_file_handle(struct file_handle*);			// Drop a reference; the last one closes the file.
 
 int get_process_exitcode(pid_t);
 void set_process_parent(pid_t,pid_t);
 void abandon_children(pid_t);
-void collect_children(void);
 
 void process_cleanup(void);
 
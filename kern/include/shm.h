@@ -0,0 +1,44 @@
+#ifndef _SHM_H_
+#define _SHM_H_
+
+/*
+ * Shared memory segments.
+ *
+ * A segment owns its pages. Each one is resident (a coremap page whose
+ * shm field points back at the segment), out in swap (filed under the
+ * segment rather than an address space), or not touched yet. Address
+ * spaces attach a segment as a region with vr_shm set; their page
+ * tables have nothing for it, and vm_fault loads the TLB straight from
+ * the segment. So when the pager takes a segment page it only has to
+ * flush TLBs, not find every page table that points at it.
+ *
+ * shm_bootstrap - set up the segment table. Called once at boot.
+ *
+ * shm_incref - another region is attaching SEG (an attach, a fork, or
+ *               a partial munmap splitting an attachment in two).
+ *
+ * shm_decref - a region attaching SEG is going away. Destroys SEG if
+ *               that was the last one and it has been removed.
+ *
+ * shm_getpage - find (bringing it in if need be) page INDEX of SEG and
+ *               hand back its physical address. Call with the coremap
+ *               lock held, and load the TLB before letting it go. The
+ *               lock is dropped while a page is read in from swap.
+ *               Returns EAGAIN if the pager is taking the page away,
+ *               or somebody else is reading it in; wait for them to
+ *               finish and try again.
+ *
+ * shm_pageout - called by the pager to write out and free a segment
+ *               page it has marked SWAPPINGOUT. If it can't be written
+ *               out, it stays resident.
+ */
+struct shm_segment;
+struct page;
+
+void shm_bootstrap(void);
+void shm_incref(struct shm_segment *seg);
+void shm_decref(struct shm_segment *seg);
+int shm_getpage(struct shm_segment *seg, size_t index, paddr_t *pa);
+void shm_pageout(struct page *page);
+
+#endif /* _SHM_H_ */
@@ -14,9 +14,10 @@
 #define SIND_TO_DISK(swap_index) ( (swap_index * PAGE_SIZE) )
 
 /* Entry for swap space array, which indicates what page is in a given swap
-   location on disk. */
+   location on disk: page VA of address space OWNER, or the page at offset
+   VA of a shared memory segment (then OWNER is the segment). */
 struct swap_entry {
-	struct addrspace *as;
+	const void *owner;
 	vaddr_t va;
 };
 
@@ -44,5 +45,13 @@ int swapin_page(struct addrspace* as, vaddr_t va, struct page* page);
 /* Look for page in swap that needs to be removed (due to as_destroy). */
 int clean_swapfile(struct addrspace* as, vaddr_t va);
 
+/* The same for pages that belong to something other than an address space
+   (shared memory segments), so have no PTE to keep track of them: write
+   physical page PA out as page VA of OWNER, read it back into PA (freeing
+   the swap slot), or throw it away. */
+int swap_store(const void *owner, vaddr_t va, paddr_t pa);
+int swap_load(const void *owner, vaddr_t va, paddr_t pa);
+void swap_discard(const void *owner, vaddr_t va);
+
 #endif /* _SWAPSPACE_H_ */
 
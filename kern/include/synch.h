@@ -63,6 +63,12 @@ void sem_destroy(struct semaphore *);
 void P(struct semaphore *);
 void V(struct semaphore *);
 
+/*
+ * P_timeout is P with a time limit: it returns ETIMEDOUT instead of
+ * waiting past NSECS nanoseconds, and 0 if it got the semaphore.
+ */
+int P_timeout(struct semaphore *, uint64_t nsecs);
+
 
 /*
  * Simple lock for mutual exclusion.
@@ -83,11 +89,14 @@ struct lock {
 
 struct lock *lock_create(const char *name);
 void lock_acquire(struct lock *);
+bool lock_tryacquire(struct lock *);
 
 /*
  * Operations:
  *    lock_acquire - Get the lock. Only one thread can hold the lock at the
  *                   same time.
+ *    lock_tryacquire - Get the lock if nobody holds it, without waiting.
+ *                   Returns true if we got it.
  *    lock_release - Free the lock. Only the thread holding the lock may do
  *                   this.
  *    lock_do_i_hold - Return true if the current thread holds the lock; 
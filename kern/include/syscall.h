@@ -47,6 +47,8 @@ void syscall(struct trapframe *tf);
 /* Helper for fork(). You write this. */
 // void enter_forked_process(struct trapframe *tf, unsigned long junk);
 void enter_forked_process(void *tf, unsigned long junk);
+/* Same, for a thread made by threadfork. */
+void enter_new_thread(void *tf, unsigned long ustack);
 
 /* Enter user mode. Does not return. */
 void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
@@ -59,23 +61,40 @@ void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_nanosleep(const_userptr_t user_req, userptr_t user_rem);
 int sys_sbrk(intptr_t amount, uint32_t* retval_sbrk);
+int sys_mmap(vaddr_t addr, size_t len, int prot, int flags, int fd, off_t offset, int* retval);
+int sys_munmap(vaddr_t addr, size_t len);
 int sys_open(char* filename, int flags, /*Added*/ int* retval);
 int sys_write(int fd, const void*, size_t nbytes, /*Added*/ int* retval);
 int sys_read(int fd, const void*, size_t buflen, /*Added*/ int* retval);
+int sys_readv(int fd, const_userptr_t iov, int iovcnt, int* retval);
+int sys_writev(int fd, const_userptr_t iov, int iovcnt, int* retval);
+int sys_pread(int fd, userptr_t buf, size_t buflen, off_t offset, int* retval);
+int sys_pwrite(int fd, userptr_t buf, size_t nbytes, off_t offset, int* retval);
 int sys_close(int fd);
 int sys_lseek(int fd, off_t pos, int whence, int64_t* retval64);
 int sys_dup2(int oldfd, int newfd, int* retval);
+int sys_pipe(userptr_t fds, int* retval);
 int sys_chdir(const char*, int* retval);
 int sys___getcwd(char* buf, size_t buflen, int* retval);
 int sys_remove(const char*, int* retval);
 
 int sys_getpid(/* Added*/ int* retval);
+int sys_getrusage(int who, userptr_t usage);
 void sys_exit(int exitcode);
 /* To be called *ONLY* from menu.c */
 int kern_sys_waitpid(pid_t pid, int* status, int options, /*Added*/ int* retval);
 int sys_waitpid(pid_t pid, int* status, int options, /*Added*/ int* retval);
 int sys_fork(/* Added */ struct trapframe *tf,/*Added*/int* retval);
+int sys_vfork(struct trapframe *tf, int* retval);
+int sys_threadfork(struct trapframe *tf, vaddr_t start, vaddr_t arg, int* retval);
+void sys_threadexit(void);
+int sys_futex(userptr_t uaddr, int op, int val, const_userptr_t timeout, int* retval);
+int sys_shmget(int key, size_t size, int flags, int* retval);
+int sys_shmat(int shmid, vaddr_t addr, int flags, int* retval);
+int sys_shmdt(vaddr_t addr);
+int sys_shmctl(int shmid, int cmd, userptr_t buf);
 int sys_execv(const char* program, char** args, /*Added*/ int* retval);
 
 /* 
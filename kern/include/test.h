@@ -105,13 +105,14 @@ int printfile(int, char **);
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
+int memperf(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
 int runprogram(char *progname);
 /* Routing for running a user-level program with args */
 int runprogram1(const char* program, char** args, unsigned long nargs);
-int runprogram2(const char* program, char** args, unsigned long nargs);
+int runprogram2(char *progname, char *argbuf, size_t argsize, unsigned long nargs);
 int runprogram3(const char* program, void* args, unsigned long nargs);
 /* Kernel menu system. */
 void menu(char *argstr);
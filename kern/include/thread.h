@@ -39,10 +39,26 @@
 
 #include <spinlock.h>
 #include <threadlist.h>
+
+/*
+ * Per-thread resource usage, summed into the process when the thread
+ * exits. Times are in hardclocks. Defined ahead of <process.h>, which
+ * embeds it.
+ */
+struct tusage {
+	unsigned tu_uticks;		/* Ticks spent in user mode */
+	unsigned tu_sticks;		/* Ticks spent in the kernel */
+	unsigned tu_nvcsw;		/* Voluntary context switches */
+	unsigned tu_nivcsw;		/* Involuntary context switches */
+	unsigned tu_minflt;		/* Page faults not needing I/O */
+	unsigned tu_majflt;		/* Page faults that read from swap */
+};
+
 #include <process.h>
 
 struct addrspace;
 struct cpu;
+struct semaphore;
 struct vnode;
 
 /* get machine-dependent defs */
@@ -109,14 +125,47 @@ struct thread {
 
 	/* VM */
 	struct addrspace *t_addrspace;	/* virtual address space */
+	vaddr_t t_ustack;		/* User stack threadfork made us, or 0 */
 
 	/* VFS */
 	struct vnode *t_cwd;		/* current working directory */
 
 	 pid_t t_pid;
+
+	/*
+	 * Scheduler fields.
+	 *
+	 * t_priority is the thread's multi-level feedback queue level;
+	 * 0 is the most interactive level. The remaining fields are the
+	 * accounting used to move threads between levels.
+	 */
+	int t_priority;			/* Current feedback queue level */
+	unsigned t_quantum;		/* Hardclocks used at this level */
+	unsigned t_readysince;		/* c_hardclocks when last queued */
+	unsigned t_runticks;		/* Total hardclocks spent running */
+	unsigned t_sleepcount;		/* Times slept on a wait channel */
+	unsigned t_lastran;		/* t_cpu's c_hardclocks when last run */
+	bool t_background;		/* Stays at the lowest level */
+
+	/*
+	 * CPU affinity. Bit N set means the thread may run on cpu N.
+	 * The scheduler only ever queues the thread on such a cpu.
+	 */
+	uint32_t t_affinity;
+
+	/*
+	 * Resource accounting. t_inuser is set by the trap code while
+	 * handling an interrupt taken in user mode, so the tick can be
+	 * charged to user rather than system time.
+	 */
+	bool t_inuser;
+	struct tusage t_usage;
 	/* add more here as needed */
 };
 
+/* Affinity mask allowing every cpu. */
+#define THREAD_AFFINITY_ANY	0xffffffff
+
 /* Call once during system startup to allocate data structures. */
 void thread_bootstrap(void);
 
@@ -161,12 +210,26 @@ int thread_forkp(const char *name,
                 void *data1, unsigned long data2, 
                 struct thread **ret, struct process **process);
 
-/* Fork */
+/*
+ * Fork. If VFORKSEM is NULL the new process gets a copy of the
+ * current address space; otherwise it borrows the current one, and
+ * VFORKSEM is V'd once it execs or exits (see process_vfork_done).
+ */
 int thread_forkf(const char *name, 
                 void (*func)(void *, unsigned long),
                 void *data1, unsigned long data2, 
+                struct semaphore *vforksem,
                 struct thread **ret, struct process **process);
 
+/*
+ * Fork a thread into the current process, sharing its address space
+ * and file table. For threadfork.
+ */
+int thread_forkt(const char *name, 
+                void (*func)(void *, unsigned long),
+                void *data1, unsigned long data2, 
+                struct thread **ret);
+
 /*
  * Cause the current thread to exit.
  * Interrupts need not be disabled.
@@ -180,16 +243,47 @@ void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Restrict the current thread to the cpus in MASK. Moves the thread
+ * off the current cpu if that is not in MASK. Returns EINVAL if MASK
+ * names no cpu that exists.
+ */
+int thread_setaffinity(uint32_t mask);
+
+/*
+ * Make the current thread a background thread: it is kept at the
+ * lowest feedback queue level, never aged or promoted for sleeping,
+ * so it only runs when nothing at a better level wants the cpu.
+ */
+void thread_setbackground(void);
+
+/*
+ * Add the counts in SRC to DEST.
+ */
+void tusage_add(struct tusage *dest, const struct tusage *src);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
 void schedule(void);
 
+/*
+ * Charge the current thread for one hardclock. Returns true if it
+ * should yield, either because its quantum is used up or because a
+ * higher-priority thread is waiting. Called from the timer interrupt.
+ */
+bool thread_tick(void);
+
 /*
  * Potentially migrate ready threads to other CPUs. Called from the
  * timer interrupt.
  */
 void thread_consider_migration(void);
 
+/*
+ * Print per-CPU load balancing statistics.
+ */
+void thread_printstats(void);
+
 
 #endif /* _THREAD_H_ */
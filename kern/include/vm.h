@@ -39,6 +39,8 @@
 #include <machine/vm.h>
 #include <addrspace.h>
 
+struct shm_segment;
+
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
 #define VM_FAULT_WRITE       1    /* A write was attempted */
@@ -52,7 +54,8 @@
  	SWAPPINGIN,/*4*/
  	SWAPPINGOUT,/*5*/
  	LOCKED,/*6*/
- 	LOADING /*7*/
+ 	LOADING,/*7*/
+ 	CACHED /*8*/	/* Free, but set aside in a cpu's page cache */
  } page_state_t;
 
  struct page {
@@ -67,17 +70,50 @@
  	size_t npages;
  	/* Page state */
  	page_state_t state;
+
+ 	/* Number of address spaces mapping the page. More than one only
+ 	 * for program text, which is shared between processes running the
+ 	 * same executable. AS is NULL once the first owner lets go of a
+ 	 * shared page, since we no longer know where all its PTEs are. */
+ 	unsigned refcount;
+ 	/* Executable a text page was read from (NULL if not program text),
+ 	 * and the next page in its text_hash chain (see smartvm.c) */
+ 	struct vnode *text_vnode;
+ 	struct page *text_next;
+ 	/* Shared memory segment the page belongs to, or NULL. For these
+ 	 * AS is NULL and VA is the offset in the segment: no page table
+ 	 * points at them (see shm.h). */
+ 	struct shm_segment *shm;
+ 	/* FREE (or CACHED) page already cleared by page_zeroer, so
+ 	 * whoever gets it next needn't. */
+ 	bool zeroed;
  };
 
 
 /* Initialization function */
 void vm_bootstrap(void);
+/* Start the thread that keeps a pool of zeroed free pages */
+void vm_zero_bootstrap(void);
+/* Start the load control thread, which swaps out whole processes when
+ * memory is overcommitted and lets them back in when it isn't */
+void vm_loadctl_bootstrap(void);
+
+/* Tell load control about a new address space, or one going away */
+void vm_loadctl_add(struct addrspace *as);
+void vm_loadctl_remove(struct addrspace *as);
+/* Called on the way back to user mode: if load control has swapped this
+ * process out, wait until it's let back in */
+void vm_loadctl_wait(void);
 
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
-/* Allocate/free kernel heap pages (called by kmalloc/kfree) */
+/* Allocate/free kernel heap pages (called by kmalloc/kfree). Pages from
+ * alloc_kpages are physically contiguous; those from alloc_kvpages are
+ * only virtually so, mapped in kseg2, and have no physical address to
+ * speak of. free_kpages frees either. */
 vaddr_t alloc_kpages(int npages);
+vaddr_t alloc_kvpages(int npages);
 void free_kpages(vaddr_t addr);
 
 /* Allocate a Page. Called by method above & by the address space*/
@@ -85,6 +121,24 @@ struct page * page_alloc(struct addrspace *as, vaddr_t va, int permissions);
 /* Pre-Allocate a Page. Called by address space for on-demand paging*/
 void page_prealloc(struct addrspace *as, vaddr_t va, int permissions);
 
+/* Map an already resident text page of VN at VA, if there is one */
+bool text_page_find(struct addrspace *as, vaddr_t va, struct vnode *vn, int permissions);
+/* Share the page PTE refers to with AS at VA, if it is program text */
+bool page_share(struct addrspace *as, vaddr_t va, int pte);
+/* Drop AS's reference to the user page at PA, freeing it if it was the last */
+void page_release(struct addrspace *as, paddr_t pa);
+
+/* Allocate a zero filled page for page INDEX of shared memory segment
+ * SEG. It comes back LOCKED; call with the coremap lock held. */
+struct page *page_alloc_shm(struct shm_segment *seg, size_t index);
+/* The coremap entry for physical page PA */
+struct page *coremap_page(paddr_t pa);
+
+/* Pin the resident user page at VA of AS so the kernel can get at it
+ * directly; returns the kernel address for VA, or 0 if it isn't there */
+vaddr_t page_pin_user(struct addrspace *as, vaddr_t va, bool write);
+void page_unpin_user(vaddr_t kva);
+
 /* Given an address space & and a virtual address, get a page table*/
 struct page_table * pgdir_walk(struct addrspace *as, vaddr_t va, bool shouldcreate);
 
@@ -94,6 +148,10 @@ struct page * get_page(int pdi,int pti,struct page_table *pt);
 /* Copy a page */
 void copy_page(struct page *src, struct page *dst);
 
+/* Zero or copy the contents of whole physical pages */
+void page_zero(paddr_t pa);
+void page_copy(paddr_t dst, paddr_t src);
+
 /* Functions to get core map lock*/
 bool get_coremap_spinlock(void);
 void release_coremap_spinlock(bool);
@@ -106,9 +164,10 @@ bool coremap_lock_do_i_hold(void);
 
 void unlock_loading_pages(struct addrspace *as);
 
-/* TLB shootdown handling called from interprocessor_interrupt */
+/* TLB shootdown handling called from interprocessor_interrupt.
+ * vm_tlbshootdown takes a whole queue of N shootdowns at once. */
 void vm_tlbshootdown_all(void);
-void vm_tlbshootdown(const struct tlbshootdown *);
+void vm_tlbshootdown(const struct tlbshootdown *, int);
 
 
 #endif /* _VM_H_ */
@@ -36,6 +36,7 @@
 
 
 struct wchan; /* Opaque */
+struct thread;
 
 /*
  * Create a wait channel. Use NAME as a symbolic name for the channel.
@@ -71,6 +72,12 @@ void wchan_unlock(struct wchan *wc);
  */
 void wchan_sleep(struct wchan *wc);
 
+/*
+ * Like wchan_sleep, but also wake up after NSECS nanoseconds if
+ * nobody else does first. Returns true if it timed out.
+ */
+bool wchan_sleep_timeout(struct wchan *wc, uint64_t nsecs);
+
 /*
  * Wake up one thread, or all threads, sleeping on a wait channel.
  * The queue should not already be locked.
@@ -81,5 +88,12 @@ void wchan_sleep(struct wchan *wc);
 void wchan_wakeone(struct wchan *wc);
 void wchan_wakeall(struct wchan *wc);
 
+/*
+ * Wake up thread T if it is sleeping on the channel, and return true;
+ * return false if it isn't. The channel must be locked, and stays
+ * locked.
+ */
+bool wchan_wakethread(struct wchan *wc, struct thread *t);
+
 
 #endif /* _WCHAN_H_ */
@@ -7,9 +7,11 @@
 #include <limits.h>
 #include <synch.h>
 #include <current.h>
+#include <addrspace.h>
 #include <process.h>
 #include <processlist.h>
 #include <filesupport.h>
+#include <vfs.h>
 #include <kern/errno.h>
 
 /*Max PID is 32767, Min PID is 2*/
@@ -25,6 +27,25 @@ static int exitcodelist[PID_MAX + 1];
 /* Lock for the Process Table IDs*/
 static struct lock *processtable_biglock;
 
+/* Bitmap of taken PIDs, one bit per PID, and where to start looking */
+#define PIDMAP_WORDS	((PID_MAX + 32) / 32)
+static uint32_t pidmap[PIDMAP_WORDS];
+static pid_t pid_hint = PID_MIN;
+
+static
+void
+pidmap_mark(pid_t pid)
+{
+	pidmap[pid / 32] |= 1U << (pid % 32);
+}
+
+static
+void
+pidmap_unmark(pid_t pid)
+{
+	pidmap[pid / 32] &= ~(1U << (pid % 32));
+}
+
 /* Create a new process, and add it to the process table*/
 int
 process_create(const char *name, pid_t parent, struct process **ret)
@@ -50,6 +71,14 @@ process_create(const char *name, pid_t parent, struct process **ret)
 		return ENOMEM;
 	}
 
+	process->p_fd_lock = lock_create(name);
+	if(process->p_fd_lock == NULL) {
+		sem_destroy(process->p_waitsem);
+		kfree(process->p_name);
+		kfree(process);
+		return ENOMEM;
+	}
+
 	// process->p_forksem = sem_create(name,0);
 	// if(process->p_forksem == NULL) {
 	// 	kfree(process->p_waitsem);
@@ -63,19 +92,36 @@ process_create(const char *name, pid_t parent, struct process **ret)
 	int err = allocate_pid(&pid);
 	if(err)
 	{
+		processtable_biglock_release();
+		lock_destroy(process->p_fd_lock);
 		kfree(process->p_waitsem);
 		kfree(process->p_name);
 		kfree(process);
 		return err;
 	}
 	process->p_id = pid;
+	bzero(&process->p_usage, sizeof(process->p_usage));
+	bzero(&process->p_childusage, sizeof(process->p_childusage));
+	processlistnode_init(&process->p_listnode, process);
+	processlist_init(&process->p_children);
+	process->p_orphaned = false;
+	process->p_nthreads = 1;
+	process->p_vforksem = NULL;
+	process->p_parentpid = parent;
 	processtable[process->p_id] = process;
 	parentprocesslist[process->p_id] = parent;
+	/*Link into the parent's child list so exit can find us without a scan*/
+	if(parent >= PID_MIN && parent <= PID_MAX && processtable[parent] != NULL)
+	{
+		processlist_addtail(&processtable[parent]->p_children, process);
+	}
 	processtable_biglock_release();
 
 	// Copy over the file descriptors
 	struct process *parent_p = get_process(parent);
 
+	// The parent's other threads may be opening and closing meanwhile.
+	lock_acquire(parent_p->p_fd_lock);
 	for(int i = 0; i < FD_MAX; i++) {
 		process->p_fd_table[i] = parent_p->p_fd_table[i];
 		// Increment the file handle open count if valid.
@@ -85,6 +131,7 @@ process_create(const char *name, pid_t parent, struct process **ret)
 			lock_release(process->p_fd_table[i]->fh_open_lk);
 		}
 	}
+	lock_release(parent_p->p_fd_lock);
 
 	*ret = process;
 	return 0;
@@ -115,6 +162,14 @@ init_process_create(const char *name)
 		return NULL;
 	}
 
+	process->p_fd_lock = lock_create(name);
+	if(process->p_fd_lock == NULL) {
+		sem_destroy(process->p_waitsem);
+		kfree(process->p_name);
+		kfree(process);
+		return NULL;
+	}
+
 	// process->p_forksem = sem_create(name,0);
 	// if(process->p_forksem == NULL) {
 	// 	// lock_destroy(process->p_waitlock);
@@ -128,7 +183,16 @@ init_process_create(const char *name)
 	processtable_biglock_acquire();
 	// process->p_id = allocate_pid();
 	process->p_id = INIT_PROCESS;
+	bzero(&process->p_usage, sizeof(process->p_usage));
+	bzero(&process->p_childusage, sizeof(process->p_childusage));
+	processlistnode_init(&process->p_listnode, process);
+	processlist_init(&process->p_children);
+	process->p_orphaned = false;
+	process->p_nthreads = 1;
+	process->p_vforksem = NULL;
+	process->p_parentpid = -1;
 	freepidlist[INIT_PROCESS] = P_USED;
+	pidmap_mark(INIT_PROCESS);
 	processtable[process->p_id] = process;
 	processtable_biglock_release();
 
@@ -142,30 +206,93 @@ init_process_create(const char *name)
 	return process;
 }
 
-/* Called by exit() */
+/* Called by exit(). The calling thread exits, and the process too,
+   with EXITCODE, if that was its last thread. */
 void
 process_exit(pid_t pid, int exitcode)
+{
+	processtable_biglock_acquire();
+	/*Store the exit code; the last thread out leaves with it*/
+	exitcodelist[pid] = exitcode;
+	processtable_biglock_release();
+
+	process_threadexit(pid);
+}
+
+/* Called by threadexit(), and by exit(). Ends the calling thread. When
+   it's the process's last the process exits, with the exit code the
+   most recent exit() left (or 0). */
+void
+process_threadexit(pid_t pid)
 {
 	// kprintf("==Exit%d",pid);
+	struct process *self = get_process(pid);
+
+	/*A vfork child is done with its parent's address space*/
+	process_vfork_done(self);
+
+	/*The other threads may go on for a while; give back our stack now*/
+	if(curthread->t_ustack != 0)
+	{
+		as_free_thread_stack(curthread->t_addrspace, curthread->t_ustack);
+		curthread->t_ustack = 0;
+	}
+
 	processtable_biglock_acquire();
+	/*Fold our thread's usage into the process for getrusage()*/
+	tusage_add(&self->p_usage, &curthread->t_usage);
+	KASSERT(self->p_nthreads > 0);
+	self->p_nthreads--;
+	if(self->p_nthreads > 0)
+	{
+		processtable_biglock_release();
+		thread_exit();
+	}
+
 	/*If I have children, abandon them*/
 	abandon_children(pid);
-	/*Store the exit code*/
-	exitcodelist[pid] = exitcode;
 
-	/*Get the process that is exiting*/
-	struct process *process = get_process(pid);
 	/*Wake up anyone listening (could be INIT_PROCESS)*/
-	V(process->p_waitsem);		
+	V(self->p_waitsem);		
 
 	/*Notify any future waitpid() calls to return immediately*/
 	freepidlist[pid] = P_ZOMBIE;
+	/*Nobody waits for an orphan, so reap it now rather than leave a zombie*/
+	if(self->p_orphaned)
+	{
+		process_destroy(pid);
+	}
 	processtable_biglock_release();
 	
 	/* Clean up when parent exits */
 	thread_exit();
 }
 
+/* A new thread has joined process PID (see thread_forkt). */
+void
+process_addthread(pid_t pid)
+{
+	processtable_biglock_acquire();
+	get_process(pid)->p_nthreads++;
+	processtable_biglock_release();
+}
+
+/*
+ * Wake a vfork parent: PROCESS is done with its parent's address space,
+ * having exec'd or exited. Does nothing for an ordinary child.
+ */
+void
+process_vfork_done(struct process *process)
+{
+	struct semaphore *sem = process->p_vforksem;
+
+	if(sem != NULL)
+	{
+		process->p_vforksem = NULL;
+		V(sem);
+	}
+}
+
 /* Called by waitpid() */
 int
 process_wait(pid_t pidToWait, pid_t pidToWaitFor)
@@ -202,10 +329,23 @@ process_destroy(pid_t pid)
 
 	KASSERT(processtable_biglock_do_i_hold());
 	struct process *process = get_process(pid);
+	/*Charge what the process and its children used to whoever reaps it,
+	  and drop off its child list*/
+	pid_t parent = parentprocesslist[pid];
+	if(parent >= PID_MIN && parent <= PID_MAX && processtable[parent] != NULL)
+	{
+		tusage_add(&processtable[parent]->p_childusage, &process->p_usage);
+		tusage_add(&processtable[parent]->p_childusage, &process->p_childusage);
+		processlist_remove(&processtable[parent]->p_children, process);
+	}
+	/*Exit already handed any children to init*/
+	processlist_cleanup(&process->p_children);
+	processlistnode_cleanup(&process->p_listnode);
 	release_pid(pid);
 	kfree(process->p_name);
 	// lock_destroy(process->p_waitlock);
 	sem_destroy(process->p_waitsem);
+	lock_destroy(process->p_fd_lock);
 	// sem_destroy(process->p_forksem);
 	// cv_destroy(process->p_waitcv);
 	//processlist_cleanup(&process->p_waiters);
@@ -230,7 +370,7 @@ get_process(pid_t pid)
 	KASSERT(freepidlist[index] > 0);
 	struct process *process = processtable[index];
 	// processtable_biglock_release();
-	KASSERT(process->p_id > 0 && process->p_id <PID_MAX);
+	KASSERT(process->p_id > 0 && process->p_id <= PID_MAX);
 	return process;
 }
 
@@ -257,11 +397,13 @@ get_process_parent(pid_t pid)
 	return parent;
 }
 
-//Checks for the first free file descriptor and returns it
+//Checks for the first free file descriptor and returns it.
+//Caller holds p_fd_lock until the descriptor is filled in.
 int
 get_free_file_descriptor(pid_t pid)
 {
 	struct process* proc = get_process(pid);
+	KASSERT(lock_do_i_hold(proc->p_fd_lock));
 	// 0 thru 2 are assumed to be used, so start at 3.
 	for(int i=3; i < FD_MAX; i++) {
 		// If the pointer is NULL, the descriptor is free for use.
@@ -277,6 +419,7 @@ void
 release_file_descriptor(pid_t pid, int fd)
 {
 	struct process* proc = get_process(pid);
+	KASSERT(lock_do_i_hold(proc->p_fd_lock));
 	proc->p_fd_table[fd] = NULL;
 	// If fd was 0, 1, 2, reset fd to point to STDIN, STDOUT, STDERR?
 }
@@ -296,6 +439,44 @@ get_file_handle(pid_t pid, int fd)
 	return proc->p_fd_table[fd];
 }
 
+// Like get_file_handle, but takes a reference to the handle, so a close()
+// or dup2() in another thread can't destroy it while we use it. Give it
+// back with put_file_handle().
+struct file_handle *
+get_file_handle_ref(pid_t pid, int fd)
+{
+	struct process* proc = get_process(pid);
+	struct file_handle *fh;
+
+	lock_acquire(proc->p_fd_lock);
+	fh = proc->p_fd_table[fd];
+	if(fh != NULL) {
+		lock_acquire(fh->fh_open_lk);
+			fh->fh_open_count = (fh->fh_open_count) + 1;
+		lock_release(fh->fh_open_lk);
+	}
+	lock_release(proc->p_fd_lock);
+
+	return fh;
+}
+
+// Drop a reference to a file handle; the last one closes the file and
+// destroys the handle.
+void
+put_file_handle(struct file_handle *fh)
+{
+	lock_acquire(fh->fh_open_lk);
+	fh->fh_open_count = (fh->fh_open_count) - 1;
+	if(fh->fh_open_count == 0) {
+		vfs_close(fh->vnode);			// Does not return error, so nothing to check.
+		lock_release(fh->fh_open_lk);
+		fh_destroy(fh);
+	}
+	else {
+		lock_release(fh->fh_open_lk);
+	}
+}
+
 int
 get_process_exitcode(pid_t pid)
 {
@@ -304,38 +485,54 @@ get_process_exitcode(pid_t pid)
 }
 
 /*
-	Allocate a process ID for somebody. This is relatively simple. We just
-	loop through the array until we find a PID marked free. Then we allocate that one.
+	Allocate a process ID for somebody. Taken PIDs are bits in pidmap, so
+	we can skip 32 of them at a time, and the search starts from pid_hint,
+	just past the last PID handed out, rather than from PID_MIN. PIDs get
+	reused round-robin and a fork doesn't rescan the low, long-lived ones.
 */
 int
 allocate_pid(pid_t* allocated_pid)
 {
-	collect_children();
-	for(int i = PID_MIN;i<=PID_MAX;i++)
+	unsigned start = pid_hint / 32;
+
+	/* One extra word so the bits below the hint in the first word get checked last. */
+	for(unsigned i = 0; i <= PIDMAP_WORDS; i++)
 	{
-		//found a free PID
-		if(freepidlist[i] == P_FREE)
+		unsigned word = (start + i) % PIDMAP_WORDS;
+		if(pidmap[word] == 0xffffffff)
+		{
+			continue;
+		}
+		for(unsigned bit = 0; bit < 32; bit++)
 		{
-			freepidlist[i] = P_USED;
-			*allocated_pid=i;
-			return 0;
+			pid_t pid = word * 32 + bit;
+			if(i == 0 && pid < pid_hint)
+			{
+				continue;
+			}
+			//found a free PID
+			if((pidmap[word] & (1U << bit)) == 0)
+			{
+				KASSERT(freepidlist[pid] == P_FREE);
+				pidmap_mark(pid);
+				freepidlist[pid] = P_USED;
+				pid_hint = (pid == PID_MAX) ? PID_MIN : pid + 1;
+				*allocated_pid = pid;
+				return 0;
+			}
 		}
 	}
-	//Do we really have to panic? Probably not. More likely we need to return an error code to somebody.
-	//But this will have to do for now. 
 	return ENPROC;
-	// panic("No more available process IDs!");
-	// return -1;
 }
 
 /* Free a Process ID. This should be called when a process is destroyed */
 void
 release_pid(int pidToFree)
 {
-	(void)pidToFree;
 	KASSERT(pidToFree >= PID_MIN);
 	// processtable_biglock_acquire();
 	freepidlist[pidToFree] = P_FREE;
+	pidmap_unmark(pidToFree);
 	// processtable_biglock_release();
 }
 
@@ -343,32 +540,50 @@ void
 set_process_parent(pid_t process, pid_t parent)
 {
 	processtable_biglock_acquire();
+	struct process *child = processtable[process];
+	pid_t oldparent = parentprocesslist[process];
+	if(child != NULL && oldparent >= PID_MIN && oldparent <= PID_MAX && processtable[oldparent] != NULL)
+	{
+		processlist_remove(&processtable[oldparent]->p_children, child);
+	}
 	parentprocesslist[process] = parent;
+	if(child != NULL && parent >= PID_MIN && parent <= PID_MAX && processtable[parent] != NULL)
+	{
+		processlist_addtail(&processtable[parent]->p_children, child);
+	}
 	processtable_biglock_release();
 }
 
+/*
+	Hand the children of an exiting process to init. This walks only the
+	dying process's own child list. Children that have already exited
+	will never be waited for now, so they are reaped here; the rest are
+	marked orphaned and reap themselves when they exit.
+*/
 void
 abandon_children(pid_t dyingParent)
 {
-	for(int i=0;i<=PID_MAX;i++)
+	struct process *parent = processtable[dyingParent];
+	struct process *init = processtable[INIT_PROCESS];
+	struct process *child;
+
+	KASSERT(processtable_biglock_do_i_hold());
+	while((child = processlist_remhead(&parent->p_children)) != NULL)
 	{
-		if(parentprocesslist[i] == dyingParent)
+		if(freepidlist[child->p_id] == P_ZOMBIE)
 		{
-			//Assign parent to be init...
-			parentprocesslist[i] = INIT_PROCESS;
+			parentprocesslist[child->p_id] = -1;
+			process_destroy(child->p_id);
 		}
-	}
-}
-
-void collect_children()
-{
-	for(int i=PID_MIN;i<=PID_MAX;i++)
-	{
-		if(parentprocesslist[i] == INIT_PROCESS && freepidlist[i] == P_ZOMBIE)
+		else
 		{
-			process_destroy(i);
+			//Assign parent to be init...
+			parentprocesslist[child->p_id] = INIT_PROCESS;
+			child->p_parentpid = INIT_PROCESS;
+			child->p_orphaned = true;
+			processlist_addtail(&init->p_children, child);
 		}
-	}	
+	}
 }
 
 /*
@@ -388,6 +603,12 @@ processtable_bootstrap()
 	for(int i=0;i<PID_MIN;i++)
 	{
 		freepidlist[i] = P_USED;
+		pidmap_mark(i);
+	}
+	//Nor is anything past PID_MAX in the last bitmap word.
+	for(int i=PID_MAX+1;i<PIDMAP_WORDS*32;i++)
+	{
+		pidmap_mark(i);
 	}
 	//But everything else is.
 	for(int i = PID_MIN;i<= PID_MAX;i++)
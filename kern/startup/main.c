@@ -53,6 +53,8 @@
 #include <process.h>
 #include <filesupport.h>
 #include <swapspace.h>
+#include <futex.h>
+#include <shm.h>
 
 
 /*
@@ -141,6 +143,10 @@ boot(void)
 	//console_init();
 	processtable_bootstrap();
 	DEBUG(DB_PROCESS, "Process List Initialized\n");
+	futex_bootstrap();
+	shm_bootstrap();
+	vm_zero_bootstrap();
+	vm_loadctl_bootstrap();
 
 	/*
 	 * Make sure various things aren't screwed up.
@@ -173,6 +173,34 @@ cmd_prog(int nargs, char **args)
 	return common_prog(nargs, args);
 }
 
+/*
+ * Command for running a program restricted to some cpus. The mask is
+ * a decimal bitmask of cpu numbers; the program inherits it from the
+ * menu thread, so set it here for the duration.
+ */
+static
+int
+cmd_pin(int nargs, char **args)
+{
+	int result;
+
+	if (nargs < 3) {
+		kprintf("Usage: pin cpumask program [arguments]\n");
+		return EINVAL;
+	}
+
+	result = thread_setaffinity((uint32_t)atoi(args[1]));
+	if (result) {
+		return result;
+	}
+
+	/* drop the leading "pin cpumask" */
+	result = common_prog(nargs - 2, args + 2);
+
+	thread_setaffinity(THREAD_AFFINITY_ANY);
+	return result;
+}
+
 /*
  * Command for starting the system shell.
  */
@@ -389,6 +417,18 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_cpustats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printstats();
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -421,6 +461,7 @@ showmenu(const char *name, const char *x[])
 static const char *opsmenu[] = {
 	"[s]       Shell                     ",
 	"[p]       Other program             ",
+	"[pin]     Program pinned to cpus    ",
 	"[mount]   Mount a filesystem        ",
 	"[unmount] Unmount a filesystem      ",
 	"[bootfs]  Set \"boot\" filesystem     ",
@@ -449,6 +490,7 @@ static const char *testmenu[] = {
 	"[bt]  Bitmap test                   ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
+	"[mp]  Memory copy/zero benchmark    ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -491,6 +533,7 @@ static const char *mainmenu[] = {
 	"[?o] Operations menu                ",
 	"[?t] Tests menu                     ",
 	"[kh] Kernel heap stats              ",
+	"[cs] CPU load balancing stats       ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -524,6 +567,7 @@ static struct {
 	/* operations */
 	{ "s",		cmd_shell },
 	{ "p",		cmd_prog },
+	{ "pin",	cmd_pin },
 	{ "mount",	cmd_mount },
 	{ "unmount",	cmd_unmount },
 	{ "bootfs",	cmd_bootfs },
@@ -539,12 +583,14 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "cs",         cmd_cpustats },
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "bt",		bitmaptest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
+	{ "mp",		memperf },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -0,0 +1,281 @@
+/*
+ * Futexes.
+ *
+ * A futex is just a word of user memory. User-level locks and condition
+ * variables do their fast path on it with ordinary loads and stores and
+ * only come in here to sleep when they can't proceed (FUTEX_WAIT), or
+ * to wake sleepers after changing it (FUTEX_WAKE).
+ *
+ * Sleepers are kept in a hash table of buckets, keyed by what the word
+ * is: its address within the address space for private memory, or its
+ * segment and offset for shared memory, so processes that attach a
+ * segment at different addresses still meet on the same word. Each
+ * bucket has a sleep lock, so FUTEX_WAIT can read the user word under it
+ * (which may fault), a list of sleepers, and one wait channel they all
+ * sleep on. FUTEX_WAKE picks the sleepers that match off the list and
+ * wakes just those with wchan_wakethread, so sleepers on other words that
+ * hash to the same bucket aren't disturbed.
+ *
+ * A waiter checks the word and goes on the list under the bucket lock,
+ * and a waker changes the word before taking it, so a wakeup can't slip
+ * in between the check and the sleep.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/futex.h>
+#include <kern/time.h>
+#include <lib.h>
+#include <copyinout.h>
+#include <synch.h>
+#include <wchan.h>
+#include <thread.h>
+#include <current.h>
+#include <addrspace.h>
+#include <syscall.h>
+#include <futex.h>
+
+/* Number of hash buckets; a power of two */
+#define FUTEX_NBUCKETS 64
+
+/*
+ * What a futex word is, independent of which thread is asking: the
+ * object its memory belongs to and its offset in that object. For
+ * private memory that's the address space and the user address; for a
+ * shared memory segment, the segment and the offset in it.
+ */
+struct futex_key {
+	const void *fk_object;
+	vaddr_t fk_offset;
+};
+
+/* A thread sleeping in FUTEX_WAIT; lives on its kernel stack. */
+struct futex_waiter {
+	struct futex_key fw_key;
+	struct thread *fw_thread;
+	bool fw_woken;			/* taken off the list by a waker */
+	struct futex_waiter *fw_next;
+};
+
+struct futex_bucket {
+	struct lock *fb_lock;		/* covers fb_waiters */
+	struct wchan *fb_wchan;		/* everyone on fb_waiters sleeps here */
+	struct futex_waiter *fb_waiters;
+};
+
+static struct futex_bucket futex_table[FUTEX_NBUCKETS];
+
+void
+futex_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<FUTEX_NBUCKETS; i++) {
+		futex_table[i].fb_lock = lock_create("futex");
+		futex_table[i].fb_wchan = wchan_create("futex");
+		if (futex_table[i].fb_lock == NULL ||
+		    futex_table[i].fb_wchan == NULL) {
+			panic("futex_bootstrap: Out of memory\n");
+		}
+		futex_table[i].fb_waiters = NULL;
+	}
+}
+
+/*
+ * Work out the key for the futex word at UADDR in the current process.
+ */
+static
+void
+futex_getkey(vaddr_t uaddr, struct futex_key *key)
+{
+	struct addrspace *as = curthread->t_addrspace;
+	struct vm_region *vr;
+
+	lock_acquire(as->as_lock);
+	vr = as_find_region(as, uaddr);
+	if (vr != NULL && vr->vr_shm != NULL) {
+		/* The region holds a reference, so the segment can't go
+		 * away while we sleep on it without us detaching first. */
+		key->fk_object = vr->vr_shm;
+		key->fk_offset = vr->vr_offset + (uaddr - vr->vr_fileva);
+	}
+	else {
+		key->fk_object = as;
+		key->fk_offset = uaddr;
+	}
+	lock_release(as->as_lock);
+}
+
+static
+bool
+futex_samekey(const struct futex_key *a, const struct futex_key *b)
+{
+	return a->fk_object == b->fk_object && a->fk_offset == b->fk_offset;
+}
+
+static
+struct futex_bucket *
+futex_bucket(const struct futex_key *key)
+{
+	uint32_t h;
+
+	h = (uint32_t)(uintptr_t)key->fk_object >> 6;
+	h ^= key->fk_offset >> 2;
+	h ^= h >> 11;
+	return &futex_table[h % FUTEX_NBUCKETS];
+}
+
+/*
+ * Take W off B's list, if it's still there. Call with B locked.
+ */
+static
+void
+futex_unlink(struct futex_bucket *b, struct futex_waiter *w)
+{
+	struct futex_waiter **pp;
+
+	for (pp = &b->fb_waiters; *pp != NULL; pp = &(*pp)->fw_next) {
+		if (*pp == w) {
+			*pp = w->fw_next;
+			return;
+		}
+	}
+}
+
+/*
+ * FUTEX_WAIT: sleep on UADDR if it holds VAL, for at most NSECS
+ * nanoseconds if TIMED.
+ */
+static
+int
+futex_wait(vaddr_t uaddr, int val, bool timed, uint64_t nsecs)
+{
+	struct futex_waiter w;
+	struct futex_bucket *b;
+	bool expired = false;
+	int cur, result;
+
+	futex_getkey(uaddr, &w.fw_key);
+	w.fw_thread = curthread;
+	w.fw_woken = false;
+	b = futex_bucket(&w.fw_key);
+
+	lock_acquire(b->fb_lock);
+	result = copyin((const_userptr_t)uaddr, &cur, sizeof(cur));
+	if (result) {
+		lock_release(b->fb_lock);
+		return result;
+	}
+	if (cur != val) {
+		lock_release(b->fb_lock);
+		return EAGAIN;
+	}
+
+	w.fw_next = b->fb_waiters;
+	b->fb_waiters = &w;
+
+	/* Get on the channel before letting wakers at the list. */
+	wchan_lock(b->fb_wchan);
+	lock_release(b->fb_lock);
+	if (timed) {
+		expired = wchan_sleep_timeout(b->fb_wchan, nsecs);
+	}
+	else {
+		wchan_sleep(b->fb_wchan);
+	}
+
+	lock_acquire(b->fb_lock);
+	if (!w.fw_woken) {
+		/* Only the timeout wakes a thread without unlinking it. */
+		KASSERT(expired);
+		futex_unlink(b, &w);
+		result = ETIMEDOUT;
+	}
+	lock_release(b->fb_lock);
+	return result;
+}
+
+/*
+ * FUTEX_WAKE: wake up to MAX threads sleeping on UADDR. Returns the
+ * number woken.
+ */
+static
+int
+futex_wake(vaddr_t uaddr, int max)
+{
+	struct futex_key key;
+	struct futex_bucket *b;
+	struct futex_waiter **pp, *w;
+	int woken = 0;
+
+	futex_getkey(uaddr, &key);
+	b = futex_bucket(&key);
+
+	lock_acquire(b->fb_lock);
+	pp = &b->fb_waiters;
+	while (*pp != NULL && woken < max) {
+		w = *pp;
+		if (!futex_samekey(&w->fw_key, &key)) {
+			pp = &w->fw_next;
+			continue;
+		}
+		/*
+		 * If its timeout got it first, leave it on the list for
+		 * it to take itself off, and don't count it.
+		 */
+		wchan_lock(b->fb_wchan);
+		if (wchan_wakethread(b->fb_wchan, w->fw_thread)) {
+			*pp = w->fw_next;
+			w->fw_woken = true;
+			woken++;
+		}
+		else {
+			pp = &w->fw_next;
+		}
+		wchan_unlock(b->fb_wchan);
+	}
+	lock_release(b->fb_lock);
+	return woken;
+}
+
+/*
+ * The futex system call.
+ */
+int
+sys_futex(userptr_t uaddr, int op, int val, const_userptr_t user_timeout,
+	  int *retval)
+{
+	struct timespec ts;
+	uint64_t nsecs = 0;
+	int result;
+
+	if ((vaddr_t)uaddr % sizeof(int) != 0) {
+		return EINVAL;
+	}
+
+	switch (op) {
+	    case FUTEX_WAIT:
+		if (user_timeout != NULL) {
+			result = copyin(user_timeout, &ts, sizeof(ts));
+			if (result) {
+				return result;
+			}
+			if (ts.tv_sec < 0 || ts.tv_nsec < 0 ||
+			    ts.tv_nsec >= 1000000000) {
+				return EINVAL;
+			}
+			nsecs = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+		}
+		result = futex_wait((vaddr_t)uaddr, val,
+				    user_timeout != NULL, nsecs);
+		if (result) {
+			return result;
+		}
+		*retval = 0;
+		return 0;
+
+	    case FUTEX_WAKE:
+		*retval = val > 0 ? futex_wake((vaddr_t)uaddr, val) : 0;
+		return 0;
+	}
+	return EINVAL;
+}
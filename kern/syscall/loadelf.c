@@ -32,18 +32,15 @@
  * Code to load an ELF-format executable into the current address space.
  *
  * It makes the following address space calls:
- *    - first, as_define_region once for each segment of the program;
- *    - then, as_prepare_load;
- *    - then it loads each chunk of the program;
+ *    - first, as_prepare_load;
+ *    - then as_define_region and as_map_segment once for each segment
+ *      of the program;
  *    - finally, as_complete_load.
  *
- * This gives the VM code enough flexibility to deal with even grossly
- * mis-linked executables if that proves desirable. Under normal
- * circumstances, as_prepare_load and as_complete_load probably don't
- * need to do anything.
- *
- * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
+ * Nothing is read here but the headers. Each segment is mapped from the
+ * executable, and vm_fault reads its pages in (or zero fills the bss)
+ * the first time they are touched, so pages a program never uses are
+ * never loaded.
  *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
@@ -52,6 +49,7 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/stat.h>
 #include <lib.h>
 #include <uio.h>
 #include <thread.h>
@@ -60,141 +58,6 @@
 #include <vnode.h>
 #include <elf.h>
 
-/*
- * Load a segment at virtual address VADDR. The segment in memory
- * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
- * segment on disk is located at file offset OFFSET and has length
- * FILESIZE.
- *
- * FILESIZE may be less than MEMSIZE; if so the remaining portion of
- * the in-memory segment should be zero-filled.
- *
- * Note that uiomove will catch it if someone tries to load an
- * executable whose load address is in kernel space. If you should
- * change this code to not use uiomove, be sure to check for this case
- * explicitly
- */
-static
-int
-load_segment(struct vnode *v, off_t offset, vaddr_t vaddr, 
-	     size_t memsize, size_t filesize,
-	     int is_executable)
-{
-	struct iovec iov;
-	struct uio u;
-	int result;
-
-	if (filesize > memsize) {
-		kprintf("ELF: warning: segment filesize > segment memsize\n");
-		filesize = memsize;
-	}
-
-	DEBUG(DB_DEMAND, "ELF: Loading %lu bytes to 0x%lx\n", 
-	      (unsigned long) filesize, (unsigned long) vaddr);
-
-	iov.iov_ubase = (userptr_t)vaddr;
-	iov.iov_len = memsize;		 // length of the memory space
-	u.uio_iov = &iov;
-	u.uio_iovcnt = 1;
-	u.uio_resid = filesize;          // amount to read from the file
-	u.uio_offset = offset;
-	u.uio_segflg = is_executable ? UIO_USERISPACE : UIO_USERSPACE;
-	u.uio_rw = UIO_READ;
-	u.uio_space = curthread->t_addrspace;
-
-	result = VOP_READ(v, &u);
-	if (result) {
-		return result;
-	}
-
-	if (u.uio_resid != 0) {
-		/* short read; problem with executable? */
-		kprintf("ELF: short read on segment - file truncated?\n");
-		return ENOEXEC;
-	}
-
-	/*
-	 * If memsize > filesize, the remaining space should be
-	 * zero-filled. There is no need to do this explicitly,
-	 * because the VM system should provide pages that do not
-	 * contain other processes' data, i.e., are already zeroed.
-	 *
-	 * During development of your VM system, it may have bugs that
-	 * cause it to (maybe only sometimes) not provide zero-filled
-	 * pages, which can cause user programs to fail in strange
-	 * ways. Explicitly zeroing program BSS may help identify such
-	 * bugs, so the following disabled code is provided as a
-	 * diagnostic tool. Note that it must be disabled again before
-	 * you submit your code for grading.
-	 */
-#if 0
-	{
-		size_t fillamt;
-
-		fillamt = memsize - filesize;
-		if (fillamt > 0) {
-			DEBUG(DB_EXEC, "ELF: Zero-filling %lu more bytes\n", 
-			      (unsigned long) fillamt);
-			u.uio_resid += fillamt;
-			result = uiomovezeros(fillamt, &u);
-		}
-	}
-#endif
-	
-	return result;
-}
-
-/* Load a Segment Dynamically */
-static
-int
-dynamic_load_segment(struct vnode *v, off_t offset, vaddr_t vaddr, 
-	     size_t memsize, size_t filesize,
-	     int is_executable, int permissions)
-{
-	/*If we split between two pages, add another page:
-	 * For example, if vaddr = 0x444970, and size = 192,
-	 * we need from 0x444970 to 0x445162. So we need
-	 * 0x44000 AND 0x445000 -- TWO PAGES. Simply aligning 
-	 * to a page boundary will get is 0x44000, but not the 
-	 * 162 bytes that spill into the next page. So we need to
-	 * account for that now:
-	 */
-	int result;
-	if(((vaddr & SUB_FRAME) + filesize > PAGE_SIZE))
-	{
-		DEBUG(DB_DEMAND, "Spillover Detected\n");
-		/*Copy the first part of the page*/
-		struct page *page = page_alloc(curthread->t_addrspace, vaddr & PAGE_FRAME,permissions);
-		//Get amount to copy
-		size_t amt_to_copy = PAGE_SIZE - (vaddr & SUB_FRAME);
-		//Copy the rest	
-		result = load_segment(v,offset,vaddr,amt_to_copy,amt_to_copy,is_executable);
-		KASSERT(page->state == LOCKED);
-		page->state = DIRTY;
-		if(result) { return result; }
-		/* Copy the second part of the page */
-		vaddr_t spillover_va = ((vaddr & PAGE_FRAME) + PAGE_SIZE);
-		bool lock = get_coremap_lock();
-		page = page_alloc(curthread->t_addrspace, spillover_va,permissions);
-		release_coremap_lock(lock);
-		result = load_segment(v,offset + amt_to_copy, vaddr, memsize - amt_to_copy, filesize - amt_to_copy,is_executable);
-		if(result) { return result;}
-		KASSERT(page->state == LOCKED);
-		page->state = DIRTY;
-	}
-	else
-	{
-		bool lock = get_coremap_lock();
-		struct page *page = page_alloc(curthread->t_addrspace,vaddr & PAGE_FRAME,permissions);
-		release_coremap_lock(lock);
-		result = load_segment(v,offset,vaddr,memsize,filesize,is_executable);
-		KASSERT(page->state == LOCKED);
-		page->state = DIRTY;
-		return result;
-	}
-	return 0;
-}
-
 /*
  * Load an ELF executable user program into the current address space.
  *
@@ -208,6 +71,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	int result, i;
 	struct iovec iov;
 	struct uio ku;
+	struct stat st;
 	struct addrspace *as = curthread->t_addrspace;
 
 	/*
@@ -251,12 +115,26 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	}
 
 	/*
-	 * Go through the list of segments and set up the address space.
+	 * We need the file size to make sure the segments are all there,
+	 * since nothing is read from them until they are touched.
+	 */
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+
+	result = as_prepare_load(as);
+	if (result) {
+		return result;
+	}
+
+	/*
+	 * Go through the list of segments and map each one.
 	 *
 	 * Ordinarily there will be one code segment, one read-only
 	 * data segment, and one data/bss segment, but there might
-	 * conceivably be more. You don't need to support such files
-	 * if it's unduly awkward to do so.
+	 * conceivably be more. Segments that share a page are not
+	 * supported.
 	 *
 	 * Note that the expression eh.e_phoff + i*eh.e_phentsize is 
 	 * mandated by the ELF standard - we use sizeof(ph) to load,
@@ -293,7 +171,18 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		DEBUG(DB_DEMAND, "MEM SZ:%d\n",ph.p_memsz);
 		DEBUG(DB_DEMAND, "FILE SZ:%d\n", ph.p_filesz);
 		DEBUG(DB_DEMAND, "VADDR:%p\n",(void*)ph.p_vaddr);
-		result = as_define_region(curthread->t_addrspace,
+
+		if (ph.p_filesz > ph.p_memsz) {
+			kprintf("ELF: warning: segment filesize > segment memsize\n");
+			ph.p_filesz = ph.p_memsz;
+		}
+		if (ph.p_offset > st.st_size ||
+		    ph.p_filesz > st.st_size - ph.p_offset) {
+			kprintf("ELF: segment past end of file - file truncated?\n");
+			return ENOEXEC;
+		}
+
+		result = as_define_region(as,
 					  ph.p_vaddr, ph.p_memsz,
 					  ph.p_flags & PF_R,
 					  ph.p_flags & PF_W,
@@ -301,131 +190,16 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		if (result) {
 			return result;
 		}
-	}
-
-	result = as_prepare_load(curthread->t_addrspace);
-	if (result) {
-		return result;
-	}
-
-	/*
-	 * Now actually load each segment.
-	 */
-	for (i=0; i<eh.e_phnum; i++) {
-		off_t offset = eh.e_phoff + i*eh.e_phentsize;
-		uio_kinit(&iov, &ku, &ph, sizeof(ph), offset, UIO_READ);
-		DEBUG(DB_DEMAND, "SEGMENT: %d\n",1);
-		result = VOP_READ(v, &ku);
-		if (result) {
-			return result;
-		}
-
-		if (ku.uio_resid != 0) {
-			/* short read; problem with executable? */
-			kprintf("ELF: short read on phdr - file truncated?\n");
-			return ENOEXEC;
-		}
-
-		switch (ph.p_type) {
-		    case PT_NULL: /* skip */ continue;
-		    case PT_PHDR: /* skip */ continue;
-		    case PT_MIPS_REGINFO: /* skip */ continue;
-		    case PT_LOAD: break;
-		    default:
-			kprintf("loadelf: unknown segment type %d\n", 
-				ph.p_type);
-			return ENOEXEC;
-		}
-		struct addrspace *as = curthread->t_addrspace;
-		vaddr_t va = ph.p_vaddr;
-		DEBUG(DB_DEMAND, "Original VA: %p\n", (void*) va);
-		DEBUG(DB_DEMAND, "Max VA:%p\n", (void*) (va + ph.p_memsz));
-		// va &= PAGE_FRAME;
-		struct page_table *pt = pgdir_walk(as,va,false);
-		int pt_index = VA_TO_PT_INDEX(va);
-		int permissions = PTE_TO_PERMISSIONS(pt->table[pt_index]);
-		int small_pages = 0;
-		if(ph.p_memsz <= PAGE_SIZE)
-		{
-			DEBUG(DB_DEMAND, "Segement Total Size is < 4k\n");
-			// pt = pgdir_walk(as,va,false);
-			// pt_index = VA_TO_PT_INDEX(va);
-			// permissions = PTE_TO_PERMISSIONS(pt->table[pt_index]);
-
 
-			result = dynamic_load_segment(v, ph.p_offset, va, 
-				ph.p_memsz, ph.p_filesz,
-				ph.p_flags & PF_X,permissions);
-			if (result) {
-					return result;
-			}
-			// page->state = DIRTY;	
-			small_pages = 1;
-		}
-		else
-		{
-			int filesize = (int) ph.p_filesz;
-			int memsize = (int) ph.p_memsz;
-			off_t cur_offset = ph.p_offset;
-			DEBUG(DB_DEMAND, "Loading >1 Segment\n");
-			DEBUG(DB_DEMAND, "Original Parameters:\n");
-			DEBUG(DB_DEMAND, "File Size: %d\n",filesize);
-			DEBUG(DB_DEMAND, "Mem Size: %d\n", memsize);
-			DEBUG(DB_DEMAND, "Offset:%d\n", (int) cur_offset);
-			DEBUG(DB_DEMAND, "VA:%p\n", (void*) va);
-			size_t amt_to_read;
-			int pages = 0;
-			int blank_pages = 0;
-			while(filesize > 0)
-			{
-				// struct page *page = page_alloc(as,va & PAGE_FRAME,permissions);
-				DEBUG(DB_DEMAND, "loading...\n");
-				DEBUG(DB_DEMAND, "File Size: %d\n",filesize);
-				DEBUG(DB_DEMAND, "Mem Size: %d\n", memsize);
-				DEBUG(DB_DEMAND, "Offset:%d\n", (int) cur_offset);
-				DEBUG(DB_DEMAND, "VA:%p\n", (void*) va);
-				amt_to_read = (filesize - PAGE_SIZE > 0 ? PAGE_SIZE : filesize);
-				result = dynamic_load_segment(v, cur_offset, va, 
-		      		PAGE_SIZE, amt_to_read, ph.p_flags & PF_X,permissions);
-				if (result) {
-						return result;
-				}
-				filesize -= PAGE_SIZE;
-				memsize -= PAGE_SIZE;
-				va += PAGE_SIZE;
-				cur_offset += PAGE_SIZE;
-				// page->state = DIRTY;
-				pages++;
-			}
-			(void)blank_pages;
-			DEBUG(DB_DEMAND,"Empty Pages...\n");
-			while(memsize > 0)
-			{
-				DEBUG(DB_DEMAND,"Mem Size:%d\n",memsize);
-				DEBUG(DB_DEMAND,"VA: %p\n",(void*) va);
-				bool lock = get_coremap_lock();
-				struct page *page = page_alloc(as,va & PAGE_FRAME,permissions);
-				release_coremap_lock(lock);
-				va += PAGE_SIZE;
-				memsize -= PAGE_SIZE;
-				KASSERT(page->state == LOCKED);
-				page->state = DIRTY;
-				blank_pages++;
-			}
-			DEBUG(DB_DEMAND, "Small Pages: %d\n", small_pages);
-			DEBUG(DB_DEMAND, "Pages: %d\n", pages);
-			DEBUG(DB_DEMAND, "Blank Pages: %d\n", blank_pages);
-
-		}
-		// result = load_segment(v, ph.p_offset, ph.p_vaddr, 
-		//       ph.p_memsz, ph.p_filesz,
-		//       ph.p_flags & PF_X);
+		result = as_map_segment(as, ph.p_vaddr, ph.p_memsz,
+					ph.p_flags & (PF_R | PF_W | PF_X),
+					v, ph.p_offset, ph.p_filesz);
 		if (result) {
 			return result;
 		}
 	}
 
-	result = as_complete_load(curthread->t_addrspace);
+	result = as_complete_load(as);
 	if (result) {
 		return result;
 	}
@@ -435,6 +209,5 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	/* Register load complete in addrspace */
 	as->loadelf_done = true;
 	DEBUG(DB_VM,"LoadELFDone\n");
-	// kprintf("LoadELF done\n");
 	return 0;
 }
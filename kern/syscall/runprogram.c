@@ -45,6 +45,7 @@
 #include <syscall.h>
 #include <test.h>
 #include <copyinout.h>
+#include <process.h>
 
 /*
  * Calculates the size of the kargs buffer. The kargs buffer must
@@ -330,184 +331,105 @@ runprogram1(const char* program, char** args, unsigned long nargs)
 }
 
 /*
- * Load program "progname" and start running it in usermode.
+ * Replace the current process image with program "progname" (execv).
  * Does not return except on error.
  *
- * Calls vfs_open on progname (args[0]) and thus may destroy it.
- * So, we copy it.
+ * ARGBUF is the argument block built by sys_execv: NARGS+1 pointers
+ * followed by the padded strings, ARGSIZE bytes in all, with each
+ * pointer holding its string's offset into the block. It is copied
+ * onto the new stack as is, after turning the offsets into addresses.
+ *
+ * The old address space is kept until the new one is fully set up, so
+ * on error the caller is left as it was. On success we only drop our
+ * reference to it, so a vfork parent, or other threads of ours, keep
+ * theirs (and a vfork parent is woken). Takes
+ * ownership of PROGNAME and ARGBUF, both of which must be kmalloc'd.
  */
 int
-runprogram2(const char* program, char** args, unsigned long nargs)
+runprogram2(char *progname, char *argbuf, size_t argsize, unsigned long nargs)
 {
-	// kprintf("entering runprogram2\n");
+	struct addrspace *oldas, *newas;
+	struct process *proc;
 	struct vnode *v;
-	vaddr_t entrypoint, stackptr;
+	vaddr_t entrypoint, stackptr, argvptr;
+	vaddr_t *argv;
+	unsigned long i;
 	int result;
-	char progname[128];
-	strcpy(progname, program);
-	(void)nargs;
 
 	/* Open the file. */
 	result = vfs_open(progname, O_RDONLY, 0, &v);
+	kfree(progname);
 	if (result) {
+		kfree(argbuf);
 		return result;
 	}
-	as_destroy(curthread->t_addrspace);
-	curthread->t_addrspace = NULL;
-	// /* We should be a new thread. */
-	KASSERT(curthread->t_addrspace == NULL);
 
-	// /* Create a new address space. */
-	curthread->t_addrspace = as_create();
-	if (curthread->t_addrspace==NULL) {       
+	/* Create the new address space and switch to it. */
+	newas = as_create();
+	if (newas == NULL) {
 		vfs_close(v);
+		kfree(argbuf);
 		return ENOMEM;
 	}
-
-	// /* Activate it. */
-	// as_activate(curthread->t_addrspace);
+	oldas = curthread->t_addrspace;
+	curthread->t_addrspace = newas;
+	as_activate(newas);
 
 	/* Load the executable. */
 	result = load_elf(v, &entrypoint);
-	if (result) {
-		/* thread_exit destroys curthread->t_addrspace */
-		vfs_close(v);
-		return result;
-	}
 
 	/* Done with the file now. */
 	vfs_close(v);
 
-	/* Define the user stack in the address space */
-	result = as_define_stack(curthread->t_addrspace, &stackptr);
 	if (result) {
-		/* thread_exit destroys curthread->t_addrspace */
-		return result;
+		goto fail;
 	}
 
-	/* Copy program arguments to the kernel buffer*/
-
-	//Calculate the size of the kernel buffer
-	// (void)curarg_split1;
-	size_t size = calculate_kargsd_size(args, nargs);
-	//Create it
-	void* kargv[size];
-	int arg_ptrs[nargs];
-	//Actually Copy the args into the kernel buffer
-	//Add the NULL pointer (comes after the last arg)
-	kargv[nargs] = NULL;
-	//Now populate the data region
-	int curblock = nargs+1; //right after NULL, this the position in kargv.
-	int curblock_offset = 0; //how far we are in to each block of each position of kargv.
-	int arg_start_pos = curblock;
-	for(size_t i=0;i<nargs;i++)
-	{
-		// kprintf("Current arg:%s\n",args[i]);
-		char* curarg = args[i]; //current arg from args
-		char curarg_split[4]; //= {'a','a','a','a'}; //4 byte buffer
-		char curarg_char = curarg[0];
-		for(int j=0; true ;j++) //copy current arg one char at a time, until we hit '\0'
-		{
-			if(curblock_offset == 4)
-			{
-				/*we copied 4 chars. add the buffer to kargv, increment kargv position,
-				, and reset the offset into the buffer */
-				// kprintf("Copying \'%c%c%c%c\'to block%d\n", curarg_split[0],curarg_split[1],curarg_split[2],curarg_split[3],curblock);
-				memcpy( &kargv[curblock], curarg_split, 4);
-				// kargv[curblock] = (void*) curarg_split;
-				curblock_offset = 0;
-				curblock++;
-			}
-
-			// kprintf("Current char:%c\n", curarg[j]);
-			curarg_char = curarg[j];
-			if(curarg_char == '\0')
-			{
-				// kprintf("copying terminator..\n");
-				curarg_split[curblock_offset] = '\0';
-				curblock_offset++;
-				break;
-			}
-
-			// kprintf("Current block:%d\n",curblock);	
-			//copy current char into the 4-byte buffer, increment index.
-			// curarg_char = curarg[j];
-			curarg_split[curblock_offset] = curarg_char;
-			curblock_offset++;
-		}
-		//Pad the remaining block, if it exists, and copy it into kargv.
-		if(curblock_offset > 0)
-		{
-			for(int j=curblock_offset;j<4;j++)
-			{
-				// kprintf("padding...\n");
-				curarg_split[curblock_offset] = '\0';
-				curblock_offset++;
-			}
-			// kprintf("Copying \'%c%c%c%c\'to block %d\n", curarg_split[0],curarg_split[1],curarg_split[2],curarg_split[3],curblock);
-			memcpy( &kargv[curblock], curarg_split, 4);
-			// kargv[curblock] = (void*) curarg_split;
-			curblock++;
-			curblock_offset = 0;
-		}
-		//Now, set the pointer in kargv to point to the correct data region:
-		//Note that i is the current arg, and kargv[i+1] should always be NULL. 
-		kargv[i] = (void*) &kargv[arg_start_pos]; 
-		arg_ptrs[i] = arg_start_pos;
-		// kprintf("Contents of block %d: %s\n",i, x);
-		// kprintf("assigning arg %d to point to block %d\n",i,arg_start_pos);
-		//The next arg, if it exists, will begin at curblock now. 
-		arg_start_pos = curblock; 
+	/* Define the user stack in the address space */
+	result = as_define_stack(newas, &stackptr);
+	if (result) {
+		goto fail;
 	}
-	for(size_t i = 0;i<size;i++)
-	{
-		if(i <= nargs){
-			// kprintf("Index: %d Value:%s Location:%p\n",i, (char*) kargv[i],&kargv[i]);
-
-		}
-		else{
-			
-			// kprintf("Index: %d VAlue:%p Location:%p\n",i, kargv[i],&kargv[i]);
 
-		}
+	/* Point argv at where the strings will land and copy it all out. */
+	argvptr = stackptr - argsize;
+	argv = (vaddr_t *) argbuf;
+	for (i = 0; i < nargs; i++) {
+		argv[i] += argvptr;
 	}
-
-	/*Copy the Kernel onto the Stack */
-	int bufSize = size * sizeof(void*);
-
-	// kprintf("stackptr:%p\n",(void*) stackptr);
-	for(size_t i =0;i<nargs;i++)
-	{
-		// kprintf("Arg %d points to %d\n",i,arg_ptrs[i]);
-		kargv[i] = (void*) (stackptr - bufSize) + sizeof(void*) * arg_ptrs[i];
+	result = copyout(argbuf, (userptr_t) argvptr, argsize);
+	if (result) {
+		goto fail;
 	}
-	result = copyout(kargv, (userptr_t) stackptr-bufSize,bufSize);
-	if(result)
-	{
-		return result;
+	kfree(argbuf);
+
+	/* No going back now. */
+	if (oldas != NULL) {
+		if (curthread->t_ustack != 0) {
+			as_free_thread_stack(oldas, curthread->t_ustack);
+			curthread->t_ustack = 0;
+		}
+		as_destroy(oldas);
 	}
+	proc = get_process(curthread->t_pid);
+	process_vfork_done(proc);
 
-	stackptr -= bufSize;
-	// userptr_t argvptr =  (userptr_t) stackptr;
+	/* Keep the stack pointer 8-byte aligned. */
+	stackptr = argvptr & ~(vaddr_t)7;
 
-	// kprintf("Size%d\n",size);
-	// kprintf("\nstackptr now: %p\n",(void*) stackptr);
-	// kprintf("argv pointer now: %p\n",(void*) argvptr);
-	// kprintf("address of argv[0] now: %p\n", &argv[0]);
-	// kprintf("argv[0] now: %p\n", argv[0]);
-	// kprintf("argv[0] now: %s\n", (char*) argv[0]);
-	// kprintf("Value of argv:%p\n", argv);
-	// kprintf("Address of argv[0]:%p\n",&argv[0]);
 	/* Warp to user mode. */
-		enter_new_process(nargs, (userptr_t) stackptr ,
-				  stackptr, entrypoint);
-	//enter_new_process(0 /*argc*/, NULL /*userspace addr of argv*/,
-	//		  stackptr, entrypoint);
-	
+	enter_new_process(nargs, (userptr_t) argvptr, stackptr, entrypoint);
+
 	/* enter_new_process does not return. */
 	panic("enter_new_process returned\n");
 	return EINVAL;
 
+ fail:
+	kfree(argbuf);
+	curthread->t_addrspace = oldas;
+	as_activate(oldas);
+	as_destroy(newas);
+	return result;
 }
 
 /*
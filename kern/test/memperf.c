@@ -0,0 +1,335 @@
+/*
+ * Microbenchmark for the block copy and fill routines.
+ *
+ * Times memcpy, memmove and bzero against the simple versions they
+ * replaced (kept below as old_*), for a page-sized block at a few
+ * alignments, and page_zero and page_copy against doing the same job
+ * with the old routines. Also checks that the new ones get the right
+ * answer while it's at it.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <vm.h>
+#include <test.h>
+
+#define NLOOPS   200
+#define BLOCKSIZE (PAGE_SIZE - 16)
+
+/* The old memcpy: words only if everything is aligned, else bytes. */
+static
+void *
+old_memcpy(void *dst, const void *src, size_t len)
+{
+	size_t i;
+
+	if ((uintptr_t)dst % sizeof(long) == 0 &&
+	    (uintptr_t)src % sizeof(long) == 0 &&
+	    len % sizeof(long) == 0) {
+		long *d = dst;
+		const long *s = src;
+
+		for (i=0; i<len/sizeof(long); i++) {
+			d[i] = s[i];
+		}
+	}
+	else {
+		char *d = dst;
+		const char *s = src;
+
+		for (i=0; i<len; i++) {
+			d[i] = s[i];
+		}
+	}
+	return dst;
+}
+
+/* The old backwards memmove, likewise. */
+static
+void *
+old_memmove(void *dst, const void *src, size_t len)
+{
+	size_t i;
+
+	if ((uintptr_t)dst < (uintptr_t)src) {
+		return old_memcpy(dst, src, len);
+	}
+	if ((uintptr_t)dst % sizeof(long) == 0 &&
+	    (uintptr_t)src % sizeof(long) == 0 &&
+	    len % sizeof(long) == 0) {
+		long *d = dst;
+		const long *s = src;
+
+		for (i=len/sizeof(long); i>0; i--) {
+			d[i-1] = s[i-1];
+		}
+	}
+	else {
+		char *d = dst;
+		const char *s = src;
+
+		for (i=len; i>0; i--) {
+			d[i-1] = s[i-1];
+		}
+	}
+	return dst;
+}
+
+/* The old bzero. */
+static
+void
+old_bzero(void *vblock, size_t len)
+{
+	char *block = vblock;
+	size_t i;
+
+	if ((uintptr_t)block % sizeof(long) == 0 &&
+	    len % sizeof(long) == 0) {
+		long *lb = (long *)block;
+		for (i=0; i<len/sizeof(long); i++) {
+			lb[i] = 0;
+		}
+	}
+	else {
+		for (i=0; i<len; i++) {
+			block[i] = 0;
+		}
+	}
+}
+
+/* What the VM system used to zero pages with: smartvm.c's memset. */
+static
+void
+old_page_zero(paddr_t pa)
+{
+	char *p = (char *)PADDR_TO_KVADDR(pa);
+	size_t i;
+
+	for (i=0; i<PAGE_SIZE; i++) {
+		p[i] = 0;
+	}
+}
+
+static
+void
+old_page_copy(paddr_t dst, paddr_t src)
+{
+	old_memcpy((void *)PADDR_TO_KVADDR(dst),
+		   (const void *)PADDR_TO_KVADDR(src), PAGE_SIZE);
+}
+
+/* Nanoseconds since BEFORESECS/BEFORENSECS, capped to fit. */
+static
+uint32_t
+elapsed(time_t beforesecs, uint32_t beforensecs)
+{
+	time_t aftersecs, secs;
+	uint32_t afternsecs, nsecs;
+
+	gettime(&aftersecs, &afternsecs);
+	getinterval(beforesecs, beforensecs, aftersecs, afternsecs,
+		    &secs, &nsecs);
+	if (secs >= 4) {
+		return 0xffffffff;
+	}
+	return secs * 1000000000 + nsecs;
+}
+
+static
+void
+report(const char *what, uint32_t oldns, uint32_t newns)
+{
+	kprintf("  %-28s old %8lu us  new %8lu us  (%lu.%02lux)\n", what,
+		(unsigned long)(oldns / 1000), (unsigned long)(newns / 1000),
+		(unsigned long)(oldns / (newns ? newns : 1)),
+		(unsigned long)((oldns % (newns ? newns : 1)) * 100 /
+				(newns ? newns : 1)));
+}
+
+static
+void
+fill(unsigned char *p, size_t len, unsigned seed)
+{
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		p[i] = (i * 31 + seed) & 0xff;
+	}
+}
+
+/*
+ * Time memcpy and the old one (or memmove, if MOVE) copying
+ * BLOCKSIZE bytes from SRC+SOFF to DST+DOFF, and check the result.
+ * Moves stay within one page (SRC is DST) and are checked against the
+ * old memmove doing the same move in REF.
+ */
+static
+void
+bench_copy(const char *what, bool move, unsigned char *dst, size_t doff,
+	   unsigned char *src, size_t soff, unsigned char *ref)
+{
+	time_t secs;
+	uint32_t nsecs, oldns, newns;
+	size_t i;
+	int j;
+
+	fill(src, PAGE_SIZE, 1);
+	gettime(&secs, &nsecs);
+	for (j=0; j<NLOOPS; j++) {
+		if (move) {
+			old_memmove(dst + doff, src + soff, BLOCKSIZE);
+		}
+		else {
+			old_memcpy(dst + doff, src + soff, BLOCKSIZE);
+		}
+	}
+	oldns = elapsed(secs, nsecs);
+
+	fill(src, PAGE_SIZE, 2);
+	gettime(&secs, &nsecs);
+	for (j=0; j<NLOOPS; j++) {
+		if (move) {
+			memmove(dst + doff, src + soff, BLOCKSIZE);
+		}
+		else {
+			memcpy(dst + doff, src + soff, BLOCKSIZE);
+		}
+	}
+	newns = elapsed(secs, nsecs);
+
+	/*
+	 * The moves all overlap, so they shift the data along each time
+	 * round; do one more from scratch, and the same with the old
+	 * memmove in REF, and compare the whole page.
+	 */
+	if (move) {
+		KASSERT(src == dst);
+		fill(dst, PAGE_SIZE, 6);
+		memcpy(ref, dst, PAGE_SIZE);
+		memmove(dst + doff, src + soff, BLOCKSIZE);
+		old_memmove(ref + doff, ref + soff, BLOCKSIZE);
+		for (i=0; i<PAGE_SIZE; i++) {
+			if (dst[i] != ref[i]) {
+				panic("memperf: %s wrong at byte %u\n",
+				      what, (unsigned)i);
+			}
+		}
+	}
+	else {
+		for (i=0; i<BLOCKSIZE; i++) {
+			if (dst[doff + i] != ((soff + i) * 31 + 2) % 256) {
+				panic("memperf: %s wrong at byte %u\n",
+				      what, (unsigned)i);
+			}
+		}
+	}
+	report(what, oldns, newns);
+}
+
+int
+memperf(int nargs, char **args)
+{
+	unsigned char *a, *b, *ref;
+	paddr_t pa, pb;
+	time_t secs;
+	uint32_t nsecs, oldns, newns;
+	size_t i;
+	int j;
+
+	(void)nargs;
+	(void)args;
+
+	/* Two pages each, so moves can overlap and blocks can be offset. */
+	a = (unsigned char *)alloc_kpages(2);
+	b = (unsigned char *)alloc_kpages(2);
+	/* Where the old memmove does each move again, to check the new. */
+	ref = (unsigned char *)alloc_kpages(1);
+	if (a == NULL || b == NULL || ref == NULL) {
+		kprintf("memperf: Out of memory\n");
+		if (a != NULL) {
+			free_kpages((vaddr_t)a);
+		}
+		if (b != NULL) {
+			free_kpages((vaddr_t)b);
+		}
+		if (ref != NULL) {
+			free_kpages((vaddr_t)ref);
+		}
+		return ENOMEM;
+	}
+	pa = KVADDR_TO_PADDR((vaddr_t)a);
+	pb = KVADDR_TO_PADDR((vaddr_t)b);
+
+	kprintf("memperf: %d x %u bytes\n", NLOOPS, (unsigned)BLOCKSIZE);
+
+	bench_copy("memcpy aligned", false, a, 0, b, 0, ref);
+	bench_copy("memcpy dst+1", false, a, 1, b, 0, ref);
+	bench_copy("memcpy src+3 dst+1", false, a, 1, b, 3, ref);
+	bench_copy("memmove up, aligned", true, a, 8, a, 0, ref);
+	bench_copy("memmove up, src+2", true, a, 7, a, 2, ref);
+	bench_copy("memmove down, src+1", true, a, 0, a, 5, ref);
+
+	gettime(&secs, &nsecs);
+	for (j=0; j<NLOOPS; j++) {
+		old_bzero(a + 1, BLOCKSIZE);
+	}
+	oldns = elapsed(secs, nsecs);
+	fill(a, PAGE_SIZE, 3);
+	gettime(&secs, &nsecs);
+	for (j=0; j<NLOOPS; j++) {
+		bzero(a + 1, BLOCKSIZE);
+	}
+	newns = elapsed(secs, nsecs);
+	for (i=0; i<BLOCKSIZE; i++) {
+		if (a[1 + i] != 0) {
+			panic("memperf: bzero missed byte %u\n", (unsigned)i);
+		}
+	}
+	report("bzero +1", oldns, newns);
+
+	gettime(&secs, &nsecs);
+	for (j=0; j<NLOOPS; j++) {
+		old_page_zero(pa);
+	}
+	oldns = elapsed(secs, nsecs);
+	fill(a, PAGE_SIZE, 4);
+	gettime(&secs, &nsecs);
+	for (j=0; j<NLOOPS; j++) {
+		page_zero(pa);
+	}
+	newns = elapsed(secs, nsecs);
+	for (i=0; i<PAGE_SIZE; i++) {
+		if (a[i] != 0) {
+			panic("memperf: page_zero missed byte %u\n",
+			      (unsigned)i);
+		}
+	}
+	report("page_zero", oldns, newns);
+
+	fill(b, PAGE_SIZE, 5);
+	gettime(&secs, &nsecs);
+	for (j=0; j<NLOOPS; j++) {
+		old_page_copy(pa, pb);
+	}
+	oldns = elapsed(secs, nsecs);
+	bzero(a, PAGE_SIZE);
+	gettime(&secs, &nsecs);
+	for (j=0; j<NLOOPS; j++) {
+		page_copy(pa, pb);
+	}
+	newns = elapsed(secs, nsecs);
+	for (i=0; i<PAGE_SIZE; i++) {
+		if (a[i] != b[i]) {
+			panic("memperf: page_copy wrong at byte %u\n",
+			      (unsigned)i);
+		}
+	}
+	report("page_copy", oldns, newns);
+
+	free_kpages((vaddr_t)a);
+	free_kpages((vaddr_t)b);
+	free_kpages((vaddr_t)ref);
+	kprintf("memperf: done\n");
+	return 0;
+}
@@ -33,14 +33,24 @@
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
+#include <spl.h>
 #include <current.h>
+#include <mainbus.h>
 
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution that one second.
+ * Each cpu keeps a list of timeouts, sorted by deadline, and programs
+ * its timer to go off at whichever comes first of the next hardclock
+ * and the first timeout. Deadlines are kept in nanoseconds as read
+ * from the hardware clock, so timeouts are not rounded to a tick.
+ *
+ * A cpu that is idle with an empty run queue has no use for the
+ * periodic tick, so it stops ticking and sleeps until its next
+ * timeout (or at most TICKLESS_MAX_NSECS). If it is handed a thread
+ * in the meantime, the IPI that wakes it brings it out of the idle
+ * loop, which calls hardclock_resume to turn the tick back on. The
+ * hardclock count is caught up from the clock when that happens.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -52,12 +62,18 @@
  */
 #define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
 #define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
+#define TICKLESS_MAX_NSECS	1000000000	/* Idle cpus wake once a second. */
 
 /*
  * Once a second, everything waiting on lbolt is awakened by CPU 0.
  */
 static struct wchan *lbolt;
 
+/*
+ * Threads in clocksleep wait here; each is woken by its own timeout.
+ */
+static struct wchan *sleepchan;
+
 /*
  * Setup.
  */
@@ -68,8 +84,194 @@ hardclock_bootstrap(void)
 	if (lbolt == NULL) {
 		panic("Couldn't create lbolt\n");
 	}
+	sleepchan = wchan_create("clocksleep");
+	if (sleepchan == NULL) {
+		panic("Couldn't create clocksleep wchan\n");
+	}
+}
+
+/*
+ * Current time in nanoseconds.
+ */
+uint64_t
+clock_nsecs(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Timeouts
+ */
+
+void
+timeout_init(struct timeout *to, void (*func)(void *), void *data)
+{
+	to->to_next = NULL;
+	to->to_cpu = NULL;
+	to->to_deadline = 0;
+	to->to_func = func;
+	to->to_data = data;
+}
+
+/*
+ * Arm TO to go off NSECS nanoseconds from now on the current cpu. If
+ * it is now the first thing due, pull the timer in to match.
+ */
+void
+timeout_add(struct timeout *to, uint64_t nsecs)
+{
+	struct cpu *c;
+	struct timeout **pp;
+	uint64_t now;
+	int spl;
+
+	KASSERT(to->to_cpu == NULL);
+
+	now = clock_nsecs();
+
+	/* Stay on this cpu until the timeout is on its list. */
+	spl = splhigh();
+	c = curcpu->c_self;
+
+	spinlock_acquire(&c->c_timeout_lock);
+	to->to_cpu = c;
+	to->to_deadline = now + nsecs;
+	for (pp = &c->c_timeouts; *pp != NULL; pp = &(*pp)->to_next) {
+		if ((*pp)->to_deadline > to->to_deadline) {
+			break;
+		}
+	}
+	to->to_next = *pp;
+	*pp = to;
+
+	if (to->to_deadline < c->c_timerdeadline) {
+		c->c_timerdeadline = to->to_deadline;
+		mainbus_timer_set(nsecs);
+	}
+	spinlock_release(&c->c_timeout_lock);
+
+	splx(spl);
+}
+
+/*
+ * Disarm TO. If its function is running on another cpu right now,
+ * wait for it to finish so the caller can safely free TO.
+ */
+bool
+timeout_del(struct timeout *to)
+{
+	struct cpu *c;
+	struct timeout **pp;
+
+	c = to->to_cpu;
+	if (c == NULL) {
+		/* Never armed, or already ran. */
+		return false;
+	}
+
+	spinlock_acquire(&c->c_timeout_lock);
+	if (to->to_cpu != c) {
+		/* Ran while we were getting the lock. */
+		spinlock_release(&c->c_timeout_lock);
+		return false;
+	}
+	for (pp = &c->c_timeouts; *pp != NULL; pp = &(*pp)->to_next) {
+		if (*pp == to) {
+			*pp = to->to_next;
+			to->to_next = NULL;
+			to->to_cpu = NULL;
+			spinlock_release(&c->c_timeout_lock);
+			return true;
+		}
+	}
+
+	/* Not on the list, so it is running; wait it out. */
+	while (c->c_timeout_running == to) {
+		spinlock_release(&c->c_timeout_lock);
+		spinlock_acquire(&c->c_timeout_lock);
+	}
+	spinlock_release(&c->c_timeout_lock);
+	return false;
+}
+
+/*
+ * Call the functions of all timeouts on C that are due by NOW. The
+ * lock is dropped around each call so the function can arm and
+ * disarm other timeouts and wake threads.
+ */
+static
+void
+timeout_run(struct cpu *c, uint64_t now)
+{
+	struct timeout *to;
+
+	spinlock_acquire(&c->c_timeout_lock);
+	while (c->c_timeouts != NULL && c->c_timeouts->to_deadline <= now) {
+		to = c->c_timeouts;
+		c->c_timeouts = to->to_next;
+		to->to_next = NULL;
+		c->c_timeout_running = to;
+		spinlock_release(&c->c_timeout_lock);
+
+		to->to_func(to->to_data);
+
+		spinlock_acquire(&c->c_timeout_lock);
+		c->c_timeout_running = NULL;
+		to->to_cpu = NULL;
+	}
+	spinlock_release(&c->c_timeout_lock);
+}
+
+/*
+ * Program C's timer for its next event: the next hardclock, or, if
+ * there is nothing to run, no tick at all; and in either case no
+ * later than the first timeout.
+ */
+static
+void
+hardclock_settimer(struct cpu *c, uint64_t now)
+{
+	uint64_t deadline;
+
+	spinlock_acquire(&c->c_timeout_lock);
+	if (c->c_isidle && threadlist_isempty(&c->c_runqueue)) {
+		c->c_tickless = true;
+		deadline = now + TICKLESS_MAX_NSECS;
+	}
+	else {
+		c->c_tickless = false;
+		deadline = c->c_nexttick;
+	}
+	if (c->c_timeouts != NULL && c->c_timeouts->to_deadline < deadline) {
+		deadline = c->c_timeouts->to_deadline;
+	}
+	c->c_timerdeadline = deadline;
+	mainbus_timer_set(deadline > now ? deadline - now : 0);
+	spinlock_release(&c->c_timeout_lock);
+}
+
+/*
+ * Turn the periodic tick back on after the idle loop found work. The
+ * next hardclock will count the ticks that were skipped.
+ */
+void
+hardclock_resume(void)
+{
+	struct cpu *c = curcpu->c_self;
+
+	if (c->c_tickless) {
+		hardclock_settimer(c, clock_nsecs());
+	}
 }
 
+////////////////////////////////////////////////////////////
+
 /*
  * This is called once per second, on one processor, by the timer
  * code.
@@ -82,24 +284,77 @@ timerclock(void)
 }
 
 /*
- * This is called HZ times a second (on each processor) by the timer
- * code.
+ * This is called by the timer code on each processor HZ times a
+ * second while it is busy, and whenever one of its timeouts is due.
  */
 void
 hardclock(void)
 {
+	struct cpu *c = curcpu->c_self;
+	uint64_t now;
+	unsigned ticks, before;
+
+	now = clock_nsecs();
+	if (c->c_nexttick == 0) {
+		/* First tick on this cpu. */
+		c->c_nexttick = now;
+	}
+
 	/*
-	 * Collect statistics here as desired.
+	 * Count however many ticks have passed; this is more than one
+	 * after running tickless.
 	 */
+	ticks = 0;
+	before = c->c_hardclocks;
+	if (now >= c->c_nexttick) {
+		ticks = 1 + (now - c->c_nexttick) / HARDCLOCK_NSECS;
+		c->c_nexttick += (uint64_t)ticks * HARDCLOCK_NSECS;
+		c->c_hardclocks += ticks;
+		c->c_skippedticks += ticks - 1;
+	}
+
+	timeout_run(c, now);
+
+	if (ticks > 0) {
+		if (before / SCHEDULE_HARDCLOCKS !=
+		    c->c_hardclocks / SCHEDULE_HARDCLOCKS) {
+			schedule();
+		}
+		if (before / MIGRATE_HARDCLOCKS !=
+		    c->c_hardclocks / MIGRATE_HARDCLOCKS) {
+			thread_consider_migration();
+		}
+	}
+
+	/* Must come before yielding, which may reenable interrupts. */
+	hardclock_settimer(c, now);
 
-	curcpu->c_hardclocks++;
-	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
-		schedule();
+	if (ticks > 0 && thread_tick()) {
+		thread_yield();
 	}
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
-		thread_consider_migration();
+}
+
+/*
+ * Suspend execution until the clock reads DEADLINE.
+ */
+void
+clocksleep_until(uint64_t deadline)
+{
+	uint64_t now;
+
+	while ((now = clock_nsecs()) < deadline) {
+		wchan_lock(sleepchan);
+		wchan_sleep_timeout(sleepchan, deadline - now);
 	}
-	thread_yield();
+}
+
+/*
+ * Suspend execution for NSECS nanoseconds.
+ */
+void
+clocksleep_nsecs(uint64_t nsecs)
+{
+	clocksleep_until(clock_nsecs() + nsecs);
 }
 
 /*
@@ -108,9 +363,7 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-	while (num_secs > 0) {
-		wchan_lock(lbolt);
-		wchan_sleep(lbolt);
-		num_secs--;
+	if (num_secs > 0) {
+		clocksleep_nsecs((uint64_t)num_secs * 1000000000);
 	}
 }
@@ -33,12 +33,14 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <clock.h>
 
 ////////////////////////////////////////////////////////////
 //
@@ -131,6 +133,39 @@ P(struct semaphore *sem)
 	spinlock_release(&sem->sem_lock);
 }
 
+/*
+ * P, but give up and return ETIMEDOUT if the count is still zero
+ * NSECS nanoseconds from now.
+ */
+int
+P_timeout(struct semaphore *sem, uint64_t nsecs)
+{
+	uint64_t deadline, now;
+
+        KASSERT(sem != NULL);
+        KASSERT(curthread->t_in_interrupt == false);
+
+	deadline = clock_nsecs() + nsecs;
+
+	spinlock_acquire(&sem->sem_lock);
+        while (sem->sem_count == 0) {
+		now = clock_nsecs();
+		if (now >= deadline) {
+			spinlock_release(&sem->sem_lock);
+			return ETIMEDOUT;
+		}
+		wchan_lock(sem->sem_wchan);
+		spinlock_release(&sem->sem_lock);
+		wchan_sleep_timeout(sem->sem_wchan, deadline - now);
+
+		spinlock_acquire(&sem->sem_lock);
+        }
+        KASSERT(sem->sem_count > 0);
+        sem->sem_count--;
+	spinlock_release(&sem->sem_lock);
+	return 0;
+}
+
 //increment (unlock)
 
 void
@@ -237,6 +272,26 @@ lock_acquire(struct lock *lock)
         // kprintf("got lock\n");
 }
 
+//ATOMIC
+bool
+lock_tryacquire(struct lock *lock)
+{
+        bool got;
+
+        KASSERT(lock != NULL);
+        KASSERT(curthread != NULL);
+
+        spinlock_acquire(&lock->lk_spinlock);
+        got = !lock->lk_locked;
+        if(got)
+        {
+            lock->lk_locked = true;
+            lock->lk_owner = curthread;
+        }
+        spinlock_release(&lock->lk_spinlock);
+        return got;
+}
+
 //ATOMIC
 void
 lock_release(struct lock *lock)
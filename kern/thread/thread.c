@@ -43,6 +43,7 @@
 #include <threadlist.h>
 #include <threadprivate.h>
 #include <current.h>
+#include <clock.h>
 #include <synch.h>
 #include <addrspace.h>
 #include <mainbus.h>
@@ -56,6 +57,24 @@
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+/*
+ * Multi-level feedback queue parameters. Level 0 is the most
+ * interactive; a thread at level N gets a quantum of 2^N hardclocks
+ * and is demoted a level whenever it burns a whole quantum. Going to
+ * sleep promotes it a level, and a thread left waiting on a run queue
+ * for SCHED_AGING_HARDCLOCKS is promoted so it cannot starve.
+ */
+#define SCHED_LEVELS		4
+#define SCHED_QUANTUM(level)	(1U << (level))
+#define SCHED_AGING_HARDCLOCKS	50
+
+/*
+ * Idle cpus steal work from the busiest peer. A thread that ran
+ * within the last STEAL_CACHEHOT_HARDCLOCKS is assumed to still have
+ * its working set in its cpu's cache and is left where it is.
+ */
+#define STEAL_CACHEHOT_HARDCLOCKS	2
+
 /* Wait channel. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
@@ -149,17 +168,33 @@ thread_create(const char *name)
 
 	/* VM fields */
 	thread->t_addrspace = NULL;
+	thread->t_ustack = 0;
 
 	/* VFS fields */
 	thread->t_cwd = NULL;
 
 	/* Process ID -1 for now*/
 	thread->t_pid = -1;
+
+	/* Scheduler fields; new threads start out interactive */
+	thread->t_priority = 0;
+	thread->t_quantum = 0;
+	thread->t_readysince = 0;
+	thread->t_runticks = 0;
+	thread->t_sleepcount = 0;
+	thread->t_lastran = 0;
+	thread->t_background = false;
+
+	thread->t_affinity = THREAD_AFFINITY_ANY;
+	thread->t_inuser = false;
+	bzero(&thread->t_usage, sizeof(thread->t_usage));
 	/* If you add to struct thread, be sure to initialize here */
 
 	return thread;
 }
 
+static void thread_idle(void *unused, unsigned long unused2);
+
 /*
  * Create a CPU structure. This is used for the bootup CPU and
  * also for secondary CPUs.
@@ -184,12 +219,25 @@ cpu_create(unsigned hardware_number)
 	c->c_hardware_number = hardware_number;
 
 	c->c_curthread = NULL;
+	c->c_curas = NULL;
 	threadlist_init(&c->c_zombies);
+	threadlist_init(&c->c_leaving);
+	c->c_idlethread = NULL;
 	c->c_hardclocks = 0;
+	c->c_nexttick = 0;
+	c->c_timerdeadline = 0;
+	c->c_tickless = false;
+	c->c_skippedticks = 0;
+
+	c->c_timeouts = NULL;
+	c->c_timeout_running = NULL;
+	spinlock_init(&c->c_timeout_lock);
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
+	c->c_steals = 0;
+	c->c_migrations = 0;
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
@@ -224,6 +272,29 @@ cpu_create(unsigned hardware_number)
 	}
 	c->c_curthread->t_cpu = c;
 
+	/*
+	 * The idle thread is never on a run queue. thread_switch
+	 * switches to it when a thread has to leave this cpu and there
+	 * is nothing else to run, so the thread's stack is free before
+	 * another cpu picks it up.
+	 */
+	snprintf(namebuf, sizeof(namebuf), "<idle #%d>", c->c_number);
+	c->c_idlethread = thread_create(namebuf);
+	if (c->c_idlethread == NULL) {
+		panic("cpu_create: thread_create failed\n");
+	}
+	c->c_idlethread->t_stack = kmalloc(STACK_SIZE);
+	if (c->c_idlethread->t_stack == NULL) {
+		panic("cpu_create: couldn't allocate stack");
+	}
+	thread_checkstack_init(c->c_idlethread);
+	c->c_idlethread->t_cpu = c;
+	c->c_idlethread->t_priority = SCHED_LEVELS - 1;
+	c->c_idlethread->t_background = true;
+	/* It starts out in thread_startup like a forked thread. */
+	c->c_idlethread->t_iplhigh_count++;
+	switchframe_init(c->c_idlethread, thread_idle, NULL, 0);
+
 	cpu_machdep_init(c);
 
 	return c;
@@ -429,10 +500,91 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Put a thread on a cpu's run queue. The run queue must be locked.
+ *
+ * With the default scheduler this is plain FIFO. Otherwise the run
+ * queue is kept sorted by feedback queue level, with threads of the
+ * same level in FIFO order, so the head is always the thread to run.
+ */
+static
+void
+thread_runqueue_insert(struct cpu *c, struct thread *t)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	t->t_readysince = c->c_hardclocks;
+#if OPT_DEFAULTSCHEDULER
+	threadlist_addtail(&c->c_runqueue, t);
+#else
+	{
+		struct threadlistnode *tln;
+
+		for (tln = c->c_runqueue.tl_tail.tln_prev;
+		     tln->tln_prev != NULL;
+		     tln = tln->tln_prev) {
+			if (tln->tln_self->t_priority <= t->t_priority) {
+				threadlist_insertafter(&c->c_runqueue,
+						       tln->tln_self, t);
+				return;
+			}
+		}
+		threadlist_addhead(&c->c_runqueue, t);
+	}
+#endif
+}
+
+/*
+ * True if T's affinity mask lets it run on C.
+ */
+static
+bool
+thread_cpu_allowed(const struct thread *t, const struct cpu *c)
+{
+	return c->c_number < 32 && (t->t_affinity & (1U << c->c_number));
+}
+
+/*
+ * Choose a cpu for a thread with affinity MASK: PREFER if the mask
+ * allows it, otherwise the allowed cpu with the shortest run queue.
+ * Queue lengths are read unlocked; they're only a hint.
+ */
+static
+struct cpu *
+thread_pickcpu(uint32_t mask, struct cpu *prefer)
+{
+	struct cpu *c, *best;
+	unsigned i, numcpus;
+
+	if (prefer->c_number < 32 && (mask & (1U << prefer->c_number))) {
+		return prefer;
+	}
+
+	best = NULL;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus && i<32; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if ((mask & (1U << i)) == 0) {
+			continue;
+		}
+		if (best == NULL ||
+		    c->c_runqueue.tl_count < best->c_runqueue.tl_count) {
+			best = c;
+		}
+	}
+	return best != NULL ? best : prefer;
+}
+
 /*
  * Make a thread runnable.
  *
  * targetcpu might be curcpu; it might not be, too. 
+ *
+ * If the thread's affinity no longer allows its cpu, it is queued on
+ * one that is allowed instead. That is not safe while the old cpu is
+ * still idling on the thread's stack (c_curthread is the thread; see
+ * thread_switch), so in that case it stays put; the old cpu won't run
+ * it, and hands it on through c_leaving once it has switched away.
  */
 static
 void
@@ -450,10 +602,18 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 	else {
 		spinlock_acquire(&targetcpu->c_runqueue_lock);
+		if (!thread_cpu_allowed(target, targetcpu) &&
+		    targetcpu->c_curthread != target) {
+			spinlock_release(&targetcpu->c_runqueue_lock);
+			targetcpu = thread_pickcpu(target->t_affinity,
+						   targetcpu);
+			target->t_cpu = targetcpu;
+			spinlock_acquire(&targetcpu->c_runqueue_lock);
+		}
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	thread_runqueue_insert(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -467,6 +627,24 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 }
 
+/*
+ * Send threads whose affinity excludes this cpu to one they may run
+ * on. thread_switch parks them on c_leaving until the cpu is off
+ * their stacks; like exorcise, this runs after the switch.
+ */
+static
+void
+thread_sendaway(void)
+{
+	struct thread *t;
+
+	while ((t = threadlist_remhead(&curcpu->c_leaving)) != NULL) {
+		KASSERT(t != curthread);
+		KASSERT(t->t_state == S_READY);
+		thread_make_runnable(t, false);
+	}
+}
+
 /*
  * Create a new thread based on an existing one.
  *
@@ -506,7 +684,9 @@ thread_fork(const char *name,
 	 */
 
 	/* Thread subsystem fields */
-	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_affinity = curthread->t_affinity;
+	newthread->t_cpu = thread_pickcpu(newthread->t_affinity,
+					  curthread->t_cpu);
 
 	/* VM fields */
 	/* do not clone address space -- let caller decide on that */
@@ -582,7 +762,9 @@ thread_forkp(const char *name,
 	 */
 
 	/* Thread subsystem fields */
-	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_affinity = curthread->t_affinity;
+	newthread->t_cpu = thread_pickcpu(newthread->t_affinity,
+					  curthread->t_cpu);
 
 	/* VM fields */
 	/* do not clone address space -- let caller decide on that */
@@ -637,15 +819,17 @@ thread_forkp(const char *name,
  * The new thread has name NAME, and starts executing in function
  * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
  *
- * The new thread is given no address space (the caller decides that)
- * but inherits its current working directory from the caller. It will
- * start on the same CPU as the caller, unless the scheduler
- * intervenes first.
+ * The new thread gets a copy of the caller's address space, or for
+ * vfork (VFORKSEM not NULL) shares it outright until the child execs
+ * or exits. It inherits its current working directory from the
+ * caller. It will start on the same CPU as the caller, unless the
+ * scheduler intervenes first.
  */
 int
 thread_forkf(const char *name,
 	    void (*entrypoint)(void *data1, unsigned long data2),
 	    void *data1, unsigned long data2,
+	    struct semaphore *vforksem,
 	    struct thread **ret, struct process **process)
 {
 	struct thread *newthread;
@@ -671,7 +855,9 @@ thread_forkf(const char *name,
 	 */
 
 	/* Thread subsystem fields */
-	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_affinity = curthread->t_affinity;
+	newthread->t_cpu = thread_pickcpu(newthread->t_affinity,
+					  curthread->t_cpu);
 
 	/*
 	 * Because new threads come out holding the cpu runqueue lock
@@ -693,12 +879,22 @@ thread_forkf(const char *name,
 	}
 
 	/* VM fields */
-	int result = as_copy(curthread->t_addrspace, &(newthread->t_addrspace));
-	// as_activate(newthread->t_addrspace);
-	if(result)
+	if(vforksem != NULL)
 	{
-		// kprintf("Address Space Copy Failed!\n");
-		return ENOMEM;
+		/* Set before the child can run, so it always wakes us. */
+		as_incref(curthread->t_addrspace);
+		newthread->t_addrspace = curthread->t_addrspace;
+		(*process)->p_vforksem = vforksem;
+	}
+	else
+	{
+		int result = as_copy(curthread->t_addrspace, &(newthread->t_addrspace));
+		// as_activate(newthread->t_addrspace);
+		if(result)
+		{
+			// kprintf("Address Space Copy Failed!\n");
+			return ENOMEM;
+		}
 	}
 
 	/* VFS fields */
@@ -726,6 +922,175 @@ thread_forkf(const char *name,
 	return 0;
 }
 
+/*
+ * Create a new thread based on an existing one.
+ * ===USED BY THE THREADFORK SYSTEM CALL===
+ *
+ * The new thread has name NAME, and starts executing in function
+ * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
+ *
+ * Unlike the others this makes no new process: the new thread joins
+ * the caller's, and so shares its file table, and it shares the
+ * caller's address space too. It inherits its current working
+ * directory from the caller. It will start on the same CPU as the
+ * caller, unless the scheduler intervenes first.
+ */
+int
+thread_forkt(const char *name,
+	    void (*entrypoint)(void *data1, unsigned long data2),
+	    void *data1, unsigned long data2,
+	    struct thread **ret)
+{
+	struct thread *newthread;
+
+	newthread = thread_create(name);
+	if (newthread == NULL) {
+		return ENOMEM;
+	}
+
+	/* Allocate a stack */
+	newthread->t_stack = kmalloc(STACK_SIZE);
+	if (newthread->t_stack == NULL) {
+		thread_destroy(newthread);
+		return ENOMEM;
+	}
+	thread_checkstack_init(newthread);
+
+	/*
+	 * Now we clone various fields from the parent thread.
+	 */
+
+	/* Thread subsystem fields */
+	newthread->t_affinity = curthread->t_affinity;
+	newthread->t_cpu = thread_pickcpu(newthread->t_affinity,
+					  curthread->t_cpu);
+
+	/*
+	 * Because new threads come out holding the cpu runqueue lock
+	 * (see notes at bottom of thread_switch), we need to account
+	 * for the spllower() that will be done releasing it.
+	 */
+	newthread->t_iplhigh_count++;
+
+	/* Set up the switchframe so entrypoint() gets called */
+	switchframe_init(newthread, entrypoint, data1, data2);
+
+	/* Join the current process */
+	process_addthread(curthread->t_pid);
+	newthread->t_pid = curthread->t_pid;
+
+	/* VM fields */
+	as_incref(curthread->t_addrspace);
+	newthread->t_addrspace = curthread->t_addrspace;
+
+	/* VFS fields */
+	if (curthread->t_cwd != NULL) {
+		VOP_INCREF(curthread->t_cwd);
+		newthread->t_cwd = curthread->t_cwd;
+	}
+
+	/* Lock the current cpu's run queue and make the new thread runnable */
+	thread_make_runnable(newthread, false);
+
+	/*
+	 * Return new thread structure if it's wanted. Note that using
+	 * the thread structure from the parent thread should be done
+	 * only with caution, because in general the child thread
+	 * might exit at any time.
+	 */
+	if (ret != NULL) {
+		*ret = newthread;
+	}
+
+	return 0;
+}
+
+/*
+ * Work stealing. Called by a cpu that has run out of things to run,
+ * with its own run queue unlocked. Pick the peer with the longest run
+ * queue and pull one thread that isn't cache-hot over to us.
+ *
+ * The queue lengths are read without locking; they're only a hint,
+ * and it means going idle costs one lock acquisition instead of one
+ * per cpu. Only one run queue is ever locked at a time.
+ *
+ * Returns true if a thread was put on our run queue.
+ */
+static
+bool
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct threadlistnode *tln;
+	struct thread *t;
+	unsigned i, numcpus, most;
+
+	victim = NULL;
+	most = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self || c->c_isidle) {
+			continue;
+		}
+		if (c->c_runqueue.tl_count > most) {
+			most = c->c_runqueue.tl_count;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return false;
+	}
+
+	/*
+	 * Take from the tail: with the feedback scheduler that's the
+	 * least interactive thread, which is the one that minds
+	 * moving least.
+	 */
+	t = NULL;
+	spinlock_acquire(&victim->c_runqueue_lock);
+	for (tln = victim->c_runqueue.tl_tail.tln_prev;
+	     tln->tln_prev != NULL;
+	     tln = tln->tln_prev) {
+		/*
+		 * The victim's curthread can be on its run queue if it
+		 * slept, the victim idled, and it got woken up again;
+		 * see thread_switch. It can't be migrated.
+		 */
+		if (tln->tln_self == victim->c_curthread) {
+			continue;
+		}
+		if (!thread_cpu_allowed(tln->tln_self, curcpu->c_self)) {
+			continue;
+		}
+		if (victim->c_hardclocks - tln->tln_self->t_lastran <
+		    STEAL_CACHEHOT_HARDCLOCKS &&
+		    thread_cpu_allowed(tln->tln_self, victim)) {
+			continue;
+		}
+		t = tln->tln_self;
+		threadlist_remove(&victim->c_runqueue, t);
+		victim->c_migrations++;
+		break;
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (t == NULL) {
+		return false;
+	}
+
+	DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+	      t->t_name, victim->c_number, curcpu->c_number);
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	t->t_cpu = curcpu->c_self;
+	thread_runqueue_insert(curcpu->c_self, t);
+	curcpu->c_steals++;
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	return true;
+}
+
 /*
  * High level, machine-independent context switch code.
  *
@@ -764,8 +1129,14 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
-	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	/*
+	 * Micro-optimization: if nothing to do, just return. Not if
+	 * we aren't allowed here any more, though, and not for the
+	 * idle thread, which yields in order to idle.
+	 */
+	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue) &&
+	    thread_cpu_allowed(cur, curcpu->c_self) &&
+	    cur != curcpu->c_idlethread) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -778,9 +1149,34 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		panic("Illegal S_RUN in thread_switch\n");
 		break;
 	    case S_READY:
-		thread_make_runnable(cur, true /*have lock*/);
+		/* A yield from the timer interrupt is a preemption. */
+		if (cur->t_in_interrupt) {
+			cur->t_usage.tu_nivcsw++;
+		}
+		else {
+			cur->t_usage.tu_nvcsw++;
+		}
+		if (cur == curcpu->c_idlethread) {
+			/* Never queued; see cpu_create. */
+		}
+		else if (!thread_cpu_allowed(cur, curcpu->c_self)) {
+			/* Moved once we're off its stack; see below. */
+			threadlist_addtail(&curcpu->c_leaving, cur);
+		}
+		else {
+			thread_make_runnable(cur, true /*have lock*/);
+		}
 		break;
 	    case S_SLEEP:
+		cur->t_usage.tu_nvcsw++;
+		cur->t_sleepcount++;
+#if !OPT_DEFAULTSCHEDULER
+		/* Threads that block are interactive; move them up. */
+		cur->t_quantum = 0;
+		if (cur->t_priority > 0 && !cur->t_background) {
+			cur->t_priority--;
+		}
+#endif
 		cur->t_wchan_name = wc->wc_name;
 		/*
 		 * Add the thread to the list in the wait channel, and
@@ -822,18 +1218,39 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	 * lock to look at it, this should not be visible or matter.
 	 */
 
+	/*
+	 * Threads this cpu may no longer run join c_leaving instead;
+	 * that includes one woken here while we idled on its stack.
+	 * If they are all there is, switch to the idle thread so
+	 * thread_sendaway can pass them on.
+	 */
+
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
 		next = threadlist_remhead(&curcpu->c_runqueue);
+		if (next != NULL && !thread_cpu_allowed(next, curcpu->c_self)) {
+			threadlist_addtail(&curcpu->c_leaving, next);
+			next = NULL;
+			continue;
+		}
+		if (next == NULL && !threadlist_isempty(&curcpu->c_leaving)) {
+			next = curcpu->c_idlethread;
+			break;
+		}
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (!thread_steal()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
 
+	/* If the tick was turned off while we idled, turn it back on. */
+	hardclock_resume();
+
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
 	 * curthread and it may not be, depending on how curthread and
@@ -844,6 +1261,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	curcpu->c_curthread = next;
 	curthread = next;
 
+	/* Remember when cur last had the cpu, for work stealing. */
+	cur->t_lastran = curcpu->c_hardclocks;
+
 	/* do the switch (in assembler in switch.S) */
 	switchframe_switch(&cur->t_context, &next->t_context);
 
@@ -909,6 +1329,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Clean up dead threads. */
 	exorcise();
 
+	/* Pass on threads that may not run here. */
+	thread_sendaway();
+
 	/* Turn interrupts back on. */
 	splx(spl);
 }
@@ -944,6 +1367,9 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 	/* Clean up dead threads. */
 	exorcise();
 
+	/* Pass on threads that may not run here. */
+	thread_sendaway();
+
 	/* Enable interrupts. */
 	spl0();
 
@@ -965,6 +1391,23 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 	thread_exit();
 }
 
+/*
+ * Body of a cpu's idle thread. It runs once thread_sendaway has
+ * emptied c_leaving, and idles in thread_switch until something is
+ * runnable here.
+ */
+static
+void
+thread_idle(void *unused, unsigned long unused2)
+{
+	(void)unused;
+	(void)unused2;
+
+	while (1) {
+		thread_yield();
+	}
+}
+
 /*
  * Cause the current thread to exit.
  *
@@ -1019,6 +1462,46 @@ thread_yield(void)
 	thread_switch(S_READY, NULL);
 }
 
+/*
+ * Set the current thread's affinity. If this cpu is no longer
+ * allowed, yield; thread_switch hands us to a cpu that is.
+ */
+int
+thread_setaffinity(uint32_t mask)
+{
+	unsigned numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	if (numcpus < 32 && (mask & ((1U << numcpus) - 1)) == 0) {
+		return EINVAL;
+	}
+
+	curthread->t_affinity = mask;
+	if (!thread_cpu_allowed(curthread, curcpu->c_self)) {
+		thread_yield();
+	}
+	return 0;
+}
+
+void
+thread_setbackground(void)
+{
+	curthread->t_background = true;
+	curthread->t_priority = SCHED_LEVELS - 1;
+	curthread->t_quantum = 0;
+}
+
+void
+tusage_add(struct tusage *dest, const struct tusage *src)
+{
+	dest->tu_uticks += src->tu_uticks;
+	dest->tu_sticks += src->tu_sticks;
+	dest->tu_nvcsw += src->tu_nvcsw;
+	dest->tu_nivcsw += src->tu_nivcsw;
+	dest->tu_minflt += src->tu_minflt;
+	dest->tu_majflt += src->tu_majflt;
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -1028,141 +1511,215 @@ thread_yield(void)
  * the current CPU's run queue by job priority.
  */
 
+/*
+ * Charge a hardclock to the current thread, as user or system time
+ * depending on where the interrupt came from.
+ */
+static
+void
+thread_charge_tick(struct thread *cur)
+{
+	cur->t_runticks++;
+	if (cur->t_inuser) {
+		cur->t_usage.tu_uticks++;
+	}
+	else {
+		cur->t_usage.tu_sticks++;
+	}
+}
+
 #if OPT_DEFAULTSCHEDULER
 void
 schedule(void)
 {
   // 28 Feb 2012 : GWA : Leave the default scheduler alone!
 }
+
+/*
+ * Round robin: yield on every tick. Affinity is enforced in
+ * thread_switch for both schedulers; a thread this cpu may not run is
+ * handed to another cpu there and never picked off our run queue.
+ */
+bool
+thread_tick(void)
+{
+	if (curcpu->c_isidle) {
+		return false;
+	}
+	thread_charge_tick(curthread);
+	return true;
+}
 #else
+/*
+ * Aging. Any thread that has sat on our run queue for
+ * SCHED_AGING_HARDCLOCKS is moved up a level and requeued, so CPU
+ * hogs that were demoted to the bottom still get to run eventually.
+ * Background threads are left at the bottom.
+ */
 void
 schedule(void)
 {
-  // 28 Feb 2012 : GWA : Implement your scheduler that prioritizes
-  // "interactive" threads here.
+	struct threadlist promoted;
+	struct threadlistnode *tln, *nexttln;
+	struct thread *t;
+	unsigned now;
+
+	threadlist_init(&promoted);
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	now = curcpu->c_hardclocks;
+	for (tln = curcpu->c_runqueue.tl_head.tln_next;
+	     tln->tln_next != NULL;
+	     tln = nexttln) {
+		nexttln = tln->tln_next;
+		t = tln->tln_self;
+		/*
+		 * t_readysince may come from another cpu's counter if
+		 * the thread was migrated; only trust it if it's in
+		 * the past.
+		 */
+		if (t->t_priority == 0 || t->t_background ||
+		    t->t_readysince > now ||
+		    now - t->t_readysince < SCHED_AGING_HARDCLOCKS) {
+			continue;
+		}
+		threadlist_remove(&curcpu->c_runqueue, t);
+		t->t_priority--;
+		t->t_quantum = 0;
+		threadlist_addtail(&promoted, t);
+	}
+	while ((t = threadlist_remhead(&promoted)) != NULL) {
+		thread_runqueue_insert(curcpu->c_self, t);
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	threadlist_cleanup(&promoted);
+}
+
+/*
+ * Charge the current thread for a hardclock. A thread that burns its
+ * whole quantum drops a level; either way it is preempted if the head
+ * of the run queue is at a better level than it is.
+ */
+bool
+thread_tick(void)
+{
+	struct thread *cur = curthread;
+	struct thread *next;
+	bool preempt;
+
+	if (curcpu->c_isidle) {
+		return false;
+	}
+
+	thread_charge_tick(cur);
+	if (!thread_cpu_allowed(cur, curcpu->c_self)) {
+		/* Affinity changed; yield to be handed to another cpu. */
+		return true;
+	}
+	cur->t_quantum++;
+	if (cur->t_quantum >= SCHED_QUANTUM(cur->t_priority)) {
+		cur->t_quantum = 0;
+		if (cur->t_priority < SCHED_LEVELS - 1) {
+			cur->t_priority++;
+		}
+		return true;
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	next = curcpu->c_runqueue.tl_head.tln_next->tln_self;
+	preempt = next != NULL && next->t_priority < cur->t_priority;
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	return preempt;
 }
 #endif
 
 /*
  * Thread migration.
  *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
+ * This is also called periodically from hardclock(). Load balancing
+ * is pull-based: idle cpus steal work for themselves in
+ * thread_switch. All we do here is notice that we have threads
+ * waiting while some other cpu is idle, and poke that cpu so it comes
+ * out of cpu_idle and steals from us.
  *
  * Migrating threads isn't free because of cache affinity; a thread's
  * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
+ * which is fairly slow. thread_steal leaves recently-run threads
+ * alone for that reason.
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * Like thread_steal, this reads the other cpus' state without
+ * locking it. A stale answer just means an extra or missed IPI.
  */
 void
 thread_consider_migration(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
 	unsigned i, numcpus;
 	struct cpu *c;
-	struct threadlist victims;
+	struct threadlist moving;
+	struct threadlistnode *tln, *nexttln;
 	struct thread *t;
 
-	my_count = total_count = 0;
-	numcpus = cpuarray_num(&allcpus);
-	for (i=0; i<numcpus; i++) {
-		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
-		}
-		spinlock_release(&c->c_runqueue_lock);
-	}
-
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
+	if (threadlist_isempty(&curcpu->c_runqueue)) {
 		return;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
+	/*
+	 * Threads whose affinity excludes this cpu are pushed to one
+	 * they may run on. thread_make_runnable picks it.
+	 */
+	threadlist_init(&moving);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	for (tln = curcpu->c_runqueue.tl_head.tln_next;
+	     tln->tln_next != NULL;
+	     tln = nexttln) {
+		nexttln = tln->tln_next;
+		t = tln->tln_self;
+		if (t == curcpu->c_curthread ||
+		    thread_cpu_allowed(t, curcpu->c_self)) {
+			continue;
+		}
+		threadlist_remove(&curcpu->c_runqueue, t);
+		curcpu->c_migrations++;
+		threadlist_addtail(&moving, t);
 	}
 	spinlock_release(&curcpu->c_runqueue_lock);
+	while ((t = threadlist_remhead(&moving)) != NULL) {
+		thread_make_runnable(t, false);
+	}
+	threadlist_cleanup(&moving);
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
-		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
-
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
+		if (c != curcpu->c_self && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
+}
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
-		}
-		spinlock_release(&curcpu->c_runqueue_lock);
-	}
+/*
+ * Print the load balancing counters for each cpu.
+ */
+void
+thread_printstats(void)
+{
+	unsigned i, numcpus;
+	struct cpu *c;
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_runqueue_lock);
+		kprintf("cpu%u: %u queued, %u steals, %u migrations, "
+			"%u/%u ticks skipped idle\n",
+			c->c_number, c->c_runqueue.tl_count,
+			c->c_steals, c->c_migrations,
+			c->c_skippedticks, c->c_hardclocks);
+		spinlock_release(&c->c_runqueue_lock);
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -1236,6 +1793,92 @@ wchan_sleep(struct wchan *wc)
 	thread_switch(S_SLEEP, wc);
 }
 
+/*
+ * State shared between wchan_sleep_timeout and its timeout handler.
+ */
+struct wchan_timer {
+	struct wchan *wt_wc;		/* channel slept on */
+	struct thread *wt_thread;	/* thread sleeping */
+	bool wt_expired;		/* set if the timeout woke it */
+};
+
+/*
+ * Take thread T off WC, which must be locked, if it is there. Returns
+ * false if it isn't (somebody else already woke it).
+ */
+static
+bool
+wchan_remove(struct wchan *wc, struct thread *t)
+{
+	struct threadlistnode *tln;
+
+	KASSERT(spinlock_do_i_hold(&wc->wc_lock));
+	for (tln = wc->wc_threads.tl_head.tln_next;
+	     tln->tln_next != NULL;
+	     tln = tln->tln_next) {
+		if (tln->tln_self == t) {
+			threadlist_remove(&wc->wc_threads, t);
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Timeout handler for wchan_sleep_timeout. If the thread is still on
+ * the channel, nobody has woken it, so take it off and wake it here.
+ * Removing it under the channel lock means exactly one of this and
+ * wchan_wake* gets to make it runnable.
+ */
+static
+void
+wchan_timeout(void *data)
+{
+	struct wchan_timer *wt = data;
+	struct wchan *wc = wt->wt_wc;
+	bool found;
+
+	spinlock_acquire(&wc->wc_lock);
+	found = wchan_remove(wc, wt->wt_thread);
+	if (found) {
+		wt->wt_expired = true;
+	}
+	spinlock_release(&wc->wc_lock);
+
+	if (found) {
+		thread_make_runnable(wt->wt_thread, false);
+	}
+}
+
+/*
+ * Like wchan_sleep, but give up after NSECS nanoseconds. Returns true
+ * if the thread was woken by the timeout rather than by a wakeup.
+ *
+ * The timeout is armed while the channel is still locked, which also
+ * keeps interrupts off on this cpu, so it cannot fire before the
+ * thread is on the channel's list.
+ */
+bool
+wchan_sleep_timeout(struct wchan *wc, uint64_t nsecs)
+{
+	struct wchan_timer wt;
+	struct timeout to;
+
+	/* may not sleep in an interrupt handler */
+	KASSERT(!curthread->t_in_interrupt);
+
+	wt.wt_wc = wc;
+	wt.wt_thread = curthread;
+	wt.wt_expired = false;
+	timeout_init(&to, wchan_timeout, &wt);
+	timeout_add(&to, nsecs);
+
+	thread_switch(S_SLEEP, wc);
+
+	timeout_del(&to);
+	return wt.wt_expired;
+}
+
 /*
  * Wake up one thread sleeping on a wait channel.
  */
@@ -1298,6 +1941,22 @@ wchan_wakeall(struct wchan *wc)
 	threadlist_cleanup(&list);
 }
 
+/*
+ * Wake up thread T if it is sleeping on WC. Unlike the others, this is
+ * called with the channel locked, so the caller can decide who to wake
+ * and wake them without anyone else getting in between. Returns false
+ * if T wasn't there (its sleep timed out, say).
+ */
+bool
+wchan_wakethread(struct wchan *wc, struct thread *t)
+{
+	if (!wchan_remove(wc, t)) {
+		return false;
+	}
+	thread_make_runnable(t, false);
+	return true;
+}
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
@@ -1370,49 +2029,152 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
-/* Given tlbshootdown information, shoot down an entry in all the CPU's as a broadcast. */
+/*
+ * Wait until every cpu in SENT (a bit per index in allcpus) has done
+ * the shootdown we sent it. Between looks we let interrupts in, so a
+ * cpu that is waiting on us in here gets its own shootdown done.
+ */
+static
 void
-ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping)
+ipi_tlbshootdown_wait(uint32_t sent)
 {
-	//int n;
 	unsigned i;
 	struct cpu *c;
-	(void)mapping;
 
-	int spl = splhigh();
-
-	// Loop to cover all CPU's (the broadcast part)
 	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		if ((sent & ((uint32_t)1 << i)) == 0) {
+			continue;
+		}
 		c = cpuarray_get(&allcpus, i);
-		if (c != curcpu->c_self) {
-			// Specific shoot down (the tlbshootdown part)
-			//int spl = splx
-			//spinlock_acquire(&c->c_ipi_lock);
+		spinlock_acquire(&c->c_ipi_lock);
+		while (c->c_ipi_pending & ((uint32_t)1 << IPI_TLBSHOOTDOWN)) {
+			spinlock_release(&c->c_ipi_lock);
+			spinlock_acquire(&c->c_ipi_lock);
+		}
+		spinlock_release(&c->c_ipi_lock);
+	}
+}
 
-			//n = c->c_numshootdown;
-			//if (n == TLBSHOOTDOWN_MAX) {
-				c->c_numshootdown = TLBSHOOTDOWN_ALL;
-			//}
-			//else {
-			//	c->c_shootdown[n] = *mapping;
-			//	c->c_numshootdown = n+1;
-			//}
+/*
+ * Shoot down the N MAPPINGS on every other cpu that might hold any of
+ * them: one whose c_curas is the mapping's address space (any cpu, for
+ * a NULL one). Each such cpu gets all of its mappings queued and one
+ * IPI; if its queue overflows it flushes everything instead. Other cpus
+ * aren't bothered at all.
+ *
+ * If we can take interrupts, wait until they're done; the caller
+ * is about to reuse the pages. With interrupts off we can't (two cpus
+ * doing this to each other would spin forever), so the mappings may
+ * live on a little longer; callers that are about to reuse the pages
+ * must check ipi_tlbshootdown_needed first.
+ */
+void
+ipi_tlbshootdown_batch(const struct tlbshootdown *mappings, unsigned n)
+{
+	unsigned i, j, numcpus;
+	uint32_t sent;
+	struct cpu *c;
+	bool queued;
 
+	sent = 0;
+	numcpus = cpuarray_num(&allcpus);
+	KASSERT(numcpus <= 32);
+	for (i=0; i < numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		queued = false;
+		spinlock_acquire(&c->c_ipi_lock);
+		for (j=0; j<n; j++) {
+			if (mappings[j].ts_addrspace != NULL &&
+			    mappings[j].ts_addrspace != c->c_curas) {
+				continue;
+			}
+			queued = true;
+			if (c->c_numshootdown == TLBSHOOTDOWN_ALL) {
+				break;
+			}
+			if (c->c_numshootdown == TLBSHOOTDOWN_MAX) {
+				c->c_numshootdown = TLBSHOOTDOWN_ALL;
+				break;
+			}
+			c->c_shootdown[c->c_numshootdown++] = mappings[j];
+		}
+		if (queued) {
 			c->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 			mainbus_send_ipi(c);
+			sent |= (uint32_t)1 << i;
+		}
+		spinlock_release(&c->c_ipi_lock);
+	}
+
+	if (curthread->t_curspl == 0) {
+		ipi_tlbshootdown_wait(sent);
+	}
+}
 
-			//spinlock_release(&c->c_ipi_lock);
+/*
+ * Flush the whole TLB of every other cpu running AS (or every other
+ * cpu at all, if AS is NULL), and wait until they all have; the caller is about to free pages of AS or take away
+ * permissions, and nobody may go on using the old mappings.
+ */
+void
+ipi_tlbshootdown_addrspace(struct addrspace *as)
+{
+	unsigned i, numcpus;
+	uint32_t sent;
+	struct cpu *c;
+
+	KASSERT(curthread->t_curspl == 0);
+
+	sent = 0;
+	numcpus = cpuarray_num(&allcpus);
+	KASSERT(numcpus <= 32);
+	for (i=0; i < numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self || (as != NULL && c->c_curas != as)) {
+			continue;
 		}
+		spinlock_acquire(&c->c_ipi_lock);
+		c->c_numshootdown = TLBSHOOTDOWN_ALL;
+		c->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+		mainbus_send_ipi(c);
+		spinlock_release(&c->c_ipi_lock);
+		sent |= (uint32_t)1 << i;
 	}
-	splx(spl);
+
+	ipi_tlbshootdown_wait(sent);
 }
 
+/*
+ * Might another cpu have mappings of AS (of anything, if AS is NULL) in
+ * its TLB? A cpu flushes when it switches address spaces, so only one
+ * running AS can, and it can't load new ones while the caller holds
+ * AS's lock. Without interrupts ipi_tlbshootdown_batch can't wait, so
+ * its callers use this to leave alone pages it couldn't flush in time.
+ */
+bool
+ipi_tlbshootdown_needed(struct addrspace *as)
+{
+	unsigned i, numcpus;
+	struct cpu *c;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i < numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self || (as != NULL && c->c_curas != as)) {
+			continue;
+		}
+		return true;
+	}
+	return false;
+}
 
 void
 interprocessor_interrupt(void)
 {
 	uint32_t bits;
-	int i;
 
 	spinlock_acquire(&curcpu->c_ipi_lock);
 	bits = curcpu->c_ipi_pending;
@@ -1443,9 +2205,8 @@ interprocessor_interrupt(void)
 			vm_tlbshootdown_all();
 		}
 		else {
-			for (i=0; i<curcpu->c_numshootdown; i++) {
-				vm_tlbshootdown(&curcpu->c_shootdown[i]);
-			}
+			vm_tlbshootdown(curcpu->c_shootdown,
+					curcpu->c_numshootdown);
 		}
 		curcpu->c_numshootdown = 0;
 	}
@@ -241,15 +241,14 @@ null_fsync(struct vnode *v)
 }
 
 /*
- * For mmap. If you want this to do anything, you have to write it
- * yourself. Some devices may not make sense to map. Others do.
+ * For mmap. None of our devices make sense to map.
  */
 static
 int
 dev_mmap(struct vnode *v  /* add stuff as needed */)
 {
 	(void)v;
-	return EUNIMP;
+	return ENODEV;
 }
 
 /*
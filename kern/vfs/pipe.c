@@ -0,0 +1,615 @@
+/*
+ * Pipes.
+ *
+ * A pipe is a page-sized ring buffer with a vnode for each end, so
+ * that file handles, fork, dup2, and close work on it the same way
+ * they do on files. The ring is single-producer single-consumer:
+ * pp_rdlock and pp_wrlock let one reader and one writer in at a time,
+ * and each copies into or out of its own part of the buffer with only
+ * pp_lock (a spinlock) covering the indexes. That also means closing
+ * an end never has to wait for a blocked reader or writer.
+ *
+ * Large writes skip the ring when a reader is already waiting: the
+ * writer copies straight from its own address space into the reader's
+ * buffer, one resident page at a time.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <limits.h>
+#include <stat.h>
+#include <lib.h>
+#include <uio.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <wchan.h>
+#include <vnode.h>
+#include <vm.h>
+#include <pipe.h>
+
+/* Size of the ring buffer */
+#define PIPE_SIZE PAGE_SIZE
+
+struct pipe {
+	struct spinlock pp_lock;	/* covers everything but the data */
+	struct lock *pp_rdlock;		/* one reader at a time */
+	struct lock *pp_wrlock;		/* one writer at a time */
+	struct wchan *pp_rdchan;	/* readers waiting for data */
+	struct wchan *pp_wrchan;	/* writers waiting for room */
+
+	char *pp_buf;
+	size_t pp_head;			/* first unread byte */
+	size_t pp_count;		/* bytes in the buffer */
+
+	bool pp_rdopen;			/* read end still open */
+	bool pp_wropen;			/* write end still open */
+	int pp_nvnodes;			/* ends not reclaimed yet */
+
+	struct uio *pp_rduio;		/* waiting reader, for direct copies */
+	bool pp_direct;			/* a writer is filling pp_rduio */
+
+	struct vnode pp_rdvn;
+	struct vnode pp_wrvn;
+};
+
+static const struct vnode_ops pipe_vnode_ops;
+
+static
+void
+pipe_destroy(struct pipe *pp)
+{
+	spinlock_cleanup(&pp->pp_lock);
+	lock_destroy(pp->pp_rdlock);
+	lock_destroy(pp->pp_wrlock);
+	wchan_destroy(pp->pp_rdchan);
+	wchan_destroy(pp->pp_wrchan);
+	kfree(pp->pp_buf);
+	kfree(pp);
+}
+
+/*
+ * Make a pipe. Each end comes back open, as if from vfs_open.
+ */
+int
+pipe_create(struct vnode **readend, struct vnode **writeend)
+{
+	struct pipe *pp;
+
+	pp = kmalloc(sizeof(struct pipe));
+	if (pp == NULL) {
+		return ENOMEM;
+	}
+	pp->pp_buf = kmalloc(PIPE_SIZE);
+	pp->pp_rdlock = lock_create("pipe read");
+	pp->pp_wrlock = lock_create("pipe write");
+	pp->pp_rdchan = wchan_create("pipe read");
+	pp->pp_wrchan = wchan_create("pipe write");
+	if (pp->pp_buf == NULL || pp->pp_rdlock == NULL ||
+	    pp->pp_wrlock == NULL || pp->pp_rdchan == NULL ||
+	    pp->pp_wrchan == NULL) {
+		if (pp->pp_buf != NULL) {
+			kfree(pp->pp_buf);
+		}
+		if (pp->pp_rdlock != NULL) {
+			lock_destroy(pp->pp_rdlock);
+		}
+		if (pp->pp_wrlock != NULL) {
+			lock_destroy(pp->pp_wrlock);
+		}
+		if (pp->pp_rdchan != NULL) {
+			wchan_destroy(pp->pp_rdchan);
+		}
+		if (pp->pp_wrchan != NULL) {
+			wchan_destroy(pp->pp_wrchan);
+		}
+		kfree(pp);
+		return ENOMEM;
+	}
+	spinlock_init(&pp->pp_lock);
+
+	pp->pp_head = 0;
+	pp->pp_count = 0;
+	pp->pp_rdopen = true;
+	pp->pp_wropen = true;
+	pp->pp_nvnodes = 2;
+	pp->pp_rduio = NULL;
+	pp->pp_direct = false;
+
+	VOP_INIT(&pp->pp_rdvn, &pipe_vnode_ops, NULL, pp);
+	VOP_INIT(&pp->pp_wrvn, &pipe_vnode_ops, NULL, pp);
+	VOP_INCOPEN(&pp->pp_rdvn);
+	VOP_INCOPEN(&pp->pp_wrvn);
+
+	*readend = &pp->pp_rdvn;
+	*writeend = &pp->pp_wrvn;
+	return 0;
+}
+
+bool
+pipe_isvnode(struct vnode *vn)
+{
+	return vn->vn_ops == &pipe_vnode_ops;
+}
+
+/*
+ * Sleep on WC. Called with pp_lock held, and returns with it held.
+ */
+static
+void
+pipe_sleep(struct pipe *pp, struct wchan *wc)
+{
+	wchan_lock(wc);
+	spinlock_release(&pp->pp_lock);
+	wchan_sleep(wc);
+	spinlock_acquire(&pp->pp_lock);
+}
+
+/*
+ * Copy from the writer's uio WU straight into the waiting reader's
+ * uio RU, as far as the reader's pages are in memory. RU's buffers are
+ * in the reader's address space, so we go through the physical pages
+ * rather than copyout. Whatever doesn't get copied goes through the
+ * ring as usual.
+ */
+static
+int
+pipe_direct(struct uio *ru, struct uio *wu)
+{
+	struct iovec *iov;
+	vaddr_t va, kva;
+	size_t n;
+	int result;
+
+	KASSERT(ru->uio_segflg == UIO_USERSPACE);
+
+	while (ru->uio_resid > 0 && wu->uio_resid > 0) {
+		KASSERT(ru->uio_iovcnt > 0);
+		iov = ru->uio_iov;
+		if (iov->iov_len == 0) {
+			ru->uio_iov++;
+			ru->uio_iovcnt--;
+			continue;
+		}
+
+		va = (vaddr_t)iov->iov_ubase;
+		n = PAGE_SIZE - (va & SUB_FRAME);
+		if (n > iov->iov_len) {
+			n = iov->iov_len;
+		}
+		if (n > wu->uio_resid) {
+			n = wu->uio_resid;
+		}
+
+		kva = page_pin_user(ru->uio_space, va, true);
+		if (kva == 0) {
+			break;
+		}
+		result = uiomove((void *)kva, n, wu);
+		page_unpin_user(kva);
+		if (result) {
+			return result;
+		}
+
+		iov->iov_ubase += n;
+		iov->iov_len -= n;
+		ru->uio_resid -= n;
+		ru->uio_offset += n;
+	}
+	return 0;
+}
+
+static
+int
+pipe_read(struct vnode *vn, struct uio *uio)
+{
+	struct pipe *pp = vn->vn_data;
+	size_t want = uio->uio_resid;
+	size_t head, n;
+	int result = 0;
+
+	if (vn != &pp->pp_rdvn) {
+		return EBADF;
+	}
+	if (want == 0) {
+		return 0;
+	}
+
+	lock_acquire(pp->pp_rdlock);
+	spinlock_acquire(&pp->pp_lock);
+
+	/*
+	 * Wait for data or for the write end to close. While we wait, a
+	 * large writer may copy directly into our buffer; we're done
+	 * once it has.
+	 */
+	while (pp->pp_direct ||
+	       (pp->pp_count == 0 && pp->pp_wropen && uio->uio_resid == want)) {
+		if (pp->pp_rduio == NULL && !pp->pp_direct &&
+		    uio->uio_segflg == UIO_USERSPACE) {
+			pp->pp_rduio = uio;
+		}
+		pipe_sleep(pp, pp->pp_rdchan);
+	}
+	if (pp->pp_rduio == uio) {
+		pp->pp_rduio = NULL;
+	}
+
+	/* Take what's in the ring (in two pieces if it wraps). */
+	while (uio->uio_resid > 0 && pp->pp_count > 0) {
+		head = pp->pp_head;
+		n = pp->pp_count;
+		if (n > PIPE_SIZE - head) {
+			n = PIPE_SIZE - head;
+		}
+		if (n > uio->uio_resid) {
+			n = uio->uio_resid;
+		}
+
+		/* The writer never touches bytes we haven't consumed. */
+		spinlock_release(&pp->pp_lock);
+		result = uiomove(pp->pp_buf + head, n, uio);
+		spinlock_acquire(&pp->pp_lock);
+		if (result) {
+			break;
+		}
+
+		pp->pp_head = (head + n) % PIPE_SIZE;
+		pp->pp_count -= n;
+		wchan_wakeall(pp->pp_wrchan);
+	}
+
+	spinlock_release(&pp->pp_lock);
+	lock_release(pp->pp_rdlock);
+	return result;
+}
+
+static
+int
+pipe_write(struct vnode *vn, struct uio *uio)
+{
+	struct pipe *pp = vn->vn_data;
+	size_t want = uio->uio_resid;
+	size_t tail, room, n;
+	bool try_direct = true;
+	struct uio *ru;
+	int result = 0;
+
+	if (vn != &pp->pp_wrvn) {
+		return EBADF;
+	}
+
+	lock_acquire(pp->pp_wrlock);
+	spinlock_acquire(&pp->pp_lock);
+
+	while (uio->uio_resid > 0) {
+		if (!pp->pp_rdopen) {
+			result = EPIPE;
+			break;
+		}
+
+		/*
+		 * A reader is waiting and nothing is queued ahead of us:
+		 * hand a large write straight over.
+		 */
+		ru = pp->pp_rduio;
+		if (try_direct && ru != NULL && pp->pp_count == 0 &&
+		    uio->uio_resid > PIPE_BUF) {
+			pp->pp_rduio = NULL;
+			pp->pp_direct = true;
+			spinlock_release(&pp->pp_lock);
+
+			n = uio->uio_resid;
+			result = pipe_direct(ru, uio);
+
+			spinlock_acquire(&pp->pp_lock);
+			pp->pp_direct = false;
+			wchan_wakeall(pp->pp_rdchan);
+			if (result) {
+				break;
+			}
+			/* Reader's buffer isn't in memory; don't keep trying. */
+			if (uio->uio_resid == n) {
+				try_direct = false;
+			}
+			continue;
+		}
+
+		/* Writes of up to PIPE_BUF bytes go in all at once. */
+		room = PIPE_SIZE - pp->pp_count;
+		if (room == 0 || (uio->uio_resid <= PIPE_BUF && room < uio->uio_resid)) {
+			pipe_sleep(pp, pp->pp_wrchan);
+			continue;
+		}
+
+		tail = (pp->pp_head + pp->pp_count) % PIPE_SIZE;
+		n = room;
+		if (n > PIPE_SIZE - tail) {
+			n = PIPE_SIZE - tail;
+		}
+		if (n > uio->uio_resid) {
+			n = uio->uio_resid;
+		}
+
+		/* The reader never looks past pp_count. */
+		spinlock_release(&pp->pp_lock);
+		result = uiomove(pp->pp_buf + tail, n, uio);
+		spinlock_acquire(&pp->pp_lock);
+		if (result) {
+			break;
+		}
+
+		pp->pp_count += n;
+		wchan_wakeall(pp->pp_rdchan);
+	}
+
+	spinlock_release(&pp->pp_lock);
+	lock_release(pp->pp_wrlock);
+
+	/* A short write is not an error. */
+	if (result == EPIPE && uio->uio_resid < want) {
+		result = 0;
+	}
+	return result;
+}
+
+/*
+ * Last close of one end: wake up anyone on the other end, who will now
+ * see EOF (readers) or EPIPE (writers).
+ */
+static
+int
+pipe_close(struct vnode *vn)
+{
+	struct pipe *pp = vn->vn_data;
+
+	spinlock_acquire(&pp->pp_lock);
+	if (vn == &pp->pp_rdvn) {
+		pp->pp_rdopen = false;
+		wchan_wakeall(pp->pp_wrchan);
+	}
+	else {
+		pp->pp_wropen = false;
+		wchan_wakeall(pp->pp_rdchan);
+	}
+	spinlock_release(&pp->pp_lock);
+	return 0;
+}
+
+/*
+ * Last reference to one end gone. The pipe goes away with the second.
+ */
+static
+int
+pipe_reclaim(struct vnode *vn)
+{
+	struct pipe *pp = vn->vn_data;
+	bool last;
+
+	spinlock_acquire(&pp->pp_lock);
+	last = (--pp->pp_nvnodes == 0);
+	spinlock_release(&pp->pp_lock);
+
+	VOP_CLEANUP(vn);
+	if (last) {
+		pipe_destroy(pp);
+	}
+	return 0;
+}
+
+static
+int
+pipe_open(struct vnode *vn, int openflags)
+{
+	(void)vn;
+	(void)openflags;
+	return 0;
+}
+
+static
+int
+pipe_stat(struct vnode *vn, struct stat *statbuf)
+{
+	struct pipe *pp = vn->vn_data;
+
+	bzero(statbuf, sizeof(struct stat));
+	spinlock_acquire(&pp->pp_lock);
+	statbuf->st_size = pp->pp_count;
+	spinlock_release(&pp->pp_lock);
+	statbuf->st_mode = S_IFIFO;
+	statbuf->st_nlink = 1;
+	statbuf->st_blksize = PIPE_SIZE;
+	return 0;
+}
+
+static
+int
+pipe_gettype(struct vnode *vn, mode_t *ret)
+{
+	(void)vn;
+	*ret = S_IFIFO;
+	return 0;
+}
+
+static
+int
+pipe_tryseek(struct vnode *vn, off_t pos)
+{
+	(void)vn;
+	(void)pos;
+	return ESPIPE;
+}
+
+static
+int
+pipe_mmap(struct vnode *vn)
+{
+	(void)vn;
+	return ENODEV;
+}
+
+/*
+ * Operations that make no sense on a pipe.
+ */
+
+static
+int
+pipe_einval(struct vnode *vn)
+{
+	(void)vn;
+	return EINVAL;
+}
+
+static
+int
+pipe_uio_einval(struct vnode *vn, struct uio *uio)
+{
+	(void)vn;
+	(void)uio;
+	return EINVAL;
+}
+
+static
+int
+pipe_uio_enotdir(struct vnode *vn, struct uio *uio)
+{
+	(void)vn;
+	(void)uio;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_ioctl(struct vnode *vn, int op, userptr_t data)
+{
+	(void)vn;
+	(void)op;
+	(void)data;
+	return EINVAL;
+}
+
+static
+int
+pipe_truncate(struct vnode *vn, off_t len)
+{
+	(void)vn;
+	(void)len;
+	return EINVAL;
+}
+
+static
+int
+pipe_creat(struct vnode *vn, const char *name, bool excl, mode_t mode,
+	   struct vnode **result)
+{
+	(void)vn;
+	(void)name;
+	(void)excl;
+	(void)mode;
+	(void)result;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_symlink(struct vnode *vn, const char *contents, const char *name)
+{
+	(void)vn;
+	(void)contents;
+	(void)name;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_mkdir(struct vnode *vn, const char *name, mode_t mode)
+{
+	(void)vn;
+	(void)name;
+	(void)mode;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_link(struct vnode *vn, const char *name, struct vnode *file)
+{
+	(void)vn;
+	(void)name;
+	(void)file;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_nameop(struct vnode *vn, const char *name)
+{
+	(void)vn;
+	(void)name;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_rename(struct vnode *vn, const char *n1, struct vnode *vn2,
+	    const char *n2)
+{
+	(void)vn;
+	(void)n1;
+	(void)vn2;
+	(void)n2;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_lookup(struct vnode *dir, char *pathname, struct vnode **result)
+{
+	(void)dir;
+	(void)pathname;
+	(void)result;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_lookparent(struct vnode *dir, char *pathname, struct vnode **result,
+		char *namebuf, size_t buflen)
+{
+	(void)dir;
+	(void)pathname;
+	(void)result;
+	(void)namebuf;
+	(void)buflen;
+	return ENOTDIR;
+}
+
+static const struct vnode_ops pipe_vnode_ops = {
+	VOP_MAGIC,
+
+	pipe_open,
+	pipe_close,
+	pipe_reclaim,
+
+	pipe_read,
+	pipe_uio_einval,	/* readlink */
+	pipe_uio_enotdir,	/* getdirentry */
+	pipe_write,
+	pipe_ioctl,
+	pipe_stat,
+	pipe_gettype,
+	pipe_tryseek,
+	pipe_einval,		/* fsync */
+	pipe_mmap,
+	pipe_truncate,
+	pipe_uio_enotdir,	/* namefile */
+
+	pipe_creat,
+	pipe_symlink,
+	pipe_mkdir,
+	pipe_link,
+	pipe_nameop,		/* remove */
+	pipe_nameop,		/* rmdir */
+	pipe_rename,
+
+	pipe_lookup,
+	pipe_lookparent,
+};
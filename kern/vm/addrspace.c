@@ -34,8 +34,20 @@
 #include <vm.h>
 #include <mips/tlb.h>
 #include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <synch.h>
 #include <elf.h>
 #include <swapspace.h>
+#include <shm.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <kern/iovec.h>
+#include <kern/mman.h>
+#include <kern/stat.h>
+
+static void region_destroy(struct vm_region *vr);
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -58,6 +70,13 @@ as_create(void)
 	if (as == NULL) {
 		return NULL;
 	}
+	as->as_lock = lock_create("addrspace");
+	if (as->as_lock == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	//The thread we're being made for.
+	as->as_refcount = 1;
 	as->static_start = 0x0;
 
 
@@ -65,6 +84,20 @@ as_create(void)
 	as->use_permissions = true;
 	//load_elf will just be starting when we call as_create...
 	as->loadelf_done = false;
+	//No mmap'd regions yet
+	as->regions = NULL;
+	//No faults yet, so no pattern to go on
+	as->as_lastfault = 0x0;
+	as->as_faultwindow = 0;
+	as->as_faultdir = 0;
+	//Nothing resident, and not swapped out
+	as->as_rss = 0;
+	as->as_wss = 0;
+	as->as_pageins = 0;
+	as->as_lastpageins = 0;
+	as->as_deactivated = false;
+	as->as_outsince = 0;
+	vm_loadctl_add(as);
 
 	return as;
 }
@@ -85,6 +118,47 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		return ENOMEM;
 	}
 
+	//Other threads in the old address space must not change it under us,
+	//and the pager must keep off the new one until it's complete.
+	lock_acquire(old->as_lock);
+	lock_acquire(newas->as_lock);
+
+	//Copy the mmap'd regions; the child gets its own reference to each file.
+	struct vm_region *vr, **tailp = &newas->regions;
+	for(vr = old->regions; vr != NULL; vr = vr->vr_next)
+	{
+		struct vm_region *newvr = kmalloc(sizeof(struct vm_region));
+		if(newvr == NULL)
+		{
+			*tailp = NULL;
+			while((vr = newas->regions) != NULL)
+			{
+				newas->regions = vr->vr_next;
+				region_destroy(vr);
+			}
+			lock_release(newas->as_lock);
+			lock_release(old->as_lock);
+			vm_loadctl_remove(newas);
+			lock_destroy(newas->as_lock);
+			kfree(newas);
+			return ENOMEM;
+		}
+		*newvr = *vr;
+		if(newvr->vr_vnode != NULL)
+		{
+			VOP_INCOPEN(newvr->vr_vnode);
+			VOP_INCREF(newvr->vr_vnode);
+		}
+		//Shared memory stays shared: the child attaches it too.
+		if(newvr->vr_shm != NULL)
+		{
+			shm_incref(newvr->vr_shm);
+		}
+		*tailp = newvr;
+		tailp = &newvr->vr_next;
+	}
+	*tailp = NULL;
+
 	lock = get_coremap_lock();
 	//Go through entries in page directory.
 	for(size_t i = 0;i<PAGE_DIR_ENTRIES;i++)
@@ -102,24 +176,42 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 			for(size_t pti = 0; pti< PAGE_TABLE_ENTRIES;pti++)
 			{
 				int* pt_entry = &(oldpt->table[pti]);
+				//Entry with permissions but no page (not touched yet, or
+				//a dropped file page): nothing to copy.
+				if(PTE_TO_PFN(*pt_entry) == 0 && PTE_TO_LOCATION(*pt_entry) == PTE_PM)
+				{
+					newpt->table[pti] = *pt_entry;
+				}
+				//Program text: the child uses the same page.
+				else if(page_share(newas, PD_INDEX_TO_VA(i) | PT_INDEX_TO_VA(pti), *pt_entry))
+				{
+					continue;
+				}
 				//Page Table Entry exists
-				if(*pt_entry != 0x0)
+				else if(*pt_entry != 0x0)
 				{
 					bool lock = get_coremap_lock();
 					int spl = splhigh();
 					struct page *oldpage = get_page(i,pti,oldpt);
+					//The pager may have dropped a file page while we waited.
+					if(PTE_TO_PFN(*pt_entry) == 0)
+					{
+						splx(spl);
+						release_coremap_lock(lock);
+						newpt->table[pti] = *pt_entry;
+						continue;
+					}
 					oldpage->state = LOCKED;
 					splx(spl);
 					release_coremap_lock(lock);
 					//Get page permissions
 					int permissions = PTE_TO_PERMISSIONS(*pt_entry);
 					//Locate the old page (swap if in, if needed)
-					//Allocate a new page
+					//Allocate a new page; it inherits the modified bit
+					newpt->table[pti] = *pt_entry & PTE_MODIFIED;
 					struct page *newpage = page_alloc(newas,oldpage->va,permissions);
-					vaddr_t new_page_va = PADDR_TO_KVADDR(newpage->pa);
-					vaddr_t old_page_va = PADDR_TO_KVADDR(oldpage->pa);
 					//Copy the data:
-					memcpy((void*) new_page_va, (void*) old_page_va,PAGE_SIZE);
+					page_copy(newpage->pa, oldpage->pa);
 					spl=splhigh();
 					oldpage->state = DIRTY;
 					newpage->state = DIRTY;
@@ -138,20 +230,50 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		}
 	}
 	release_coremap_lock(lock);
+	lock_release(newas->as_lock);
+	lock_release(old->as_lock);
 	
 	*ret = newas;
 	return 0;
 }
 
-/* Destroy a process's address space. We need to walk the page
- * table, free any pages, and then free the appropriate data structures 
- * used by the VM system (the page directory, page tables, addrsapce struct).
+/* Another thread is going to share AS. */
+void
+as_incref(struct addrspace *as)
+{
+	lock_acquire(as->as_lock);
+	KASSERT(as->as_refcount > 0);
+	as->as_refcount++;
+	lock_release(as->as_lock);
+}
+
+/* Drop a thread's reference to an address space. When the last thread
+ * lets go we destroy it: walk the page table, free any pages, and then
+ * free the appropriate data structures used by the VM system (the page
+ * directory, page tables, addrsapce struct).
  */
 void
 as_destroy(struct addrspace *as)
 {
 	// bool lock;
 	// lock = get_coremap_lock();
+	bool last;
+
+	lock_acquire(as->as_lock);
+	KASSERT(as->as_refcount > 0);
+	as->as_refcount--;
+	last = (as->as_refcount == 0);
+	if(!last)
+	{
+		lock_release(as->as_lock);
+		return;
+	}
+	//Keep it locked while we tear it down: the pager only takes pages of
+	//address spaces it can lock, so it keeps off ours.
+	vm_loadctl_remove(as);
+
+	//Tear down mmap'd regions first, so shared file pages get written back.
+	as_unmap_range(as, 0, USERSPACETOP);
 
 	//Go through each entry in the page directory.
 	for(size_t i = 0;i<PAGE_DIR_ENTRIES;i++)
@@ -165,7 +287,7 @@ as_destroy(struct addrspace *as)
 			{
 				int* pt_entry = &(pt->table[j]);
 				//If a page exists at this entry in the table, free it.
-				if(pt_entry != 0x0)
+				if(PTE_TO_PFN(*pt_entry) != 0 || PTE_TO_LOCATION(*pt_entry) != PTE_PM)
 				{
 					int swapped = PTE_TO_LOCATION(*pt_entry);
 					//If swapped, we don't need to load the page.
@@ -207,19 +329,18 @@ as_destroy(struct addrspace *as)
 	}
 	// release_coremap_lock(lock);
 	//Now, delete the address space.
+	lock_release(as->as_lock);
+	lock_destroy(as->as_lock);
 	kfree(as);
 }
 
-/* Shamelessly stolen from dumbvm.
- * It simply invalidate all TLB entries.
- */
+/* Invalidate all of this cpu's TLB entries. */
+static
 void
-as_activate(struct addrspace *as)
+as_flush_tlb(void)
 {
 	int i, spl;
 
-	(void)as;
-
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
@@ -230,79 +351,70 @@ as_activate(struct addrspace *as)
 	splx(spl);
 }
 
+/* Shamelessly stolen from dumbvm.
+ * It simply invalidate all TLB entries. We also note which address
+ * space this cpu is now running, for as_shootdown.
+ */
+void
+as_activate(struct addrspace *as)
+{
+	int spl;
+
+	spl = splhigh();
+	curcpu->c_curas = as;
+	as_flush_tlb();
+	splx(spl);
+}
+
+/* Invalidate AS's TLB entries everywhere. Any other cpu that might be
+ * holding some (because it's running a thread in AS) is told to flush,
+ * and we wait for it to, so once this returns nobody can use a mapping
+ * without faulting for it again. Faults wait for as_lock, which our
+ * caller holds. If AS is NULL every cpu flushes; the pager does that
+ * for shared memory pages, which any address space may have mapped.
+ */
+void
+as_shootdown(struct addrspace *as)
+{
+	as_flush_tlb();
+	ipi_tlbshootdown_addrspace(as);
+}
+
 /*
  * Set up a segment at virtual address VADDR of size MEMSIZE. The
  * segment in memory extends from VADDR up to (but not including)
  * VADDR+MEMSIZE.
  *
- * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * Nothing is allocated here: load_elf maps the segment with
+ * as_map_segment and vm_fault pages it in. We just keep track of where
+ * the static segments start and push the heap up past their end. The
+ * READABLE, WRITEABLE, and EXECUTABLE flags go on the segment's region.
  */
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		 int readable, int writeable, int executable)
 {
+	(void)readable;
+	(void)writeable;
+	(void)executable;
+
 	//Set the start of the static region
-	if(as->static_start == 0x0)
+	if(as->static_start == 0x0 || (vaddr & PAGE_FRAME) < as->static_start)
 	{
 		as->static_start = vaddr & PAGE_FRAME;
 	}
 	DEBUG(DB_VM, "Seg Start: %p\n", (void*) vaddr);
 	DEBUG(DB_VM, "Size: %p\n", (void*) sz);
-	//Calculate the number of pages that we need
-	size_t pages_required = sz / PAGE_SIZE;
-	if(sz < PAGE_SIZE)
-	{
-		pages_required = 1;
-	}
-	else if(sz % PAGE_SIZE != 0)
-	{
-		pages_required++;
-	}
-	/*If we split between two pages, add another page:
-	 * For example, if vaddr = 0x444970, and size = 192,
-	 * we need from 0x444970 to 0x445162. So we need
-	 * 0x44000 AND 0x445000 -- TWO PAGES. Simply aligning 
-	 * to a page boundary will get is 0x44000, but not the 
-	 * 162 bytes that spill into the next page. So we need to
-	 * account for that now:
-	 */
-	// if(((vaddr & SUB_FRAME) + sz > PAGE_SIZE))
-	// {
-	// 	// DEBUG(DB_VM, "Addr: %p Size: %d\n", (void*) vaddr,sz);
-	// 	// DEBUG(DB_VM, "Offest: %p\n", (void*) (vaddr & SUB_FRAME));
-	// 	pages_required++;
-	// }
-	DEBUG(DB_VM,"Pages Required:%d\n", pages_required);
-	DEBUG(DB_VM,"Seg End:%p\n", (void*) ( vaddr + (pages_required * PAGE_SIZE)));
-	DEBUG(DB_VM,"Seg End:%p\n", (void*) (vaddr + sz));
 
 	//Adjust the start of the heap to be *PAST* the end of this segment.
-	vaddr_t seg_end = vaddr + pages_required * PAGE_SIZE;
+	vaddr_t seg_end = ROUNDUP(vaddr + sz, PAGE_SIZE);
+	DEBUG(DB_VM,"Seg End:%p\n", (void*) seg_end);
 	if(seg_end > as->heap_start)
 	{
 		as->heap_start = seg_end + PAGE_SIZE;
 		as->heap_end = as->heap_start;
 	}
 
-	//Align the vaddr on a page boundary.
-	DEBUG(DB_VM, "addr: %p size: %d\n", (void*) vaddr,sz);
-	vaddr &= PAGE_FRAME;
-	DEBUG(DB_VM, "addr: %p size: %d\n",(void*) vaddr,sz);
-	//Allocate the segment, one page at a time. Pages need not be contiguous.
-	vaddr_t cur_vaddr = vaddr;
-	for(size_t i = 0; i < pages_required; i++)
-	{
-		DEBUG(DB_VM, "CURVA:%p\n", (void*) cur_vaddr);
-		int permissions = readable | writeable | executable;
-		// struct page *page = page_alloc(as,cur_vaddr,permissions);
-		page_prealloc(as,cur_vaddr,permissions);
-		cur_vaddr += PAGE_SIZE;
-		// page->state = LOADING;
-	}
-
 	return 0;
 }
 
@@ -354,9 +466,7 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	//Set permissions
 	int permissions = PF_RWX; //change?
 	//Allocate the page
-	bool lock = get_coremap_lock();
 	struct page *page = page_alloc(as,as->stack,permissions);
-	release_coremap_lock(lock);
 	(void) page;
 	DEBUG(DB_VM,"Heap Start before aligning: %p\n", (void*) as->heap_end);
 	//Align the heap on a page boundary:
@@ -373,3 +483,484 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+/* Return the mmap'd region containing VA, or NULL. */
+struct vm_region *
+as_find_region(struct addrspace *as, vaddr_t va)
+{
+	struct vm_region *vr;
+
+	for(vr = as->regions; vr != NULL && vr->vr_start <= va; vr = vr->vr_next)
+	{
+		if(va < vr->vr_end)
+		{
+			return vr;
+		}
+	}
+	return NULL;
+}
+
+/* Return the first mmap'd region overlapping [START, END), or NULL. */
+struct vm_region *
+as_find_overlap(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	struct vm_region *vr;
+
+	for(vr = as->regions; vr != NULL && vr->vr_start < end; vr = vr->vr_next)
+	{
+		if(vr->vr_end > start)
+		{
+			return vr;
+		}
+	}
+	return NULL;
+}
+
+/* Make a region, taking an open reference to its file (if any). The
+ * file data covers the whole region unless the caller says otherwise.
+ */
+static
+struct vm_region *
+region_create(vaddr_t start, vaddr_t end, int perms, int flags,
+	      struct vnode *vn, off_t offset)
+{
+	struct vm_region *vr;
+
+	vr = kmalloc(sizeof(struct vm_region));
+	if(vr == NULL)
+	{
+		return NULL;
+	}
+	vr->vr_start = start;
+	vr->vr_end = end;
+	vr->vr_perms = perms;
+	vr->vr_flags = flags;
+	vr->vr_vnode = vn;
+	vr->vr_offset = offset;
+	vr->vr_fileva = start;
+	vr->vr_filesz = end - start;
+	vr->vr_text = false;
+	vr->vr_shm = NULL;
+	vr->vr_next = NULL;
+	if(vn != NULL)
+	{
+		VOP_INCOPEN(vn);
+		VOP_INCREF(vn);
+	}
+	return vr;
+}
+
+static
+void
+region_destroy(struct vm_region *vr)
+{
+	if(vr->vr_vnode != NULL)
+	{
+		vfs_close(vr->vr_vnode);
+	}
+	if(vr->vr_shm != NULL)
+	{
+		shm_decref(vr->vr_shm);
+	}
+	kfree(vr);
+}
+
+/* Put VR on the region list, which is kept sorted by address. */
+static
+void
+region_insert(struct addrspace *as, struct vm_region *vr)
+{
+	struct vm_region **pp;
+
+	for(pp = &as->regions; *pp != NULL && (*pp)->vr_start < vr->vr_start; pp = &(*pp)->vr_next);
+	vr->vr_next = *pp;
+	*pp = vr;
+}
+
+/* Find room for NPAGES pages of mappings, working down from just under
+ * the stack limit. Leaves an unmapped guard page above the heap. Returns
+ * 0 if there isn't room.
+ */
+static
+vaddr_t
+region_findspace(struct addrspace *as, size_t npages)
+{
+	vaddr_t floor = (as->heap_end & PAGE_FRAME) + 2 * PAGE_SIZE;
+	vaddr_t top = USER_STACK_LIMIT - PAGE_SIZE;
+	size_t size = npages * PAGE_SIZE;
+	struct vm_region *vr;
+	vaddr_t start;
+
+	if(npages == 0 || npages > (top - floor) / PAGE_SIZE)
+	{
+		return 0;
+	}
+	start = top - size;
+	while((vr = as_find_overlap(as, start, start + size)) != NULL)
+	{
+		if(vr->vr_start < floor + size)
+		{
+			return 0;
+		}
+		start = vr->vr_start - size;
+	}
+	return start;
+}
+
+/* Add a region of NPAGES pages at *VA (or wherever there is room, if *VA
+ * is 0) and return its address in *VA. The range must be free.
+ */
+int
+as_map_region(struct addrspace *as, vaddr_t *va, size_t npages, int perms,
+	      int flags, struct vnode *vn, off_t offset)
+{
+	struct vm_region *vr;
+	vaddr_t start = *va;
+
+	if(start == 0)
+	{
+		start = region_findspace(as, npages);
+		if(start == 0)
+		{
+			return ENOMEM;
+		}
+	}
+	else if(as_find_overlap(as, start, start + npages * PAGE_SIZE) != NULL)
+	{
+		return EINVAL;
+	}
+
+	vr = region_create(start, start + npages * PAGE_SIZE, perms, flags, vn, offset);
+	if(vr == NULL)
+	{
+		return ENOMEM;
+	}
+	region_insert(as, vr);
+
+	*va = start;
+	return 0;
+}
+
+/* Add the program segment of MEMSZ bytes at VADDR as a private file
+ * region, so that load_elf doesn't have to read anything: the FILESZ
+ * bytes at OFFSET in VN are paged in as they are touched, and the rest
+ * of the segment (the bss) comes up zero filled. Neither VADDR nor
+ * OFFSET need be page aligned.
+ */
+int
+as_map_segment(struct addrspace *as, vaddr_t vaddr, size_t memsz, int perms,
+	       struct vnode *vn, off_t offset, size_t filesz)
+{
+	struct vm_region *vr;
+	vaddr_t start = vaddr & PAGE_FRAME;
+	vaddr_t end;
+
+	if(memsz == 0)
+	{
+		return 0;
+	}
+	if(vaddr >= USERSPACETOP || memsz > USERSPACETOP - vaddr)
+	{
+		return ENOEXEC;
+	}
+	end = ROUNDUP(vaddr + memsz, PAGE_SIZE);
+
+	//Segments sharing a page would need the page filled from both.
+	if(as_find_overlap(as, start, end) != NULL)
+	{
+		kprintf("ELF: segments at %p share a page\n", (void*) vaddr);
+		return ENOEXEC;
+	}
+
+	vr = region_create(start, end, perms, MAP_PRIVATE, vn, offset);
+	if(vr == NULL)
+	{
+		return ENOMEM;
+	}
+	vr->vr_fileva = vaddr;
+	vr->vr_filesz = filesz;
+	//Nobody can change read-only segments, so every process running
+	//this program can use the same pages.
+	vr->vr_text = !(perms & PF_W);
+	region_insert(as, vr);
+	return 0;
+}
+
+/* Throw away the page at VA of region VR: write it back to the file if
+ * it is a modified page of a shared mapping, then free the memory (or
+ * our reference to it, for shared text) or swap slot holding it and
+ * clear the PTE. Call with as_lock held.
+ */
+void
+vm_region_unmap_page(struct addrspace *as, struct vm_region *vr, vaddr_t va)
+{
+	struct page_table *pt = pgdir_walk(as,va,false);
+	if(pt == NULL)
+	{
+		return;
+	}
+	int *pte = &(pt->table[VA_TO_PT_INDEX(va)]);
+
+	bool lock = get_coremap_lock();
+	//The pager might be on its way out with this page; let it finish.
+	while(PTE_TO_LOCATION(*pte) == PTE_SWAPPING)
+	{
+		release_coremap_lock(lock);
+		thread_yield();
+		lock = get_coremap_lock();
+	}
+
+	if(PTE_TO_LOCATION(*pte) == PTE_SWAP)
+	{
+		clean_swapfile(as, va);
+	}
+	else if(PTE_TO_PFN(*pte) != 0)
+	{
+		paddr_t pa = PTE_TO_PFN(*pte);
+		if(vr != NULL && (*pte & PTE_MODIFIED))
+		{
+			//Our as_lock keeps the pager off the page while we
+			//write it without the coremap lock.
+			release_coremap_lock(lock);
+			vm_region_writeback(vr, va, pa);
+			lock = get_coremap_lock();
+		}
+		page_release(as, pa);
+	}
+	*pte = 0;
+	release_coremap_lock(lock);
+}
+
+/* Unmap [START, END) (page aligned) from whatever regions it overlaps.
+ * Regions are trimmed, split, or removed as needed.
+ */
+int
+as_unmap_range(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	struct vm_region *vr, *tail, **pp;
+	vaddr_t lo, hi, va;
+	bool flushed = false;
+
+	pp = &as->regions;
+	while((vr = *pp) != NULL && vr->vr_start < end)
+	{
+		if(vr->vr_end <= start)
+		{
+			pp = &vr->vr_next;
+			continue;
+		}
+
+		lo = (start > vr->vr_start) ? start : vr->vr_start;
+		hi = (end < vr->vr_end) ? end : vr->vr_end;
+
+		//A hole in the middle splits the region; get the memory up front.
+		tail = NULL;
+		if(lo > vr->vr_start && hi < vr->vr_end)
+		{
+			tail = region_create(hi, vr->vr_end, vr->vr_perms, vr->vr_flags,
+					     vr->vr_vnode, vr->vr_offset);
+			if(tail == NULL)
+			{
+				return ENOMEM;
+			}
+			tail->vr_fileva = vr->vr_fileva;
+			tail->vr_filesz = vr->vr_filesz;
+			tail->vr_text = vr->vr_text;
+			tail->vr_shm = vr->vr_shm;
+			if(tail->vr_shm != NULL)
+			{
+				shm_incref(tail->vr_shm);
+			}
+		}
+
+		//Nobody may keep using a page once it's freed.
+		if(!flushed)
+		{
+			as_shootdown(as);
+			flushed = true;
+		}
+		for(va = lo; va < hi; va += PAGE_SIZE)
+		{
+			vm_region_unmap_page(as, vr, va);
+		}
+
+		if(tail != NULL)
+		{
+			tail->vr_next = vr->vr_next;
+			vr->vr_next = tail;
+			vr->vr_end = lo;
+			pp = &tail->vr_next;
+		}
+		else if(lo > vr->vr_start)
+		{
+			vr->vr_end = lo;
+			pp = &vr->vr_next;
+		}
+		else if(hi < vr->vr_end)
+		{
+			vr->vr_start = hi;
+			pp = &vr->vr_next;
+		}
+		else
+		{
+			*pp = vr->vr_next;
+			region_destroy(vr);
+		}
+	}
+
+	return 0;
+}
+
+/* Throw away the anonymous (heap) pages in [START, END), page aligned.
+ * They come back zero filled if touched again.
+ */
+void
+as_free_pages(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	vaddr_t va;
+
+	//Get rid of any TLB entries for the pages we're about to free.
+	as_shootdown(as);
+	for(va = start; va < end; va += PAGE_SIZE)
+	{
+		vm_region_unmap_page(as, NULL, va);
+	}
+}
+
+/* Attach shared memory: a region like an anonymous mmap, except that its
+ * pages come from the segment (see vm_fault_shm) rather than the page
+ * table.
+ */
+int
+as_map_shm(struct addrspace *as, vaddr_t *va, size_t npages, int perms,
+	   struct shm_segment *seg)
+{
+	struct vm_region *vr;
+	int result;
+
+	result = as_map_region(as, va, npages, perms, MAP_SHARED, NULL, 0);
+	if(result)
+	{
+		return result;
+	}
+	vr = as_find_region(as, *va);
+	KASSERT(vr != NULL && vr->vr_start == *va);
+	vr->vr_shm = seg;
+	return 0;
+}
+
+/* Thread stacks are anonymous regions, placed like any other mmap, with
+ * an unmapped guard page below so an overflow faults instead of running
+ * into whatever is under it.
+ */
+int
+as_map_thread_stack(struct addrspace *as, vaddr_t *va)
+{
+	vaddr_t start;
+	int result;
+
+	lock_acquire(as->as_lock);
+	start = region_findspace(as, VM_THREADSTACKPAGES + 1);
+	if(start == 0)
+	{
+		lock_release(as->as_lock);
+		return ENOMEM;
+	}
+	*va = start + PAGE_SIZE;
+	result = as_map_region(as, va, VM_THREADSTACKPAGES, PF_R | PF_W,
+			       MAP_PRIVATE, NULL, 0);
+	lock_release(as->as_lock);
+	return result;
+}
+
+void
+as_free_thread_stack(struct addrspace *as, vaddr_t va)
+{
+	lock_acquire(as->as_lock);
+	//The exact region as_map_thread_stack made, so no split to fail.
+	as_unmap_range(as, va, va + VM_THREADSTACKPAGES * PAGE_SIZE);
+	lock_release(as->as_lock);
+}
+
+/* Can the page at VA be evicted by just dropping it? True for file pages
+ * that haven't been written, and for shared file pages (which the pager
+ * writes back first). Private pages that have been written need swap.
+ */
+bool
+as_page_refetchable(struct addrspace *as, vaddr_t va, int pte)
+{
+	struct vm_region *vr = as_find_region(as, va);
+
+	if(vr == NULL || vr->vr_vnode == NULL)
+	{
+		return false;
+	}
+	return (vr->vr_flags & MAP_SHARED) || !(pte & PTE_MODIFIED);
+}
+
+/* Read the file contents for page VA of region VR into physical page PA.
+ * Only the part of the page that the region's file data covers is read;
+ * the rest, and anything past the end of the file, is left as it is
+ * (zeros, since page_alloc zero fills).
+ */
+int
+vm_region_fill(struct vm_region *vr, vaddr_t va, paddr_t pa)
+{
+	struct iovec iov;
+	struct uio u;
+	vaddr_t lo = va;
+	vaddr_t hi = va + PAGE_SIZE;
+
+	if(hi <= vr->vr_fileva || lo >= vr->vr_fileva + vr->vr_filesz)
+	{
+		return 0;
+	}
+	if(lo < vr->vr_fileva)
+	{
+		lo = vr->vr_fileva;
+	}
+	if(hi > vr->vr_fileva + vr->vr_filesz)
+	{
+		hi = vr->vr_fileva + vr->vr_filesz;
+	}
+
+	uio_kinit(&iov, &u, (void*) (PADDR_TO_KVADDR(pa) + (lo - va)), hi - lo,
+		  vr->vr_offset + (lo - vr->vr_fileva), UIO_READ);
+	return VOP_READ(vr->vr_vnode, &u);
+}
+
+/* Write physical page PA back to the file page VA of region VR maps, if
+ * the mapping is shared. Never extends the file: only the part of the
+ * page inside the current file size is written.
+ */
+int
+vm_region_writeback(struct vm_region *vr, vaddr_t va, paddr_t pa)
+{
+	struct iovec iov;
+	struct uio u;
+	struct stat st;
+	off_t pos = vr->vr_offset + (va - vr->vr_fileva);
+	size_t len = PAGE_SIZE;
+	int result;
+
+	if(!(vr->vr_flags & MAP_SHARED))
+	{
+		return 0;
+	}
+
+	result = VOP_STAT(vr->vr_vnode, &st);
+	if(result)
+	{
+		return result;
+	}
+	if(pos >= st.st_size)
+	{
+		return 0;
+	}
+	if(st.st_size - pos < (off_t) len)
+	{
+		len = st.st_size - pos;
+	}
+
+	uio_kinit(&iov, &u, (void*) PADDR_TO_KVADDR(pa), len, pos, UIO_WRITE);
+	return VOP_WRITE(vr->vr_vnode, &u);
+}
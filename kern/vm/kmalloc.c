@@ -606,9 +606,10 @@ kmalloc(size_t sz)
 		unsigned long npages;
 		vaddr_t address;
 
-		/* Round up to a whole number of pages. */
+		/* Round up to a whole number of pages. These needn't be
+		 * physically contiguous. */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
-		address = alloc_kpages(npages);
+		address = alloc_kvpages(npages);
 		if (address==0) {
 			return NULL;
 		}
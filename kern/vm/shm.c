@@ -0,0 +1,448 @@
+/*
+ * System V style shared memory segments: shmget, shmat, shmdt, shmctl.
+ *
+ * Segments live in a small table indexed by their id. A segment stays
+ * around until it is removed with IPC_RMID and the last attachment
+ * goes away, whether or not anyone has it attached meanwhile. How its
+ * pages are kept and mapped is described in shm.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/shm.h>
+#include <lib.h>
+#include <synch.h>
+#include <thread.h>
+#include <current.h>
+#include <copyinout.h>
+#include <elf.h>
+#include <vm.h>
+#include <addrspace.h>
+#include <swapspace.h>
+#include <syscall.h>
+#include <shm.h>
+
+/* Most segments there can be at once, and most pages in one */
+#define SHM_MAX		32
+#define SHM_MAXPAGES	1024
+
+/* ss_pages entry for a page that is out in swap; 0 means never touched */
+#define SHM_SWAPPED	((paddr_t) 1)
+
+struct shm_segment {
+	int ss_id;			/* index in shm_table */
+	int ss_key;			/* shmget key, or IPC_PRIVATE */
+	size_t ss_size;			/* size asked for, in bytes */
+	size_t ss_npages;
+	unsigned ss_nattach;		/* regions attaching it */
+	bool ss_removed;		/* IPC_RMID'd; goes at last detach */
+	paddr_t *ss_pages;		/* where each page is (coremap lock) */
+};
+
+/* Covers the table and every segment's ss_nattach and ss_removed */
+static struct lock *shm_lock;
+static struct shm_segment *shm_table[SHM_MAX];
+
+void
+shm_bootstrap(void)
+{
+	shm_lock = lock_create("shm");
+	if(shm_lock == NULL)
+	{
+		panic("shm_bootstrap: Out of memory\n");
+	}
+}
+
+/* The segment with id SHMID, or NULL. Call with shm_lock held. */
+static
+struct shm_segment *
+shm_lookup(int shmid)
+{
+	if(shmid < 0 || shmid >= SHM_MAX)
+	{
+		return NULL;
+	}
+	return shm_table[shmid];
+}
+
+/* Free SEG's pages, wherever they are, and then SEG. Nobody has it
+ * attached, so only the pager can still be looking at its pages.
+ */
+static
+void
+shm_destroy(struct shm_segment *seg)
+{
+	size_t i;
+	paddr_t pa;
+	bool lock;
+
+	for(i = 0; i < seg->ss_npages; i++)
+	{
+		lock = get_coremap_lock();
+		pa = seg->ss_pages[i];
+		//The pager may be on its way out with it; let it finish.
+		while(pa != 0 && pa != SHM_SWAPPED &&
+		      coremap_page(pa)->state != DIRTY)
+		{
+			release_coremap_lock(lock);
+			thread_yield();
+			lock = get_coremap_lock();
+			pa = seg->ss_pages[i];
+		}
+		if(pa == SHM_SWAPPED)
+		{
+			swap_discard(seg, i * PAGE_SIZE);
+		}
+		else if(pa != 0)
+		{
+			free_kpages(PADDR_TO_KVADDR(pa));
+		}
+		seg->ss_pages[i] = 0;
+		release_coremap_lock(lock);
+	}
+	kfree(seg->ss_pages);
+	kfree(seg);
+}
+
+void
+shm_incref(struct shm_segment *seg)
+{
+	lock_acquire(shm_lock);
+	KASSERT(seg->ss_nattach > 0);
+	seg->ss_nattach++;
+	lock_release(shm_lock);
+}
+
+void
+shm_decref(struct shm_segment *seg)
+{
+	bool last;
+
+	lock_acquire(shm_lock);
+	KASSERT(seg->ss_nattach > 0);
+	seg->ss_nattach--;
+	last = seg->ss_nattach == 0 && seg->ss_removed;
+	if(last)
+	{
+		shm_table[seg->ss_id] = NULL;
+	}
+	lock_release(shm_lock);
+
+	if(last)
+	{
+		shm_destroy(seg);
+	}
+}
+
+int
+shm_getpage(struct shm_segment *seg, size_t index, paddr_t *pa)
+{
+	struct page *page;
+	int result;
+
+	KASSERT(coremap_lock_do_i_hold());
+	KASSERT(index < seg->ss_npages);
+
+	if(seg->ss_pages[index] == 0)
+	{
+		//First touch: a zero filled page.
+		page = page_alloc_shm(seg, index);
+		curthread->t_usage.tu_minflt++;
+	}
+	else if(seg->ss_pages[index] == SHM_SWAPPED)
+	{
+		//Read it in without the coremap lock, as swapin_page does. The
+		//page stays LOCKED meanwhile, so other attachers faulting on it
+		//get EAGAIN, and the pager and shm_destroy leave it alone.
+		page = page_alloc_shm(seg, index);
+		seg->ss_pages[index] = page->pa;
+		release_coremap_lock(true);
+		result = swap_load(seg, index * PAGE_SIZE, page->pa);
+		get_coremap_lock();
+		KASSERT(page->state == LOCKED);
+		if(result)
+		{
+			seg->ss_pages[index] = SHM_SWAPPED;
+			free_kpages(PADDR_TO_KVADDR(page->pa));
+			return result;
+		}
+		curthread->t_usage.tu_majflt++;
+	}
+	else
+	{
+		page = coremap_page(seg->ss_pages[index]);
+		if(page->state != DIRTY)
+		{
+			KASSERT(page->state == SWAPPINGOUT || page->state == CLEAN ||
+				page->state == LOCKED);
+			return EAGAIN;
+		}
+		*pa = page->pa;
+		return 0;
+	}
+
+	seg->ss_pages[index] = page->pa;
+	page->state = DIRTY;
+	*pa = page->pa;
+	return 0;
+}
+
+void
+shm_pageout(struct page *page)
+{
+	struct shm_segment *seg = page->shm;
+	size_t index = page->va / PAGE_SIZE;
+	paddr_t pa = page->pa;
+	bool lock;
+	int result;
+
+	lock = get_coremap_lock();
+	KASSERT(page->state == SWAPPINGOUT);
+	KASSERT(seg->ss_pages[index] == pa);
+
+	//Attachers only load the page into their TLBs with the coremap lock
+	//held, and not while it's SWAPPINGOUT, so once every cpu has
+	//flushed nobody has it mapped. SWAPPINGOUT also keeps shm_getpage
+	//and shm_destroy off it while we write it without the lock.
+	as_shootdown(NULL);
+	release_coremap_lock(lock);
+	result = swap_store(seg, page->va, pa);
+	lock = get_coremap_lock();
+	if(result)
+	{
+		//Keep it; attachers fault it back into their TLBs.
+		swap_discard(seg, page->va);
+		page->state = DIRTY;
+		release_coremap_lock(lock);
+		return;
+	}
+	seg->ss_pages[index] = SHM_SWAPPED;
+	free_kpages(PADDR_TO_KVADDR(pa));
+	release_coremap_lock(lock);
+}
+
+/* Make a segment of SIZE bytes. Call with shm_lock held. */
+static
+int
+shm_create(int key, size_t size, int *retval)
+{
+	struct shm_segment *seg;
+	size_t npages, i;
+	int id;
+
+	if(size == 0 || size > SHM_MAXPAGES * PAGE_SIZE)
+	{
+		return EINVAL;
+	}
+	npages = ROUNDUP(size, PAGE_SIZE) / PAGE_SIZE;
+
+	for(id = 0; id < SHM_MAX && shm_table[id] != NULL; id++);
+	if(id == SHM_MAX)
+	{
+		return ENOSPC;
+	}
+
+	seg = kmalloc(sizeof(struct shm_segment));
+	if(seg == NULL)
+	{
+		return ENOMEM;
+	}
+	seg->ss_pages = kmalloc(npages * sizeof(paddr_t));
+	if(seg->ss_pages == NULL)
+	{
+		kfree(seg);
+		return ENOMEM;
+	}
+	for(i = 0; i < npages; i++)
+	{
+		seg->ss_pages[i] = 0;
+	}
+	seg->ss_id = id;
+	seg->ss_key = key;
+	seg->ss_size = size;
+	seg->ss_npages = npages;
+	seg->ss_nattach = 0;
+	seg->ss_removed = false;
+	shm_table[id] = seg;
+
+	*retval = id;
+	return 0;
+}
+
+/* Find the segment with KEY, or make one of SIZE bytes. */
+int
+sys_shmget(int key, size_t size, int flags, int *retval)
+{
+	struct shm_segment *seg = NULL;
+	int id, result;
+
+	lock_acquire(shm_lock);
+	if(key != IPC_PRIVATE)
+	{
+		for(id = 0; id < SHM_MAX; id++)
+		{
+			if(shm_table[id] != NULL && shm_table[id]->ss_key == key)
+			{
+				seg = shm_table[id];
+				break;
+			}
+		}
+	}
+
+	if(seg != NULL)
+	{
+		if((flags & IPC_CREAT) && (flags & IPC_EXCL))
+		{
+			result = EEXIST;
+		}
+		else if(size > seg->ss_size)
+		{
+			result = EINVAL;
+		}
+		else
+		{
+			*retval = seg->ss_id;
+			result = 0;
+		}
+	}
+	else if(key != IPC_PRIVATE && !(flags & IPC_CREAT))
+	{
+		result = ENOENT;
+	}
+	else
+	{
+		result = shm_create(key, size, retval);
+	}
+	lock_release(shm_lock);
+	return result;
+}
+
+/* Attach segment SHMID at ADDR, or wherever there's room if ADDR is 0. */
+int
+sys_shmat(int shmid, vaddr_t addr, int flags, int *retval)
+{
+	struct addrspace *as = curthread->t_addrspace;
+	struct shm_segment *seg;
+	int perms, result;
+
+	if(addr & SUB_FRAME)
+	{
+		return EINVAL;
+	}
+	perms = (flags & SHM_RDONLY) ? PF_R : (PF_R | PF_W);
+
+	lock_acquire(as->as_lock);
+
+	lock_acquire(shm_lock);
+	seg = shm_lookup(shmid);
+	if(seg == NULL || seg->ss_removed)
+	{
+		lock_release(shm_lock);
+		lock_release(as->as_lock);
+		return EINVAL;
+	}
+	//This is the reference the region will hold.
+	seg->ss_nattach++;
+	lock_release(shm_lock);
+
+	//Like MAP_FIXED: between the heap and the stack, and nothing there.
+	if(addr != 0 && (addr <= as->heap_end ||
+			 seg->ss_npages > (USER_STACK_LIMIT - addr) / PAGE_SIZE))
+	{
+		result = EINVAL;
+	}
+	else
+	{
+		result = as_map_shm(as, &addr, seg->ss_npages, perms, seg);
+	}
+	lock_release(as->as_lock);
+	if(result)
+	{
+		shm_decref(seg);
+		return result;
+	}
+
+	*retval = (int) addr;
+	return 0;
+}
+
+/* Detach the segment attached at ADDR. Every piece of that attachment
+ * goes, even if munmap has since split it up.
+ */
+int
+sys_shmdt(vaddr_t addr)
+{
+	struct addrspace *as = curthread->t_addrspace;
+	struct shm_segment *seg;
+	struct vm_region *vr;
+	vaddr_t va, end;
+	int result = 0;
+
+	lock_acquire(as->as_lock);
+	vr = as_find_region(as, addr);
+	if(vr == NULL || vr->vr_shm == NULL || vr->vr_start != addr)
+	{
+		lock_release(as->as_lock);
+		return EINVAL;
+	}
+	seg = vr->vr_shm;
+	end = addr + seg->ss_npages * PAGE_SIZE;
+
+	va = addr;
+	while(result == 0 && (vr = as_find_overlap(as, va, end)) != NULL)
+	{
+		va = vr->vr_end;
+		//Part of this attachment: the right segment, at the right offset.
+		if(vr->vr_shm == seg &&
+		   vr->vr_offset + (vr->vr_start - vr->vr_fileva) == vr->vr_start - addr)
+		{
+			result = as_unmap_range(as, vr->vr_start, vr->vr_end);
+		}
+	}
+	lock_release(as->as_lock);
+	return result;
+}
+
+int
+sys_shmctl(int shmid, int cmd, userptr_t buf)
+{
+	struct shm_segment *seg;
+	struct shmid_ds ds;
+	bool destroy = false;
+
+	lock_acquire(shm_lock);
+	seg = shm_lookup(shmid);
+	if(seg == NULL)
+	{
+		lock_release(shm_lock);
+		return EINVAL;
+	}
+
+	switch(cmd)
+	{
+	    case IPC_STAT:
+		ds.shm_segsz = seg->ss_size;
+		ds.shm_nattch = seg->ss_nattach;
+		lock_release(shm_lock);
+		return copyout(&ds, buf, sizeof(ds));
+
+	    case IPC_RMID:
+		//Nobody new can find it, and it goes once the last one lets go.
+		seg->ss_removed = true;
+		seg->ss_key = IPC_PRIVATE;
+		if(seg->ss_nattach == 0)
+		{
+			shm_table[shmid] = NULL;
+			destroy = true;
+		}
+		lock_release(shm_lock);
+		if(destroy)
+		{
+			shm_destroy(seg);
+		}
+		return 0;
+	}
+
+	lock_release(shm_lock);
+	return EINVAL;
+}
@@ -19,13 +19,58 @@
 #include <spl.h>
 #include <elf.h>
 #include <swapspace.h>
+#include <shm.h>
+#include <cpu.h>
+#include <wchan.h>
+#include <clock.h>
 /*
  * Wrap ram_stealmem in a spinlock.
  */
-/* Maximum of 1MB of user stack */
-#define VM_STACKPAGES	256
-#define USER_STACK_LIMIT (0x80000000 - (VM_STACKPAGES * PAGE_SIZE)) 
 #define SWAPPING_ENABLED
+/* On a TLB miss in the middle of a sequential walk, also load up to
+ * FAULTAROUND_MAX resident pages ahead of it (see faultaround_load). */
+#define FAULTAROUND_ENABLED
+#define FAULTAROUND_MAX 8
+/* Pre-zeroed free pages. page_zeroer, a background thread that only
+ * runs when nothing else wants the cpu, tops the pool up to ZERO_HIGH,
+ * and is woken again once allocations take it below ZERO_LOW. Allocation
+ * takes zeroed pages first and only clears one inline when the pool is
+ * empty. */
+#define ZERO_LOW 16
+#define ZERO_HIGH 64
+/* Free pages each cpu keeps for itself, so most allocations and frees
+ * needn't take the coremap lock (see pagecache_get). A cpu takes up to
+ * PAGECACHE_BATCH at a time from the coremap, and only while more than
+ * PAGECACHE_RESERVE pages are free, so the caches don't sit on pages the
+ * pager is trying to find. */
+#define PAGECACHE_MAX 16
+#define PAGECACHE_BATCH 8
+#define PAGECACHE_RESERVE 32
+#define PAGECACHE_NCPUS 32
+/* Load control (see vm_loadctl_tick). Every LOADCTL_NSECS it looks at
+ * memory; if for LOADCTL_SUSTAIN looks in a row fewer than
+ * LOADCTL_LOWFREE pages were free and processes read LOADCTL_THRASH or
+ * more pages back from swap, it swaps out the process doing most of that
+ * and keeps it off the cpu. It lets one back in once there's room for
+ * what it had, or after LOADCTL_MAXOUT looks regardless. Needs
+ * SWAPPING_ENABLED. */
+#define LOADCTL_ENABLED
+#define LOADCTL_NSECS (50*1000*1000)
+#define LOADCTL_LOWFREE 32
+#define LOADCTL_THRASH 16
+#define LOADCTL_SUSTAIN 3
+#define LOADCTL_MAXOUT 40
+/* Kernel virtual space in kseg2 for multi-page kmallocs, which are built
+ * out of single pages mapped through the TLB so they needn't find a run
+ * of free physical pages (see alloc_kvpages). */
+#define KVM_PAGES 1024
+/* Resident program text, so a process can find a page another one
+ * running the same executable already read in without searching the
+ * coremap: TEXT_HASH_SIZE chains through text_next, hashed on the
+ * executable's vnode and the page's address in it. */
+#define TEXT_HASH_SIZE 64
+#define TEXT_HASH(vn, va) \
+	((((uintptr_t)(vn) >> 4) ^ ((va) >> 12)) % TEXT_HASH_SIZE)
 
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 
@@ -42,6 +87,49 @@ static volatile size_t current_index = 0;
 static volatile size_t current_n_index = 0;
 /* Number of free pages in memory  */
 static size_t free_pages;
+/* Number of those known to be zeroed, where page_zeroer got to, and
+ * where it sleeps (all under the coremap lock) */
+static size_t zeroed_pages;
+static size_t zero_cursor = 0;
+static struct wchan *zero_wchan = NULL;
+
+/* Text page chains (see TEXT_HASH), under the coremap lock */
+static struct page *text_hash[TEXT_HASH_SIZE];
+static void text_page_add(struct page *page, struct vnode *vn);
+static void text_page_remove(struct page *page);
+
+/* Every address space, for load control; the lock covers the list and
+ * keeps its members from being destroyed. Threads of swapped out
+ * processes wait on loadctl_wchan. */
+static struct lock *loadctl_lock = NULL;
+static struct addrspace *loadctl_list = NULL;
+static struct wchan *loadctl_wchan = NULL;
+static unsigned loadctl_looks = 0;
+static unsigned loadctl_nout = 0;
+
+/* The kseg2 page table: the frame behind each page, or 0, and whether
+ * the page is free, in use, or freed but perhaps still in some cpu's TLB
+ * (stale, or purging while we flush them all). KVM_NPAGES is the length
+ * of an allocation, kept at its first page. Only one thread purges at a
+ * time (kvm_purger), so the purging pages are all its own. */
+#define KVM_FREE	0
+#define KVM_USED	1
+#define KVM_STALE	2
+#define KVM_PURGING	3
+static struct spinlock kvm_lock = SPINLOCK_INITIALIZER;
+static paddr_t kvm_map[KVM_PAGES];
+static unsigned char kvm_state[KVM_PAGES];
+static unsigned short kvm_npages[KVM_PAGES];
+static bool kvm_purger = false;
+
+/* Per cpu page caches, indexed by c_number. The lock is only to keep
+ * pagecache_drain out; otherwise only the cpu itself uses its cache, so
+ * it's never contended in the common case. */
+static struct pagecache {
+	struct spinlock pc_lock;
+	unsigned pc_count;
+	size_t pc_pages[PAGECACHE_MAX];
+} pagecaches[PAGECACHE_NCPUS];
 /* TODO figure out how to do this. I'll probably kmalloc it in
 vm_bootstrap after we set the correct flag.*/ 
 struct lock *core_map_lock = NULL;
@@ -126,35 +214,161 @@ coremap_lock_do_i_hold()
 }
 
 
+/* Can the pager take page I? Program text shared between address spaces
+ * stays put, since we only know where one of its PTEs is. Taking a page
+ * another cpu may have in its TLB means waiting for it to flush, which
+ * the pager can only do if it was called with interrupts on (CANFLUSH).
+ * That's any cpu for shared memory pages, which have no PTEs.
+ */
+static
+bool
+page_evictable(size_t i, bool canflush)
+{
+	if(core_map[i].state != DIRTY)
+	{
+		return false;
+	}
+	if(core_map[i].shm != NULL)
+	{
+		return canflush;
+	}
+	if(core_map[i].refcount > 1 || core_map[i].as == NULL)
+	{
+		return false;
+	}
+	return canflush || !ipi_tlbshootdown_needed(core_map[i].as);
+}
+
+/* Lock the address space page I belongs to, so that its regions and
+ * page table hold still (against munmap and as_destroy) while the pager
+ * works on the page. We have the coremap lock, which comes after
+ * as_lock, so we only try: false means somebody else has it, and the
+ * page should be left alone. *LOCKED is set to the address space if the
+ * caller has to unlock it when done, or NULL if there's nothing to
+ * unlock: shared memory pages have no address space, and the one we're
+ * faulting on is locked already.
+ */
+static
+bool
+page_lock_as(size_t i, struct addrspace **locked)
+{
+	struct addrspace *as = core_map[i].as;
+
+	*locked = NULL;
+	if(core_map[i].shm != NULL || lock_do_i_hold(as->as_lock))
+	{
+		return true;
+	}
+	if(!lock_tryacquire(as->as_lock))
+	{
+		return false;
+	}
+	//Another cpu may have faulted the page in since page_evictable
+	//looked. With the lock held it can't any more, so look again.
+	if(!page_evictable(i, curthread->t_curspl == 0))
+	{
+		lock_release(as->as_lock);
+		return false;
+	}
+	*locked = as;
+	return true;
+}
+
+/* Claim page I for the pager: mark it on its way out, and its PTE too,
+ * so that faults on it wait until it's gone. Shared memory pages have
+ * no PTE; shm_pageout keeps faults off them. Call with the page's
+ * address space locked (page_lock_as).
+ */
+static
+void
+page_start_swapout(size_t i)
+{
+	KASSERT(core_map[i].state != SWAPPINGOUT);
+	core_map[i].state = SWAPPINGOUT;
+	if(core_map[i].shm == NULL)
+	{
+		//Update PTE to state PTE_SWAPPING
+		struct page_table *pt = pgdir_walk(core_map[i].as,core_map[i].va,false);
+		int pt_index = VA_TO_PT_INDEX(core_map[i].va);
+		pt->table[pt_index] |= PTE_SWAPPING;
+	}
+}
+
+/* Take the N pages in BATCH, claimed with page_start_swapout, out of
+ * every TLB that might hold them: ours directly, and other cpus' with a
+ * single IPI each, sent only to cpus running an address space the pages
+ * belong to. Shared memory pages are left to shm_pageout, which flushes
+ * every cpu for them anyway.
+ */
+static
+void
+pages_shootdown(const size_t *batch, unsigned n)
+{
+	struct tlbshootdown ts[TLBSHOOTDOWN_MAX];
+	unsigned nts = 0;
+
+	KASSERT(n <= TLBSHOOTDOWN_MAX);
+	for(unsigned i = 0; i < n; i++)
+	{
+		KASSERT(core_map[batch[i]].state == SWAPPINGOUT);
+		if(core_map[batch[i]].shm == NULL)
+		{
+			ts[nts].ts_addrspace = core_map[batch[i]].as;
+			ts[nts].ts_vaddr = core_map[batch[i]].va;
+			nts++;
+		}
+	}
+	if(nts > 0)
+	{
+		vm_tlbshootdown(ts, nts);
+		ipi_tlbshootdown_batch(ts, nts);
+	}
+}
+
+/* Write out and free a page claimed with page_start_swapout, once
+ * pages_shootdown has taken it out of the TLBs. Call without the
+ * coremap lock, so the write doesn't hold up everyone else's faults;
+ * a page that can't be written stays where it is. */
+static
+void
+page_swapout(struct page *page)
+{
+	if(page->shm != NULL)
+	{
+		shm_pageout(page);
+	}
+	else if(swapout_page(page) == 0)
+	{
+		evict_page(page);
+	}
+}
+
 /* Returns the next available index of a page we're going to page to disk. 
  * We do this round robin style at the moment, but I suppose we could change to
  * random at a later time, or even LRU with some tweaks to this method.
+ * The page comes back claimed, with its address space locked; unlock
+ * *LOCKED (see page_lock_as) once it's out. Returns -1 if every page we
+ * could take belongs to an address space somebody else has locked.
  */
 static 
 size_t
-get_a_dirty_page_index(int retry)
+get_a_dirty_page_index(int retry, struct addrspace **locked)
 {
 
 	bool lock = get_coremap_lock();
 	// KASSERT(spinlock_do_i_hold(&stealmem_lock));
 	// DEBUG(DB_SWAP, "Cur:%d\n",current_index);
+	bool canflush = curthread->t_curspl == 0;
+	bool busy = false;
 	size_t start = current_index;
 	for(size_t i = start; i<page_count; i++)
 	{
 		int spl = splhigh();
-		if(core_map[i].state == DIRTY)
+		if(page_evictable(i, canflush) && page_lock_as(i, locked))
 		{
 			KASSERT(core_map[i].state == DIRTY);
-			KASSERT(core_map[i].state != SWAPPINGOUT);
 			current_index = i+1;
-			KASSERT(core_map[i].state != SWAPPINGOUT);
-			core_map[i].state = SWAPPINGOUT;
-			//Update PTE to state PTE_SWAPPING
-			struct page_table *pt = pgdir_walk(core_map[i].as,core_map[i].va,false);
-			int pt_index = VA_TO_PT_INDEX(core_map[i].va);
-			pt->table[pt_index] |= PTE_SWAPPING;
-			// DEBUG(DB_SWAP, "%d\n",pt->table[pt_index]);
-			//////////////////////////////////
+			page_start_swapout(i);
 			splx(spl);
 			struct thread *thread = curthread;
 			(void)thread;
@@ -179,18 +393,17 @@ get_a_dirty_page_index(int retry)
 			// KASSERT(spinlock_do_i_hold(&stealmem_lock));
 			// DEBUG(DB_SWAP,"DPI: %d\n", i);
 			int spl = splhigh();
-			if(core_map[i].state == DIRTY)
+			if(page_evictable(i, canflush))
 			{
+				if(!page_lock_as(i, locked))
+				{
+					busy = true;
+					splx(spl);
+					continue;
+				}
 				KASSERT(core_map[i].state == DIRTY);
 				current_index = i+1;
-				KASSERT(core_map[i].state != SWAPPINGOUT);
-				core_map[i].state = SWAPPINGOUT;
-				//Update PTE to state PTE_SWAPPING
-				struct page_table *pt = pgdir_walk(core_map[i].as,core_map[i].va,false);
-				int pt_index = VA_TO_PT_INDEX(core_map[i].va);
-				pt->table[pt_index] |= PTE_SWAPPING;
-				// DEBUG(DB_SWAP, "%d\n",pt->table[pt_index]);
-				//////////////////////////////////
+				page_start_swapout(i);
 				splx(spl);
 				struct thread *thread = curthread;
 				(void)thread;
@@ -200,8 +413,14 @@ get_a_dirty_page_index(int retry)
 				release_coremap_lock(lock);
 				return i;
 			}
+			splx(spl);
+		}
+		//Their owners will be done with them soon; the caller tries again.
+		if(busy)
+		{
+			release_coremap_lock(lock);
+			return -1;
 		}
-		//splx(spl);
 		retry = 2;
 		// panic("get a dirty page index failed");	
 	}
@@ -223,19 +442,65 @@ get_a_dirty_page_index(int retry)
 	}
 	//Reached end of core map. Start from beginning.
 	current_index = 0;
-	// release_coremap_lock(lock);
 	// DEBUG(DB_SWAP,"??%d\n",spinlock_do_i_hold(&stealmem_lock));
-	// KASSERT(spinlock_do_i_hold(&stealmem_lock) == true);
-	return get_a_dirty_page_index(1);
-
-
-	panic("Get dirty page index is broken!");
-	// return -1;
+	size_t i = get_a_dirty_page_index(1, locked);
+	release_coremap_lock(lock);
+	return i;
 }
 
 
  #ifdef SWAPPING_ENABLED
 
+/* Swap out every page the pager can take that belongs to AS, or every one
+ * at all if AS is NULL.
+ */
+static
+void
+pages_evict(struct addrspace *as)
+{
+	bool lock; 
+	bool canflush = curthread->t_curspl == 0;
+	size_t batch[TLBSHOOTDOWN_MAX];
+	struct addrspace *locked[TLBSHOOTDOWN_MAX];
+	unsigned n = 0;
+	lock = get_coremap_lock();
+
+	// Claim pages a batch at a time, so that each batch costs other
+	// cpus one shootdown IPI rather than one per page.
+	for (int i = 0; i < (int)page_count; i++) {
+		int spl = splhigh();
+		if(page_evictable(i, canflush) && (as == NULL || core_map[i].as == as) &&
+		   page_lock_as(i, &locked[n])) {
+			page_start_swapout(i);
+			batch[n++] = i;
+		}
+		splx(spl);
+		if(n == TLBSHOOTDOWN_MAX || (n > 0 && i == (int)page_count - 1))
+		{
+			pages_shootdown(batch, n);
+			// Write them out with the coremap lock dropped. Address
+			// spaces are unlocked only once the whole batch is out,
+			// since later pages may belong to one locked earlier.
+			release_coremap_lock(lock);
+			for(unsigned j = 0; j < n; j++)
+			{
+				page_swapout(&core_map[batch[j]]);
+			}
+			for(unsigned j = 0; j < n; j++)
+			{
+				if(locked[j] != NULL)
+				{
+					lock_release(locked[j]->as_lock);
+				}
+			}
+			lock = get_coremap_lock();
+			n = 0;
+		}
+	}
+
+	release_coremap_lock(lock);
+}
+
 /* Called in page_alloc ONLY at the moment.
  * This method will page available IF NEEDED - i.e. if there are less than 10 free
  * pages on the system, we'll start swapping. If not, we simply return.
@@ -252,7 +517,8 @@ make_page_available()
 		// DEBUG(DB_SWAP, "Making page available\n");
 		//DEBUG(DB_SWAP, "Start Swap: %d\n",free_pages);	
 		//DEBUG(DB_SWAP, "\nStart Swapping\n");	
-		int rr_page = get_a_dirty_page_index(0);
+		struct addrspace *locked;
+		int rr_page = get_a_dirty_page_index(0, &locked);
 		if(rr_page == -1)
 		{
 			return;
@@ -260,10 +526,13 @@ make_page_available()
 		//KASSERT(spinlock_do_i_hold(&stealmem_lock));
 		KASSERT(core_map[rr_page].state == SWAPPINGOUT);
 		// DEBUG(DB_SWAP, "SWOs%d\n",rr_page);
-		swapout_page(&core_map[rr_page]);
-		// KASSERT(spinlock_do_i_hold(&stealmem_lock));
-		// DEBUG(DB_SWAP, "Starting Eviction...%d\n",rr_page);
-		evict_page(&core_map[rr_page]);
+		size_t batch = rr_page;
+		pages_shootdown(&batch, 1);
+		page_swapout(&core_map[rr_page]);
+		if(locked != NULL)
+		{
+			lock_release(locked->as_lock);
+		}
 		// KASSERT(spinlock_do_i_hold(&stealmem_lock));
 		//DEBUG(DB_SWAP, "Evicted %d\n",rr_page);
 	}
@@ -380,30 +649,7 @@ make_pages_available(int npages, bool retry)
 	{
 		return;
 	}
-	bool lock; 
-	lock = get_coremap_lock();
-
-	for (int i = 0; i < (int)page_count; i++) {
-		int spl = splhigh();
-		if(core_map[i].state == DIRTY) {
-			KASSERT(core_map[i].state != SWAPPINGOUT);
-			core_map[i].state = SWAPPINGOUT;
-			//Update PTE to state PTE_SWAPPING
-			struct page_table *pt = pgdir_walk(core_map[i].as,core_map[i].va,false);
-			int pt_index = VA_TO_PT_INDEX(core_map[i].va);
-			pt->table[pt_index] |= PTE_SWAPPING;
-			splx(spl);
-			// KASSERT(core_map[i].state != SWAPPINGOUT);
-			swapout_page(&core_map[i]);
-			evict_page(&core_map[i]);	
-		}
-		else
-		{
-			splx(spl);
-		}
-	}
-
-	release_coremap_lock(lock);
+	pages_evict(NULL);
 }
 #endif
 
@@ -457,6 +703,11 @@ void vm_bootstrap()
 		// core_map[i].va = PADDR_TO_KVADDR(i * PAGE_SIZE);
 		core_map[i].state = FIXED;
 		core_map[i].as = 0x0;
+		core_map[i].refcount = 0;
+		core_map[i].text_vnode = NULL;
+		core_map[i].text_next = NULL;
+		core_map[i].shm = NULL;
+		core_map[i].zeroed = false;
 	}
 	/* Mark every available page (from freeaddr + offset into next page,
 	if applicable) to lastaddr as FREE*/
@@ -468,6 +719,11 @@ void vm_bootstrap()
 		core_map[i].state = FREE;
 		core_map[i].as = 0x0;
 		core_map[i].va = 0x0;
+		core_map[i].refcount = 0;
+		core_map[i].text_vnode = NULL;
+		core_map[i].text_next = NULL;
+		core_map[i].shm = NULL;
+		core_map[i].zeroed = false;
 		free_pages++;
 	}
 	/* Set VM initialization flag. alloc_kpages and free_kpages
@@ -477,24 +733,212 @@ void vm_bootstrap()
 	spinlock_cleanup(&stealmem_lock);
 	spinlock_init(&stealmem_lock);
 	core_map_lock = lock_create("coremap_lock");
+	zero_wchan = wchan_create("pagezero");
+	loadctl_lock = lock_create("loadctl");
+	loadctl_wchan = wchan_create("loadctl");
+	for(size_t i = 0; i < PAGECACHE_NCPUS; i++)
+	{
+		spinlock_init(&pagecaches[i].pc_lock);
+		pagecaches[i].pc_count = 0;
+	}
 }
 
-/* Fault handling function called by trap code */
+/* Put the translation FAULTADDRESS -> ELO in the TLB. If there's already
+ * an entry for the page (read-only, being made writable), replace it,
+ * since the TLB must not hold two; else use a free slot, or kill an
+ * entry round robin style if there isn't one. Call with interrupts off.
+ */
+static
+void
+tlb_load(vaddr_t faultaddress, uint32_t elo)
+{
+	uint32_t ehi, oldelo;
+	int i;
+
+	i = tlb_probe(faultaddress, 0);
+	if(i >= 0)
+	{
+		tlb_write(faultaddress, elo, i);
+		return;
+	}
 
-int vm_fault(int faulttype, vaddr_t faultaddress) 
+	for(i = 0; i < NUM_TLB; i++)
+	{
+		tlb_read(&ehi, &oldelo, i);
+		if(!(oldelo & TLBLO_VALID))
+		{
+			tlb_write(faultaddress, elo, i);
+			return;
+		}
+	}
+
+	tlb_write(faultaddress, elo, tlb_offering);
+	tlb_offering++;
+	if(tlb_offering == NUM_TLB)
+	{
+		//At the end of the TLB. Start back at 0 again.
+		tlb_offering = 0;
+	}
+}
+
+/* Fault on page FAULTADDRESS of VR, an attached shared memory segment.
+ * There's no PTE: the TLB is loaded straight from the segment, under the
+ * coremap lock, so the pager (which holds it too) only has to flush TLBs
+ * to take the page away.
+ */
+static
+int
+vm_fault_shm(struct addrspace *as, struct vm_region *vr, vaddr_t faultaddress)
+{
+	size_t index = (vr->vr_offset + (faultaddress - vr->vr_fileva)) / PAGE_SIZE;
+	bool writable = (vr->vr_perms & PF_W) || !(as->use_permissions);
+	paddr_t pa;
+	uint32_t elo;
+	bool lock;
+	int result;
+
+	while(1)
+	{
+		lock = get_coremap_lock();
+		result = shm_getpage(vr->vr_shm, index, &pa);
+		if(result != EAGAIN)
+		{
+			break;
+		}
+		//The pager is on its way out with it; let it finish.
+		release_coremap_lock(lock);
+		thread_yield();
+	}
+	if(result == 0)
+	{
+		bool slock = get_coremap_spinlock();
+		int spl = splhigh();
+		elo = pa | TLBLO_VALID;
+		if(writable)
+		{
+			elo |= TLBLO_DIRTY;
+		}
+		tlb_load(faultaddress, elo);
+		splx(spl);
+		release_coremap_spinlock(slock);
+	}
+	release_coremap_lock(lock);
+	return result;
+}
+
+#ifdef FAULTAROUND_ENABLED
+/* Note a fault at FAULTADDRESS in AS and work out how many pages to load
+ * around it. A fault just past the pages loaded around the last one means
+ * AS is walking through memory in order, so the window doubles, up to
+ * FAULTAROUND_MAX; a fault anywhere else starts over. Call with as_lock
+ * held.
+ */
+static
+void
+faultaround_update(struct addrspace *as, vaddr_t faultaddress)
+{
+	vaddr_t reach = (as->as_faultwindow + 1) * PAGE_SIZE;
+	int dir = 0;
+
+	if(faultaddress == as->as_lastfault)
+	{
+		//Same page again (e.g. a write after a read); no news.
+		return;
+	}
+	if(faultaddress > as->as_lastfault && faultaddress - as->as_lastfault <= reach)
+	{
+		dir = 1;
+	}
+	else if(faultaddress < as->as_lastfault && as->as_lastfault - faultaddress <= reach)
+	{
+		dir = -1;
+	}
+
+	if(dir != 0 && (dir == as->as_faultdir || as->as_faultwindow == 0))
+	{
+		as->as_faultwindow = (as->as_faultwindow == 0) ? 1 : as->as_faultwindow * 2;
+		if(as->as_faultwindow > FAULTAROUND_MAX)
+		{
+			as->as_faultwindow = FAULTAROUND_MAX;
+		}
+	}
+	else
+	{
+		as->as_faultwindow = 0;
+	}
+	as->as_faultdir = dir;
+	as->as_lastfault = faultaddress;
+}
+
+/* Load the TLB with the pages after FAULTADDRESS (or before it, walking
+ * down) in the current window, as long as they're in the same region VR
+ * and resident. Pages on their way out, or not there yet, end the run;
+ * they'll fault in the usual way. Call with the coremap spinlock held and
+ * interrupts off, before loading FAULTADDRESS itself, so that entry can't
+ * be the one these push out.
+ */
+static
+void
+faultaround_load(struct addrspace *as, struct vm_region *vr, vaddr_t faultaddress)
+{
+	vaddr_t va = faultaddress;
+	struct page_table *pt;
+	uint32_t pte, elo;
+	bool writable;
+
+	for(unsigned i = 0; i < as->as_faultwindow; i++)
+	{
+		va = (as->as_faultdir > 0) ? va + PAGE_SIZE : va - PAGE_SIZE;
+		if(va == 0x0 || va >= 0x80000000 || as_find_region(as, va) != vr)
+		{
+			return;
+		}
+
+		pt = pgdir_walk(as, va, false);
+		if(pt == NULL)
+		{
+			return;
+		}
+		pte = pt->table[VA_TO_PT_INDEX(va)];
+		if(PTE_TO_PFN(pte) == 0 || PTE_TO_LOCATION(pte) != PTE_PM ||
+		   coremap_page(PTE_TO_PFN(pte))->state != DIRTY)
+		{
+			return;
+		}
+
+		//Same rules as for the faulting page: file pages stay read-only
+		//until they've been written.
+		writable = (PTE_TO_PERMISSIONS(pte) & PF_W) || !(as->use_permissions);
+		if(vr != NULL && vr->vr_vnode != NULL && as->use_permissions &&
+		   !(pte & PTE_MODIFIED))
+		{
+			writable = false;
+		}
+		//It won't fault now, so count it as used for load control here.
+		pt->table[VA_TO_PT_INDEX(va)] |= PTE_REFERENCED;
+
+		elo = PTE_TO_PFN(pte) | TLBLO_VALID;
+		if(writable)
+		{
+			elo |= TLBLO_DIRTY;
+		}
+		tlb_load(va, elo);
+	}
+}
+#endif
+
+/* Handle a fault in AS, whose as_lock we hold. */
+static
+int
+vm_fault_as(struct addrspace *as, int faulttype, vaddr_t faultaddress)
 {
 	bool lock = false;	// Indicates if lock was aquired in "this" function
 	//int spl = splhigh();
 	// bool lock = get_coremap_lock();
 	// DEBUG(DB_VM,"F:%p\n",(void*) faultaddress);
-	struct addrspace *as = curthread->t_addrspace;
-	//We ALWAYS update TLB with writable bits ASAP. So this means a fault.
-	if(faulttype == VM_FAULT_READONLY && as->use_permissions)
-	{
-		// DEBUG(DB_VM, "NOT ALLOWED\n");
-		//splx(spl);
-		return EFAULT;
-	}
+	struct vm_region *vr;
+	bool shared = false;	// Mapped a text page another process had
+	int result;
 	//Null Pointer
 	if(faultaddress == 0x0)
 	{	
@@ -510,53 +954,105 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
 		//splx(spl);
 		return EFAULT;
 	}
+
+	//mmap'd region, if any, the address is in.
+	vr = as_find_region(as, faultaddress);
+
+	//We ALWAYS update TLB with writable bits ASAP. So this means a fault...
+	//except for file pages, which are mapped read-only until first written
+	//so we know which ones need writing back.
+	if(faulttype == VM_FAULT_READONLY && as->use_permissions)
+	{
+		if(vr == NULL || vr->vr_vnode == NULL || !(vr->vr_perms & PF_W))
+		{
+			// DEBUG(DB_VM, "NOT ALLOWED\n");
+			//splx(spl);
+			return EFAULT;
+		}
+	}
 	/*If we're trying to access a region after the end of the heap but 
-	 * before the stack, that's invalid (unless load_elf is running) */
-	if(as->loadelf_done && faultaddress < USER_STACK_LIMIT && faultaddress > as->heap_end)
+	 * before the stack, that's invalid (unless load_elf is running or
+	 * it's been mmap'd) */
+	if(vr == NULL && as->loadelf_done && faultaddress < USER_STACK_LIMIT && faultaddress > as->heap_end)
 	{
 		//splx(spl);
 		return EFAULT;
 	}
+	if(vr != NULL && vr->vr_perms == 0)
+	{
+		//PROT_NONE
+		return EFAULT;
+	}
+	if(vr != NULL && vr->vr_shm != NULL)
+	{
+		return vm_fault_shm(as, vr, faultaddress);
+	}
 	
-	//Translate....
+	//Translate.... (no page table yet means nothing's been touched here)
 	struct page_table *pt = pgdir_walk(as,faultaddress,false);
 	int pt_index = VA_TO_PT_INDEX(faultaddress);
-	int pfn = PTE_TO_PFN(pt->table[pt_index]);
-	int permissions = PTE_TO_PERMISSIONS(pt->table[pt_index]);
-	int swapped = PTE_TO_LOCATION(pt->table[pt_index]);
+	int pfn = (pt == NULL) ? 0 : PTE_TO_PFN(pt->table[pt_index]);
+	int permissions;
+	int swapped;
 	struct page *page = NULL;
 
 	/*If the PFN is 0, we might need to dynamically allocate
 	on the stack or the heap */
 	if(pfn == 0)
 	{
+		//Program text another process has already read in.
+		if(vr != NULL && vr->vr_text &&
+		   text_page_find(as, faultaddress, vr->vr_vnode, vr->vr_perms))
+		{
+			shared = true;
+		}
+		//mmap'd region: zero fill, or read in from the file.
+		else if(vr != NULL)
+		{
+			page = page_alloc(as,faultaddress,vr->vr_perms);
+			if(vr->vr_vnode != NULL)
+			{
+				//The page is LOCKED, so the pager leaves it alone meanwhile.
+				result = vm_region_fill(vr, faultaddress, page->pa);
+				if(result)
+				{
+					vm_region_unmap_page(as, vr, faultaddress);
+					return result;
+				}
+				//Let the next process running this program use it too.
+				if(vr->vr_text)
+				{
+					text_page_add(page, vr->vr_vnode);
+				}
+			}
+		}
 		//Stack
-		if(faultaddress < as->stack && faultaddress > USER_STACK_LIMIT)
+		else if(faultaddress < as->stack && faultaddress > USER_STACK_LIMIT)
 		{
 			as->stack -= PAGE_SIZE;
-			lock = get_coremap_lock();
 			page = page_alloc(as,as->stack, PF_RW);
-			release_coremap_lock(lock);
 		}
 		//Heap
 		else if(faultaddress < as->heap_end && faultaddress >= as->heap_start)
 		{
-			lock = get_coremap_lock();
 			page = page_alloc(as,faultaddress, PF_RW);
-			release_coremap_lock(lock);
-		}
-		//Static Segment(s)
-		else if(faultaddress < as->heap_start && faultaddress >= as->static_start)
-		{
-			panic("code not loaded: %p",(void*) faultaddress);
-			//TODO
-			// page = page_alloc(as,faultaddress,PF_)
 		}
+		//Static segments are regions, paged in from the executable above;
+		//anything else down there is a hole between segments.
 		else
 		{
 			//splx(spl);
 			return EFAULT;
 		}
+		if(vr != NULL && vr->vr_vnode != NULL && !shared)
+		{
+			curthread->t_usage.tu_majflt++;
+		}
+		else
+		{
+			/* Zero-fill fault; no I/O needed. */
+			curthread->t_usage.tu_minflt++;
+		}
 	}
 
 	/*We grew the stack and/or heap dynamically. Try translating again */
@@ -576,6 +1072,12 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
 		swapped = PTE_TO_LOCATION(pt->table[pt_index]);
 	}
 
+	// The pager dropped a file page rather than swapping it; read it in again.
+	if(pfn == 0 && swapped == PTE_PM && vr != NULL)
+	{
+		return vm_fault_as(as, faulttype, faultaddress);
+	}
+
 	// Swap completed and page is now in memory or on disk; if disk, bring it back to memory
 	if(swapped == PTE_SWAP)
 	{
@@ -583,15 +1085,17 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
 		//TODO get the page back in to ram. 
 		//Does this work?
 		// DEBUG(DB_SWAP,"PTE (vmfault)1:%p\n",(void*) pt->table[pt_index]);
-		lock = get_coremap_lock();
+		curthread->t_usage.tu_majflt++;
+		as->as_pageins++;
+		//Nothing else touches this PTE (we hold as_lock) or the page
+		//(it's LOCKED), so no coremap lock; swapin_page takes it to
+		//hand the page over.
 		page = page_alloc(as,faultaddress,permissions);
 		/* Page now has a home in RAM. But set the swap bit to 1 so we can swap the page in*/
 		pt->table[pt_index] |= PTE_SWAP;
 		// DEBUG(DB_SWAP,"PTE (vmfault)2:%p\n",(void*) pt->table[pt_index]);
 		swapin_page(as,faultaddress,page);
 
-		release_coremap_lock(lock);
-
 		/* Page was swapped back in. Re-translate */
 		pt = pgdir_walk(as,faultaddress,false);
 		pt_index = VA_TO_PT_INDEX(faultaddress);
@@ -606,19 +1110,16 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
 	bool writable = (permissions & PF_W) || !(as->use_permissions);
 
 	//This time, it shouldn't be 0.
-	//Static Segment(s)
-	// if(faultaddress < as->heap_start && faultaddress >= as->static_start)
-	// {
-	// 	panic("code not loaded: %p",(void*) faultaddress);
-	// 	//TODO
-	// 	// page = page_alloc(as,faultaddress,PF_)
-	// }
 	KASSERT(pfn > 0);
 	KASSERT(pfn <= PAGE_SIZE * (int) page_count);
 
-	uint32_t ehi,elo;
+	uint32_t elo;
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
+#ifdef FAULTAROUND_ENABLED
+	faultaround_update(as, faultaddress);
+#endif
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
 
 	lock = get_coremap_spinlock();
 	int spl = splhigh();
@@ -631,51 +1132,84 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
 		page->state = DIRTY;
 	}
 
-	for (int i=0; i<NUM_TLB; i++) {
-		tlb_read(&ehi, &elo, i);
-
-		if (elo & TLBLO_VALID) {
-			// kprintf("Index %d in use\n",i);
-			continue;
+	// File pages stay read-only in the TLB until written, so that only
+	// pages that were actually changed get written back (or swapped).
+	if(vr != NULL && vr->vr_vnode != NULL && writable && as->use_permissions)
+	{
+		if(faulttype != VM_FAULT_READ)
+		{
+			pt->table[pt_index] |= PTE_MODIFIED;
 		}
-
-		ehi = faultaddress;
-		elo = pfn | TLBLO_VALID;
-
-		if(writable)
+		else if(!(pt->table[pt_index] & PTE_MODIFIED))
 		{
-			elo |= TLBLO_DIRTY;
+			writable = false;
 		}
-
-		// kprintf("Writing TLB Index %d\n",i); 
-		// DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, pfn);
-		tlb_write(ehi, elo, i);
-
-		splx(spl);
-		release_coremap_spinlock(lock);
-		return 0;
 	}
 
-	/*If we get here, TLB was full. Kill an entry, round robin style*/
-	ehi = faultaddress;
+	//For load control's working set estimate.
+	pt->table[pt_index] |= PTE_REFERENCED;
+
 	elo = pfn | TLBLO_VALID;
 	if(writable)
 	{
 		elo |= TLBLO_DIRTY;
 	}
-	tlb_write(ehi,elo,tlb_offering);
-	tlb_offering++;
-	if(tlb_offering == NUM_TLB)
-	{
-		//At the end of the TLB. Start back at 0 again.
-		tlb_offering = 0;
-	}
+#ifdef FAULTAROUND_ENABLED
+	faultaround_load(as, vr, faultaddress);
+#endif
+	tlb_load(faultaddress, elo);
 
 	splx(spl);
 	release_coremap_spinlock(lock);
 	return 0;
 }
 
+/* A kernel fault on kseg2 page FAULTADDRESS: load it from the kseg2 page
+ * table. This can happen anywhere the kernel touches kmalloc'd memory,
+ * spinlocks held or not, so no sleeping. The entry is filled in before
+ * the memory is handed out and isn't cleared until it's freed.
+ */
+static
+int
+kvm_fault(vaddr_t faultaddress)
+{
+	size_t i = (faultaddress - MIPS_KSEG2) / PAGE_SIZE;
+	int spl;
+
+	if(i >= KVM_PAGES || kvm_map[i] == 0)
+	{
+		return EFAULT;
+	}
+	//The TLB is our own cpu's; keeping interrupts off is enough.
+	spl = splhigh();
+	tlb_load(faultaddress & PAGE_FRAME, kvm_map[i] | TLBLO_VALID | TLBLO_DIRTY);
+	splx(spl);
+	return 0;
+}
+
+/* Fault handling function called by trap code. Other threads sharing
+ * the address space may be faulting on other cpus, or growing or
+ * unmapping bits of it, so we hold its lock throughout.
+ */
+int vm_fault(int faulttype, vaddr_t faultaddress) 
+{
+	struct addrspace *as = curthread->t_addrspace;
+	int result;
+
+	if(faultaddress >= MIPS_KSEG2)
+	{
+		return kvm_fault(faultaddress);
+	}
+	if(as == NULL)
+	{
+		return EFAULT;
+	}
+	lock_acquire(as->as_lock);
+	result = vm_fault_as(as, faulttype, faultaddress);
+	lock_release(as->as_lock);
+	return result;
+}
+
 /* Given a virtual address & an address space, return the page table from the page directory */
 struct page_table *
 pgdir_walk(struct addrspace *as, vaddr_t va, bool create)
@@ -788,31 +1322,601 @@ getppages(unsigned long npages)
 	return addr;
 }
 
-/* Shamelessly stolen from memset.c */
+/*
+ * Zero the physical page at PA, through KSEG0. This is bzero with the
+ * alignment and length known up front, so it's just stores, sixteen
+ * words per trip around the loop.
+ */
+void
+page_zero(paddr_t pa)
+{
+	uint32_t *p = (uint32_t *) PADDR_TO_KVADDR(pa);
+	uint32_t *end = p + PAGE_SIZE / sizeof(uint32_t);
+
+	KASSERT(pa % PAGE_SIZE == 0);
+
+	for (; p < end; p += 16) {
+		p[0] = 0;
+		p[1] = 0;
+		p[2] = 0;
+		p[3] = 0;
+		p[4] = 0;
+		p[5] = 0;
+		p[6] = 0;
+		p[7] = 0;
+		p[8] = 0;
+		p[9] = 0;
+		p[10] = 0;
+		p[11] = 0;
+		p[12] = 0;
+		p[13] = 0;
+		p[14] = 0;
+		p[15] = 0;
+	}
+}
+
+/*
+ * Copy the physical page at SRC to the one at DST, likewise. Each
+ * group of eight words is loaded before any is stored, so the loads
+ * aren't each stalled behind a store.
+ */
+void
+page_copy(paddr_t dst, paddr_t src)
+{
+	uint32_t *d = (uint32_t *) PADDR_TO_KVADDR(dst);
+	const uint32_t *s = (const uint32_t *) PADDR_TO_KVADDR(src);
+	uint32_t *end = d + PAGE_SIZE / sizeof(uint32_t);
+	uint32_t w0, w1, w2, w3, w4, w5, w6, w7;
+
+	KASSERT(dst % PAGE_SIZE == 0);
+	KASSERT(src % PAGE_SIZE == 0);
+
+	for (; d < end; d += 8, s += 8) {
+		w0 = s[0];
+		w1 = s[1];
+		w2 = s[2];
+		w3 = s[3];
+		w4 = s[4];
+		w5 = s[5];
+		w6 = s[6];
+		w7 = s[7];
+		d[0] = w0;
+		d[1] = w1;
+		d[2] = w2;
+		d[3] = w3;
+		d[4] = w4;
+		d[5] = w5;
+		d[6] = w6;
+		d[7] = w7;
+	}
+}
+
+/* Zero a page. Called during allocation */
+static
+void
+zero_page(size_t page_num)
+{
+	page_zero(core_map[page_num].pa);
+}
+
+/* Take free page PAGE_NUM off the free pool, for an allocation or for a
+ * cpu's page cache; it's CACHED until its new owner sets it up. Get
+ * page_zeroer going if the zeroed pool is low and there are free pages
+ * left for it to clear. Call with the coremap lock held. */
+static
+void
+page_unfree(size_t page_num)
+{
+	KASSERT(core_map[page_num].state == FREE);
+	core_map[page_num].state = CACHED;
+	free_pages--;
+	if(core_map[page_num].zeroed)
+	{
+		zeroed_pages--;
+	}
+	if(zeroed_pages < ZERO_LOW && zeroed_pages < free_pages &&
+	   zero_wchan != NULL)
+	{
+		wchan_lock(zero_wchan);
+		wchan_wakeone(zero_wchan);
+		wchan_unlock(zero_wchan);
+	}
+}
+
+/* Put CACHED page PAGE_NUM back in the free pool. Call with the coremap
+ * lock held. */
+static
+void
+page_refree(size_t page_num)
+{
+	KASSERT(core_map[page_num].state == CACHED);
+	core_map[page_num].state = FREE;
+	free_pages++;
+	if(core_map[page_num].zeroed)
+	{
+		zeroed_pages++;
+	}
+}
+
+/* Make sure page PAGE_NUM, being handed out, is zeroed: page_zeroer may
+ * have done it already, else do it now. */
+static
+void
+page_clear(size_t page_num)
+{
+	if(!core_map[page_num].zeroed)
+	{
+		zero_page(page_num);
+	}
+	core_map[page_num].zeroed = false;
+}
+
+/* This cpu's page cache. If we move cpus before locking it we just use
+ * another cpu's, which the lock makes safe, if rare. */
+static
+struct pagecache *
+pagecache_mine(void)
+{
+	KASSERT(curcpu->c_number < PAGECACHE_NCPUS);
+	return &pagecaches[curcpu->c_number];
+}
+
+/* Take a page from this cpu's cache; false if it's empty. */
+static
+bool
+pagecache_get(size_t *page_num)
+{
+	struct pagecache *pc = pagecache_mine();
+	bool found = false;
+
+	spinlock_acquire(&pc->pc_lock);
+	if(pc->pc_count > 0)
+	{
+		*page_num = pc->pc_pages[--pc->pc_count];
+		found = true;
+	}
+	spinlock_release(&pc->pc_lock);
+	return found;
+}
+
+/* Keep the page PAGE_NUM, just freed, in this cpu's cache if there's
+ * room and memory isn't short; false if it should go back to the pool. */
+static
+bool
+pagecache_put(size_t page_num)
+{
+	struct pagecache *pc;
+	bool put = false;
+
+	if(free_pages <= PAGECACHE_RESERVE)
+	{
+		return false;
+	}
+	pc = pagecache_mine();
+	spinlock_acquire(&pc->pc_lock);
+	if(pc->pc_count < PAGECACHE_MAX)
+	{
+		core_map[page_num].state = CACHED;
+		pc->pc_pages[pc->pc_count++] = page_num;
+		put = true;
+	}
+	spinlock_release(&pc->pc_lock);
+	return put;
+}
+
+/* Move up to PAGECACHE_BATCH free pages into this cpu's cache, so its
+ * next allocations don't need the coremap lock. Call with the coremap
+ * lock held. */
+static
+void
+pagecache_refill(void)
+{
+	size_t got[PAGECACHE_BATCH];
+	struct pagecache *pc;
+	unsigned n = 0, k;
+
+	for(size_t i = 0; i < page_count && n < PAGECACHE_BATCH &&
+	    free_pages > PAGECACHE_RESERVE; i++)
+	{
+		if(core_map[i].state == FREE)
+		{
+			page_unfree(i);
+			got[n++] = i;
+		}
+	}
+
+	pc = pagecache_mine();
+	spinlock_acquire(&pc->pc_lock);
+	for(k = 0; k < n && pc->pc_count < PAGECACHE_MAX; k++)
+	{
+		pc->pc_pages[pc->pc_count++] = got[k];
+	}
+	spinlock_release(&pc->pc_lock);
+	//No room for the rest after all; give them back.
+	for(; k < n; k++)
+	{
+		page_refree(got[k]);
+	}
+}
+
+/* Give every cpu's cached pages back to the free pool, for when it has
+ * run dry or page_nalloc needs a run the caches are breaking up. Call
+ * with the coremap lock held. */
+static
+void
+pagecache_drain(void)
+{
+	for(size_t c = 0; c < PAGECACHE_NCPUS; c++)
+	{
+		spinlock_acquire(&pagecaches[c].pc_lock);
+		while(pagecaches[c].pc_count > 0)
+		{
+			page_refree(pagecaches[c].pc_pages[--pagecaches[c].pc_count]);
+		}
+		spinlock_release(&pagecaches[c].pc_lock);
+	}
+}
+
+/* A free page to hand out, zeroed ones first; page_count if there are
+ * none. Call with the coremap lock held. */
+static
+size_t
+find_free_page(void)
+{
+	size_t first = page_count;
+
+	for(size_t i = 0; i < page_count; i++)
+	{
+		if(core_map[i].state != FREE)
+		{
+			continue;
+		}
+		if(core_map[i].zeroed || zeroed_pages == 0)
+		{
+			return i;
+		}
+		if(first == page_count)
+		{
+			first = i;
+		}
+	}
+	return first;
+}
+
+/* Zero one free page that isn't yet and add it to the pool. Returns
+ * false if there's none to do. Call with the coremap lock held; the page
+ * stays FREE throughout, and nobody can take it while we hold the lock.
+ */
+static
+bool
+zero_free_page(void)
+{
+	for(size_t n = 0; n < page_count; n++)
+	{
+		size_t i = zero_cursor;
+		zero_cursor = (zero_cursor + 1) % page_count;
+		if(core_map[i].state == FREE && !core_map[i].zeroed)
+		{
+			zero_page(i);
+			core_map[i].zeroed = true;
+			zeroed_pages++;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Keep the pool of zeroed pages topped up, one page at a time. This is a
+ * background thread, so the scheduler only gives it the cpu when nothing
+ * else wants it and preempts it as soon as something does. Each page is
+ * cleared with interrupts off, and the coremap lock let go before they
+ * come back on, so being preempted never leaves the lock held by the
+ * lowest priority thread there is.
+ */
+static
+void
+page_zeroer(void *data1, unsigned long data2)
+{
+	bool lock;
+	int spl;
+
+	(void)data1;
+	(void)data2;
+
+	thread_setbackground();
+	while(1)
+	{
+		lock = get_coremap_lock();
+		spl = splhigh();
+		if(zeroed_pages >= ZERO_HIGH || !zero_free_page())
+		{
+			//Full, or nothing left to zero: wait until allocation
+			//takes the pool below ZERO_LOW.
+			wchan_lock(zero_wchan);
+			release_coremap_lock(lock);
+			splx(spl);
+			wchan_sleep(zero_wchan);
+			continue;
+		}
+		release_coremap_lock(lock);
+		splx(spl);
+	}
+}
+
+void
+vm_zero_bootstrap(void)
+{
+	int result;
+
+	result = thread_fork("pagezero", page_zeroer, NULL, 0, NULL);
+	if(result)
+	{
+		panic("vm_zero_bootstrap: thread_fork failed: %s\n", strerror(result));
+	}
+}
+
+/* Load control. When processes between them need more memory than
+ * there is, paging alone just has them all fault each other's pages out
+ * and nobody gets anywhere. Instead, once that has gone on for a while,
+ * vm_loadctl_tick takes a whole process out: swaps out its pages and
+ * holds its threads in vm_loadctl_wait on their way back to user mode,
+ * so the rest have room to run. It's let back in when there's room for
+ * the pages it had, or after a while anyway so nobody starves.
+ *
+ * What a process is using is measured from the coremap: its resident
+ * pages, and of those, the ones it touched since the last look. There
+ * are no hardware reference bits, so faults set PTE_REFERENCED and each
+ * look clears them and flushes the TLBs, so the next touch faults again.
+ * Looks only happen while memory is short or someone is out.
+ */
+void
+vm_loadctl_add(struct addrspace *as)
+{
+	lock_acquire(loadctl_lock);
+	as->as_next = loadctl_list;
+	loadctl_list = as;
+	lock_release(loadctl_lock);
+}
+
+void
+vm_loadctl_remove(struct addrspace *as)
+{
+	struct addrspace **pp;
+
+	lock_acquire(loadctl_lock);
+	for(pp = &loadctl_list; *pp != NULL; pp = &(*pp)->as_next)
+	{
+		if(*pp == as)
+		{
+			*pp = as->as_next;
+			break;
+		}
+	}
+	if(as->as_deactivated)
+	{
+		loadctl_nout--;
+	}
+	lock_release(loadctl_lock);
+}
+
+void
+vm_loadctl_wait(void)
+{
+	struct addrspace *as = curthread->t_addrspace;
+
+	if(as == NULL || !as->as_deactivated)
+	{
+		return;
+	}
+	wchan_lock(loadctl_wchan);
+	while(as->as_deactivated)
+	{
+		wchan_sleep(loadctl_wchan);
+		wchan_lock(loadctl_wchan);
+	}
+	wchan_unlock(loadctl_wchan);
+}
+
+#if defined(SWAPPING_ENABLED) && defined(LOADCTL_ENABLED)
+/* Count each address space's resident pages and the ones touched since
+ * the last look, and clear the reference bits for next time. Call with
+ * loadctl_lock held. Like the pager, only looks at the page tables of
+ * address spaces it can lock; a busy one's pages all count as touched.
+ */
+static
+void
+loadctl_sample(void)
+{
+	struct addrspace *as;
+	struct page_table *pt;
+	bool lock, slock;
+	int spl;
+
+	for(as = loadctl_list; as != NULL; as = as->as_next)
+	{
+		as->as_rss = 0;
+		//Swapped out processes keep what they had, for letting them in.
+		if(!as->as_deactivated)
+		{
+			as->as_wss = 0;
+		}
+		//We hold no as_lock otherwise, so lock_do_i_hold says below
+		//whether we got this one.
+		lock_tryacquire(as->as_lock);
+	}
+
+	//Pages only become DIRTY, and reference bits only get set, under the
+	//coremap spinlock; holding the lock as well keeps the pager off.
+	lock = get_coremap_lock();
+	slock = get_coremap_spinlock();
+	spl = splhigh();
+	for(size_t i = 0; i < page_count; i++)
+	{
+		as = core_map[i].as;
+		if(as == NULL || core_map[i].state == FREE || core_map[i].state == CACHED)
+		{
+			continue;
+		}
+		as->as_rss++;
+		if(core_map[i].state != DIRTY)
+		{
+			continue;
+		}
+		if(!lock_do_i_hold(as->as_lock))
+		{
+			as->as_wss++;
+			continue;
+		}
+		pt = pgdir_walk(as, core_map[i].va, false);
+		if(pt != NULL && (pt->table[VA_TO_PT_INDEX(core_map[i].va)] & PTE_REFERENCED))
+		{
+			pt->table[VA_TO_PT_INDEX(core_map[i].va)] &= ~PTE_REFERENCED;
+			as->as_wss++;
+		}
+	}
+	splx(spl);
+	release_coremap_spinlock(slock);
+	release_coremap_lock(lock);
+
+	for(as = loadctl_list; as != NULL; as = as->as_next)
+	{
+		if(lock_do_i_hold(as->as_lock))
+		{
+			lock_release(as->as_lock);
+		}
+	}
+
+	//So that pages still in use fault, and get marked, again.
+	as_shootdown(NULL);
+}
+
+/* Take AS out: swap out its pages and keep its threads off the cpu. It
+ * will want back about what it had. Call with loadctl_lock held.
+ */
+static
+void
+loadctl_swapout(struct addrspace *as)
+{
+	if(as->as_rss > as->as_wss)
+	{
+		as->as_wss = as->as_rss;
+	}
+	as->as_deactivated = true;
+	as->as_outsince = loadctl_looks;
+	loadctl_nout++;
+	DEBUG(DB_SWAP, "loadctl: swapping out %p (%u pages)\n", as, as->as_wss);
+	pages_evict(as);
+}
+
+/* Let AS back in. Call with loadctl_lock held. */
+static
+void
+loadctl_swapin(struct addrspace *as)
+{
+	DEBUG(DB_SWAP, "loadctl: letting in %p\n", as);
+	as->as_deactivated = false;
+	loadctl_nout--;
+	wchan_wakeall(loadctl_wchan);
+}
+
+/* Have a look at memory, and take a process out or let one back in. */
+static
+void
+loadctl_tick(void)
+{
+	static unsigned thrashing = 0;
+	struct addrspace *as, *victim = NULL, *oldest = NULL;
+	unsigned pageins = 0, most = 0, nactive = 0, delta;
+
+	lock_acquire(loadctl_lock);
+	loadctl_looks++;
+	if(free_pages > LOADCTL_LOWFREE && loadctl_nout == 0)
+	{
+		thrashing = 0;
+		lock_release(loadctl_lock);
+		return;
+	}
+	loadctl_sample();
+
+	for(as = loadctl_list; as != NULL; as = as->as_next)
+	{
+		delta = as->as_pageins - as->as_lastpageins;
+		as->as_lastpageins = as->as_pageins;
+		if(as->as_deactivated)
+		{
+			if(oldest == NULL || loadctl_looks - as->as_outsince >
+			   loadctl_looks - oldest->as_outsince)
+			{
+				oldest = as;
+			}
+			continue;
+		}
+		pageins += delta;
+		if(as->as_rss > 0)
+		{
+			nactive++;
+		}
+		if(delta > most || (delta == most && delta > 0 && as->as_rss > victim->as_rss))
+		{
+			most = delta;
+			victim = as;
+		}
+	}
+
+	if(free_pages <= LOADCTL_LOWFREE && pageins >= LOADCTL_THRASH)
+	{
+		thrashing++;
+	}
+	else
+	{
+		thrashing = 0;
+	}
+
+	//Let the one that's been out longest back in if it fits, or has
+	//waited long enough; else, if it's still thrashing, take one out.
+	//One or the other, so each change gets a look before the next.
+	if(oldest != NULL &&
+	   ((thrashing == 0 && free_pages >= oldest->as_wss + LOADCTL_LOWFREE) ||
+	    loadctl_looks - oldest->as_outsince >= LOADCTL_MAXOUT))
+	{
+		loadctl_swapin(oldest);
+		thrashing = 0;
+	}
+	else if(thrashing >= LOADCTL_SUSTAIN && victim != NULL && nactive > 1)
+	{
+		loadctl_swapout(victim);
+		thrashing = 0;
+	}
+	lock_release(loadctl_lock);
+}
+
 static
 void
-memset(void *ptr, int ch, size_t len)
+loadctl_thread(void *data1, unsigned long data2)
 {
-	char *p = ptr;
-	size_t i;
-	
-	for (i=0; i<len; i++) {
-		p[i] = ch;
+	(void)data1;
+	(void)data2;
+
+	while(1)
+	{
+		clocksleep_nsecs(LOADCTL_NSECS);
+		loadctl_tick();
 	}
 }
+#endif
 
-/* Zero a page. Called during allocation */
-/* Calls function above. Might need to change later,
-but works for KVAs at the time being 
-//TODO use UIO word-aligned setting
-for better performance?? */
-static
 void
-zero_page(size_t page_num)
+vm_loadctl_bootstrap(void)
 {
-	vaddr_t ptr = PADDR_TO_KVADDR(core_map[page_num].pa);
+#if defined(SWAPPING_ENABLED) && defined(LOADCTL_ENABLED)
+	int result;
 
-	memset((void*) ptr,'\0',PAGE_SIZE);
+	result = thread_fork("loadctl", loadctl_thread, NULL, 0, NULL);
+	if(result)
+	{
+		panic("vm_loadctl_bootstrap: thread_fork failed: %s\n", strerror(result));
+	}
+#endif
 }
 
 /* Allocate a page for use by the kernel */
@@ -821,15 +1925,13 @@ void
 allocate_fixed_page(size_t page_num)
 {
 	// KASSERT(spinlock_do_i_hold(&stealmem_lock));
-	KASSERT(core_map[page_num].state == FREE);
+	KASSERT(core_map[page_num].state == CACHED);
 	core_map[page_num].state = FIXED;
 	paddr_t pa = page_num * PAGE_SIZE;
 	core_map[page_num].pa = pa;
 	core_map[page_num].va = 0x0;
 	core_map[page_num].as = NULL;
-	zero_page(page_num);
-	free_pages--;
-	// DEBUG(DB_VM, "AF:%d\n",free_pages);
+	page_clear(page_num);
 }
 
 /* Allocate a page in a user address space */
@@ -838,13 +1940,21 @@ void
 allocate_nonfixed_page(size_t page_num, struct addrspace *as, vaddr_t va, int permissions)
 {
 	// KASSERT(spinlock_do_i_hold(&stealmem_lock));
-	KASSERT(core_map[page_num].state == FREE);
-	//Allocate a page
+	KASSERT(core_map[page_num].state == CACHED);
+	//This may run without the coremap lock, off this cpu's page cache.
+	//That's safe: the page is ours until it's DIRTY, and LOCKED keeps the
+	//pager off it. The caller holds as_lock, so nobody else changes this
+	//PTE, and the pager only touches PTEs of DIRTY pages, never this
+	//one. pgdir_walk clears a new page table before hanging it in the
+	//directory, so the pager never sees a half-made one.
 	core_map[page_num].state = LOCKED;
 	paddr_t pa = page_num * PAGE_SIZE;
 	core_map[page_num].pa = pa;
 	core_map[page_num].va = va;
 	core_map[page_num].as = as;
+	core_map[page_num].refcount = 1;
+	core_map[page_num].text_vnode = NULL;
+	core_map[page_num].shm = NULL;
 
 	//Get the page table for the virtual address.
 	struct page_table *pt = pgdir_walk(as,va,true);
@@ -855,16 +1965,15 @@ allocate_nonfixed_page(size_t page_num, struct addrspace *as, vaddr_t va, int pe
 	//Update the page table entry to point to the page we made.
 	size_t pt_index = VA_TO_PT_INDEX(va);
 	vaddr_t page_location = PADDR_TO_KVADDR(core_map[page_num].pa);
-	pt->table[pt_index] = PAGEVA_TO_PTE(page_location);
+	//Keep the modified bit across swap-in; the page's contents are the same.
+	pt->table[pt_index] = PAGEVA_TO_PTE(page_location) | (pt->table[pt_index] & PTE_MODIFIED);
 	// DEBUG(DB_VM, "VA:%p\n", (void*) va);
 	// DEBUG(DB_VM, "PTE:%p\n", (void*) pt->table[pt_index]);
 	// DEBUG(DB_VM, "PFN:%p\n", (void*) PTE_TO_PFN(pt->table[pt_index]));
 	//Add in permissions
 	pt->table[pt_index] |= permissions;
 
-	zero_page(page_num);
-	free_pages--;
-	// DEBUG(DB_VM, "A:%d\n",free_pages);
+	page_clear(page_num);
 }
 
 /* Pre-Allocate a Page in User Address Space. Simply Set Permissions*/
@@ -880,7 +1989,8 @@ pre_allocate_nonfixed_page(struct addrspace *as,vaddr_t va,int permissions)
 	pt->table[pt_index] |= permissions;
 }
 
-/* Called by free_kpages */
+/* Called by free_kpages. The page goes in this cpu's cache if it can,
+ * else back in the free pool. */
 static
 void 
 free_fixed_page(size_t page_num)
@@ -889,8 +1999,18 @@ free_fixed_page(size_t page_num)
 	core_map[page_num].va = 0x0;
 	core_map[page_num].as =  NULL;
 	core_map[page_num].npages = 0;
-	core_map[page_num].state = FREE;
-	free_pages++;
+	core_map[page_num].refcount = 0;
+	if(core_map[page_num].text_vnode != NULL)
+	{
+		text_page_remove(&core_map[page_num]);
+	}
+	core_map[page_num].shm = NULL;
+	core_map[page_num].zeroed = false;
+	if(!pagecache_put(page_num))
+	{
+		core_map[page_num].state = FREE;
+		free_pages++;
+	}
 
 	// DEBUG(DB_VM, "FR:%d\n",free_pages);
 	// if(core_map[page_num].as != NULL)
@@ -899,12 +2019,41 @@ free_fixed_page(size_t page_num)
 	// }
 }
 
+/* Set up page PAGE_NUM, taken off the free pool or out of a page cache,
+ * for the kernel (AS NULL) or for VA in AS. */
+static
+void
+page_setup(size_t page_num, struct addrspace *as, vaddr_t va, int permissions)
+{
+	if(as == NULL)
+	{
+		KASSERT(va == 0x0);
+		// DEBUG(DB_SWAP, "Getting page %d for FIXED\n",page_num);
+		allocate_fixed_page(page_num);
+	}
+	else
+	{
+		KASSERT(va != 0x0);
+		// DEBUG(DB_SWAP, "Getting page %d for %p\n",page_num, (void*) va);
+		allocate_nonfixed_page(page_num,as,va,permissions);
+	}
+	core_map[page_num].npages = 1;
+}
+
 /* Allocate a page. Either kernel or user. */
 struct page *
 page_alloc(struct addrspace* as, vaddr_t va, int permissions)
 {
 	//int spl = splhigh();
 	//bool lock = get_coremap_lock();
+	size_t i;
+
+	//Usually this cpu has a page to hand, and the coremap lock isn't needed.
+	if(pagecache_get(&i))
+	{
+		page_setup(i, as, va, permissions);
+		return &core_map[i];
+	}
 
 	//KASSERT(spinlock_do_i_hold(&stealmem_lock));
 	// DEBUG(DB_SWAP, "Need page for %p\n",(void*) va);
@@ -918,29 +2067,21 @@ page_alloc(struct addrspace* as, vaddr_t va, int permissions)
 	int j = 0;
 	while(j < 7){
 		bool lock = get_coremap_lock();
-		for(size_t i = 0;i<page_count;i++)
+		i = find_free_page();
+		if(i == page_count)
 		{
-			//int spl = splhigh();
-			if(core_map[i].state == FREE)
-			{
-				if(as == NULL)
-				{
-					KASSERT(va == 0x0);
-					// DEBUG(DB_SWAP, "Getting page %d for FIXED\n",i);
-					allocate_fixed_page(i);				
-				}
-				else
-				{
-					KASSERT(va != 0x0);
-					// DEBUG(DB_SWAP, "Getting page %d for %p\n",i, (void*) va);
-					allocate_nonfixed_page(i,as,va,permissions);
-				}
-				core_map[i].npages = 1;
-				//release_coremap_lock(lock);
-				//splx(spl);
-				release_coremap_lock(lock);
-				return &core_map[i];
-			}
+			//Other cpus may be sitting on the last few.
+			pagecache_drain();
+			i = find_free_page();
+		}
+		if(i < page_count)
+		{
+			page_unfree(i);
+			page_setup(i, as, va, permissions);
+			//While we're here, stock up for next time.
+			pagecache_refill();
+			release_coremap_lock(lock);
+			return &core_map[i];
 		}
 		release_coremap_lock(lock);
 		#ifdef SWAPPING_ENABLED
@@ -972,6 +2113,187 @@ page_prealloc(struct addrspace *as, vaddr_t va, int permissions)
 	pre_allocate_nonfixed_page(as,va,permissions);
 }
 
+/* Look for a resident copy of the text page at VA of executable VN,
+ * left there by another process running the same program. If there is
+ * one, map it into AS with PERMISSIONS and return true.
+ */
+bool
+text_page_find(struct addrspace *as, vaddr_t va, struct vnode *vn, int permissions)
+{
+	bool lock = get_coremap_lock();
+	struct page *page;
+	for(page = text_hash[TEXT_HASH(vn, va)]; page != NULL; page = page->text_next)
+	{
+		//Only settled pages: not still being read in, nor on their way out.
+		if(page->text_vnode == vn && page->va == va && page->state == DIRTY)
+		{
+			page->refcount++;
+			struct page_table *pt = pgdir_walk(as,va,true);
+			pt->table[VA_TO_PT_INDEX(va)] =
+				PAGEVA_TO_PTE(PADDR_TO_KVADDR(page->pa)) | permissions;
+			release_coremap_lock(lock);
+			return true;
+		}
+	}
+	release_coremap_lock(lock);
+	return false;
+}
+
+/* PAGE, at its VA, is text read in from executable VN: make it one
+ * text_page_find can hand out.
+ */
+static
+void
+text_page_add(struct page *page, struct vnode *vn)
+{
+	bool lock = get_coremap_lock();
+	size_t h = TEXT_HASH(vn, page->va);
+	KASSERT(page->text_vnode == NULL);
+	page->text_vnode = vn;
+	page->text_next = text_hash[h];
+	text_hash[h] = page;
+	release_coremap_lock(lock);
+}
+
+/* PAGE is being freed; take it out of its text chain. Text pages are
+ * user pages, only ever freed with the coremap lock held.
+ */
+static
+void
+text_page_remove(struct page *page)
+{
+	struct page **pp;
+
+	KASSERT(coremap_lock_do_i_hold());
+	for(pp = &text_hash[TEXT_HASH(page->text_vnode, page->va)]; *pp != page;
+	    pp = &(*pp)->text_next)
+	{
+		KASSERT(*pp != NULL);
+	}
+	*pp = page->text_next;
+	page->text_vnode = NULL;
+	page->text_next = NULL;
+}
+
+/* Pin the page at VA of AS, which need not be the current address
+ * space, so the kernel can read or write it through KSEG0 without the
+ * pager taking it away. Only pages already in memory qualify (we can't
+ * fault on another process's behalf); returns 0 otherwise, or if WRITE
+ * is set and the page isn't writable. Undo with page_unpin_user.
+ */
+vaddr_t
+page_pin_user(struct addrspace *as, vaddr_t va, bool write)
+{
+	vaddr_t kva = 0;
+
+	if(va >= USERSPACETOP)
+	{
+		return 0;
+	}
+
+	bool lock = get_coremap_lock();
+	struct page_table *pt = pgdir_walk(as,va,false);
+	if(pt != NULL)
+	{
+		int *pte = &(pt->table[VA_TO_PT_INDEX(va)]);
+		paddr_t pa = PTE_TO_PFN(*pte);
+		if(pa != 0 && PTE_TO_LOCATION(*pte) == PTE_PM &&
+		   (!write || (PTE_TO_PERMISSIONS(*pte) & PF_W)) &&
+		   core_map[pa / PAGE_SIZE].state == DIRTY)
+		{
+			core_map[pa / PAGE_SIZE].state = LOCKED;
+			if(write)
+			{
+				*pte |= PTE_MODIFIED;
+			}
+			kva = PADDR_TO_KVADDR(pa) | (va & SUB_FRAME);
+		}
+	}
+	release_coremap_lock(lock);
+	return kva;
+}
+
+void
+page_unpin_user(vaddr_t kva)
+{
+	bool lock = get_coremap_lock();
+	struct page *page = &core_map[KVADDR_TO_PADDR(kva) / PAGE_SIZE];
+	KASSERT(page->state == LOCKED);
+	page->state = DIRTY;
+	release_coremap_lock(lock);
+}
+
+/* Get a page for shared memory segment SEG. Any free page will do; we
+ * take it as a kernel page and hand it over to the segment.
+ */
+struct page *
+page_alloc_shm(struct shm_segment *seg, size_t index)
+{
+	KASSERT(coremap_lock_do_i_hold());
+	struct page *page = page_alloc(NULL, 0x0, 0);
+	KASSERT(page->state == FIXED);
+	page->state = LOCKED;
+	page->shm = seg;
+	page->va = index * PAGE_SIZE;
+	page->refcount = 1;
+	return page;
+}
+
+struct page *
+coremap_page(paddr_t pa)
+{
+	KASSERT(pa / PAGE_SIZE < page_count);
+	return &core_map[pa / PAGE_SIZE];
+}
+
+/* Called by as_copy: if PTE maps a text page, map the same page at VA in
+ * AS rather than copying it, and return true.
+ */
+bool
+page_share(struct addrspace *as, vaddr_t va, int pte)
+{
+	if(PTE_TO_PFN(pte) == 0 || PTE_TO_LOCATION(pte) != PTE_PM)
+	{
+		return false;
+	}
+
+	bool lock = get_coremap_lock();
+	struct page *page = &core_map[PTE_TO_PFN(pte) / PAGE_SIZE];
+	if(page->text_vnode == NULL || page->state != DIRTY)
+	{
+		release_coremap_lock(lock);
+		return false;
+	}
+	page->refcount++;
+	struct page_table *pt = pgdir_walk(as,va,true);
+	pt->table[VA_TO_PT_INDEX(va)] = pte;
+	release_coremap_lock(lock);
+	return true;
+}
+
+/* AS is done with the user page at PA. Free it, unless other address
+ * spaces are still using it.
+ */
+void
+page_release(struct addrspace *as, paddr_t pa)
+{
+	bool lock = get_coremap_lock();
+	struct page *page = &core_map[pa / PAGE_SIZE];
+	if(page->refcount > 1)
+	{
+		page->refcount--;
+		if(page->as == as)
+		{
+			page->as = NULL;
+		}
+	}
+	else
+	{
+		free_kpages(PADDR_TO_KVADDR(pa));
+	}
+	release_coremap_lock(lock);
+}
+
 
 
 
@@ -980,49 +2302,59 @@ static
 vaddr_t
 page_nalloc(int npages)
 {
+	#ifdef SWAPPING_ENABLED
+	//Make a page available for allocation, if needed. Before taking the
+	//coremap lock, so the pager can drop it while it writes.
+	make_pages_available(npages,false);
+	#endif
+
 	bool lock = get_coremap_lock();
 	//KASSERT(spinlock_do_i_hold(&stealmem_lock));
 	bool blockStarted = false;
 	int pagesFound = 0;
 	int startingPage = 0;
 
-	#ifdef SWAPPING_ENABLED
-	//Make a page available for allocation, if needed.
-	make_pages_available(npages,false);
-	#endif
-
 	int spl = splhigh();
-	for(size_t i = 0;i<page_count;i++)
+	//Twice: if there's no run the first time, cached pages may be
+	//breaking one up, so give them back and look again.
+	for(int pass = 0; pass < 2; pass++)
 	{
-		if(!blockStarted && core_map[i].state == FREE)
-		{
-			blockStarted = true;
-			pagesFound = 1;
-			startingPage = i;
-		}
-		else if(blockStarted && core_map[i].state != FREE)
-		{
-			blockStarted = false;
-			pagesFound = 0;
-		}
-		else if(blockStarted && core_map[i].state == FREE)
-		{
-			pagesFound++;
-		}
-		if(pagesFound == npages)
+		blockStarted = false;
+		pagesFound = 0;
+		for(size_t i = 0;i<page_count;i++)
 		{
-			// DEBUG(DB_SWAP, "Getting %d npages %d-%d for FIXED\n",npages,startingPage,startingPage+npages-1);
-			//KASSERT(spinlock_do_i_hold(&stealmem_lock));
-			//Allocate the block of pages, now.
-			for(int j = startingPage; j<startingPage + npages; j++)
+			if(!blockStarted && core_map[i].state == FREE)
 			{
-				allocate_fixed_page(j);
+				blockStarted = true;
+				pagesFound = 1;
+				startingPage = i;
+			}
+			else if(blockStarted && core_map[i].state != FREE)
+			{
+				blockStarted = false;
+				pagesFound = 0;
+			}
+			else if(blockStarted && core_map[i].state == FREE)
+			{
+				pagesFound++;
+			}
+			if(pagesFound == npages)
+			{
+				// DEBUG(DB_SWAP, "Getting %d npages %d-%d for FIXED\n",npages,startingPage,startingPage+npages-1);
+				//KASSERT(spinlock_do_i_hold(&stealmem_lock));
+				//Allocate the block of pages, now.
+				for(int j = startingPage; j<startingPage + npages; j++)
+				{
+					page_unfree(j);
+					allocate_fixed_page(j);
+				}
+				core_map[startingPage].npages = npages;
+				release_coremap_lock(lock);
+				splx(spl);
+				return PADDR_TO_KVADDR(core_map[startingPage].pa);
 			}
-			core_map[startingPage].npages = npages;
-			release_coremap_lock(lock);
-			splx(spl);
-			return PADDR_TO_KVADDR(core_map[startingPage].pa);
 		}
+		pagecache_drain();
 	}
 	panic("Couldn't find a big enough chunk for npages!");
 	return 0x0;	
@@ -1054,6 +2386,127 @@ vaddr_t alloc_kpages(int npages)
 	return t;
 }
 
+/* Find NPAGES free pages in a row of kseg2 and mark them used; returns
+ * the first, or KVM_PAGES if there's no such run. Call with kvm_lock held.
+ */
+static
+size_t
+kvm_reserve(size_t npages)
+{
+	size_t run = 0;
+
+	for(size_t i = 0; i < KVM_PAGES; i++)
+	{
+		run = (kvm_state[i] == KVM_FREE) ? run + 1 : 0;
+		if(run == npages)
+		{
+			size_t first = i + 1 - npages;
+			for(size_t j = first; j <= i; j++)
+			{
+				kvm_state[j] = KVM_USED;
+			}
+			kvm_npages[first] = npages;
+			return first;
+		}
+	}
+	return KVM_PAGES;
+}
+
+/* Allocate NPAGES of kernel memory that needn't be physically contiguous.
+ * Each page is an ordinary kernel page, and they're mapped in a row in
+ * kseg2 and loaded into the TLB by kvm_fault. Freed kseg2 addresses
+ * aren't given out again until every cpu has flushed its TLB, which is
+ * done only when we run out of them, so freeing needn't send any IPIs.
+ * Falls back on contiguous pages from alloc_kpages for single pages,
+ * before the VM is up, or if kseg2 is full. (So thread stacks, which are
+ * one page, stay in kseg0, where the trap code can use them without a
+ * TLB entry.)
+ */
+vaddr_t alloc_kvpages(int npages)
+{
+	size_t first, purging = 0;
+
+	if(npages <= 1 || !vm_initialized || npages > KVM_PAGES)
+	{
+		return alloc_kpages(npages);
+	}
+
+	spinlock_acquire(&kvm_lock);
+	first = kvm_reserve(npages);
+	if(first == KVM_PAGES && curthread->t_curspl == 0 && !kvm_purger)
+	{
+		//Out of room: flush every TLB so freed addresses can be reused.
+		//Only ones freed before the flush started count. If someone
+		//else is already flushing, use kseg0 rather than wait.
+		kvm_purger = true;
+		for(size_t i = 0; i < KVM_PAGES; i++)
+		{
+			if(kvm_state[i] == KVM_STALE)
+			{
+				kvm_state[i] = KVM_PURGING;
+				purging++;
+			}
+		}
+		spinlock_release(&kvm_lock);
+		if(purging > 0)
+		{
+			as_shootdown(NULL);
+		}
+		spinlock_acquire(&kvm_lock);
+		for(size_t i = 0; i < KVM_PAGES; i++)
+		{
+			if(kvm_state[i] == KVM_PURGING)
+			{
+				kvm_state[i] = KVM_FREE;
+			}
+		}
+		kvm_purger = false;
+		first = kvm_reserve(npages);
+	}
+	spinlock_release(&kvm_lock);
+	if(first == KVM_PAGES)
+	{
+		return alloc_kpages(npages);
+	}
+
+	for(size_t i = first; i < first + npages; i++)
+	{
+		kvm_map[i] = KVADDR_TO_PADDR(alloc_kpages(1));
+	}
+	return MIPS_KSEG2 + first * PAGE_SIZE;
+}
+
+/* Free memory from alloc_kvpages at kseg2 address ADDR. */
+static
+void
+kvm_free(vaddr_t addr)
+{
+	size_t first = (addr - MIPS_KSEG2) / PAGE_SIZE;
+	size_t npages;
+	paddr_t pa;
+
+	if(first >= KVM_PAGES || addr % PAGE_SIZE != 0 ||
+	   kvm_state[first] != KVM_USED || kvm_npages[first] == 0)
+	{
+		panic("VA Doesn't exist!");
+	}
+	npages = kvm_npages[first];
+	for(size_t i = first; i < first + npages; i++)
+	{
+		pa = kvm_map[i];
+		kvm_map[i] = 0;
+		free_kpages(PADDR_TO_KVADDR(pa));
+	}
+
+	spinlock_acquire(&kvm_lock);
+	kvm_npages[first] = 0;
+	for(size_t i = first; i < first + npages; i++)
+	{
+		kvm_state[i] = KVM_STALE;
+	}
+	spinlock_release(&kvm_lock);
+}
+
 /* Free a page, either user or kernel. */
 void free_kpages(vaddr_t addr)
 {
@@ -1061,6 +2514,11 @@ void free_kpages(vaddr_t addr)
 	{
 		panic("Tried to free a direct-mapped address\n");	
 	}
+	if(addr >= MIPS_KSEG2)
+	{
+		kvm_free(addr);
+		return;
+	}
 	
 	// bool lock = get_coremap_lock();
 	/* Disable interrupts on this CPU while frobbing the TLB. */
@@ -1069,25 +2527,20 @@ void free_kpages(vaddr_t addr)
 
 	// kprintf("Freeing VA:%p\n", (void*) addr);
 	KASSERT(page_count > 0);
-	for(size_t i = 0;i<page_count;i++)
+	//The coremap is indexed by physical page, so no need to search it.
+	size_t i = KVADDR_TO_PADDR(addr) / PAGE_SIZE;
+	if(i >= page_count || core_map[i].pa != KVADDR_TO_PADDR(addr) ||
+	   core_map[i].npages == 0)
 	{
-		vaddr_t page_location = PADDR_TO_KVADDR(core_map[i].pa);
-		// DEBUG(DB_VM, "Page locaion:%p\n", (void*) page_location);
-		if(addr == page_location)
-		{
-			// size_t target = i + core_map[i].npages;
-			for(size_t j = i; j<i+core_map[i].npages;j++)
-			{
-				// DEBUG(DB_SWAP, "FREE %p\n",&core_map[j]);
-				free_fixed_page(j);
-			}
-			// release_coremap_lock(lock);
-			//release_coremap_lock(lock);
-			//splx(spl);
-			return;
-		}
+		panic("VA Doesn't exist!");
+	}
+	//free_fixed_page clears npages, so read it first.
+	size_t npages = core_map[i].npages;
+	for(size_t j = i; j<i+npages;j++)
+	{
+		// DEBUG(DB_SWAP, "FREE %p\n",&core_map[j]);
+		free_fixed_page(j);
 	}
-	panic("VA Doesn't exist!");
 }
 
 void unlock_loading_pages(struct addrspace *as)
@@ -1120,27 +2573,32 @@ void vm_tlbshootdown_all(void)
 	return;
 }
 
-void vm_tlbshootdown(const struct tlbshootdown *ts)
+/* Invalidate the N entries in TS that this cpu's TLB might hold, all
+ * under one splhigh. Entries for an address space other than the one
+ * we're running can't be in the TLB (as_activate flushes it), so they
+ * are skipped. */
+void vm_tlbshootdown(const struct tlbshootdown *ts, int n)
 {
-	//(void)ts;
-
 	int tlb_entry, spl;
 
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	bool lock = get_coremap_spinlock();
 	spl = splhigh();
-	// Probe TLB so see if particular VA is present.
-	tlb_entry = tlb_probe(VA_TO_VPF(ts->ts_vaddr), 0);
-	if(tlb_entry < 0) {
-		// No entry found, so shoot down succeeded
-		splx(spl);
-		return;
+	for(int i = 0; i < n; i++)
+	{
+		if(ts[i].ts_addrspace != NULL && ts[i].ts_addrspace != curcpu->c_curas)
+		{
+			continue;
+		}
+		// Probe TLB so see if particular VA is present.
+		tlb_entry = tlb_probe(VA_TO_VPF(ts[i].ts_vaddr), 0);
+		if(tlb_entry >= 0)
+		{
+			// Invalidate the particular TLB entry
+			tlb_write(TLBHI_INVALID(tlb_entry), TLBLO_INVALID(), tlb_entry);
+		}
 	}
 
-	// Invalidate the particular TLB entry
-	tlb_write(TLBHI_INVALID(tlb_entry), TLBLO_INVALID(), tlb_entry);
-
 	splx(spl);
 	release_coremap_spinlock(lock);
-
 }
@@ -92,6 +92,8 @@ release_swap_spinlock(bool release)
 
 static char swap_disk_file[] = "swapfile";
 
+static void zcache_init(void);
+
 /* Initialization of the swap disk and the swap table. This one is for the swapfile version,
 	the raw disk version is above. */
 int swapspace_init(void)
@@ -118,12 +120,13 @@ int swapspace_init(void)
 	// TODO: is the NULL init correct below?
 	for (int i = 0; i < SWAP_MAX; i++) {
 		//swap_table[i]->page = NULL;
-		swap_table[i].as = NULL;
+		swap_table[i].owner = NULL;
 	}
 
 	// Need the swap lock from now on to protect the swap table.
 	swap_lock = lock_create("swap_lock");
 	spinlock_init(&swap_spinlock);
+	zcache_init();
 
 	kprintf("Swap Init Done.\n");
 
@@ -144,16 +147,16 @@ int swapspace_init(void)
 }
 
 
-/* SWAPFILE VERSION: Contains uio setup and execution for writting page to disk file. */
+/* SWAPFILE VERSION: Contains uio setup and execution for writting the page at
+	kernel address PAGE to disk file. */
 static
-int write_page(int swap_index, paddr_t page)
+int disk_write_page(int swap_index, vaddr_t page)
 {
 	struct thread *thread = curthread;
 	(void)thread;
 
 	//KASSERT(coremap_lock_do_i_hold());
 
-	page = PADDR_TO_KVADDR(page);
 	int result = 0;
 
 	struct iovec iov;
@@ -174,14 +177,14 @@ int write_page(int swap_index, paddr_t page)
 	return result;
 }
 
-/* SWAPFILE VERSION: Contains uio setup and execution for reading page from disk file. */
+/* SWAPFILE VERSION: Contains uio setup and execution for reading page from disk
+	file into kernel address PAGE. */
 static
-int read_page(int swap_index, paddr_t page)
+int disk_read_page(int swap_index, vaddr_t page)
 {
 	struct thread *thread = curthread;
 	(void)thread;
 	// KASSERT(coremap_lock_do_i_hold());
-	page = PADDR_TO_KVADDR(page);
 	int result = 0;
 
 	struct iovec iov;
@@ -201,6 +204,352 @@ int read_page(int swap_index, paddr_t page)
 	return result;
 }
 
+/**********************************************************************************
+	Compressed swap cache. A page written to swap is first offered to an
+	in-memory pool: if it's all one 32 bit word (most often zero) only the
+	word is kept, else it's packed with a small WKdm style coder (each word
+	is zero, a repeat of a recently seen word, a recent word with new low
+	bits, or new) and kept if that at least halves it. Pages that don't pack
+	go straight to disk, and when the pool fills the oldest packed pages are
+	written out to their disk slots to make room. Reading a page back from
+	the pool is a decompression rather than a disk read.
+
+	Entries are indexed like swap_table and protected by the swap lock.
+**********************************************************************************/
+
+#define ZCACHE_PAGES	32				// Size of the packed page pool
+#define ZCACHE_CHUNK	64				// Allocation unit in the pool
+#define ZCACHE_CHUNKS	(ZCACHE_PAGES * PAGE_SIZE / ZCACHE_CHUNK)
+#define ZCACHE_MAXPACKED	(PAGE_SIZE / 2)	// Worst packing worth keeping
+
+#define ZC_WORDS	(PAGE_SIZE / sizeof(uint32_t))
+#define ZC_TAGBYTES	(ZC_WORDS / 4)			// Two bit tag per word
+#define ZC_DICT		16				// Recently seen words
+#define ZC_HASH(w)	((((w) >> 10) * 2654435761U) >> 28)
+
+/* Word tags */
+#define ZC_ZERO		0	// Zero
+#define ZC_EXACT	1	// Same as a dictionary word: index
+#define ZC_PARTIAL	2	// Dictionary word with new low 10 bits: index, bits
+#define ZC_MISS		3	// New word: the word
+
+/* Where a slot's page is */
+#define ZC_DISK		0	// On disk (if the slot is in use at all)
+#define ZC_SAME		1	// In memory, every word ze_word
+#define ZC_PACKED	2	// In memory, packed in the pool
+
+struct zcache_entry {
+	int ze_kind;
+	uint32_t ze_word;		// ZC_SAME: what the page is full of
+	unsigned ze_chunk;		// ZC_PACKED: where it is in the pool,
+	unsigned ze_nchunks;		// and how much of it
+	unsigned ze_age;		// When it went in, to spill the oldest
+};
+
+static struct zcache_entry zcache[SWAP_MAX];
+static char *zcache_pool;
+static bool zcache_used[ZCACHE_CHUNKS];
+static unsigned zcache_clock;
+static uint8_t *zcache_scratch;		// Packing happens here
+static uint32_t *zcache_bounce;		// Unpacking for spills happens here
+
+/* Pack the page IN into OUT; returns the size, or 0 if it would take
+	more than LIMIT bytes. */
+static
+size_t zcache_pack(const uint32_t *in, uint8_t *out, size_t limit)
+{
+	uint32_t dict[ZC_DICT];
+	size_t pos = ZC_TAGBYTES;
+	unsigned i, tag, d;
+	uint32_t w;
+
+	bzero(dict, sizeof(dict));
+	bzero(out, ZC_TAGBYTES);
+	for (i = 0; i < ZC_WORDS; i++) {
+		w = in[i];
+		d = ZC_HASH(w);
+		if (w == 0) {
+			tag = ZC_ZERO;
+		}
+		else if (dict[d] == w) {
+			if (pos + 1 > limit) {
+				return 0;
+			}
+			tag = ZC_EXACT;
+			out[pos++] = d;
+		}
+		else if ((dict[d] >> 10) == (w >> 10)) {
+			if (pos + 3 > limit) {
+				return 0;
+			}
+			tag = ZC_PARTIAL;
+			out[pos++] = d;
+			out[pos++] = w & 0xff;
+			out[pos++] = (w >> 8) & 0x3;
+			dict[d] = w;
+		}
+		else {
+			if (pos + 4 > limit) {
+				return 0;
+			}
+			tag = ZC_MISS;
+			out[pos++] = w & 0xff;
+			out[pos++] = (w >> 8) & 0xff;
+			out[pos++] = (w >> 16) & 0xff;
+			out[pos++] = w >> 24;
+			dict[d] = w;
+		}
+		out[i / 4] |= tag << ((i % 4) * 2);
+	}
+	return pos;
+}
+
+/* Unpack what zcache_pack made into the page OUT. */
+static
+void zcache_unpack(const uint8_t *in, uint32_t *out)
+{
+	uint32_t dict[ZC_DICT];
+	size_t pos = ZC_TAGBYTES;
+	unsigned i, d;
+	uint32_t w = 0;
+
+	bzero(dict, sizeof(dict));
+	for (i = 0; i < ZC_WORDS; i++) {
+		switch ((in[i / 4] >> ((i % 4) * 2)) & 3) {
+		    case ZC_ZERO:
+			w = 0;
+			break;
+		    case ZC_EXACT:
+			w = dict[in[pos++]];
+			break;
+		    case ZC_PARTIAL:
+			d = in[pos++];
+			w = (dict[d] & ~(uint32_t)0x3ff) | in[pos] |
+				((uint32_t)(in[pos+1] & 0x3) << 8);
+			pos += 2;
+			dict[d] = w;
+			break;
+		    case ZC_MISS:
+			w = in[pos] | ((uint32_t)in[pos+1] << 8) |
+				((uint32_t)in[pos+2] << 16) | ((uint32_t)in[pos+3] << 24);
+			pos += 4;
+			dict[ZC_HASH(w)] = w;
+			break;
+		}
+		out[i] = w;
+	}
+}
+
+/* Forget what the pool holds for slot SWAP_INDEX. */
+static
+void zcache_drop(int swap_index)
+{
+	struct zcache_entry *ze = &zcache[swap_index];
+
+	if (ze->ze_kind == ZC_PACKED) {
+		for (unsigned c = 0; c < ze->ze_nchunks; c++) {
+			zcache_used[ze->ze_chunk + c] = false;
+		}
+	}
+	ze->ze_kind = ZC_DISK;
+}
+
+/* Find NCHUNKS free chunks in a row in the pool; -1 if there aren't. */
+static
+int zcache_alloc(unsigned nchunks)
+{
+	unsigned run = 0;
+
+	for (unsigned c = 0; c < ZCACHE_CHUNKS; c++) {
+		run = zcache_used[c] ? 0 : run + 1;
+		if (run == nchunks) {
+			for (unsigned k = c + 1 - nchunks; k <= c; k++) {
+				zcache_used[k] = true;
+			}
+			return c + 1 - nchunks;
+		}
+	}
+	return -1;
+}
+
+/* Make room by writing the oldest packed page out to its disk slot.
+	Returns false if there's nothing left to spill. */
+static
+bool zcache_spill(void)
+{
+	int oldest = -1;
+	int result;
+
+	for (int i = 0; i < SWAP_MAX; i++) {
+		if (zcache[i].ze_kind == ZC_PACKED &&
+		    (oldest < 0 || zcache[i].ze_age - zcache[oldest].ze_age > (~0U >> 1))) {
+			oldest = i;
+		}
+	}
+	if (oldest < 0) {
+		return false;
+	}
+
+	zcache_unpack((uint8_t *)zcache_pool + zcache[oldest].ze_chunk * ZCACHE_CHUNK,
+		      zcache_bounce);
+	result = disk_write_page(oldest, (vaddr_t)zcache_bounce);
+	if (result) {
+		panic("zcache: can't spill to swap: %s\n", strerror(result));
+	}
+	zcache_drop(oldest);
+	return true;
+}
+
+/* Keep the page at kernel address PAGE in the pool as slot SWAP_INDEX, if
+	it's worth it; false if it should go to disk instead. */
+static
+bool zcache_put(int swap_index, vaddr_t page)
+{
+	const uint32_t *words = (const uint32_t *)page;
+	struct zcache_entry *ze = &zcache[swap_index];
+	unsigned i, nchunks;
+	size_t len;
+	int chunk;
+
+	for (i = 1; i < ZC_WORDS && words[i] == words[0]; i++);
+	if (i == ZC_WORDS) {
+		ze->ze_kind = ZC_SAME;
+		ze->ze_word = words[0];
+		return true;
+	}
+
+	len = zcache_pack(words, zcache_scratch, ZCACHE_MAXPACKED);
+	if (len == 0) {
+		return false;
+	}
+	nchunks = (len + ZCACHE_CHUNK - 1) / ZCACHE_CHUNK;
+	while ((chunk = zcache_alloc(nchunks)) < 0) {
+		if (!zcache_spill()) {
+			return false;
+		}
+	}
+	memcpy(zcache_pool + chunk * ZCACHE_CHUNK, zcache_scratch, len);
+	ze->ze_kind = ZC_PACKED;
+	ze->ze_chunk = chunk;
+	ze->ze_nchunks = nchunks;
+	ze->ze_age = zcache_clock++;
+	return true;
+}
+
+/* Set up the pool; if there's no memory for it, swap just goes to disk. */
+static
+void zcache_init(void)
+{
+	for (int i = 0; i < SWAP_MAX; i++) {
+		zcache[i].ze_kind = ZC_DISK;
+	}
+	zcache_pool = kmalloc(ZCACHE_PAGES * PAGE_SIZE);
+	zcache_scratch = kmalloc(PAGE_SIZE);
+	zcache_bounce = kmalloc(PAGE_SIZE);
+	if (zcache_pool == NULL || zcache_scratch == NULL || zcache_bounce == NULL) {
+		kprintf("No memory for the compressed swap cache.\n");
+		kfree(zcache_pool);
+		kfree(zcache_scratch);
+		kfree(zcache_bounce);
+		zcache_pool = NULL;
+	}
+}
+
+/* Write the page at PA to slot SWAP_INDEX: into the pool if it packs,
+	else to disk. */
+static
+int write_page(int swap_index, paddr_t pa)
+{
+	vaddr_t page = PADDR_TO_KVADDR(pa);
+	bool sw_lock = get_swap_lock();
+	bool kept;
+
+	zcache_drop(swap_index);
+	kept = zcache_pool != NULL && zcache_put(swap_index, page);
+	release_swap_lock(sw_lock);
+	if (kept) {
+		return 0;
+	}
+	return disk_write_page(swap_index, page);
+}
+
+/* Read slot SWAP_INDEX into the page at PA, from the pool or from disk.
+	Whoever reads a page back writes it out again before it's read again,
+	so the pool copy can go now. */
+static
+int read_page(int swap_index, paddr_t pa)
+{
+	vaddr_t page = PADDR_TO_KVADDR(pa);
+	bool sw_lock = get_swap_lock();
+	struct zcache_entry *ze = &zcache[swap_index];
+	uint32_t *words = (uint32_t *)page;
+
+	switch (ze->ze_kind) {
+	    case ZC_SAME:
+		for (unsigned i = 0; i < ZC_WORDS; i++) {
+			words[i] = ze->ze_word;
+		}
+		break;
+	    case ZC_PACKED:
+		zcache_unpack((uint8_t *)zcache_pool + ze->ze_chunk * ZCACHE_CHUNK, words);
+		break;
+	    default:
+		release_swap_lock(sw_lock);
+		return disk_read_page(swap_index, page);
+	}
+	zcache_drop(swap_index);
+	release_swap_lock(sw_lock);
+	return 0;
+}
+
+/* Slot SWAP_INDEX is no longer anyone's. Call with the swap lock held. */
+static
+void swap_free_slot(int swap_index)
+{
+	swap_table[swap_index].owner = NULL;
+	zcache_drop(swap_index);
+}
+
+/* Find where page VA of OWNER is in swap; -1 if it isn't. Call with the
+	swap lock held. */
+static
+int swap_lookup(const void *owner, vaddr_t va)
+{
+	for (int i=0; i < SWAP_MAX; i++) {
+		if (swap_table[i].owner == owner && swap_table[i].va == va) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* Find a swap slot for page VA of OWNER: the one it already has, if any,
+	else a free one. */
+static
+int swap_slot(const void *owner, vaddr_t va)
+{
+	int swap_index = swap_lookup(owner, va);
+
+	// ...if not, find free swap space.
+	if (swap_index < 0) {
+		for (int i=0; i < SWAP_MAX; i++) {
+			if (swap_table[i].owner == NULL) {
+				swap_index = i;
+				break;
+			}
+		}
+	}
+
+	// Swap didn't exist and there are no free swaps left; oh dear...
+	// If no swap avialable, panic!!!
+	if (swap_index < 0) {
+		panic("Out of disk space!!!");
+	}
+	swap_table[swap_index].owner = owner;
+	swap_table[swap_index].va = va;
+	return swap_index;
+}
+
 /* SWAPFILE VERSION: Evict a CLEAN page from memory. Called by page swapping algorithm */
 
 int evict_page(struct page* page)
@@ -236,9 +585,18 @@ int evict_page(struct page* page)
 	// DEBUG(DB_SWAP, "PTE Location: %p\n", pte);
 	// DEBUG(DB_SWAP, "PTE Before: %p\n", (void*) *pte);
 
-	*pte &= 0xFFFFFFBF;		 // Flips the bit to indicate swapped
-	pte = &(pt->table[pt_index]);	
-	KASSERT(PTE_TO_LOCATION(*pte) == PTE_SWAP); // Check that the bit was set correctly.
+	if(as_page_refetchable(page->as, page->va, *pte))
+	{
+		// File page, not in swap: leave just the permissions, so the
+		// next fault reads it from the file again.
+		*pte = PTE_TO_PERMISSIONS(*pte);
+	}
+	else
+	{
+		*pte &= 0xFFFFFFBF;		 // Flips the bit to indicate swapped
+		pte = &(pt->table[pt_index]);	
+		KASSERT(PTE_TO_LOCATION(*pte) == PTE_SWAP); // Check that the bit was set correctly.
+	}
 	
 	// DEBUG(DB_SWAP, "PTE After: %p\n", (void*) *pte);
 	// Update the coremap to list the physical page as free
@@ -246,7 +604,7 @@ int evict_page(struct page* page)
 
 	vaddr_t page_location = PADDR_TO_KVADDR(page->pa);
 	free_kpages(page_location);
-	KASSERT(page->state == FREE);
+	KASSERT(page->state == FREE || page->state == CACHED);
 	// Unlock core map
 	//lock_release(core_map_lock);
 	release_coremap_lock(lock);
@@ -256,15 +614,16 @@ int evict_page(struct page* page)
 }
 
 /* SWAPFILE VERSION: Swap the specified page out to disk; maked page clean but
-	does NOT evict the page. */
+	does NOT evict the page. The caller has already shot it down in
+	every TLB (see pages_shootdown), and holds the as_lock of the
+	address space it belongs to. The write itself is done without the
+	coremap lock (unless the caller has it); SWAPPINGOUT keeps everyone
+	else off the page meanwhile. If the write fails the page is left
+	resident and DIRTY, and an error is returned. */
 int swapout_page(struct page* page)
 {	
 	// DEBUG(DB_SWAP,"SWO%d\n", page->pa/PAGE_SIZE);
 	bool lock = get_coremap_lock();
-	// Shootdown the TLB for all CPU's
-	struct tlbshootdown tlb;
-	tlb.ts_vaddr = page->va;
-	ipi_tlbshootdown_broadcast(&tlb);
 	//KASSERT(coremap_lock_do_i_hold());
 	// DEBUG(DB_SWAP,"O%p", page);
 	KASSERT(page->state == SWAPPINGOUT);
@@ -299,44 +658,43 @@ int swapout_page(struct page* page)
 	// Only handling singe pages right now
 	KASSERT(page->npages == 1);
 
-	// mark page as SWAPPING IN PROGRESS
-
-	// Lock the swap table while checking and updating it.
-	//bool sw_lock = get_swap_lock();
-	//bool sw_lock = get_swap_spinlock();
-
-	// Check swap space to see if this page is already there...
-	swap_index = -1;	// -1 is an invalid index
-	for (int i=0; i < SWAP_MAX; i++) {
-		if (swap_table[i].as == page->as && swap_table[i].va == page->va) {
-			swap_index = i;	
-			break;
+	// Pages of file mappings go back to their file (if shared and
+	// written) or nowhere at all (if unwritten), not to swap.
+	if(as_page_refetchable(page->as, page->va, *pte))
+	{
+		release_swap_lock(lock2);
+		if(*pte & PTE_MODIFIED)
+		{
+			struct vm_region *vr = as_find_region(page->as, page->va);
+			release_coremap_lock(lock);
+			result = vm_region_writeback(vr, page->va, page->pa);
+			lock = get_coremap_lock();
 		}
-	}
-
-	// ...if not, find free swap space.
-	if (swap_index < 0) {
-		for (int i=0; i < SWAP_MAX; i++) {
-			if (swap_table[i].as == NULL) {
-				swap_index = i;
-				break;
-			}
+		KASSERT(page->state == SWAPPINGOUT);
+		if(result)
+		{
+			//Couldn't write it back; keep it.
+			page->state = DIRTY;
+			*pte = PTE_IN_MEM(*pte);
+		}
+		else
+		{
+			page->state = CLEAN;
 		}
+		release_coremap_lock(lock);
+		return result;
 	}
 
-	// Swap didn't exist and there are no free swaps left; oh dear...
-	// If no swap avialable, panic!!!
-	if (swap_index < 0) {
-		panic("Out of disk space!!!");
-	}
-	// Write zeros to swap?
+	// mark page as SWAPPING IN PROGRESS
 
-	// Lock the swap_table lock, since it's shared
+	// Lock the swap table while checking and updating it.
+	//bool sw_lock = get_swap_lock();
+	//bool sw_lock = get_swap_spinlock();
 
-	// Update swap bit map for new location as occupied
-	// Update swap table so we can find this page later
-	swap_table[swap_index].as = page->as;
-	swap_table[swap_index].va = page->va;
+	// Check swap space to see if this page is already there, and if
+	// not find it free swap space; the table entry then says where to
+	// find it later.
+	swap_index = swap_slot(page->as, page->va);
 	if(page->state != SWAPPINGOUT)
 	{
 		kprintf("Page State: %d", page->state);
@@ -349,20 +707,28 @@ int swapout_page(struct page* page)
 
 	// Write page to disk; page should be marked for swapping out
 	KASSERT(page->state == SWAPPINGOUT);
-	write_page(swap_index, page->pa);
-	// Unlock the swap_lock
-
 	// Unlock core map to sleep
-	//lock_release(core_map_lock);
+	release_coremap_lock(lock);
+	result = write_page(swap_index, page->pa);
 
 	// sleep until swap to disk completes, so that others can run
 	// grab coremap lock
+	lock = get_coremap_lock();
 
 	// mark page as CLEAN; does not need a lock because the SWAPPING_OUT status 
 	// protects the state of the page at this point
 	KASSERT(page->state == SWAPPINGOUT);
-	page->state = CLEAN;
 	KASSERT(page->as != NULL);
+	if(result)
+	{
+		// Couldn't write it out; keep it. The slot stays assigned,
+		// as it does after a swap in.
+		page->state = DIRTY;
+		*pte = PTE_IN_MEM(*pte);
+		release_coremap_lock(lock);
+		return result;
+	}
+	page->state = CLEAN;
 	KASSERT(page->state == CLEAN);
 	// KASSERT(coremap_lock_do_i_hold());
 	// release coremap lock
@@ -405,13 +771,7 @@ int swapin_page(struct addrspace* as, vaddr_t va, struct page* page)
 	//bool sw_lock = get_swap_spinlock();
 
 	// Locate the swapped page in the swap table
-	swap_index = -1;	// -1 is an invalid index
-	for (int i=0; i < SWAP_MAX; i++) {
-		if (swap_table[i].as == as && swap_table[i].va == va) {
-			swap_index = i;
-			break;
-		}
-	}
+	swap_index = swap_lookup(as, va);
 
 	// Unlock swap table
 
@@ -467,15 +827,9 @@ clean_swapfile(struct addrspace* as, vaddr_t va)
 	bool sw_lock = get_swap_lock();
 	//bool sw_lock = get_swap_spinlock();
 
-	// Locate the swapped page in the swap table
-	int swap_index = -1;	// -1 is an invalid index
-	for (int i=0; i < SWAP_MAX; i++) {
-		// AS and VA must both match to identify page.
-		if (swap_table[i].as == as && swap_table[i].va == va) {
-			swap_index = i;
-			break;
-		}
-	}
+	// Locate the swapped page in the swap table; AS and VA must both
+	// match to identify page.
+	int swap_index = swap_lookup(as, va);
 
 	if (swap_index == -1) {
 		panic("Tried to clean a swap page that doesn't exist.\n");
@@ -485,7 +839,7 @@ clean_swapfile(struct addrspace* as, vaddr_t va)
 
 	// All we do is make the swap entry null, same as in swapspace_init(). 
 	//DEBUG(DB_SWAP,"Cleaning a swap page.\n");
-	swap_table[swap_index].as = NULL;
+	swap_free_slot(swap_index);
 
 	release_swap_lock(sw_lock);
 	//release_swap_spinlock(sw_lock);
@@ -493,4 +847,51 @@ clean_swapfile(struct addrspace* as, vaddr_t va)
 	return result;
 }
 
+/* Write the page at PA to swap as page VA of OWNER. */
+int
+swap_store(const void *owner, vaddr_t va, paddr_t pa)
+{
+	bool sw_lock = get_swap_lock();
+	int swap_index = swap_slot(owner, va);
+	release_swap_lock(sw_lock);
+
+	return write_page(swap_index, pa);
+}
+
+/* Read page VA of OWNER back from swap into PA. It won't be written to
+	the same place again unless it's swapped out again, so give up the slot. */
+int
+swap_load(const void *owner, vaddr_t va, paddr_t pa)
+{
+	bool sw_lock = get_swap_lock();
+	int swap_index = swap_lookup(owner, va);
+	if (swap_index < 0) {
+		panic("Tried to swap in a non-existant page.");
+	}
+	release_swap_lock(sw_lock);
+
+	int result = read_page(swap_index, pa);
+	if (result) {
+		return result;
+	}
+
+	sw_lock = get_swap_lock();
+	swap_free_slot(swap_index);
+	release_swap_lock(sw_lock);
+	return 0;
+}
+
+/* Page VA of OWNER is going away; forget its copy in swap. */
+void
+swap_discard(const void *owner, vaddr_t va)
+{
+	bool sw_lock = get_swap_lock();
+	int swap_index = swap_lookup(owner, va);
+	if (swap_index < 0) {
+		panic("Tried to clean a swap page that doesn't exist.\n");
+	}
+	swap_free_slot(swap_index);
+	release_swap_lock(sw_lock);
+}
+
 #endif
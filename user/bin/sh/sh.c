@@ -354,11 +354,16 @@ docommand(char *buf)
 		__time(&startsecs, &startnsecs);
 	}
 
-	pid = fork();
+	/*
+	 * vfork, since all the child does is exec: there's no point in
+	 * copying our address space only to throw it away.
+	 */
+	fflush(NULL);
+	pid = vfork();
 	switch (pid) {
 		case -1:
 			/* error */
-			warn("fork");
+			warn("vfork");
 			return _MKWAIT_EXIT(255);
 		case 0:
 			/* child */
@@ -41,6 +41,81 @@
 /* Constant returned by a bunch of stdio functions on error */
 #define EOF (-1)
 
+/* Default buffer size for streams */
+#define BUFSIZ 1024
+
+/* Buffering modes, for setvbuf */
+#define _IOFBF 0	/* fully buffered */
+#define _IOLBF 1	/* line buffered */
+#define _IONBF 2	/* unbuffered */
+
+/*
+ * A buffered I/O stream. The buffer holds either pending output
+ * (__SWRITING; f_pos bytes of it) or input read ahead (__SREADING;
+ * f_pos is the next byte to hand out, f_len the end of valid data),
+ * never both. Unbuffered streams use the one-byte f_onebuf.
+ *
+ * The fields are for libc internal use only.
+ */
+typedef struct __FILE {
+	int f_fd;		/* underlying file handle */
+	int f_flags;		/* __S* flags below */
+	int f_mode;		/* _IOFBF, _IOLBF, or _IONBF */
+	char *f_buf;		/* buffer */
+	size_t f_bufsize;	/* size of f_buf */
+	size_t f_pos;		/* position in f_buf */
+	size_t f_len;		/* end of input in f_buf */
+	char f_onebuf;		/* buffer for unbuffered streams */
+	struct __FILE *f_next;	/* next open stream, for fflush(NULL) */
+} FILE;
+
+/* f_flags bits (for libc internal use only) */
+#define __SRD		0x01	/* open for reading */
+#define __SWR		0x02	/* open for writing */
+#define __SEOF		0x04	/* hit end of file */
+#define __SERR		0x08	/* hit an error */
+#define __SREADING	0x10	/* buffer holds input */
+#define __SWRITING	0x20	/* buffer holds output */
+#define __SMALLOCBUF	0x40	/* f_buf came from malloc */
+#define __SMALLOCFILE	0x80	/* the FILE itself came from malloc */
+
+/* The standard streams */
+extern FILE __stdin, __stdout, __stderr;
+#define stdin	(&__stdin)
+#define stdout	(&__stdout)
+#define stderr	(&__stderr)
+
+/* stdio internals (for libc internal use only) */
+int __swsetup(FILE *);		/* get ready to write */
+int __srsetup(FILE *);		/* get ready to read */
+int __swflush(FILE *);		/* write out pending output */
+int __srefill(FILE *);		/* read more input into the buffer */
+void __slink(FILE *);		/* add to the list of open streams */
+void __sunlink(FILE *);		/* remove from it */
+
+/* Opening and closing streams */
+FILE *fopen(const char *path, const char *mode);
+int fclose(FILE *);
+int fflush(FILE *);		/* NULL means all streams */
+int setvbuf(FILE *, char *buf, int mode, size_t size);
+
+/* Stream I/O */
+size_t fread(void *ptr, size_t size, size_t nitems, FILE *);
+size_t fwrite(const void *ptr, size_t size, size_t nitems, FILE *);
+int fgetc(FILE *);
+int getc(FILE *);
+int fputc(int, FILE *);
+int putc(int, FILE *);
+int fputs(const char *, FILE *);
+int fprintf(FILE *, const char *fmt, ...);
+int vfprintf(FILE *, const char *fmt, __va_list ap);
+
+/* Stream state */
+int feof(FILE *);
+int ferror(FILE *);
+void clearerr(FILE *);
+int fileno(FILE *);
+
 /*
  * The actual guts of printf
  * (for libc internal use only)
@@ -63,10 +138,10 @@ int puts(const char *);
 /* Nonstandard C, hence the __. */
 int __puts(const char *);
 
-/* Writes one character. Returns it. */
+/* Writes one character to stdout. Returns it. */
 int putchar(int);
 
-/* Reads one character (0-255) or returns EOF on error. */
+/* Reads one character (0-255) from stdin or returns EOF on error. */
 int getchar(void);
 
 #endif /* _STDIO_H_ */
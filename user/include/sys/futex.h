@@ -0,0 +1,20 @@
+#ifndef _SYS_FUTEX_H_
+#define _SYS_FUTEX_H_
+
+/*
+ * Get the FUTEX_* operations from the kernel.
+ *
+ * FUTEX_WAIT sleeps until a FUTEX_WAKE on the same address, as long as
+ * *ADDR still holds VAL when the kernel looks (else it fails at once
+ * with EAGAIN); TIMEOUT, if not NULL, bounds the sleep (ETIMEDOUT).
+ * FUTEX_WAKE wakes up to VAL threads sleeping on ADDR and returns how
+ * many it woke. Locks built on this only need to call it when they
+ * have to sleep or there may be someone to wake.
+ */
+#include <sys/types.h>
+#include <kern/time.h>
+#include <kern/futex.h>
+
+int futex(volatile int *addr, int op, int val, const struct timespec *timeout);
+
+#endif /* _SYS_FUTEX_H_ */
@@ -0,0 +1,13 @@
+#ifndef _SYS_MMAN_H_
+#define _SYS_MMAN_H_
+
+/*
+ * Get the PROT_* and MAP_* constants from the kernel.
+ */
+#include <sys/types.h>
+#include <kern/mman.h>
+
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+int munmap(void *addr, size_t len);
+
+#endif /* _SYS_MMAN_H_ */
@@ -0,0 +1,21 @@
+#ifndef _SYS_SHM_H_
+#define _SYS_SHM_H_
+
+/*
+ * Get the IPC_* and SHM_* constants and struct shmid_ds from the kernel.
+ *
+ * shmget finds the segment with KEY, or makes one of SIZE bytes with
+ * IPC_CREAT (or always, for IPC_PRIVATE), and returns its id. shmat
+ * maps it at ADDR, or wherever there's room if ADDR is NULL, and is
+ * inherited across fork; shmdt unmaps it. shmctl IPC_RMID removes it
+ * once the last attachment is gone.
+ */
+#include <sys/types.h>
+#include <kern/shm.h>
+
+int shmget(int key, size_t size, int flags);
+void *shmat(int shmid, const void *addr, int flags);
+int shmdt(const void *addr);
+int shmctl(int shmid, int cmd, struct shmid_ds *buf);
+
+#endif /* _SYS_SHM_H_ */
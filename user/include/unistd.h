@@ -118,7 +118,17 @@
 __DEAD void _exit(int code);
 int execv(const char *prog, char *const *args);
 pid_t fork(void);
+/*
+ * vfork is fork without the address space copy: the child runs in the
+ * parent's memory (and on its stack) while the parent waits, until the
+ * child calls execv or _exit. The child may do nothing else. Unlike
+ * fork it doesn't flush stdio first.
+ */
+pid_t vfork(void);
 int waitpid(pid_t pid, int *returncode, int flags);
+/* The raw system calls behind fork and execv (for libc internal use only) */
+int __execv(const char *prog, char *const *args);
+pid_t __fork(void);
 /* 
  * Open actually takes either two or three args: the optional third
  * arg is the file mode used for creation. Unless you're implementing
@@ -147,13 +157,28 @@ int chdir(const char *path);
 
 /* Optional. */
 void *sbrk(int change);
+/* mmap, munmap - see sys/mman.h */
 int getdirentry(int filehandle, char *buf, size_t buflen);
+int pread(int filehandle, void *buf, size_t size, off_t pos);
+int pwrite(int filehandle, const void *buf, size_t size, off_t pos);
+/* readv, writev - see sys/uio.h */
 int symlink(const char *target, const char *linkname);
 int readlink(const char *path, char *buf, size_t buflen);
 int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 time_t __time(time_t *seconds, unsigned long *nanoseconds);
+int nanosleep(const struct timespec *req, struct timespec *rem);
 int __getcwd(char *buf, size_t buflen);
+/*
+ * Threads. threadfork starts a new thread in this process running
+ * FUNC, on a stack of its own; the thread ends when FUNC returns or it
+ * calls threadexit. _exit ends only the calling thread, and the process
+ * exits once its last thread has. The threads share memory and file
+ * handles; libc itself (stdio, malloc) does no locking.
+ */
+__DEAD void threadexit(void);
+/* The raw system call behind threadfork (for libc internal use only) */
+int __threadfork(void (*start)(void (*)(void)), void (*func)(void));
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
 
@@ -163,5 +188,6 @@ int __getcwd(char *buf, size_t buflen);
 
 char *getcwd(char *buf, size_t buflen);		/* calls __getcwd */
 time_t time(time_t *seconds);			/* calls __time */
+int threadfork(void (*func)(void));		/* calls __threadfork */
 
 #endif /* _UNISTD_H_ */
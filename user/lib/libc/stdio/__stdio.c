@@ -0,0 +1,182 @@
+/*
+ * stdio internals: the standard streams, the list of open streams,
+ * and the routines that move data between a stream's buffer and its
+ * file handle.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <kern/seek.h>
+
+static char __stdoutbuf[BUFSIZ];
+
+/*
+ * stdout is line buffered and stderr is unbuffered, as in Unix. (We
+ * can't ask whether stdout is a terminal, so assume it is.) stdin is
+ * unbuffered: the console does no echo or line editing, so programs
+ * like the shell need to see each character as it is typed, and
+ * reading ahead would steal input from programs they run.
+ */
+FILE __stdin = {
+	STDIN_FILENO, __SRD, _IONBF,
+	&__stdin.f_onebuf, 1, 0, 0, 0, &__stdout
+};
+FILE __stdout = {
+	STDOUT_FILENO, __SWR, _IOLBF,
+	__stdoutbuf, BUFSIZ, 0, 0, 0, &__stderr
+};
+FILE __stderr = {
+	STDERR_FILENO, __SWR, _IONBF,
+	&__stderr.f_onebuf, 1, 0, 0, 0, NULL
+};
+
+/* All open streams, for fflush(NULL). */
+static FILE *__streams = &__stdin;
+
+void
+__slink(FILE *fp)
+{
+	fp->f_next = __streams;
+	__streams = fp;
+}
+
+void
+__sunlink(FILE *fp)
+{
+	FILE **pp;
+
+	for (pp = &__streams; *pp != NULL; pp = &(*pp)->f_next) {
+		if (*pp == fp) {
+			*pp = fp->f_next;
+			return;
+		}
+	}
+}
+
+/*
+ * Write out everything in the buffer. Returns 0, or EOF on error, in
+ * which case whatever couldn't be written is thrown away, so the
+ * buffer always has room for the next byte.
+ */
+int
+__swflush(FILE *fp)
+{
+	size_t done;
+	int r;
+
+	if ((fp->f_flags & __SWRITING) == 0) {
+		return 0;
+	}
+
+	done = 0;
+	while (done < fp->f_pos) {
+		r = write(fp->f_fd, fp->f_buf + done, fp->f_pos - done);
+		if (r <= 0) {
+			fp->f_flags |= __SERR;
+			fp->f_pos = 0;
+			return EOF;
+		}
+		done += r;
+	}
+	fp->f_pos = 0;
+	fp->f_flags &= ~__SWRITING;
+	return 0;
+}
+
+/*
+ * Throw away read-ahead input, moving the file position back to
+ * where the caller thinks it is. (This fails harmlessly on the
+ * console, which has no position and whose read-ahead is lost.)
+ */
+static
+void
+__sdiscard(FILE *fp)
+{
+	if (fp->f_len > fp->f_pos) {
+		lseek(fp->f_fd, -(off_t)(fp->f_len - fp->f_pos), SEEK_CUR);
+	}
+	fp->f_pos = fp->f_len = 0;
+	fp->f_flags &= ~__SREADING;
+}
+
+int
+__swsetup(FILE *fp)
+{
+	if ((fp->f_flags & __SWR) == 0) {
+		errno = EBADF;
+		fp->f_flags |= __SERR;
+		return EOF;
+	}
+	if (fp->f_flags & __SREADING) {
+		__sdiscard(fp);
+	}
+	fp->f_flags |= __SWRITING;
+	return 0;
+}
+
+int
+__srsetup(FILE *fp)
+{
+	if ((fp->f_flags & __SRD) == 0) {
+		errno = EBADF;
+		fp->f_flags |= __SERR;
+		return EOF;
+	}
+	if (fp->f_flags & __SWRITING) {
+		if (__swflush(fp)) {
+			return EOF;
+		}
+	}
+	fp->f_flags |= __SREADING;
+	return 0;
+}
+
+/*
+ * Refill an empty read buffer. Before blocking on an interactive
+ * (line or unbuffered) stream, flush line-buffered output so prompts
+ * appear. Returns 0, or EOF at end of file or on error.
+ */
+int
+__srefill(FILE *fp)
+{
+	FILE *op;
+	int r;
+
+	if (fp->f_mode != _IOFBF) {
+		for (op = __streams; op != NULL; op = op->f_next) {
+			if (op->f_mode == _IOLBF && (op->f_flags & __SWRITING)) {
+				__swflush(op);
+			}
+		}
+	}
+
+	r = read(fp->f_fd, fp->f_buf, fp->f_bufsize);
+	if (r <= 0) {
+		fp->f_flags |= (r == 0) ? __SEOF : __SERR;
+		fp->f_pos = fp->f_len = 0;
+		return EOF;
+	}
+	fp->f_pos = 0;
+	fp->f_len = r;
+	return 0;
+}
+
+/*
+ * Flush one stream, or all of them if FP is NULL.
+ */
+int
+fflush(FILE *fp)
+{
+	int ret = 0;
+
+	if (fp != NULL) {
+		return __swflush(fp);
+	}
+	for (fp = __streams; fp != NULL; fp = fp->f_next) {
+		if (__swflush(fp)) {
+			ret = EOF;
+		}
+	}
+	return ret;
+}
@@ -0,0 +1,31 @@
+/*
+ * fclose - C standard I/O function.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+int
+fclose(FILE *fp)
+{
+	int ret;
+
+	ret = fflush(fp);
+	if (close(fp->f_fd) < 0) {
+		ret = EOF;
+	}
+
+	__sunlink(fp);
+	if (fp->f_flags & __SMALLOCBUF) {
+		free(fp->f_buf);
+	}
+	if (fp->f_flags & __SMALLOCFILE) {
+		free(fp);
+	}
+	else {
+		/* A standard stream; leave it unusable. */
+		fp->f_flags = 0;
+	}
+	return ret;
+}
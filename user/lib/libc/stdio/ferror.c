@@ -0,0 +1,29 @@
+/*
+ * Stream state functions - C standard I/O (and fileno, from POSIX).
+ */
+
+#include <stdio.h>
+
+int
+feof(FILE *fp)
+{
+	return (fp->f_flags & __SEOF) != 0;
+}
+
+int
+ferror(FILE *fp)
+{
+	return (fp->f_flags & __SERR) != 0;
+}
+
+void
+clearerr(FILE *fp)
+{
+	fp->f_flags &= ~(__SEOF | __SERR);
+}
+
+int
+fileno(FILE *fp)
+{
+	return fp->f_fd;
+}
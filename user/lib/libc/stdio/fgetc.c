@@ -0,0 +1,24 @@
+/*
+ * fgetc and getc - C standard I/O functions. Return a character
+ * (0-255) or EOF.
+ */
+
+#include <stdio.h>
+
+int
+fgetc(FILE *fp)
+{
+	if (fp->f_pos >= fp->f_len || (fp->f_flags & __SREADING) == 0) {
+		if (__srsetup(fp) || __srefill(fp)) {
+			return EOF;
+		}
+	}
+	/* Cast through unsigned char so EOF is distinguishable. */
+	return (int)(unsigned char)fp->f_buf[fp->f_pos++];
+}
+
+int
+getc(FILE *fp)
+{
+	return fgetc(fp);
+}
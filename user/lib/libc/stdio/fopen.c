@@ -0,0 +1,66 @@
+/*
+ * fopen - C standard I/O function.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+FILE *
+fopen(const char *path, const char *mode)
+{
+	FILE *fp;
+	int oflags, sflags, fd;
+
+	switch (mode[0]) {
+	    case 'r':
+		oflags = O_RDONLY;
+		sflags = __SRD;
+		break;
+	    case 'w':
+		oflags = O_WRONLY | O_CREAT | O_TRUNC;
+		sflags = __SWR;
+		break;
+	    case 'a':
+		oflags = O_WRONLY | O_CREAT | O_APPEND;
+		sflags = __SWR;
+		break;
+	    default:
+		errno = EINVAL;
+		return NULL;
+	}
+	/* "b" means nothing here; "+" opens for both. */
+	if (mode[1] == '+' || (mode[1] != '\0' && mode[2] == '+')) {
+		oflags = (oflags & ~(O_RDONLY | O_WRONLY)) | O_RDWR;
+		sflags = __SRD | __SWR;
+	}
+
+	fp = malloc(sizeof(*fp));
+	if (fp == NULL) {
+		return NULL;
+	}
+	fp->f_buf = malloc(BUFSIZ);
+	if (fp->f_buf == NULL) {
+		free(fp);
+		return NULL;
+	}
+
+	fd = open(path, oflags, 0664);
+	if (fd < 0) {
+		free(fp->f_buf);
+		free(fp);
+		return NULL;
+	}
+
+	fp->f_fd = fd;
+	fp->f_flags = sflags | __SMALLOCBUF | __SMALLOCFILE;
+	fp->f_mode = _IOFBF;
+	fp->f_bufsize = BUFSIZ;
+	fp->f_pos = 0;
+	fp->f_len = 0;
+	fp->f_onebuf = 0;
+	__slink(fp);
+	return fp;
+}
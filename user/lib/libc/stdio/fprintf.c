@@ -0,0 +1,33 @@
+/*
+ * fprintf and vfprintf - C standard I/O functions.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+
+/*
+ * Function passed to __vprintf to do the actual output.
+ */
+static
+void
+__fprintf_send(void *mydata, const char *data, size_t len)
+{
+	fwrite(data, 1, len, (FILE *)mydata);
+}
+
+int
+fprintf(FILE *fp, const char *fmt, ...)
+{
+	int chars;
+	va_list ap;
+	va_start(ap, fmt);
+	chars = vfprintf(fp, fmt, ap);
+	va_end(ap);
+	return chars;
+}
+
+int
+vfprintf(FILE *fp, const char *fmt, va_list ap)
+{
+	return __vprintf(__fprintf_send, fp, fmt, ap);
+}
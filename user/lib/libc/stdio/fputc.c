@@ -0,0 +1,28 @@
+/*
+ * fputc and putc - C standard I/O functions. Return the character
+ * written, or EOF.
+ */
+
+#include <stdio.h>
+
+int
+fputc(int ch, FILE *fp)
+{
+	if ((fp->f_flags & __SWRITING) == 0 && __swsetup(fp)) {
+		return EOF;
+	}
+	fp->f_buf[fp->f_pos++] = ch;
+	if (fp->f_pos == fp->f_bufsize ||
+	    (fp->f_mode == _IOLBF && ch == '\n')) {
+		if (__swflush(fp)) {
+			return EOF;
+		}
+	}
+	return (unsigned char)ch;
+}
+
+int
+putc(int ch, FILE *fp)
+{
+	return fputc(ch, fp);
+}
@@ -0,0 +1,17 @@
+/*
+ * fputs - C standard I/O function. Unlike puts, adds no newline.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+int
+fputs(const char *str, FILE *fp)
+{
+	size_t len = strlen(str);
+
+	if (len > 0 && fwrite(str, 1, len, fp) != len) {
+		return EOF;
+	}
+	return 0;
+}
@@ -0,0 +1,47 @@
+/*
+ * fread - C standard I/O function.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+size_t
+fread(void *ptr, size_t size, size_t nitems, FILE *fp)
+{
+	char *p = ptr;
+	size_t total, done, chunk;
+	int r;
+
+	total = size * nitems;
+	if (total == 0 || __srsetup(fp)) {
+		return 0;
+	}
+
+	done = 0;
+	while (done < total) {
+		if (fp->f_pos < fp->f_len) {
+			/* Hand out what's already buffered. */
+			chunk = fp->f_len - fp->f_pos;
+			if (chunk > total - done) {
+				chunk = total - done;
+			}
+			memcpy(p + done, fp->f_buf + fp->f_pos, chunk);
+			fp->f_pos += chunk;
+			done += chunk;
+		}
+		else if (fp->f_mode == _IOFBF && total - done >= fp->f_bufsize) {
+			/* Big reads go straight into the caller's memory. */
+			r = read(fp->f_fd, p + done, total - done);
+			if (r <= 0) {
+				fp->f_flags |= (r == 0) ? __SEOF : __SERR;
+				break;
+			}
+			done += r;
+		}
+		else if (__srefill(fp)) {
+			break;
+		}
+	}
+	return done / size;
+}
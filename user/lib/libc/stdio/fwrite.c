@@ -0,0 +1,66 @@
+/*
+ * fwrite - C standard I/O function.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+size_t
+fwrite(const void *ptr, size_t size, size_t nitems, FILE *fp)
+{
+	const char *p = ptr;
+	size_t total, done, chunk, i;
+	int r;
+
+	total = size * nitems;
+	if (total == 0 || __swsetup(fp)) {
+		return 0;
+	}
+
+	if (fp->f_mode == _IONBF || total >= fp->f_bufsize) {
+		/*
+		 * Unbuffered, or too big to be worth copying: write out
+		 * what's pending, then the caller's data in place.
+		 */
+		if (__swflush(fp)) {
+			return 0;
+		}
+		done = 0;
+		while (done < total) {
+			r = write(fp->f_fd, p + done, total - done);
+			if (r <= 0) {
+				fp->f_flags |= __SERR;
+				break;
+			}
+			done += r;
+		}
+		return done / size;
+	}
+
+	done = 0;
+	while (done < total) {
+		chunk = fp->f_bufsize - fp->f_pos;
+		if (chunk > total - done) {
+			chunk = total - done;
+		}
+		memcpy(fp->f_buf + fp->f_pos, p + done, chunk);
+		fp->f_pos += chunk;
+		done += chunk;
+		if (fp->f_pos == fp->f_bufsize && __swflush(fp)) {
+			return (done - chunk) / size;
+		}
+	}
+
+	if (fp->f_mode == _IOLBF) {
+		for (i = 0; i < total; i++) {
+			if (p[i] == '\n') {
+				if (__swflush(fp)) {
+					return 0;
+				}
+				break;
+			}
+		}
+	}
+	return nitems;
+}
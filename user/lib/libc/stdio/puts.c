@@ -37,6 +37,8 @@ int
 puts(const char *s)
 {
 	__puts(s);
-	putchar('\n');
+	if (putchar('\n') == EOF) {
+		return EOF;
+	}
 	return 0;
 }
@@ -0,0 +1,52 @@
+/*
+ * setvbuf - C standard I/O function. Should be called before any I/O
+ * on the stream, but pending output is flushed in case it isn't.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+int
+setvbuf(FILE *fp, char *buf, int mode, size_t size)
+{
+	char *newbuf;
+	int newflags;
+
+	if (mode != _IOFBF && mode != _IOLBF && mode != _IONBF) {
+		errno = EINVAL;
+		return EOF;
+	}
+	if (fflush(fp)) {
+		return EOF;
+	}
+
+	newflags = 0;
+	if (mode == _IONBF) {
+		newbuf = &fp->f_onebuf;
+		size = 1;
+	}
+	else if (buf != NULL && size > 0) {
+		newbuf = buf;
+	}
+	else {
+		if (size == 0) {
+			size = BUFSIZ;
+		}
+		newbuf = malloc(size);
+		if (newbuf == NULL) {
+			return EOF;
+		}
+		newflags = __SMALLOCBUF;
+	}
+
+	if (fp->f_flags & __SMALLOCBUF) {
+		free(fp->f_buf);
+	}
+	fp->f_flags = (fp->f_flags & ~(__SMALLOCBUF | __SREADING)) | newflags;
+	fp->f_mode = mode;
+	fp->f_buf = newbuf;
+	fp->f_bufsize = size;
+	fp->f_pos = fp->f_len = 0;
+	return 0;
+}
@@ -30,10 +30,24 @@
 /*
  * User-level malloc and free implementation.
  *
- * This is a basic first-fit allocator. It's intended to be simple and
- * easy to follow. It performs abysmally if the heap becomes larger than
- * physical memory. To get (much) better out-of-core performance, port
- * the kernel's malloc. :-)
+ * This is a segregated-fit allocator. Every block, free or in use,
+ * starts with a header giving its own size and the size of the block
+ * below it (a boundary tag), so free can coalesce with both neighbours
+ * in constant time. Free blocks live on doubly linked free lists
+ * ("bins") by size: each small size has a bin of its own, so a small
+ * malloc is usually a list pop, and larger sizes share a bin per power
+ * of two. A bitmap of the non-empty bins finds the next bin up that
+ * can satisfy a request without walking the empty ones.
+ *
+ * Requests of a page or more are rounded up to whole pages, so big
+ * blocks are reused cleanly rather than leaving odd-sized slivers.
+ * The heap grows with sbrk at least a page at a time, and whenever the
+ * block at the top of the heap is free and big enough, its whole
+ * pages go back to the kernel with a negative sbrk.
+ *
+ * The top of the heap is marked by a fence: a permanently in-use,
+ * zero-size header, so the block below it never has to be treated
+ * specially when coalescing.
  */
 
 #include <stdlib.h>
@@ -41,109 +55,97 @@
 #include <err.h>
 #include <stdint.h>  // for uintptr_t on non-OS/161 platforms
 
-// Added to debug sbrk and malloc
-//#include <stdio.h>
-//
-
 #undef MALLOCDEBUG
 //#define MALLOCDEBUG
 
-#if defined(__mips__) || defined(__i386__)
-#define MALLOC32
-#elif defined(__alpha__)
-#define MALLOC64
-#else
-#error "please fix me"
-#endif
-
 /*
  * malloc block header.
  *
- * mh_prevblock is the downwards offset to the previous header, 0 if this
- * is the bottom of the heap.
+ * mh_prevsize is the size of the block below this one, 0 if this is
+ * the bottom of the heap.
  *
- * mh_nextblock is the upwards offset to the next header.
+ * mh_size is the size of this block, header included. Sizes are
+ * multiples of MBLOCKSIZE, so the low bits hold M_INUSE (set if the
+ * block is allocated) and the magic value M_MAGIC.
  *
- * mh_pad is unused.
- * mh_inuse is 1 if the block is in use, 0 if it is free.
- * mh_magic* should always be a fixed value.
+ * A free block also holds its free list links, right after the header.
  *
- * MBLOCKSIZE should equal sizeof(struct mheader) and be a power of 2.
- * MBLOCKSHIFT is the log base 2 of MBLOCKSIZE.
- * MMAGIC is the value for mh_magic*.
+ * MBLOCKSIZE is sizeof(struct mheader), and the alignment of every
+ * block and of the pointers malloc returns.
  */
 struct mheader {
+	size_t mh_prevsize;
+	size_t mh_size;
+};
 
-#if defined(MALLOC32)
-#define MBLOCKSIZE 8
-#define MBLOCKSHIFT 3
-#define MMAGIC 2
-	/*
-	 * 32-bit platform. size_t is 32 bits (4 bytes). 
-	 * Block size is 8 bytes.
-	 */
-	unsigned mh_prevblock:29;
-	unsigned mh_pad:1;
-	unsigned mh_magic1:2;
-
-	unsigned mh_nextblock:29;
-	unsigned mh_inuse:1;
-	unsigned mh_magic2:2;
-
-#elif defined(MALLOC64)
-#define MBLOCKSIZE 16
-#define MBLOCKSHIFT 4
-#define MMAGIC 6
-	/*
-	 * 64-bit platform. size_t is 64 bits (8 bytes)
-	 * Block size is 16 bytes.
-	 */
-	unsigned mh_prevblock:62;
-	unsigned mh_pad:1;
-	unsigned mh_magic1:3;
+struct mfree {
+	struct mheader mf_hdr;
+	struct mfree *mf_next;
+	struct mfree *mf_prev;
+};
 
-	unsigned mh_nextblock:62;
-	unsigned mh_inuse:1;
-	unsigned mh_magic2:3;
+#define MBLOCKSIZE	(2 * sizeof(size_t))
+#define MINBLOCK	((sizeof(struct mfree) + MBLOCKSIZE - 1) & \
+			 ~(size_t)(MBLOCKSIZE - 1))
 
-#else
-#error "please fix me"
-#endif
-};
+#define M_INUSE		0x1
+#define M_MAGIC		0x4
+#define M_FLAGS		0x7
+
+/* Page size, for growing and trimming the heap. */
+#define MPAGESIZE	4096
+
+/* The most sbrk can be asked for at once (it takes an int). */
+#define MAXSBRK		((size_t)0x3fffffff)
+
+/* Give memory back once the free top of the heap has this much. */
+#define TRIMSIZE	(4 * MPAGESIZE)
 
 /*
  * Operator macros on struct mheader.
  *
- * M_NEXT/PREVOFF:	return offset to next/previous header
- * M_NEXT/PREV:		return next/previous header
- * 
- * M_DATA:		return data pointer of a header
- * M_SIZE:		return data size of a header
- *
- * M_OK:		true if the magic values are correct
- * 
- * M_MKFIELD:		prepare a value for mh_next/prevblock.
- * 			(value should include the header size)
+ * M_SIZE:		size of the block, header included
+ * M_NEXT/PREV:		the block above/below
+ * M_DATA:		data pointer of a header
+ * M_HDR:		header of a data pointer
+ * M_OK:		true if the magic value is correct
+ * M_INUSE_P:		true if the block is allocated
+ * M_SET:		set the size and in-use flag
  */
 
-#define M_NEXTOFF(mh)	((size_t)(((size_t)((mh)->mh_nextblock))<<MBLOCKSHIFT))
-#define M_PREVOFF(mh)	((size_t)(((size_t)((mh)->mh_prevblock))<<MBLOCKSHIFT))
-#define M_NEXT(mh)	((struct mheader *)(((char*)(mh))+M_NEXTOFF(mh)))
-#define M_PREV(mh)	((struct mheader *)(((char*)(mh))-M_PREVOFF(mh)))
-
-#define M_DATA(mh)	((void *)((mh)+1))
-#define M_SIZE(mh)	(M_NEXTOFF(mh)-MBLOCKSIZE)
+#define M_SIZE(mh)	((mh)->mh_size & ~(size_t)M_FLAGS)
+#define M_NEXT(mh)	((struct mheader *)((char *)(mh) + M_SIZE(mh)))
+#define M_PREV(mh)	((struct mheader *)((char *)(mh) - (mh)->mh_prevsize))
+#define M_DATA(mh)	((void *)((mh) + 1))
+#define M_HDR(p)	(((struct mheader *)(p)) - 1)
+#define M_OK(mh)	(((mh)->mh_size & (M_FLAGS & ~M_INUSE)) == M_MAGIC)
+#define M_INUSE_P(mh)	(((mh)->mh_size & M_INUSE) != 0)
+#define M_SET(mh, sz, inuse) \
+	((mh)->mh_size = (sz) | M_MAGIC | ((inuse) ? M_INUSE : 0))
 
-#define M_OK(mh)	((mh)->mh_magic1==MMAGIC && (mh)->mh_magic2==MMAGIC)
-
-#define M_MKFIELD(off)	((off)>>MBLOCKSHIFT)
+/*
+ * Bins. Free blocks smaller than SMALLMAX go in bin (size/MBLOCKSIZE),
+ * which holds only blocks of exactly that size. Bigger ones go in bin
+ * NSMALLBINS + log2(size/SMALLMAX), which holds sizes from that power
+ * of two up to the next.
+ */
+#define SMALLMAX	(64 * MBLOCKSIZE)
+#define NSMALLBINS	64
+#define NBINS		(NSMALLBINS + 32)
+#define BINMAPWORDS	((NBINS + 31) / 32)
 
 ////////////////////////////////////////////////////////////
 
 /*
- * Static variables - the bottom and top addresses of the heap.
+ * Static variables - the bottom and top addresses of the heap (the
+ * top includes the fence), the free lists, and which of them are
+ * non-empty.
  */
 static uintptr_t __heapbase, __heaptop;
+static struct mfree *__bins[NBINS];
+static uint32_t __binmap[BINMAPWORDS];
+
+#define FENCE()		((struct mheader *)(__heaptop - MBLOCKSIZE))
 
 /*
  * Setup function.
@@ -153,60 +155,132 @@ static
 void
 __malloc_init(void)
 {
+	struct mheader *fence;
 	void *x;
 
-	
-	// Check various assumed properties of the sizes.
-	 
-	if (sizeof(struct mheader) != MBLOCKSIZE) {
-		errx(1, "malloc: Internal error - MBLOCKSIZE wrong");
-	}
-	if ((MBLOCKSIZE & (MBLOCKSIZE-1))!=0) {
-		errx(1, "malloc: Internal error - MBLOCKSIZE not power of 2");
-	}
-	if (1<<MBLOCKSHIFT != MBLOCKSIZE) {
-		errx(1, "malloc: Internal error - MBLOCKSHIFT wrong");
-	}
-
-	//init should only be called once. 
+	/* init should only be called once. */
 	if (__heapbase!=0 || __heaptop!=0) {
 		errx(1, "malloc: Internal error - bad init call");
 	}
 
-	// Use sbrk to find the base of the heap. 
+	/* Use sbrk to find the base of the heap. */
 	x = sbrk(0);
-
 	if (x==(void *)-1) {
 		err(1, "malloc: initial sbrk failed");
 	}
 	if (x==(void *) 0) {
 		errx(1, "malloc: Internal error - heap began at 0");
 	}
-	__heapbase = __heaptop = (uintptr_t)x;
+	__heapbase = (uintptr_t)x;
 
 	/*
-	 * Make sure the heap base is aligned the way we want it.
-	 * (On OS/161, it will begin on a page boundary. But on 
-	 * an arbitrary Unix, it may not be, as traditionally it
-	 * begins at _end.)
+	 * Make sure the heap base is aligned the way we want it, and
+	 * make room for the fence. (On OS/161, the heap will begin on
+	 * a page boundary. But on an arbitrary Unix, it may not be, as
+	 * traditionally it begins at _end.)
 	 */
-
 	if (__heapbase % MBLOCKSIZE != 0) {
-		size_t adjust = MBLOCKSIZE - (__heapbase % MBLOCKSIZE);
-		x = sbrk(adjust);
-		if (x==(void *)-1) {
-			err(1, "malloc: sbrk failed aligning heap base");
+		__heapbase += MBLOCKSIZE - (__heapbase % MBLOCKSIZE);
+	}
+	x = sbrk(__heapbase - (uintptr_t)x + MBLOCKSIZE);
+	if (x==(void *)-1) {
+		err(1, "malloc: sbrk failed setting up the heap");
+	}
+	__heaptop = __heapbase + MBLOCKSIZE;
+
+	fence = FENCE();
+	fence->mh_prevsize = 0;
+	M_SET(fence, 0, 1);
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Free list handling.
+ */
+
+static
+unsigned
+__malloc_binindex(size_t size)
+{
+	unsigned i;
+
+	if (size < SMALLMAX) {
+		return size / MBLOCKSIZE;
+	}
+	for (i = 0, size /= SMALLMAX; size > 1; size >>= 1) {
+		i++;
+	}
+	return NSMALLBINS + i;
+}
+
+static
+void
+__malloc_bininsert(struct mheader *mh)
+{
+	struct mfree *mf = (struct mfree *)mh;
+	unsigned ix = __malloc_binindex(M_SIZE(mh));
+
+	mf->mf_prev = NULL;
+	mf->mf_next = __bins[ix];
+	if (mf->mf_next != NULL) {
+		mf->mf_next->mf_prev = mf;
+	}
+	__bins[ix] = mf;
+	__binmap[ix / 32] |= (uint32_t)1 << (ix % 32);
+}
+
+static
+void
+__malloc_binremove(struct mheader *mh)
+{
+	struct mfree *mf = (struct mfree *)mh;
+	unsigned ix;
+
+	if (mf->mf_prev != NULL) {
+		mf->mf_prev->mf_next = mf->mf_next;
+	}
+	else {
+		ix = __malloc_binindex(M_SIZE(mh));
+		if (__bins[ix] != mf) {
+			errx(1, "malloc: Heap corrupt; free block at %p "
+			     "not on its free list", mh);
 		}
-		if ((uintptr_t)x != __heapbase) {
-			err(1, "malloc: heap base moved during init");
+		__bins[ix] = mf->mf_next;
+		if (__bins[ix] == NULL) {
+			__binmap[ix / 32] &= ~((uint32_t)1 << (ix % 32));
+		}
+	}
+	if (mf->mf_next != NULL) {
+		mf->mf_next->mf_prev = mf->mf_prev;
+	}
+}
+
+/*
+ * Return the lowest non-empty bin at or above IX, or NBINS if none.
+ */
+static
+unsigned
+__malloc_nextbin(unsigned ix)
+{
+	unsigned w;
+	uint32_t bits;
+
+	for (w = ix / 32; w < BINMAPWORDS; w++) {
+		bits = __binmap[w];
+		if (w == ix / 32) {
+			bits &= ~(uint32_t)0 << (ix % 32);
+		}
+		if (bits != 0) {
+			ix = w * 32;
+			while ((bits & 1) == 0) {
+				bits >>= 1;
+				ix++;
+			}
+			return ix;
 		}
-#ifdef MALLOCDEBUG
-		warnx("malloc: adjusted heap base upwards by %lu bytes",
-		      (unsigned long) adjust);
-#endif
-		__heapbase += adjust;
-		__heaptop = __heapbase;
 	}
+	return NBINS;
 }
 
 ////////////////////////////////////////////////////////////
@@ -222,116 +296,172 @@ __malloc_dump(void)
 {
 	struct mheader *mh;
 	uintptr_t i;
-	size_t rightprevblock;
+	size_t rightprevsize;
 
 	warnx("heap: ************************************************");
 
-	rightprevblock = 0;
-	for (i=__heapbase; i<__heaptop; i += M_NEXTOFF(mh)) {
+	rightprevsize = 0;
+	for (i=__heapbase; i<__heaptop - MBLOCKSIZE; i += M_SIZE(mh)) {
 		mh = (struct mheader *) i;
-		if (!M_OK(mh)) {
+		if (!M_OK(mh) || M_SIZE(mh) < MINBLOCK) {
 			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad magic bits",
+			     " has bad magic bits or size",
 			     (unsigned long) i);
 		}
-		if (mh->mh_prevblock != rightprevblock) {
+		if (mh->mh_prevsize != rightprevsize) {
 			errx(1, "malloc: Heap corrupt; header at 0x%lx"
 			     " has bad previous-block size %lu "
 			     "(should be %lu)",
-			     (unsigned long) i, 
-			     (unsigned long) mh->mh_prevblock << MBLOCKSHIFT,
-			     (unsigned long) rightprevblock << MBLOCKSHIFT);
+			     (unsigned long) i,
+			     (unsigned long) mh->mh_prevsize,
+			     (unsigned long) rightprevsize);
 		}
-		rightprevblock = mh->mh_nextblock;
+		rightprevsize = M_SIZE(mh);
 
 		warnx("heap: 0x%lx 0x%-6lx (next: 0x%lx) %s",
 		      (unsigned long) i + MBLOCKSIZE,
-		      (unsigned long) M_SIZE(mh),
-		      (unsigned long) (i+M_NEXTOFF(mh)),
-		      mh->mh_inuse ? "INUSE" : "FREE");
+		      (unsigned long) M_SIZE(mh) - MBLOCKSIZE,
+		      (unsigned long) (i+M_SIZE(mh)),
+		      M_INUSE_P(mh) ? "INUSE" : "FREE");
 	}
-	if (i!=__heaptop) {
+	if (i!=__heaptop - MBLOCKSIZE || FENCE()->mh_prevsize != rightprevsize) {
 		errx(1, "malloc: Heap corrupt; ran off end");
 	}
 
 	warnx("heap: ************************************************");
 }
 
+/*
+ * Fill a range of memory with 0xdeadbeef, to catch use after free.
+ * ptr must be suitably aligned.
+ */
+static
+void
+__malloc_deadbeef(void *ptr, size_t size)
+{
+	uint32_t *x = ptr;
+	size_t i, n = size/sizeof(uint32_t);
+	for (i=0; i<n; i++) {
+		x[i] = 0xdeadbeef;
+	}
+}
+
 #endif /* MALLOCDEBUG */
 
 ////////////////////////////////////////////////////////////
 
 /*
- * Get more memory (at the top of the heap) using sbrk, and 
- * return a pointer to it.
+ * Get at least SIZE more bytes at the top of the heap using sbrk, and
+ * return the free block (not on any free list) that ends at the new
+ * fence. If the block below the old fence was free, it's merged in
+ * and counts towards SIZE.
  */
 static
-void *
-__malloc_sbrk(size_t size)
+struct mheader *
+__malloc_grow(size_t size)
 {
+	struct mheader *mh, *last, *fence;
+	size_t need, amount;
 	void *x;
 
-	x = sbrk(size);
-	//err(1, "malloc: passed sbrk: 0x%x\n", (unsigned int)x);
-	if (x == (void *)-1) {
-		return NULL;
+	fence = FENCE();
+	last = NULL;
+	need = size;
+	if (fence->mh_prevsize != 0) {
+		last = M_PREV(fence);
+		if (M_INUSE_P(last)) {
+			last = NULL;
+		}
+		else {
+			need -= M_SIZE(last);
+		}
 	}
 
+	/* A page at a time if we can; otherwise just what we need. */
+	amount = (need + MPAGESIZE - 1) & ~(size_t)(MPAGESIZE - 1);
+	if (amount > MAXSBRK || (x = sbrk(amount)) == (void *)-1) {
+		amount = need;
+		if (amount > MAXSBRK || (x = sbrk(amount)) == (void *)-1) {
+			return NULL;
+		}
+	}
 	if ((uintptr_t)x != __heaptop) {
 		errx(1, "malloc: Internal error - "
 		     "heap top moved itself from 0x%lx to 0x%lx",
 		     (unsigned long) __heaptop,
 		     (unsigned long) (uintptr_t) x);
 	}
-	__heaptop += size;
-	return x;
+	__heaptop += amount;
+
+	/* The old fence becomes the header of the new space. */
+	mh = fence;
+	M_SET(mh, amount, 0);
+	if (last != NULL) {
+		__malloc_binremove(last);
+		M_SET(last, M_SIZE(last) + amount, 0);
+		mh = last;
+	}
+
+	fence = FENCE();
+	fence->mh_prevsize = M_SIZE(mh);
+	M_SET(fence, 0, 1);
+	return mh;
 }
 
 /*
- * Make a new (free) block from the block passed in, leaving size
- * bytes for data in the current block. size must be a multiple of
- * MBLOCKSIZE.
- *
- * Only split if the excess space is at least twice the blocksize -
- * one blocksize to hold a header and one for data.
+ * The free block MH is at the top of the heap. If there are enough
+ * whole pages in it, give them back to the kernel. Either way, put
+ * what's left of it on its free list.
  */
 static
 void
-__malloc_split(struct mheader *mh, size_t size)
+__malloc_trim(struct mheader *mh)
 {
-	struct mheader *mhnext, *mhnew;
-	size_t oldsize;
+	struct mheader *fence;
+	uintptr_t newtop;
+
+	/* Keep at least a minimal block, and the fence, below newtop. */
+	newtop = (uintptr_t)mh + MINBLOCK + MBLOCKSIZE;
+	newtop = (newtop + MPAGESIZE - 1) & ~(uintptr_t)(MPAGESIZE - 1);
+
+	if (newtop < __heaptop && __heaptop - newtop >= TRIMSIZE &&
+	    __heaptop - newtop <= MAXSBRK &&
+	    sbrk(-(int)(__heaptop - newtop)) != (void *)-1) {
+		__heaptop = newtop;
+		M_SET(mh, newtop - MBLOCKSIZE - (uintptr_t)mh, 0);
+		fence = FENCE();
+		fence->mh_prevsize = M_SIZE(mh);
+		M_SET(fence, 0, 1);
+	}
+	__malloc_bininsert(mh);
+}
 
-	if (size % MBLOCKSIZE != 0) {
-		errx(1, "malloc: Internal error (size %lu passed to split)",
-		     (unsigned long) size);
-	}
+/*
+ * Cut the block MH down to SIZE bytes, if what's left over is big
+ * enough to be a block of its own, and put the rest on a free list.
+ * (It can't have a free neighbour above: MH's was in use, since free
+ * blocks are always coalesced.)
+ */
+static
+void
+__malloc_split(struct mheader *mh, size_t size)
+{
+	struct mheader *rest;
+	size_t restsize;
 
-	if (M_SIZE(mh) - size < 2*MBLOCKSIZE) {
+	if (M_SIZE(mh) - size < MINBLOCK) {
 		/* no room */
 		return;
 	}
 
-	mhnext = M_NEXT(mh);
-
-	oldsize = M_SIZE(mh);
-	mh->mh_nextblock = M_MKFIELD(size + MBLOCKSIZE);
-	
-	mhnew = M_NEXT(mh);
-	if (mhnew==mhnext) {
-		errx(1, "malloc: Internal error (split screwed up?)");
-	}
-
-	mhnew->mh_prevblock = M_MKFIELD(size + MBLOCKSIZE);
-	mhnew->mh_pad = 0;
-	mhnew->mh_magic1 = MMAGIC;
-	mhnew->mh_nextblock = M_MKFIELD(oldsize - size);
-	mhnew->mh_inuse = 0;
-	mhnew->mh_magic2 = MMAGIC;
+	restsize = M_SIZE(mh) - size;
+	M_SET(mh, size, M_INUSE_P(mh));
 
-	if (mhnext != (struct mheader *) __heaptop) {
-		mhnext->mh_prevblock = mhnew->mh_nextblock;
-	}
+	rest = M_NEXT(mh);
+	rest->mh_prevsize = size;
+	M_SET(rest, restsize, 0);
+	M_NEXT(rest)->mh_prevsize = restsize;
+	__malloc_bininsert(rest);
 }
 
 /*
@@ -340,100 +470,78 @@ __malloc_split(struct mheader *mh, size_t size)
 void *
 malloc(size_t size)
 {
-	//printf("Hello World in\n");
 	struct mheader *mh;
-	uintptr_t i;
-	size_t rightprevblock;
+	struct mfree *mf;
+	unsigned ix;
 
 	if (__heapbase==0) {
-		//printf("Initalizing malloc\n");
 		__malloc_init();
 	}
-	if (__heapbase==0 || __heaptop==0 || __heapbase > __heaptop) {
+	if (__heapbase==0 || __heaptop==0 || __heapbase >= __heaptop) {
 		warnx("malloc: Internal error - local data corrupt");
-		errx(1, "malloc: heapbase 0x%lx; heaptop 0x%lx", 
+		errx(1, "malloc: heapbase 0x%lx; heaptop 0x%lx",
 		     (unsigned long) __heapbase, (unsigned long) __heaptop);
 	}
 
 #ifdef MALLOCDEBUG
-	warnx("malloc: about to allocate %lu (0x%lx) bytes", 
+	warnx("malloc: about to allocate %lu (0x%lx) bytes",
 	      (unsigned long) size, (unsigned long) size);
 	__malloc_dump();
 #endif
 
-	/* Round size up to an integral number of blocks. */
-	//printf("Inital malloc size: %d\n", size);
-	size = ((size + MBLOCKSIZE - 1) & ~(size_t)(MBLOCKSIZE-1));
-	//printf("Rounded malloc size: %d\n", size);
-	/*
-	 * First-fit search algorithm for available blocks.
-	 * Check to make sure the next/previous sizes all agree.
-	 */
-	rightprevblock = 0;
-	for (i=__heapbase; i<__heaptop; i += M_NEXTOFF(mh)) {
-		mh = (struct mheader *) i;
-		if (!M_OK(mh)) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad magic bits",
-			     (unsigned long) i);
-		}
-		if (mh->mh_prevblock != rightprevblock) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad previous-block size %lu "
-			     "(should be %lu)",
-			     (unsigned long) i, 
-			     (unsigned long) mh->mh_prevblock << MBLOCKSHIFT,
-			     (unsigned long) rightprevblock << MBLOCKSHIFT);
-		}
-		rightprevblock = mh->mh_nextblock;
-
-		/* Can't allocate a block that's in use. */
-		if (mh->mh_inuse) {
-			continue;
-		}
-
-		/* Can't allocate a block that isn't big enough. */
-		if (M_SIZE(mh) < size) {
-			continue;
-		}
-
-		/* Try splitting block. */
-		__malloc_split(mh, size);
-
-		/*
-		 * Now, allocate.
-		 */
-		mh->mh_inuse = 1;
+	if (size > MAXSBRK) {
+		return NULL;
+	}
 
-#ifdef MALLOCDEBUG
-		warnx("malloc: allocating at %p", M_DATA(mh));
-		__malloc_dump();
-#endif
-		return M_DATA(mh);
+	/* Add the header and round up to a block size (or whole pages). */
+	size = (size + MBLOCKSIZE + MBLOCKSIZE - 1) & ~(size_t)(MBLOCKSIZE-1);
+	if (size < MINBLOCK) {
+		size = MINBLOCK;
 	}
-	if (i!=__heaptop) {
-		errx(1, "malloc: Heap corrupt; ran off end");
+	else if (size > MPAGESIZE) {
+		size = (size + MPAGESIZE - 1) & ~(size_t)(MPAGESIZE - 1);
 	}
 
 	/*
-	 * Didn't find anything. Expand the heap.
+	 * Small sizes have a bin to themselves, so anything there fits.
+	 * In a big-size bin, look for the first block that fits. After
+	 * that, anything in a higher bin fits.
 	 */
-
-	mh = __malloc_sbrk(size + MBLOCKSIZE);
+	mh = NULL;
+	ix = __malloc_binindex(size);
+	if (ix >= NSMALLBINS) {
+		for (mf = __bins[ix]; mf != NULL; mf = mf->mf_next) {
+			if (M_SIZE(&mf->mf_hdr) >= size) {
+				mh = &mf->mf_hdr;
+				break;
+			}
+		}
+		ix++;
+	}
 	if (mh == NULL) {
-		return NULL;
+		ix = __malloc_nextbin(ix);
+		if (ix < NBINS) {
+			mh = &__bins[ix]->mf_hdr;
+		}
 	}
-	/*
-	if (mh){
-		err(1, "malloc: initial sbrk failed");
+
+	if (mh != NULL) {
+		if (!M_OK(mh) || M_INUSE_P(mh)) {
+			errx(1, "malloc: Heap corrupt; free block at %p "
+			     "has bad magic bits", mh);
+		}
+		__malloc_binremove(mh);
 	}
-*/
-	mh->mh_prevblock = rightprevblock;
-	mh->mh_magic1 = MMAGIC;
-	mh->mh_magic2 = MMAGIC;
-	mh->mh_pad = 0;
-	mh->mh_inuse = 1;
-	mh->mh_nextblock = M_MKFIELD(size + MBLOCKSIZE);
+	else {
+		/* Didn't find anything. Expand the heap. */
+		mh = __malloc_grow(size);
+		if (mh == NULL) {
+			return NULL;
+		}
+	}
+
+	M_SET(mh, M_SIZE(mh), 1);
+	__malloc_split(mh, size);
 
 #ifdef MALLOCDEBUG
 	warnx("malloc: allocating at %p", M_DATA(mh));
@@ -444,52 +552,6 @@ malloc(size_t size)
 
 ////////////////////////////////////////////////////////////
 
-/*
- * Clear a range of memory with 0xdeadbeef.
- * ptr must be suitably aligned.
- */
-static
-void
-__malloc_deadbeef(void *ptr, size_t size)
-{
-	uint32_t *x = ptr;
-	size_t i, n = size/sizeof(uint32_t);
-	for (i=0; i<n; i++) {
-		x[i] = 0xdeadbeef;
-	}
-}
-
-/*
- * Attempt to merge two adjacent blocks (mh below mhnext).
- */
-static
-void
-__malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
-{
-	struct mheader *mhnextnext;
-
-	if (mh->mh_nextblock != mhnext->mh_prevblock) {
-		errx(1, "free: Heap corrupt (%p and %p inconsistent)",
-		     mh, mhnext);
-	}
-	if (mh->mh_inuse || mhnext->mh_inuse) {
-		/* can't merge */
-		return;
-	}
-
-	mhnextnext = M_NEXT(mhnext);
-
-	mh->mh_nextblock = M_MKFIELD(MBLOCKSIZE + M_SIZE(mh) +
-				     MBLOCKSIZE + M_SIZE(mhnext));
-
-	if (mhnextnext != (struct mheader *)__heaptop) {
-		mhnextnext->mh_prevblock = mh->mh_nextblock;
-	}
-
-	/* Deadbeef out the memory used by the now-obsolete header */
-	__malloc_deadbeef(mhnext, sizeof(struct mheader));
-}
-
 /*
  * The actual free() implementation.
  */
@@ -497,6 +559,7 @@ void
 free(void *x)
 {
 	struct mheader *mh, *mhnext, *mhprev;
+	size_t size;
 
 	if (x==NULL) {
 		/* safest practice */
@@ -504,14 +567,16 @@ free(void *x)
 	}
 
 	/* Consistency check. */
-	if (__heapbase==0 || __heaptop==0 || __heapbase > __heaptop) {
+	if (__heapbase==0 || __heaptop==0 || __heapbase >= __heaptop) {
 		warnx("free: Internal error - local data corrupt");
-		errx(1, "free: heapbase 0x%lx; heaptop 0x%lx", 
+		errx(1, "free: heapbase 0x%lx; heaptop 0x%lx",
 		     (unsigned long) __heapbase, (unsigned long) __heaptop);
 	}
 
 	/* Don't allow freeing pointers that aren't on the heap. */
-	if ((uintptr_t)x < __heapbase || (uintptr_t)x >= __heaptop) {
+	if ((uintptr_t)x < __heapbase + MBLOCKSIZE ||
+	    (uintptr_t)x >= __heaptop ||
+	    (uintptr_t)x % MBLOCKSIZE != 0) {
 		errx(1, "free: Invalid pointer %p freed (out of range)", x);
 	}
 
@@ -520,31 +585,51 @@ free(void *x)
 	__malloc_dump();
 #endif
 
-	mh = ((struct mheader *)x)-1;
+	mh = M_HDR(x);
 	if (!M_OK(mh)) {
 		errx(1, "free: Invalid pointer %p freed (corrupt header)", x);
 	}
-
-	if (!mh->mh_inuse) {
+	if (!M_INUSE_P(mh)) {
 		errx(1, "free: Invalid pointer %p freed (already free)", x);
 	}
 
-	/* mark it free */
-	mh->mh_inuse = 0;
+	size = M_SIZE(mh);
 
+#ifdef MALLOCDEBUG
 	/* wipe it */
-	__malloc_deadbeef(M_DATA(mh), M_SIZE(mh));
+	__malloc_deadbeef(M_DATA(mh), size - MBLOCKSIZE);
+#endif
 
-	/* Try merging with the block above (but not if we're at the top) */
+	/* Merge with the block above (the fence is always in use). */
 	mhnext = M_NEXT(mh);
-	if (mhnext != (struct mheader *)__heaptop) {
-		__malloc_trymerge(mh, mhnext);
+	if (mhnext->mh_prevsize != size || !M_OK(mhnext)) {
+		errx(1, "free: Heap corrupt (%p and %p inconsistent)",
+		     mh, mhnext);
+	}
+	if (!M_INUSE_P(mhnext)) {
+		__malloc_binremove(mhnext);
+		size += M_SIZE(mhnext);
 	}
 
-	/* Try merging with the block below (but not if we're at the bottom) */
-	if (mh != (struct mheader *)__heapbase) {
+	/* Merge with the block below (but not if we're at the bottom). */
+	if (mh->mh_prevsize != 0) {
 		mhprev = M_PREV(mh);
-		__malloc_trymerge(mhprev, mh);
+		if (!M_INUSE_P(mhprev)) {
+			__malloc_binremove(mhprev);
+			size += M_SIZE(mhprev);
+			mh = mhprev;
+		}
+	}
+
+	M_SET(mh, size, 0);
+	mhnext = M_NEXT(mh);
+	mhnext->mh_prevsize = size;
+
+	if (mhnext == FENCE() && size >= TRIMSIZE) {
+		__malloc_trim(mh);
+	}
+	else {
+		__malloc_bininsert(mh);
 	}
 
 #ifdef MALLOCDEBUG
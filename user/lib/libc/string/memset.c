@@ -27,6 +27,7 @@
  * SUCH DAMAGE.
  */
 
+#include <stdint.h>
 #include <string.h>
 
 /*
@@ -36,11 +37,50 @@
 void *
 memset(void *ptr, int ch, size_t len)
 {
-	char *p = ptr;
-	size_t i;
-	
-	for (i=0; i<len; i++) {
-		p[i] = ch;
+	unsigned char *p = ptr;
+	unsigned long *lp;
+	unsigned long w;
+
+	/*
+	 * Like bzero: bytes up to a word boundary, then whole words
+	 * (eight at a time) holding CH in every byte, then the bytes
+	 * left over.
+	 */
+
+	if (len >= 2 * sizeof(long)) {
+		while ((uintptr_t)p % sizeof(long) != 0) {
+			*p++ = ch;
+			len--;
+		}
+		w = (unsigned char)ch;
+		w |= w << 8;
+		w |= w << 16;
+		if (sizeof(long) > 4) {
+			w |= (w << 16) << 16;
+		}
+		lp = (unsigned long *)p;
+		while (len >= 8 * sizeof(long)) {
+			lp[0] = w;
+			lp[1] = w;
+			lp[2] = w;
+			lp[3] = w;
+			lp[4] = w;
+			lp[5] = w;
+			lp[6] = w;
+			lp[7] = w;
+			lp += 8;
+			len -= 8 * sizeof(long);
+		}
+		while (len >= sizeof(long)) {
+			*lp++ = w;
+			len -= sizeof(long);
+		}
+		p = (unsigned char *)lp;
+	}
+
+	while (len > 0) {
+		*p++ = ch;
+		len--;
 	}
 
 	return ptr;
@@ -21,6 +21,12 @@ awk '
     }
 ' | awk '{
 	# output something simple that will work in syscalls.S.
-	printf "SYSCALL(%s, %s)\n", $1, $2;
+	# Calls that libc wraps in C get a __-prefixed stub instead.
+	if ($1 == "fork" || $1 == "execv" || $1 == "threadfork") {
+		printf "SYSCALL_WRAPPED(%s, %s)\n", $1, $2;
+	}
+	else {
+		printf "SYSCALL(%s, %s)\n", $1, $2;
+	}
 }'
     
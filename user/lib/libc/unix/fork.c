@@ -0,0 +1,22 @@
+/*
+ * fork and execv - wrappers around the system calls that flush stdio
+ * first. Otherwise output still sitting in a buffer would be printed
+ * twice after fork, or thrown away by execv.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+pid_t
+fork(void)
+{
+	fflush(NULL);
+	return __fork();
+}
+
+int
+execv(const char *prog, char *const *args)
+{
+	fflush(NULL);
+	return __execv(prog, args);
+}
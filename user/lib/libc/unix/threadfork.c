@@ -0,0 +1,21 @@
+/*
+ * threadfork - start a thread running FUNC. The kernel starts it in
+ * threadstart, on a stack of its own, so that it ends cleanly if FUNC
+ * returns.
+ */
+
+#include <unistd.h>
+
+static
+void
+threadstart(void (*func)(void))
+{
+	func();
+	threadexit();
+}
+
+int
+threadfork(void (*func)(void))
+{
+	return __threadfork(threadstart, func);
+}
@@ -0,0 +1,267 @@
+/*
+ * futextest - test futex().
+ *
+ * Checks the error cases (a word that has already changed, a timeout,
+ * a misaligned address); builds a mutex on a futex word and has
+ * several threads hammer a counter with it, and checks that locking
+ * and unlocking with nobody else around never enters the kernel; and
+ * checks that a sleeping waiter is woken by FUTEX_WAKE.
+ *
+ * The mutex is the usual three-state one: 0 unlocked, 1 locked, 2
+ * locked with (maybe) sleepers, so unlock only has to call in when
+ * the word says someone might be asleep.
+ */
+
+#include <sys/types.h>
+#include <sys/futex.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <err.h>
+#include <errno.h>
+
+#define NTHREADS   4
+#define NLOOPS     2000
+#define NFAST      10000
+
+static volatile int mutex;
+static volatile unsigned counter;
+static volatile int nextslot;
+static volatile int done[NTHREADS];
+
+/* Calls to futex() made by the mutex code, per thread slot */
+static volatile unsigned ncalls[NTHREADS + 1];
+
+/*
+ * Compare and swap with LL/SC: if *P is OLD, make it NEW. Returns what
+ * *P was, so the swap happened if that is OLD.
+ */
+static
+int
+cas(volatile int *p, int old, int new)
+{
+	int x, ok;
+
+	do {
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set noreorder;"	/* we fill the delay slot */
+			"ll %0, 0(%2);"		/*   x = *p */
+			"bne %0, %3, 1f;"	/*   if (x != old) give up */
+			" move %1, $0;"		/*   ok = 0 (delay slot) */
+			"move %1, %4;"		/*   ok = new */
+			"sc %1, 0(%2);"		/*   *p = ok; ok = success? */
+			"1:"
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "=&r" (ok)
+			: "r" (p), "r" (old), "r" (new)
+			: "memory");
+	} while (x == old && ok == 0);
+	return x;
+}
+
+static
+int
+xchg(volatile int *p, int new)
+{
+	int old;
+
+	do {
+		old = *p;
+	} while (cas(p, old, new) != old);
+	return old;
+}
+
+static
+void
+mutex_lock(volatile int *m, unsigned slot)
+{
+	int c;
+
+	c = cas(m, 0, 1);
+	if (c == 0) {
+		return;
+	}
+	if (c != 2) {
+		c = xchg(m, 2);
+	}
+	while (c != 0) {
+		ncalls[slot]++;
+		futex(m, FUTEX_WAIT, 2, NULL);
+		c = xchg(m, 2);
+	}
+}
+
+static
+void
+mutex_unlock(volatile int *m, unsigned slot)
+{
+	if (xchg(m, 0) == 2) {
+		ncalls[slot]++;
+		futex(m, FUTEX_WAKE, 1, NULL);
+	}
+}
+
+/* Wait until the thread in SLOT is done, sleeping rather than spinning. */
+static
+void
+join(int slot)
+{
+	while (!done[slot]) {
+		futex(&done[slot], FUTEX_WAIT, 0, NULL);
+	}
+}
+
+static
+void
+test_errors(void)
+{
+	volatile int word = 5;
+	struct timespec ts;
+	char buf[8];
+
+	if (futex(&word, FUTEX_WAIT, 4, NULL) >= 0 || errno != EAGAIN) {
+		errx(1, "wait on a changed word didn't fail with EAGAIN");
+	}
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = 50*1000*1000;
+	if (futex(&word, FUTEX_WAIT, 5, &ts) >= 0 || errno != ETIMEDOUT) {
+		errx(1, "wait with nobody to wake didn't time out");
+	}
+
+	if (futex((volatile int *)(buf + 1), FUTEX_WAKE, 1, NULL) >= 0 ||
+	    errno != EINVAL) {
+		errx(1, "misaligned address wasn't rejected");
+	}
+
+	if (futex(&word, FUTEX_WAKE, 1, NULL) != 0) {
+		errx(1, "wake with nobody asleep woke somebody");
+	}
+	printf("futextest: errors ok\n");
+}
+
+static
+void
+test_fast(void)
+{
+	int i;
+
+	ncalls[NTHREADS] = 0;
+	for (i=0; i<NFAST; i++) {
+		mutex_lock(&mutex, NTHREADS);
+		counter++;
+		mutex_unlock(&mutex, NTHREADS);
+	}
+	if (ncalls[NTHREADS] != 0) {
+		errx(1, "uncontended mutex made %u futex calls",
+		     ncalls[NTHREADS]);
+	}
+	printf("futextest: uncontended mutex ok\n");
+}
+
+static
+void
+hammer(void)
+{
+	unsigned slot;
+	int i;
+
+	mutex_lock(&mutex, NTHREADS);
+	slot = nextslot++;
+	mutex_unlock(&mutex, NTHREADS);
+
+	for (i=0; i<NLOOPS; i++) {
+		mutex_lock(&mutex, slot);
+		counter++;
+		mutex_unlock(&mutex, slot);
+	}
+
+	done[slot] = 1;
+	futex(&done[slot], FUTEX_WAKE, 1, NULL);
+}
+
+static
+void
+test_contended(void)
+{
+	unsigned calls;
+	int t;
+
+	counter = 0;
+	nextslot = 0;
+	for (t=0; t<NTHREADS; t++) {
+		done[t] = 0;
+		ncalls[t] = 0;
+	}
+	for (t=0; t<NTHREADS; t++) {
+		if (threadfork(hammer) < 0) {
+			err(1, "threadfork");
+		}
+	}
+
+	calls = 0;
+	for (t=0; t<NTHREADS; t++) {
+		join(t);
+		calls += ncalls[t];
+	}
+	if (counter != NTHREADS * NLOOPS) {
+		errx(1, "contended: counter is %u, expected %u",
+		     counter, NTHREADS * NLOOPS);
+	}
+	printf("futextest: contended mutex ok (%u futex calls for %u locks)\n",
+	       calls, NTHREADS * NLOOPS);
+}
+
+static volatile int flag;
+
+static
+void
+sleeper(void)
+{
+	while (flag == 0) {
+		futex(&flag, FUTEX_WAIT, 0, NULL);
+	}
+	done[0] = 1;
+	futex(&done[0], FUTEX_WAKE, 1, NULL);
+}
+
+static
+void
+test_wake(void)
+{
+	struct timespec ts;
+	int r;
+
+	flag = 0;
+	done[0] = 0;
+	if (threadfork(sleeper) < 0) {
+		err(1, "threadfork");
+	}
+
+	/* Give it time to get to sleep, then wake it. */
+	ts.tv_sec = 0;
+	ts.tv_nsec = 100*1000*1000;
+	nanosleep(&ts, NULL);
+	flag = 1;
+	r = futex(&flag, FUTEX_WAKE, 10, NULL);
+	if (r < 0) {
+		err(1, "futex wake");
+	}
+	if (r > 1) {
+		errx(1, "wake: woke %d threads, only one was asleep", r);
+	}
+	join(0);
+	printf("futextest: wake ok\n");
+}
+
+int
+main(void)
+{
+	test_errors();
+	test_fast();
+	test_contended();
+	test_wake();
+	printf("futextest: passed\n");
+	return 0;
+}
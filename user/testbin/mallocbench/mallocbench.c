@@ -0,0 +1,120 @@
+/*
+ * mallocbench - time malloc and free.
+ *
+ * Keeps a pool of NSLOTS live blocks and repeatedly frees or refills
+ * a random slot, mostly with small sizes and now and then a big one,
+ * so the heap is full of interleaved free and allocated blocks of all
+ * sizes. That is where a list-walking allocator slows down. Reports
+ * operations per second and how big the heap got.
+ *
+ * Then frees everything and checks the heap shrank again, since malloc
+ * should hand the free top of the heap back to the kernel.
+ *
+ * Usage: mallocbench [iterations]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define NSLOTS     2000
+#define DEFITERS   200000
+
+static void *slots[NSLOTS];
+static size_t sizes[NSLOTS];
+
+static
+size_t
+pick_size(void)
+{
+	unsigned r = random() % 100;
+
+	if (r < 75) {
+		return 1 + random() % 128;
+	}
+	if (r < 97) {
+		return 129 + random() % 4000;
+	}
+	return 8192 + random() % 60000;
+}
+
+int
+main(int argc, char *argv[])
+{
+	time_t startsecs, endsecs;
+	unsigned long startnsecs, endnsecs;
+	unsigned long iters, i, usecs, ops;
+	uintptr_t base, peak, top;
+	unsigned slot;
+
+	iters = DEFITERS;
+	if (argc > 1) {
+		iters = atoi(argv[1]);
+	}
+
+	/* Get malloc set up before noting where the heap starts. */
+	free(malloc(1));
+	base = (uintptr_t)sbrk(0);
+	peak = base;
+	srandom(50);
+
+	__time(&startsecs, &startnsecs);
+	ops = 0;
+	for (i=0; i<iters; i++) {
+		slot = random() % NSLOTS;
+		if (slots[slot] != NULL) {
+			if (((unsigned char *)slots[slot])[sizes[slot] - 1]
+			    != (slot & 0xff)) {
+				errx(1, "block in slot %u corrupted", slot);
+			}
+			free(slots[slot]);
+			slots[slot] = NULL;
+		}
+		else {
+			sizes[slot] = pick_size();
+			slots[slot] = malloc(sizes[slot]);
+			if (slots[slot] == NULL) {
+				errx(1, "malloc of %lu failed",
+				     (unsigned long)sizes[slot]);
+			}
+			((unsigned char *)slots[slot])[0] = slot & 0xff;
+			((unsigned char *)slots[slot])[sizes[slot] - 1]
+				= slot & 0xff;
+		}
+		ops++;
+		if (i % 1024 == 0 && (uintptr_t)sbrk(0) > peak) {
+			peak = (uintptr_t)sbrk(0);
+		}
+	}
+	__time(&endsecs, &endnsecs);
+
+	if (endnsecs < startnsecs) {
+		endnsecs += 1000000000;
+		endsecs--;
+	}
+	usecs = (endsecs - startsecs) * 1000000 +
+		(endnsecs - startnsecs) / 1000;
+	printf("mallocbench: %lu operations in %lu.%06lu seconds",
+	       ops, usecs / 1000000, usecs % 1000000);
+	if (usecs >= 1000) {
+		printf(" (%lu per second)", ops * 1000 / (usecs / 1000));
+	}
+	printf("\n");
+	printf("mallocbench: heap peaked at %lu KB\n",
+	       (unsigned long)(peak - base) / 1024);
+
+	for (slot=0; slot<NSLOTS; slot++) {
+		free(slots[slot]);
+		slots[slot] = NULL;
+	}
+	top = (uintptr_t)sbrk(0);
+	printf("mallocbench: heap is %lu KB after freeing everything\n",
+	       (unsigned long)(top - base) / 1024);
+	if (peak - base > 64 * 1024 && top - base > (peak - base) / 2) {
+		errx(1, "free didn't give the heap back");
+	}
+	return 0;
+}
@@ -0,0 +1,234 @@
+/*
+ * mmaptest - test mmap and munmap.
+ *
+ * Checks anonymous mappings, private and shared file mappings
+ * (including that shared writes reach the file and private ones
+ * don't), partial munmap, and that fork copies mappings.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <err.h>
+
+#define TESTFILE "mmaptest.dat"
+#define PAGESZ   4096
+#define FILEPAGES 5
+#define FILESIZE (FILEPAGES * PAGESZ + 100)	/* last page is partial */
+#define ANONPAGES 64
+
+static char buf[FILESIZE];
+
+static
+char
+pattern(unsigned pos)
+{
+	return 'A' + (pos * 7 + pos / PAGESZ) % 26;
+}
+
+static
+void
+makefile(void)
+{
+	unsigned i;
+	int fd;
+
+	for (i=0; i<FILESIZE; i++) {
+		buf[i] = pattern(i);
+	}
+	fd = open(TESTFILE, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", TESTFILE);
+	}
+	if (write(fd, buf, FILESIZE) != FILESIZE) {
+		err(1, "%s: write", TESTFILE);
+	}
+	close(fd);
+}
+
+static
+void
+readfile(void)
+{
+	int fd;
+
+	fd = open(TESTFILE, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", TESTFILE);
+	}
+	if (read(fd, buf, FILESIZE) != FILESIZE) {
+		err(1, "%s: read", TESTFILE);
+	}
+	close(fd);
+}
+
+static
+void
+test_anon(void)
+{
+	unsigned *p;
+	unsigned i, n = ANONPAGES * PAGESZ / sizeof(unsigned);
+	pid_t pid;
+	int status;
+
+	p = mmap(NULL, ANONPAGES * PAGESZ, PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_ANON, -1, 0);
+	if (p == MAP_FAILED) {
+		err(1, "anonymous mmap");
+	}
+	for (i=0; i<n; i++) {
+		if (p[i] != 0) {
+			errx(1, "anonymous mapping not zero filled");
+		}
+		p[i] = i;
+	}
+
+	/* The child gets a copy. */
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		for (i=0; i<n; i++) {
+			if (p[i] != i) {
+				errx(1, "child: wrong data in mapping");
+			}
+		}
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child failed");
+	}
+
+	/* Punch a hole in the middle; the rest stays. */
+	if (munmap((char *)p + 16 * PAGESZ, 16 * PAGESZ) < 0) {
+		err(1, "munmap middle");
+	}
+	for (i=0; i<n; i++) {
+		if (i * sizeof(unsigned) >= 16 * PAGESZ &&
+		    i * sizeof(unsigned) < 32 * PAGESZ) {
+			continue;
+		}
+		if (p[i] != i) {
+			errx(1, "data lost after partial munmap");
+		}
+	}
+	if (munmap(p, ANONPAGES * PAGESZ) < 0) {
+		err(1, "munmap");
+	}
+	printf("anonymous mapping: ok\n");
+}
+
+static
+void
+test_private(void)
+{
+	char *p;
+	unsigned i;
+	int fd;
+
+	fd = open(TESTFILE, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", TESTFILE);
+	}
+	p = mmap(NULL, FILESIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "private mmap");
+	}
+	/* The mapping keeps the file open. */
+	close(fd);
+
+	for (i=0; i<FILESIZE; i++) {
+		if (p[i] != pattern(i)) {
+			errx(1, "private mapping: wrong data at %u", i);
+		}
+	}
+	for (i=FILESIZE; i<FILEPAGES * PAGESZ + PAGESZ; i++) {
+		if (p[i] != 0) {
+			errx(1, "private mapping: no zeros past EOF");
+		}
+	}
+	for (i=0; i<FILESIZE; i+=PAGESZ) {
+		p[i] = '#';
+	}
+	if (munmap(p, FILESIZE) < 0) {
+		err(1, "munmap");
+	}
+
+	readfile();
+	for (i=0; i<FILESIZE; i++) {
+		if (buf[i] != pattern(i)) {
+			errx(1, "private mapping: write reached the file");
+		}
+	}
+	printf("private file mapping: ok\n");
+}
+
+static
+void
+test_shared(void)
+{
+	char *p;
+	unsigned i;
+	int fd;
+
+	fd = open(TESTFILE, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s", TESTFILE);
+	}
+
+	/* Map from the second page on. */
+	p = mmap(NULL, FILESIZE - PAGESZ, PROT_READ|PROT_WRITE, MAP_SHARED,
+		 fd, PAGESZ);
+	if (p == MAP_FAILED) {
+		err(1, "shared mmap");
+	}
+	if (p[0] != pattern(PAGESZ)) {
+		errx(1, "shared mapping: offset ignored");
+	}
+	/* Write every other page; the others must not be written back. */
+	for (i=0; i<FILESIZE - PAGESZ; i++) {
+		if ((i / PAGESZ) % 2 == 0) {
+			p[i] = 'z';
+		}
+	}
+	if (munmap(p, FILESIZE - PAGESZ) < 0) {
+		err(1, "munmap");
+	}
+
+	if (lseek(fd, 0, SEEK_END) != FILESIZE) {
+		errx(1, "shared mapping: file size changed");
+	}
+	close(fd);
+
+	readfile();
+	for (i=0; i<FILESIZE; i++) {
+		char want = pattern(i);
+		if (i >= PAGESZ && ((i - PAGESZ) / PAGESZ) % 2 == 0) {
+			want = 'z';
+		}
+		if (buf[i] != want) {
+			errx(1, "shared mapping: wrong file data at %u", i);
+		}
+	}
+	printf("shared file mapping: ok\n");
+}
+
+int
+main(void)
+{
+	makefile();
+	test_anon();
+	test_private();
+	test_shared();
+	remove(TESTFILE);
+	printf("mmaptest: passed\n");
+	return 0;
+}
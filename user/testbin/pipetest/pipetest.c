@@ -0,0 +1,189 @@
+/*
+ * pipetest - test pipe().
+ *
+ * Checks a round trip through a pipe in one process, streams a large
+ * block from a child to its parent (big writes, so the kernel may hand
+ * them straight to the waiting reader) and checks it arrives intact and
+ * is followed by EOF, checks that a reader left alone on a pipe gets
+ * EOF once the writer's dup2'd copy is closed too, and checks that
+ * writing with no reader fails with EPIPE.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <err.h>
+#include <errno.h>
+
+#define BIGSIZE   (64*1024)
+#define CHUNK     (8*1024)
+
+static char bigbuf[BIGSIZE];
+
+static
+char
+pattern(unsigned i)
+{
+	return 'a' + (i * 7 + i / 4096) % 26;
+}
+
+static
+void
+waitchild(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child failed");
+	}
+}
+
+static
+void
+test_roundtrip(void)
+{
+	const char *msg = "through the pipe";
+	char buf[64];
+	int fds[2];
+	int r;
+
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+	r = write(fds[1], msg, strlen(msg));
+	if (r != (int)strlen(msg)) {
+		err(1, "write: %d", r);
+	}
+	r = read(fds[0], buf, sizeof(buf));
+	if (r != (int)strlen(msg) || memcmp(buf, msg, r) != 0) {
+		errx(1, "roundtrip: read %d bytes back", r);
+	}
+	if (lseek(fds[0], 0, SEEK_SET) >= 0 || errno != ESPIPE) {
+		errx(1, "lseek on a pipe worked");
+	}
+	close(fds[0]);
+	close(fds[1]);
+	printf("pipetest: roundtrip ok\n");
+}
+
+static
+void
+test_stream(void)
+{
+	int fds[2];
+	unsigned i, got;
+	pid_t pid;
+	int r;
+
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		for (i=0; i<BIGSIZE; i++) {
+			bigbuf[i] = pattern(i);
+		}
+		for (i=0; i<BIGSIZE; i+=CHUNK) {
+			r = write(fds[1], bigbuf + i, CHUNK);
+			if (r != CHUNK) {
+				err(1, "child write: %d", r);
+			}
+		}
+		_exit(0);
+	}
+
+	close(fds[1]);
+	got = 0;
+	while ((r = read(fds[0], bigbuf + got, BIGSIZE - got)) > 0) {
+		got += r;
+		if (got == BIGSIZE) {
+			break;
+		}
+	}
+	if (r < 0) {
+		err(1, "read");
+	}
+	if (got != BIGSIZE) {
+		errx(1, "stream: got %u of %u bytes", got, BIGSIZE);
+	}
+	for (i=0; i<BIGSIZE; i++) {
+		if (bigbuf[i] != pattern(i)) {
+			errx(1, "stream: wrong byte at %u", i);
+		}
+	}
+	if (read(fds[0], bigbuf, 1) != 0) {
+		errx(1, "stream: no EOF after writer exited");
+	}
+	close(fds[0]);
+	waitchild(pid);
+	printf("pipetest: stream ok\n");
+}
+
+static
+void
+test_dup2_eof(void)
+{
+	int fds[2];
+	char c;
+
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+	if (dup2(fds[1], 10) < 0) {
+		err(1, "dup2");
+	}
+	close(fds[1]);
+	if (write(10, "x", 1) != 1) {
+		err(1, "write through dup");
+	}
+	if (read(fds[0], &c, 1) != 1 || c != 'x') {
+		errx(1, "dup2: bad read");
+	}
+	close(10);
+	if (read(fds[0], &c, 1) != 0) {
+		errx(1, "dup2: no EOF after last writer closed");
+	}
+	close(fds[0]);
+	printf("pipetest: dup2 ok\n");
+}
+
+static
+void
+test_epipe(void)
+{
+	int fds[2];
+
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+	close(fds[0]);
+	if (write(fds[1], "x", 1) >= 0) {
+		errx(1, "write with no reader worked");
+	}
+	if (errno != EPIPE) {
+		err(1, "write with no reader");
+	}
+	close(fds[1]);
+	printf("pipetest: EPIPE ok\n");
+}
+
+int
+main(void)
+{
+	test_roundtrip();
+	test_stream();
+	test_dup2_eof();
+	test_epipe();
+	printf("pipetest: passed\n");
+	return 0;
+}
@@ -0,0 +1,115 @@
+/*
+ * rusagetest - test getrusage.
+ *
+ * Burns some CPU, touches some fresh heap pages, and does the same in
+ * a child, then checks that the time, faults and switches show up
+ * under RUSAGE_SELF and RUSAGE_CHILDREN respectively.
+ */
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+
+#define SPINS  2000000
+#define PAGES  16
+#define PAGESZ 4096
+
+static volatile unsigned sink;
+
+static
+void
+work(void)
+{
+	char *p;
+	unsigned i;
+
+	for (i=0; i<SPINS; i++) {
+		sink += i;
+	}
+
+	p = malloc(PAGES * PAGESZ);
+	if (p == NULL) {
+		errx(1, "malloc failed");
+	}
+	for (i=0; i<PAGES; i++) {
+		p[i * PAGESZ] = 1;
+	}
+	free(p);
+}
+
+static
+void
+show(const char *what, const struct rusage *ru)
+{
+	printf("%s: user %lu.%06lu sys %lu.%06lu minflt %lu majflt %lu "
+	       "nvcsw %lu nivcsw %lu\n", what,
+	       (unsigned long)ru->ru_utime.tv_sec,
+	       (unsigned long)ru->ru_utime.tv_usec,
+	       (unsigned long)ru->ru_stime.tv_sec,
+	       (unsigned long)ru->ru_stime.tv_usec,
+	       (unsigned long)ru->ru_minflt, (unsigned long)ru->ru_majflt,
+	       (unsigned long)ru->ru_nvcsw, (unsigned long)ru->ru_nivcsw);
+}
+
+static
+int
+hastime(const struct rusage *ru)
+{
+	return ru->ru_utime.tv_sec > 0 || ru->ru_utime.tv_usec > 0 ||
+		ru->ru_stime.tv_sec > 0 || ru->ru_stime.tv_usec > 0;
+}
+
+int
+main(void)
+{
+	struct rusage self, children;
+	pid_t pid;
+	int status, bad = 0;
+
+	work();
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		work();
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+
+	if (getrusage(RUSAGE_SELF, &self)) {
+		err(1, "getrusage RUSAGE_SELF");
+	}
+	if (getrusage(RUSAGE_CHILDREN, &children)) {
+		err(1, "getrusage RUSAGE_CHILDREN");
+	}
+	show("self", &self);
+	show("children", &children);
+
+	if (!hastime(&self) || self.ru_minflt == 0) {
+		printf("FAILED: no usage recorded for self\n");
+		bad = 1;
+	}
+	if (!hastime(&children) || children.ru_minflt == 0) {
+		printf("FAILED: no usage recorded for children\n");
+		bad = 1;
+	}
+	if (self.ru_nvcsw == 0) {
+		printf("FAILED: waitpid did not count as a switch\n");
+		bad = 1;
+	}
+	if (getrusage(42, &self) == 0) {
+		printf("FAILED: bad who accepted\n");
+		bad = 1;
+	}
+
+	printf("rusagetest %s\n", bad ? "failed" : "passed");
+	return bad;
+}
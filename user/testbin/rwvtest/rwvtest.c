@@ -0,0 +1,146 @@
+/*
+ * rwvtest - test readv, writev, pread, and pwrite.
+ *
+ * Writes records as header+payload with one writev, reads them back
+ * with readv, then patches and rereads them with pwrite/pread and
+ * checks that the seek position was left alone throughout.
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <err.h>
+#include <errno.h>
+
+#define TESTFILE "rwvtest.dat"
+#define NRECS    16
+#define PAYLOAD  100
+
+struct header {
+	unsigned h_num;
+	unsigned h_len;
+};
+
+#define RECSIZE ((int)(sizeof(struct header) + PAYLOAD))
+
+static
+void
+fill(char *buf, unsigned num)
+{
+	unsigned i;
+
+	for (i=0; i<PAYLOAD; i++) {
+		buf[i] = 'a' + (num + i) % 26;
+	}
+}
+
+static
+void
+check_offset(int fd, off_t expected, const char *when)
+{
+	off_t pos;
+
+	pos = lseek(fd, 0, SEEK_CUR);
+	if (pos != expected) {
+		errx(1, "%s: seek position is %ld, expected %ld", when,
+		     (long)pos, (long)expected);
+	}
+}
+
+int
+main(void)
+{
+	struct header h;
+	struct iovec iov[2];
+	char payload[PAYLOAD], expect[PAYLOAD];
+	unsigned i;
+	int fd, r;
+
+	fd = open(TESTFILE, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", TESTFILE);
+	}
+
+	/* One trap per record. */
+	for (i=0; i<NRECS; i++) {
+		h.h_num = i;
+		h.h_len = PAYLOAD;
+		fill(payload, i);
+		iov[0].iov_base = &h;
+		iov[0].iov_len = sizeof(h);
+		iov[1].iov_base = payload;
+		iov[1].iov_len = PAYLOAD;
+		r = writev(fd, iov, 2);
+		if (r != RECSIZE) {
+			err(1, "writev record %u: got %d", i, r);
+		}
+	}
+	check_offset(fd, NRECS * RECSIZE, "after writev");
+
+	lseek(fd, 0, SEEK_SET);
+	for (i=0; i<NRECS; i++) {
+		iov[0].iov_base = &h;
+		iov[0].iov_len = sizeof(h);
+		iov[1].iov_base = payload;
+		iov[1].iov_len = PAYLOAD;
+		r = readv(fd, iov, 2);
+		if (r != RECSIZE) {
+			err(1, "readv record %u: got %d", i, r);
+		}
+		fill(expect, i);
+		if (h.h_num != i || h.h_len != PAYLOAD ||
+		    memcmp(payload, expect, PAYLOAD) != 0) {
+			errx(1, "readv record %u: wrong data", i);
+		}
+	}
+
+	/* Positional I/O must not move the seek position. */
+	lseek(fd, 0, SEEK_SET);
+	for (i=0; i<NRECS; i++) {
+		h.h_num = i + 1000;
+		r = pwrite(fd, &h, sizeof(h), (off_t)i * RECSIZE);
+		if (r != (int)sizeof(h)) {
+			err(1, "pwrite record %u: got %d", i, r);
+		}
+	}
+	check_offset(fd, 0, "after pwrite");
+
+	for (i=NRECS; i-- > 0; ) {
+		r = pread(fd, &h, sizeof(h), (off_t)i * RECSIZE);
+		if (r != (int)sizeof(h)) {
+			err(1, "pread record %u: got %d", i, r);
+		}
+		if (h.h_num != i + 1000) {
+			errx(1, "pread record %u: got number %u", i, h.h_num);
+		}
+	}
+	check_offset(fd, 0, "after pread");
+
+	/* Reading past the end is not an error. */
+	r = pread(fd, payload, PAYLOAD, (off_t)NRECS * RECSIZE);
+	if (r != 0) {
+		errx(1, "pread at EOF: got %d", r);
+	}
+
+	/* And some things that should fail. */
+	r = pread(fd, payload, PAYLOAD, -1);
+	if (r >= 0 || errno != EINVAL) {
+		errx(1, "pread at negative offset: got %d", r);
+	}
+	r = pwrite(STDOUT_FILENO, "x", 1, 0);
+	if (r >= 0 || errno != ESPIPE) {
+		errx(1, "pwrite on console: got %d", r);
+	}
+	r = readv(fd, iov, 0);
+	if (r >= 0 || errno != EINVAL) {
+		errx(1, "readv with no iovecs: got %d", r);
+	}
+
+	close(fd);
+	remove(TESTFILE);
+	printf("rwvtest: passed\n");
+	return 0;
+}
@@ -0,0 +1,230 @@
+/*
+ * shmtest - test shmget/shmat/shmdt/shmctl.
+ *
+ * Checks that a segment attached before fork is shared between parent
+ * and child, and that a futex in it works across the two processes;
+ * that keys find the same segment and IPC_EXCL refuses to make a second;
+ * that IPC_STAT counts attachments and IPC_RMID waits for the last one;
+ * and, with a segment bigger than a fair share of memory, that its pages
+ * come back intact from swap.
+ */
+
+#include <sys/types.h>
+#include <sys/shm.h>
+#include <sys/futex.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <err.h>
+#include <errno.h>
+
+#define SMALLSIZE  (4*4096)
+#define BIGSIZE    (1024*1024)
+#define NROUNDS    200
+#define TESTKEY    0x5117
+
+static
+void *
+attach(int id, int flags)
+{
+	void *p;
+
+	p = shmat(id, NULL, flags);
+	if (p == (void *)-1) {
+		err(1, "shmat");
+	}
+	return p;
+}
+
+static
+void
+waitchild(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child failed");
+	}
+}
+
+/*
+ * Parent and child take turns on a futex word in the segment: each
+ * waits for its own value, adds one and wakes the other.
+ */
+static
+void
+taketurns(volatile int *turn, int me)
+{
+	int i;
+
+	for (i=0; i<NROUNDS; i++) {
+		while (*turn % 2 != me) {
+			futex(turn, FUTEX_WAIT, *turn, NULL);
+		}
+		(*turn)++;
+		futex(turn, FUTEX_WAKE, 1, NULL);
+	}
+}
+
+static
+void
+test_fork(void)
+{
+	volatile int *p;
+	pid_t pid;
+	int id;
+
+	id = shmget(IPC_PRIVATE, SMALLSIZE, 0);
+	if (id < 0) {
+		err(1, "shmget");
+	}
+	p = attach(id, 0);
+	p[0] = 0;
+	p[SMALLSIZE/sizeof(int) - 1] = 0;
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		p[SMALLSIZE/sizeof(int) - 1] = 1234;
+		taketurns(&p[0], 1);
+		_exit(0);
+	}
+	taketurns(&p[0], 0);
+	waitchild(pid);
+
+	if (p[0] != 2 * NROUNDS) {
+		errx(1, "fork: turn is %d, expected %d", p[0], 2 * NROUNDS);
+	}
+	if (p[SMALLSIZE/sizeof(int) - 1] != 1234) {
+		errx(1, "fork: child's store didn't show up");
+	}
+	if (shmdt((void *)p) < 0 || shmctl(id, IPC_RMID, NULL) < 0) {
+		err(1, "fork: detach");
+	}
+	printf("shmtest: fork and futex ok\n");
+}
+
+static
+void
+test_keys(void)
+{
+	struct shmid_ds ds;
+	volatile int *a, *b;
+	int id, id2;
+
+	id = shmget(TESTKEY, SMALLSIZE, IPC_CREAT | IPC_EXCL);
+	if (id < 0) {
+		err(1, "shmget create");
+	}
+	if (shmget(TESTKEY, SMALLSIZE, IPC_CREAT | IPC_EXCL) >= 0 ||
+	    errno != EEXIST) {
+		errx(1, "keys: IPC_EXCL made a second segment");
+	}
+	id2 = shmget(TESTKEY, 0, 0);
+	if (id2 != id) {
+		errx(1, "keys: got id %d for the key, expected %d", id2, id);
+	}
+	if (shmget(TESTKEY, 2 * SMALLSIZE, 0) >= 0 || errno != EINVAL) {
+		errx(1, "keys: asked for more than the segment has");
+	}
+	if (shmget(TESTKEY + 1, SMALLSIZE, 0) >= 0 || errno != ENOENT) {
+		errx(1, "keys: found a segment that doesn't exist");
+	}
+
+	/* Two attachments in one process see the same memory. */
+	a = attach(id, 0);
+	b = attach(id, SHM_RDONLY);
+	if (a == b) {
+		errx(1, "keys: both attachments at the same address");
+	}
+	a[5] = 99;
+	if (b[5] != 99) {
+		errx(1, "keys: attachments don't share memory");
+	}
+
+	if (shmctl(id, IPC_STAT, &ds) < 0) {
+		err(1, "shmctl IPC_STAT");
+	}
+	if (ds.shm_segsz != SMALLSIZE || ds.shm_nattch != 2) {
+		errx(1, "keys: IPC_STAT says %u bytes, %u attached",
+		     (unsigned)ds.shm_segsz, ds.shm_nattch);
+	}
+
+	/* Removed, but still usable until the last detach. */
+	if (shmctl(id, IPC_RMID, NULL) < 0) {
+		err(1, "shmctl IPC_RMID");
+	}
+	if (shmget(TESTKEY, 0, 0) >= 0) {
+		errx(1, "keys: removed segment still found by key");
+	}
+	if (shmat(id, NULL, 0) != (void *)-1) {
+		errx(1, "keys: attached a removed segment");
+	}
+	a[6] = 100;
+	if (b[6] != 100) {
+		errx(1, "keys: removed segment stopped sharing");
+	}
+	if (shmdt((void *)a) < 0 || shmdt((void *)b) < 0) {
+		err(1, "keys: shmdt");
+	}
+	if (shmctl(id, IPC_STAT, &ds) >= 0) {
+		errx(1, "keys: segment outlived its last detach");
+	}
+	printf("shmtest: keys and removal ok\n");
+}
+
+static
+void
+test_big(void)
+{
+	volatile unsigned *p;
+	unsigned i, n = BIGSIZE / sizeof(unsigned);
+	pid_t pid;
+	int id;
+
+	id = shmget(IPC_PRIVATE, BIGSIZE, 0);
+	if (id < 0) {
+		err(1, "shmget big");
+	}
+	p = attach(id, 0);
+	if (shmctl(id, IPC_RMID, NULL) < 0) {
+		err(1, "shmctl IPC_RMID");
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		for (i=0; i<n; i++) {
+			p[i] = i * 2654435761U;
+		}
+		_exit(0);
+	}
+	waitchild(pid);
+
+	for (i=0; i<n; i++) {
+		if (p[i] != i * 2654435761U) {
+			errx(1, "big: word %u is %u", i, p[i]);
+		}
+	}
+	if (shmdt((void *)p) < 0) {
+		err(1, "big: shmdt");
+	}
+	printf("shmtest: big segment ok\n");
+}
+
+int
+main(void)
+{
+	test_fork();
+	test_keys();
+	test_big();
+	printf("shmtest: passed\n");
+	return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * sleeptest - test nanosleep.
+ *
+ * Sleeps for a range of intervals, most of them shorter than a
+ * second, and checks with __time that each sleep lasted at least as
+ * long as asked and not absurdly longer.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <err.h>
+
+/* Allow this much oversleep (scheduling, clock reads) */
+#define SLOP_NSECS 50000000
+
+static const unsigned long intervals[] = {
+	1000000,	/* 1 ms */
+	5000000,	/* 5 ms */
+	25000000,	/* 25 ms */
+	100000000,	/* 100 ms */
+	500000000,	/* 500 ms */
+	1500000000,	/* 1.5 s */
+};
+
+#define NINTERVALS (sizeof(intervals) / sizeof(intervals[0]))
+
+static
+unsigned long long
+now_nsecs(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	return (unsigned long long)secs * 1000000000 + nsecs;
+}
+
+int
+main(void)
+{
+	struct timespec ts;
+	unsigned long long before, after, slept;
+	unsigned i;
+	int bad = 0;
+
+	for (i=0; i<NINTERVALS; i++) {
+		ts.tv_sec = intervals[i] / 1000000000;
+		ts.tv_nsec = intervals[i] % 1000000000;
+
+		before = now_nsecs();
+		if (nanosleep(&ts, NULL)) {
+			err(1, "nanosleep");
+		}
+		after = now_nsecs();
+		slept = after - before;
+
+		printf("asked %lu us, slept %lu us\n",
+		       intervals[i] / 1000, (unsigned long)(slept / 1000));
+		if (slept < intervals[i]) {
+			printf("  FAILED: woke up early\n");
+			bad = 1;
+		}
+		else if (slept > intervals[i] + SLOP_NSECS) {
+			printf("  FAILED: overslept\n");
+			bad = 1;
+		}
+	}
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = 1000000000;
+	if (nanosleep(&ts, NULL) == 0 || errno != EINVAL) {
+		printf("FAILED: out of range tv_nsec accepted\n");
+		bad = 1;
+	}
+
+	printf("sleeptest %s\n", bad ? "failed" : "passed");
+	return bad;
+}
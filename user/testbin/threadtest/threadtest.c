@@ -0,0 +1,241 @@
+/*
+ * threadtest - test threadfork().
+ *
+ * Splits a sum over an array between several threads and checks that
+ * they all see the same memory and their results come back; runs a
+ * lot of short-lived threads one after another, so their stacks have
+ * to be given back; has several threads open and close files at once,
+ * so they race for slots in the shared file table; and checks that a
+ * process only exits once its last thread has, with the status of the
+ * last _exit.
+ *
+ * There's no atomic increment in userland, so every shared variable
+ * here has only one writer.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <err.h>
+
+#define NTHREADS   4
+#define NVALUES    (64*1024)
+#define NSEQUENTIAL 200
+#define NOPENS     100
+
+static unsigned values[NVALUES];
+
+/* Which slot the thread being started should take, and its answer. */
+static volatile int nextslot;
+static volatile int tookslot;
+
+static volatile unsigned results[NTHREADS];
+static volatile int done[NTHREADS];
+
+/* Hand the slot main set up to the calling thread. */
+static
+int
+takeslot(void)
+{
+	int slot = nextslot;
+
+	tookslot = slot;
+	return slot;
+}
+
+/* Start a thread running FUNC, and wait until it has taken slot I. */
+static
+void
+start(void (*func)(void), int i)
+{
+	tookslot = -1;
+	nextslot = i;
+	if (threadfork(func) < 0) {
+		err(1, "threadfork");
+	}
+	while (tookslot != i) {
+		/* spin */
+	}
+}
+
+static
+void
+summer(void)
+{
+	unsigned slot = takeslot();
+	unsigned i, sum;
+
+	sum = 0;
+	for (i = slot * (NVALUES/NTHREADS); i < (slot+1) * (NVALUES/NTHREADS); i++) {
+		sum += values[i];
+	}
+	results[slot] = sum;
+	done[slot] = 1;
+}
+
+static
+void
+test_sum(void)
+{
+	unsigned i, expected, total;
+	int t;
+
+	expected = 0;
+	for (i=0; i<NVALUES; i++) {
+		values[i] = i * 7 + 1;
+		expected += values[i];
+	}
+
+	for (t=0; t<NTHREADS; t++) {
+		done[t] = 0;
+		start(summer, t);
+	}
+
+	total = 0;
+	for (t=0; t<NTHREADS; t++) {
+		while (!done[t]) {
+			/* spin */
+		}
+		total += results[t];
+	}
+	if (total != expected) {
+		errx(1, "sum: got %u, expected %u", total, expected);
+	}
+	printf("threadtest: sum ok\n");
+}
+
+static
+void
+quick(void)
+{
+	int slot = takeslot();
+
+	done[0] = slot + 1;
+}
+
+static
+void
+test_sequential(void)
+{
+	int i;
+
+	for (i=0; i<NSEQUENTIAL; i++) {
+		done[0] = 0;
+		start(quick, i);
+		while (done[0] != i + 1) {
+			/* spin */
+		}
+	}
+	printf("threadtest: %d threads in turn ok\n", NSEQUENTIAL);
+}
+
+/*
+ * Write our slot number to our own file and read it back, over and
+ * over. If two threads were handed the same descriptor, one of them
+ * reads the other's file, or finds its descriptor closed under it.
+ */
+static
+void
+opener(void)
+{
+	unsigned slot = takeslot();
+	char name[32];
+	unsigned i;
+	int fd;
+	char c;
+
+	snprintf(name, sizeof(name), "threadtest.%u", slot);
+	results[slot] = 0;
+	for (i=0; i<NOPENS; i++) {
+		fd = open(name, O_WRONLY|O_CREAT|O_TRUNC);
+		c = 'a' + slot;
+		if (fd < 0 || write(fd, &c, 1) != 1 || close(fd) < 0) {
+			results[slot]++;
+			continue;
+		}
+		fd = open(name, O_RDONLY);
+		c = 0;
+		if (fd < 0 || read(fd, &c, 1) != 1 || close(fd) < 0 ||
+		    c != (char)('a' + slot)) {
+			results[slot]++;
+		}
+	}
+	done[slot] = 1;
+}
+
+static
+void
+test_files(void)
+{
+	char name[32];
+	int t;
+
+	for (t=0; t<NTHREADS; t++) {
+		done[t] = 0;
+		start(opener, t);
+	}
+
+	for (t=0; t<NTHREADS; t++) {
+		while (!done[t]) {
+			/* spin */
+		}
+		snprintf(name, sizeof(name), "threadtest.%d", t);
+		remove(name);
+		if (results[t] != 0) {
+			errx(1, "files: thread %d failed %u of %d times",
+			     t, results[t], NOPENS);
+		}
+	}
+	printf("threadtest: files ok\n");
+}
+
+static
+void
+lateexit(void)
+{
+	struct timespec ts;
+
+	(void)takeslot();
+	ts.tv_sec = 0;
+	ts.tv_nsec = 200*1000*1000;
+	nanosleep(&ts, NULL);
+	_exit(7);
+}
+
+static
+void
+test_exit(void)
+{
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		start(lateexit, 0);
+		/* Not the last thread, so this shouldn't end the process. */
+		_exit(3);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 7) {
+		errx(1, "exit: process didn't wait for its last thread");
+	}
+	printf("threadtest: exit ok\n");
+}
+
+int
+main(void)
+{
+	test_sum();
+	test_sequential();
+	test_files();
+	test_exit();
+	printf("threadtest: passed\n");
+	return 0;
+}
@@ -0,0 +1,125 @@
+/*
+ * vforktest - test vfork().
+ *
+ * Checks that a vfork child runs in the parent's memory and that the
+ * parent doesn't resume until the child is done with it, both when the
+ * child exits and when it execs. Also checks that a child whose exec
+ * fails can still report the error and exit.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <err.h>
+#include <errno.h>
+
+static volatile int shared;
+
+static
+int
+waitstatus(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status)) {
+		errx(1, "child %d did not exit normally", pid);
+	}
+	return WEXITSTATUS(status);
+}
+
+static
+void
+test_exit(void)
+{
+	pid_t pid;
+
+	shared = 0;
+	pid = vfork();
+	if (pid < 0) {
+		err(1, "vfork");
+	}
+	if (pid == 0) {
+		shared = 1234;
+		_exit(7);
+	}
+	if (shared != 1234) {
+		errx(1, "exit: parent didn't see the child's store");
+	}
+	if (waitstatus(pid) != 7) {
+		errx(1, "exit: wrong exit status");
+	}
+	printf("vforktest: exit ok\n");
+}
+
+static
+void
+test_exec(void)
+{
+	char *args[2];
+	pid_t pid;
+
+	args[0] = (char *)"/bin/false";
+	args[1] = NULL;
+
+	shared = 0;
+	pid = vfork();
+	if (pid < 0) {
+		err(1, "vfork");
+	}
+	if (pid == 0) {
+		shared = 1;
+		execv(args[0], args);
+		_exit(99);
+	}
+	if (shared != 1) {
+		errx(1, "exec: parent resumed before the child ran");
+	}
+	if (waitstatus(pid) != 1) {
+		errx(1, "exec: /bin/false didn't run");
+	}
+	printf("vforktest: exec ok\n");
+}
+
+static
+void
+test_badexec(void)
+{
+	char *args[2];
+	pid_t pid;
+
+	args[0] = (char *)"/no/such/program";
+	args[1] = NULL;
+
+	shared = 0;
+	pid = vfork();
+	if (pid < 0) {
+		err(1, "vfork");
+	}
+	if (pid == 0) {
+		if (execv(args[0], args) < 0) {
+			shared = errno;
+		}
+		_exit(3);
+	}
+	if (waitstatus(pid) != 3) {
+		errx(1, "badexec: wrong exit status");
+	}
+	if (shared != ENOENT) {
+		errx(1, "badexec: execv failed with %d, not ENOENT", shared);
+	}
+	printf("vforktest: failed exec ok\n");
+}
+
+int
+main(void)
+{
+	test_exit();
+	test_exec();
+	test_badexec();
+	printf("vforktest: passed\n");
+	return 0;
+}